@@ -0,0 +1,1311 @@
+// updsvc_bench: micro and end-to-end benchmarks for the update engine.
+//
+//   updsvc_bench [--filter <substring>] [--min-time <seconds>] [--repetitions <n>]
+//                [--json <file>|-] [--commit <id>]
+//
+// The JSON output follows the Google Benchmark layout (context + benchmarks with
+// real_time/cpu_time per iteration) so existing comparison tooling can diff two commits.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef UPDSVC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "../SvcBandwidth.h"
+#include "../SvcCancel.h"
+#include "../SvcChunk.h"
+#include "../SvcCore.h"
+#include "../SvcDelta.h"
+#include "../SvcEngine.h"
+#include "../SvcMetrics.h"
+#include "../SvcMirror.h"
+#include "../SvcPosix.h"
+#include "../SvcResources.h"
+#include "../SvcState.h"
+#include "../SvcText.h"
+#include "../SvcValidate.h"
+#include "../json.hpp"
+#include "LoopbackServer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <regex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef UPDSVC_GIT_COMMIT
+#define UPDSVC_GIT_COMMIT "unknown"
+#endif
+
+namespace {
+
+template <class T>
+void doNotOptimize(const T &value) {
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+class BenchState {
+public:
+    explicit BenchState(unsigned long long iterations)
+        : iterations(iterations)
+        , remaining(iterations) {}
+
+    // Only the loop is timed, whatever the case sets up before it or checks after it is not
+    bool keepRunning() {
+        if (! started) {
+            started = true;
+            cpuBegin = std::clock();
+            begin = std::chrono::steady_clock::now();
+        }
+        if (remaining != 0) {
+            --remaining;
+            return true;
+        }
+        end = std::chrono::steady_clock::now();
+        cpuEnd = std::clock();
+        return false;
+    }
+
+    double seconds() const { return std::chrono::duration<double>(end - begin).count(); }
+    double cpuSeconds() const { return static_cast<double>(cpuEnd - cpuBegin) / CLOCKS_PER_SEC; }
+
+    unsigned long long iterations;
+    // Per-iteration throughput, reported as bytes_per_second / items_per_second
+    unsigned long long bytesPerIteration = 0;
+    unsigned long long itemsPerIteration = 0;
+    // Free-form counters copied into the JSON entry
+    std::vector<std::pair<std::string, double>> counters;
+
+private:
+    unsigned long long remaining;
+    bool started = false;
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::time_point end;
+    std::clock_t cpuBegin = 0;
+    std::clock_t cpuEnd = 0;
+};
+
+struct BenchCase {
+    std::string name;
+    std::function<void(BenchState &)> fn;
+};
+
+struct BenchResult {
+    std::string name;
+    unsigned long long iterations = 0;
+    double realNs = 0;
+    double cpuNs = 0;
+    double minNs = 0;
+    double maxNs = 0;
+    double bytesPerSecond = 0;
+    double itemsPerSecond = 0;
+    std::vector<std::pair<std::string, double>> counters;
+};
+
+struct Options {
+    std::string filter;
+    double minTime = 0.5;
+    unsigned repetitions = 3;
+    std::string jsonPath;
+    std::string commit = UPDSVC_GIT_COMMIT;
+    // Real installer pair for the Delta/pair case
+    std::string pairOld;
+    std::string pairNew;
+};
+
+std::vector<BenchCase> &registry() {
+    static std::vector<BenchCase> cases;
+    return cases;
+}
+
+void addBench(std::string name, std::function<void(BenchState &)> fn) {
+    registry().push_back({std::move(name), std::move(fn)});
+}
+
+double runOnce(const BenchCase &bench, unsigned long long iterations, BenchState &state,
+        double &cpuSeconds) {
+    state = BenchState(iterations);
+    bench.fn(state);
+    cpuSeconds = state.cpuSeconds();
+    return state.seconds();
+}
+
+BenchResult run(const BenchCase &bench, const Options &options) {
+    BenchState state(1);
+    double cpuSeconds = 0;
+
+    // Grow the iteration count until one run takes at least min-time
+    unsigned long long iterations = 1;
+    for (;;) {
+        double seconds = runOnce(bench, iterations, state, cpuSeconds);
+        if (seconds >= options.minTime || iterations >= (1ULL << 40)) {
+            break;
+        }
+        double factor = seconds > 0 ? options.minTime * 1.4 / seconds : 100;
+        factor = std::clamp(factor, 2.0, 100.0);
+        iterations = static_cast<unsigned long long>(iterations * factor);
+    }
+
+    std::vector<double> realNs;
+    std::vector<double> cpuNs;
+    for (unsigned r = 0; r < options.repetitions; ++r) {
+        double seconds = runOnce(bench, iterations, state, cpuSeconds);
+        realNs.push_back(seconds * 1e9 / iterations);
+        cpuNs.push_back(cpuSeconds * 1e9 / iterations);
+    }
+    std::sort(realNs.begin(), realNs.end());
+    std::sort(cpuNs.begin(), cpuNs.end());
+
+    BenchResult result;
+    result.name = bench.name;
+    result.iterations = iterations;
+    result.realNs = realNs[realNs.size() / 2];
+    result.cpuNs = cpuNs[cpuNs.size() / 2];
+    result.minNs = realNs.front();
+    result.maxNs = realNs.back();
+    if (state.bytesPerIteration) {
+        result.bytesPerSecond = state.bytesPerIteration * 1e9 / result.realNs;
+    }
+    if (state.itemsPerIteration) {
+        result.itemsPerSecond = state.itemsPerIteration * 1e9 / result.realNs;
+    }
+    result.counters = state.counters;
+    return result;
+}
+
+std::string hostName() {
+    char name[256] = {};
+#ifdef _WIN32
+    DWORD size = sizeof(name);
+    GetComputerNameA(name, &size);
+#else
+    gethostname(name, sizeof(name) - 1);
+#endif
+    return name;
+}
+
+void writeJson(const std::vector<BenchResult> &results, const Options &options) {
+    using json = nlohmann::json;
+    json out;
+
+    char date[64];
+    auto now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+    out["context"] = {
+            {"date", date},
+            {"host_name", hostName()},
+            {"executable", "updsvc_bench"},
+            {"num_cpus", std::thread::hardware_concurrency()},
+            {"git_commit", options.commit},
+#ifdef NDEBUG
+            {"library_build_type", "release"},
+#else
+            {"library_build_type", "debug"},
+#endif
+    };
+
+    out["benchmarks"] = json::array();
+    for (auto &r : results) {
+        json entry = {
+                {"name", r.name},
+                {"run_name", r.name},
+                {"run_type", "iteration"},
+                {"repetitions", options.repetitions},
+                {"iterations", r.iterations},
+                {"real_time", r.realNs},
+                {"cpu_time", r.cpuNs},
+                {"min_time", r.minNs},
+                {"max_time", r.maxNs},
+                {"time_unit", "ns"},
+        };
+        if (r.bytesPerSecond > 0) {
+            entry["bytes_per_second"] = r.bytesPerSecond;
+        }
+        if (r.itemsPerSecond > 0) {
+            entry["items_per_second"] = r.itemsPerSecond;
+        }
+        for (auto &[name, value] : r.counters) {
+            entry[name] = value;
+        }
+        out["benchmarks"].push_back(entry);
+    }
+
+    auto text = out.dump(2);
+    if (options.jsonPath == "-") {
+        std::printf("%s\n", text.c_str());
+        return;
+    }
+    if (auto *fp = std::fopen(options.jsonPath.c_str(), "wb")) {
+        std::fwrite(text.data(), 1, text.size(), fp);
+        std::fputc('\n', fp);
+        std::fclose(fp);
+    }
+    else {
+        std::fprintf(stderr, "cannot write %s\n", options.jsonPath.c_str());
+    }
+}
+
+// Synthetic manifest in the shape UpdateDetector expects. Every release carries a full
+// package and a patch from 1.0.0. All patches are banned and only the oldest full package
+// is on the Stable channel, so detection has to walk the whole document, which is the
+// worst case for a long manifest and a long ban list.
+std::string makeManifest(size_t releases, const std::string &baseUrl, BannedSet *banned) {
+    using json = nlohmann::json;
+    json exe = json::object();
+    for (size_t i = 0; i < releases; ++i) {
+        auto version = "2." + std::to_string(i) + ".0";
+        auto patchName = "patch-1.0.0-" + version + ".exe";
+        exe[version] = {
+                {"null",
+                        {{"name", "pkg-" + version + ".exe"}, {"url", baseUrl + "/pkg.bin"},
+                                {"channel", i == 0 ? "Stable" : "Beta"}}},
+                {"1.0.0",
+                        {{"name", patchName}, {"url", baseUrl + "/" + patchName},
+                                {"channel", "Stable"}}},
+        };
+        if (banned) {
+            banned->insert(patchName);
+        }
+    }
+    json manifest;
+    manifest["mgui-wgt"]["exe"] = exe;
+    return manifest.dump();
+}
+
+std::string randomBytes(size_t size, unsigned seed) {
+    std::mt19937_64 rng(seed);
+    std::string bytes(size, '\0');
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        auto v = rng();
+        std::memcpy(&bytes[i], &v, 8);
+    }
+    return bytes;
+}
+
+void registerStringBenches() {
+    static const std::string ascii16 = "mgui-wgt-2.4.1.e";
+    static const std::string ascii256 = [] {
+        std::string s;
+        while (s.size() < 256) {
+            s += "https://updates.example.com/mgui-wgt/2.4.1/";
+        }
+        s.resize(256);
+        return s;
+    }();
+    // Turkish product names are the common non-ASCII case in the field
+    static const std::string utf8_256 = [] {
+        std::string s;
+        while (s.size() < 256) {
+            s += u8"Güncelleme çalışıyor, lütfen bekleyiniz. ";
+        }
+        return s;
+    }();
+
+    // Registry values and manifest URLs are rarely longer than this
+    static const std::string ascii4096 = [] {
+        std::string s;
+        while (s.size() < 4096) {
+            s += ascii256;
+        }
+        return s;
+    }();
+
+    struct Input {
+        const char *name;
+        const std::string *text;
+    };
+    for (auto input : {Input{"ascii_16", &ascii16}, Input{"ascii_256", &ascii256},
+                 Input{"ascii_4096", &ascii4096}, Input{"utf8_256", &utf8_256}}) {
+        // The _scalar variants turn the SSE2/AVX2 paths off to show what they buy
+        for (bool simd : {true, false}) {
+            std::string variant = simd ? "/" : "_scalar/";
+            auto text = input.text;
+            addBench("s2ws" + variant + input.name, [text, simd](BenchState &state) {
+                TextUseSimd(simd);
+                state.bytesPerIteration = text->size();
+                while (state.keepRunning()) {
+                    doNotOptimize(s2ws(*text));
+                }
+                TextUseSimd(true);
+            });
+            auto wide = s2ws(*text);
+            addBench("ws2s" + variant + input.name, [wide, text, simd](BenchState &state) {
+                TextUseSimd(simd);
+                state.bytesPerIteration = text->size();
+                while (state.keepRunning()) {
+                    doNotOptimize(ws2s(wide));
+                }
+                TextUseSimd(true);
+            });
+        }
+    }
+}
+
+void registerEngineBenches() {
+    addBench("compareVersions/newer", [](BenchState &state) {
+        const std::string candidate = "10.2.34";
+        const std::string installed = "10.2.33";
+        while (state.keepRunning()) {
+            doNotOptimize(compareVersions(candidate, installed));
+        }
+    });
+    addBench("compareVersions/equal", [](BenchState &state) {
+        const std::string candidate = "3.14.159";
+        const std::string installed = "3.14.159";
+        while (state.keepRunning()) {
+            doNotOptimize(compareVersions(candidate, installed));
+        }
+    });
+
+    addBench("urlSplit/https", [](BenchState &state) {
+        const std::string url = "https://updates.example.com/mgui-wgt/stable/manifest.json";
+        std::string domain, path;
+        while (state.keepRunning()) {
+            urlSplit(url, domain, path);
+            doNotOptimize(domain);
+            doNotOptimize(path);
+        }
+    });
+
+    for (size_t releases : {10, 100, 1000, 10000}) {
+        addBench("UpdateDetector/releases_" + std::to_string(releases), [releases](
+                                                                            BenchState &state) {
+            BannedSet banned;
+            auto manifest = makeManifest(releases, "https://updates.example.com", &banned);
+            state.bytesPerIteration = manifest.size();
+            state.counters.push_back({"manifest_bytes", static_cast<double>(manifest.size())});
+            while (state.keepRunning()) {
+                doNotOptimize(DetectUpdate(manifest, "1.0.0", "Stable", banned));
+            }
+        });
+    }
+}
+
+#ifdef UPDSVC_HAVE_ZLIB
+std::string gzipBytes(const std::string &text) {
+    z_stream stream{};
+    // 16 added to the window bits writes a gzip header, like updsvc-mkindex --gzip
+    deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&stream, static_cast<uLong>(text.size())), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+    stream.avail_in = static_cast<uInt>(text.size());
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+#endif
+
+// One update check's manifest round trip over loopback: transfer, parse and detection,
+// with the body plain or gzipped. The parser is fed as the body arrives in both cases.
+void registerManifestBenches() {
+    for (size_t releases : {1000, 10000}) {
+        for (bool gzip : {false, true}) {
+#ifndef UPDSVC_HAVE_ZLIB
+            if (gzip) {
+                continue;
+            }
+#endif
+            auto name = std::string(gzip ? "Manifest/fetch_gzip" : "Manifest/fetch")
+                    + "/releases_" + std::to_string(releases);
+            addBench(name, [name, releases, gzip](BenchState &state) {
+                LoopbackServer server;
+                BannedSet banned;
+                auto manifest = makeManifest(releases, server.baseUrl(), &banned);
+                server.serve("/manifest.json", manifest);
+#ifdef UPDSVC_HAVE_ZLIB
+                server.serveGzip("/manifest.json", gzipBytes(manifest));
+#endif
+                SocketTransport transport;
+                HttpRequest request{"127.0.0.1:" + std::to_string(server.port()), "/manifest.json"};
+                request.compressed = gzip;
+                RequestStats stats;
+                state.bytesPerIteration = manifest.size();
+                while (state.keepRunning()) {
+                    ManifestParser parser;
+                    std::ostream sink(&parser);
+                    stats = RequestStats{};
+                    if (! transport.get(request, sink, stats)) {
+                        std::fprintf(stderr, "%s: request failed\n", name.c_str());
+                        std::exit(1);
+                    }
+                    doNotOptimize(DetectUpdate(parser.finish(), "1.0.0", "Stable", banned));
+                }
+                state.counters.push_back({"manifest_bytes", static_cast<double>(stats.bytes)});
+                state.counters.push_back({"wire_bytes", static_cast<double>(stats.wireBytes)});
+            });
+        }
+    }
+}
+
+// The scanners in SvcValidate.h against the std::regex patterns they replaced, both with the
+// pattern compiled once and, as the old code did for every call, compiled each time.
+void registerValidateBenches() {
+    static const char *const GUID_PATTERN = "^\\{?[0-9a-fA-F]{8}-[0-9a-fA-F]{4}-[0-9a-fA-F]{4}-"
+                                            "[0-9a-fA-F]{4}-[0-9a-fA-F]{12}\\}?$";
+    static const char *const FILE_PATTERN = "^[A-Za-z0-9._-]+$";
+    static const char *const URL_PATTERN = "^(https?)://([^/]+)(/.*)$";
+    static const std::string guid = "{028818E2-5DF4-414F-A1E4-2AA542DE4697}";
+    static const std::string file = "mgui-wgt-patch-2.4.0-2.4.1.exe";
+    static const std::string url = "https://updates.example.com/mgui-wgt/stable/manifest.json";
+
+    addBench("validate/guid/scanner", [](BenchState &state) {
+        while (state.keepRunning()) {
+            doNotOptimize(IsValidGuid(guid));
+        }
+    });
+    addBench("validate/guid/regex", [](BenchState &state) {
+        const std::regex pattern(GUID_PATTERN);
+        while (state.keepRunning()) {
+            doNotOptimize(std::regex_match(guid, pattern));
+        }
+    });
+    addBench("validate/guid/regex_per_call", [](BenchState &state) {
+        while (state.keepRunning()) {
+            doNotOptimize(std::regex_match(guid, std::regex(GUID_PATTERN)));
+        }
+    });
+
+    addBench("validate/filename/scanner", [](BenchState &state) {
+        while (state.keepRunning()) {
+            doNotOptimize(IsSafeFileName(file));
+        }
+    });
+    addBench("validate/filename/regex", [](BenchState &state) {
+        const std::regex pattern(FILE_PATTERN);
+        while (state.keepRunning()) {
+            doNotOptimize(std::regex_match(file, pattern));
+        }
+    });
+    addBench("validate/filename/regex_per_call", [](BenchState &state) {
+        while (state.keepRunning()) {
+            doNotOptimize(std::regex_match(file, std::regex(FILE_PATTERN)));
+        }
+    });
+
+    addBench("validate/url/scanner", [](BenchState &state) {
+        while (state.keepRunning()) {
+            auto parts = SplitUrl(url);
+            doNotOptimize(parts.host);
+            doNotOptimize(parts.path);
+        }
+    });
+    addBench("validate/url/regex", [](BenchState &state) {
+        const std::regex pattern(URL_PATTERN);
+        std::smatch match;
+        while (state.keepRunning()) {
+            doNotOptimize(std::regex_match(url, match, pattern));
+        }
+    });
+}
+
+void registerCycleBenches() {
+    struct CycleCase {
+        size_t releases;
+        size_t packageBytes;
+    };
+    for (auto c : {CycleCase{100, 1 << 20}, CycleCase{1000, 16 << 20}}) {
+        auto name = "Cycle/releases_" + std::to_string(c.releases) + "/package_"
+                + std::to_string(c.packageBytes >> 20) + "MiB";
+        addBench(name, [c, name](BenchState &state) {
+            LoopbackServer server;
+            BannedSet bannedFiles;
+            auto manifest = makeManifest(c.releases, server.baseUrl(), &bannedFiles);
+            server.serve("/manifest.json", manifest);
+            server.serve("/pkg.bin", randomBytes(c.packageBytes, 1));
+            state.bytesPerIteration = manifest.size() + c.packageBytes;
+
+            // The whole pipeline the service runs, with "true" standing in for the
+            // installer.
+            PosixPlatform platform("true");
+            Config cfg{};
+            cfg.product_guid = "{028818E2-5DF4-414F-A1E4-2AA542DE4697}";
+            cfg.url = server.baseUrl() + "/manifest.json";
+            cfg.params_full = "/quiet";
+            cfg.params_patch = "/quiet";
+            cfg.rel_chan = "Stable";
+            cfg.period = 3600;
+            platform.config.setProduct(cfg);
+            for (auto &file : bannedFiles) {
+                platform.config.addBanned(cfg.product_guid, file);
+            }
+            platform.inventory.setProduct(cfg.product_guid, "1.0.0", "/nonexistent/mgui-wgt");
+
+            auto cacheDir = std::filesystem::temp_directory_path() / "updsvc_bench";
+            UpdateEngine engine(platform.backends(), PackageCache(cacheDir));
+            while (state.keepRunning()) {
+                if (! engine.updateProduct(cfg)) {
+                    std::fprintf(stderr, "%s: update failed\n", name.c_str());
+                    std::exit(1);
+                }
+            }
+            std::error_code ec;
+            std::filesystem::remove_all(cacheDir, ec);
+            state.counters.push_back({"requests", static_cast<double>(server.requests())});
+        });
+    }
+}
+
+// The next release of a package: a few percent of it rewritten, inserted or deleted in
+// blocks of up to 64 KiB at random places, the way a rebuilt installer differs from the last
+// where some of the files it carries changed.
+std::string editBytes(const std::string &old, double changedPercent, unsigned seed) {
+    std::mt19937_64 rng(seed);
+    auto edits = static_cast<size_t>(old.size() * changedPercent / 100 / (32 << 10)) + 1;
+    std::vector<size_t> positions(edits);
+    for (auto &position : positions) {
+        position = rng() % old.size();
+    }
+    std::sort(positions.begin(), positions.end());
+
+    std::string result;
+    result.reserve(old.size() + old.size() / 50);
+    size_t from = 0;
+    for (auto position : positions) {
+        if (position < from) {
+            continue;
+        }
+        result.append(old, from, position - from);
+        size_t length = 1 + rng() % (64 << 10);
+        auto kind = rng() % 3;
+        if (kind != 2) {
+            // Rewrite or insert
+            result += randomBytes(length, static_cast<unsigned>(rng()));
+        }
+        from = kind == 1 ? position : std::min(old.size(), position + length);
+    }
+    result.append(old, from, std::string::npos);
+    return result;
+}
+
+bool writeFile(const std::filesystem::path &path, const std::string &bytes) {
+    std::ofstream out(path, std::ios::trunc | std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(out);
+}
+
+bool readFile(const std::filesystem::path &path, std::string &bytes) {
+    std::ifstream in(path, std::ios::binary);
+    if (! in.is_open()) {
+        return false;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Rebuilds the new package from the old one over the loopback server, the way the engine
+// does it when the manifest lists a chunk index. The seed is chunked once before timing
+// starts, like the engine does when it keeps <seed>.idx around.
+void addDeltaBench(const std::string &name,
+        std::function<void(std::string &oldBytes, std::string &newBytes)> load) {
+    addBench(name, [name, load](BenchState &state) {
+        auto oldBytes = std::make_unique<std::string>();
+        auto newBytes = std::make_unique<std::string>();
+        load(*oldBytes, *newBytes);
+
+        auto dir = std::filesystem::temp_directory_path() / "updsvc_bench_delta";
+        std::filesystem::create_directories(dir);
+        auto seed = dir / "old.seed";
+        auto out = dir / "new.bin";
+        std::error_code ec;
+        std::filesystem::remove(dir / "old.seed.idx", ec);
+        if (! writeFile(seed, *oldBytes)) {
+            std::fprintf(stderr, "%s: cannot write %s\n", name.c_str(), seed.c_str());
+            std::exit(1);
+        }
+
+        LoopbackServer server;
+        server.serve("/pkg.bin", *newBytes);
+        auto index = ChunkBuffer(newBytes->data(), newBytes->size());
+        ChunkIndex seedIndex;
+        LoadSeedIndex(seed, index.params, seedIndex);
+
+        SocketTransport transport;
+        HttpRequest package{"127.0.0.1:" + std::to_string(server.port()), "/pkg.bin"};
+        DeltaStats stats;
+        state.bytesPerIteration = newBytes->size();
+        while (state.keepRunning()) {
+            stats = DeltaStats{};
+            if (! BuildFromSeed(transport, package, index, seed, out, stats)) {
+                std::fprintf(stderr, "%s: rebuild failed\n", name.c_str());
+                std::exit(1);
+            }
+        }
+        std::filesystem::remove_all(dir, ec);
+
+        state.counters.push_back({"package_bytes", static_cast<double>(newBytes->size())});
+        state.counters.push_back({"chunks", static_cast<double>(index.chunks.size())});
+        state.counters.push_back({"reused_bytes", static_cast<double>(stats.reusedBytes)});
+        state.counters.push_back({"fetched_bytes", static_cast<double>(stats.fetchedBytes)});
+        state.counters.push_back({"fetched_ratio",
+                static_cast<double>(stats.fetchedBytes) / static_cast<double>(newBytes->size())});
+        state.counters.push_back({"requests", static_cast<double>(stats.requests)});
+    });
+}
+
+const std::string &chunkBenchData() {
+    static const std::string data = randomBytes(64 << 20, 7);
+    return data;
+}
+
+void registerDeltaBenches(const Options &options) {
+    addBench("Chunk/cut_points/64MiB", [](BenchState &state) {
+        auto &data = chunkBenchData();
+        auto *bytes = reinterpret_cast<const unsigned char *>(data.data());
+        ChunkParams params;
+        state.bytesPerIteration = data.size();
+        while (state.keepRunning()) {
+            size_t chunks = 0;
+            for (size_t offset = 0; offset < data.size(); ++chunks) {
+                offset += NextChunkSize(bytes + offset, data.size() - offset, params);
+            }
+            doNotOptimize(chunks);
+        }
+    });
+    // The _scalar variant turns the SHA extensions off
+    for (bool simd : {true, false}) {
+        addBench(simd ? "Chunk/sha256/64MiB" : "Chunk/sha256_scalar/64MiB",
+                [simd](BenchState &state) {
+                    auto &data = chunkBenchData();
+                    Sha256UseSimd(simd);
+                    state.bytesPerIteration = data.size();
+                    while (state.keepRunning()) {
+                        doNotOptimize(Sha256::digest(data.data(), data.size()));
+                    }
+                    Sha256UseSimd(true);
+                });
+    }
+    addBench("Chunk/index/64MiB", [](BenchState &state) {
+        auto &data = chunkBenchData();
+        state.bytesPerIteration = data.size();
+        while (state.keepRunning()) {
+            doNotOptimize(ChunkBuffer(data.data(), data.size()).chunks.size());
+        }
+    });
+
+    for (size_t mib : {16, 64}) {
+        for (double percent : {1.0, 5.0}) {
+            addDeltaBench("Delta/synthetic_" + std::to_string(mib) + "MiB/edit_"
+                            + std::to_string(static_cast<int>(percent)) + "pct",
+                    [mib, percent](std::string &oldBytes, std::string &newBytes) {
+                        oldBytes = randomBytes(mib << 20, 11);
+                        newBytes = editBytes(oldBytes, percent, 12);
+                    });
+        }
+    }
+
+    if (! options.pairOld.empty()) {
+        addDeltaBench("Delta/pair", [options](std::string &oldBytes, std::string &newBytes) {
+            if (! readFile(options.pairOld, oldBytes) || ! readFile(options.pairNew, newBytes)) {
+                std::fprintf(stderr, "cannot read %s or %s\n", options.pairOld.c_str(),
+                        options.pairNew.c_str());
+                std::exit(2);
+            }
+        });
+    }
+}
+
+// Counts what it is given and keeps none of it, for clients whose body is not the point
+class DiscardBuffer : public std::streambuf {
+protected:
+    std::streamsize xsputn(const char *, std::streamsize count) override { return count; }
+    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+};
+
+// A branch office: clients downloading the same package from updsvc-mirror at once, either
+// all from its cache or all arriving while it fetches the package from the origin
+void registerMirrorBenches() {
+    const size_t packageBytes = 4 << 20;
+    for (unsigned clients : {1, 16, 64}) {
+        addBench("Mirror/hit/clients_" + std::to_string(clients),
+                [clients, packageBytes](BenchState &state) {
+                    LoopbackServer origin;
+                    origin.serve("/pkg.bin", randomBytes(packageBytes, 3));
+                    SocketTransport upstream;
+                    MirrorOptions options;
+                    options.upstream = origin.baseUrl();
+                    options.cacheDir = std::filesystem::temp_directory_path() / "updsvc_mirror";
+                    options.listenAddress = "127.0.0.1";
+                    options.port = 0;
+                    std::error_code ec;
+                    std::filesystem::remove_all(options.cacheDir, ec);
+                    {
+                        MirrorServer mirror(upstream, options);
+                        HttpRequest request{
+                                "127.0.0.1:" + std::to_string(mirror.port()), "/pkg.bin"};
+                        auto download = [&request] {
+                            SocketTransport transport;
+                            DiscardBuffer discard;
+                            std::ostream sink(&discard);
+                            RequestStats stats;
+                            transport.get(request, sink, stats);
+                        };
+                        download();
+
+                        state.bytesPerIteration = packageBytes * clients;
+                        while (state.keepRunning()) {
+                            std::vector<std::thread> threads;
+                            for (unsigned i = 0; i < clients; ++i) {
+                                threads.emplace_back(download);
+                            }
+                            for (auto &thread : threads) {
+                                thread.join();
+                            }
+                        }
+                        state.counters.push_back({"upstream_requests",
+                                static_cast<double>(origin.requests())});
+                    }
+                    std::filesystem::remove_all(options.cacheDir, ec);
+                });
+    }
+
+    addBench("Mirror/miss_coalesced/clients_16", [packageBytes](BenchState &state) {
+        const unsigned clients = 16;
+        LoopbackServer origin;
+        auto package = randomBytes(packageBytes, 4);
+        SocketTransport upstream;
+        MirrorOptions options;
+        options.upstream = origin.baseUrl();
+        options.cacheDir = std::filesystem::temp_directory_path() / "updsvc_mirror";
+        options.listenAddress = "127.0.0.1";
+        options.port = 0;
+        std::error_code ec;
+        std::filesystem::remove_all(options.cacheDir, ec);
+        {
+            MirrorServer mirror(upstream, options);
+            auto domain = "127.0.0.1:" + std::to_string(mirror.port());
+
+            // Every iteration asks for a release the mirror has not seen yet
+            unsigned release = 0;
+            state.bytesPerIteration = packageBytes * clients;
+            while (state.keepRunning()) {
+                auto path = "/" + std::to_string(++release) + "/pkg.bin";
+                origin.serve(path, package);
+                std::vector<std::thread> threads;
+                for (unsigned i = 0; i < clients; ++i) {
+                    threads.emplace_back([&domain, &path] {
+                        SocketTransport transport;
+                        DiscardBuffer discard;
+                        std::ostream sink(&discard);
+                        RequestStats stats;
+                        transport.get({domain, path}, sink, stats);
+                    });
+                }
+                for (auto &thread : threads) {
+                    thread.join();
+                }
+            }
+            state.counters.push_back({"upstream_requests_per_iteration",
+                    static_cast<double>(origin.requests()) / state.iterations});
+            state.counters.push_back(
+                    {"coalesced", static_cast<double>(mirror.stats().coalesced)});
+        }
+        std::filesystem::remove_all(options.cacheDir, ec);
+    });
+}
+
+void registerBandwidthBenches() {
+    // Throughput should come out at the cap, however many downloads share it
+    const unsigned long capKBps = 16 * 1024;
+    const size_t packageBytes = 4 << 20;
+    for (unsigned downloads : {1, 4}) {
+        addBench("Bandwidth/cap_16MiB/downloads_" + std::to_string(downloads),
+                [=](BenchState &state) {
+                    LoopbackServer origin;
+                    origin.serve("/pkg.bin", randomBytes(packageBytes, 5));
+                    SystemClock clock;
+                    SocketTransport socket;
+                    BandwidthGovernor governor(clock);
+                    governor.setLimits({capKBps, capKBps});
+                    ThrottledTransport transport(socket, governor);
+                    auto download = [&] {
+                        DiscardBuffer discard;
+                        std::ostream sink(&discard);
+                        RequestStats stats;
+                        transport.get({"127.0.0.1:" + std::to_string(origin.port()), "/pkg.bin"},
+                                sink, stats);
+                    };
+                    // Spends the burst a fresh bucket starts with
+                    download();
+
+                    state.bytesPerIteration = packageBytes * downloads;
+                    while (state.keepRunning()) {
+                        std::vector<std::thread> threads;
+                        for (unsigned i = 0; i < downloads; ++i) {
+                            threads.emplace_back(download);
+                        }
+                        for (auto &thread : threads) {
+                            thread.join();
+                        }
+                    }
+                    state.counters.push_back({"cap_bytes_per_second", capKBps * 1024.0});
+                });
+    }
+
+    // Five quick requests, six that take 200 ms longer and twenty quick ones again: how far
+    // the adaptive cap backs off under load, and how far it has recovered at the end
+    addBench("Bandwidth/adaptive_backoff", [](BenchState &state) {
+        LoopbackServer origin;
+        origin.serve("/manifest.json", randomBytes(16 << 10, 6));
+        SystemClock clock;
+        SocketTransport socket;
+        BandwidthLimits limits{8 * 1024, 8 * 1024};
+        limits.adaptive = true;
+        HttpRequest request{"127.0.0.1:" + std::to_string(origin.port()), "/manifest.json"};
+        double loaded = 0;
+        double recovered = 0;
+        while (state.keepRunning()) {
+            BandwidthGovernor governor(clock);
+            governor.setLimits(limits);
+            ThrottledTransport transport(socket, governor);
+            auto fetch = [&](int count) {
+                for (int i = 0; i < count; ++i) {
+                    DiscardBuffer discard;
+                    std::ostream sink(&discard);
+                    RequestStats stats;
+                    transport.get(request, sink, stats);
+                }
+            };
+            origin.setDelay(std::chrono::milliseconds(0));
+            fetch(5);
+            origin.setDelay(std::chrono::milliseconds(200));
+            fetch(6);
+            loaded = governor.backoff();
+            origin.setDelay(std::chrono::milliseconds(0));
+            fetch(20);
+            recovered = governor.backoff();
+        }
+        state.counters.push_back({"backoff_loaded", loaded});
+        state.counters.push_back({"backoff_recovered", recovered});
+    });
+}
+
+void registerResourceBenches() {
+    // A foreground task (hashing 64 KB, about what handling one event costs) while every core
+    // also hashes an installer for the service: at normal priority, as background work and as
+    // background work within half a core
+    struct Mode {
+        const char *name;
+        bool background;
+        double cpuBudget;
+    };
+    for (auto mode : {Mode{"normal", false, 1.0}, Mode{"background", true, 1.0},
+                 Mode{"background_cpu_50", true, 0.5}}) {
+        auto name = std::string("Resources/foreground_latency/") + mode.name;
+        addBench(name, [mode](BenchState &state) {
+            auto installer = randomBytes(1 << 20, 7);
+            std::atomic<bool> stop{false};
+            std::atomic<unsigned long long> hashed{0};
+            std::vector<std::thread> workers;
+            for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i) {
+                workers.emplace_back([&] {
+                    ResourceScope scope(mode.background ? ResourceClass::Background
+                                                        : ResourceClass::Foreground,
+                            mode.cpuBudget);
+                    while (! stop.load()) {
+                        ChunkBuffer(installer.data(), installer.size());
+                        hashed += installer.size();
+                    }
+                });
+            }
+
+            auto event = randomBytes(64 << 10, 8);
+            std::vector<double> latencies;
+            using Micros = std::chrono::duration<double, std::micro>;
+            auto begin = std::chrono::steady_clock::now();
+            while (state.keepRunning()) {
+                auto start = std::chrono::steady_clock::now();
+                doNotOptimize(Sha256::digest(event.data(), event.size()));
+                latencies.push_back(Micros(std::chrono::steady_clock::now() - start).count());
+            }
+            double seconds = Micros(std::chrono::steady_clock::now() - begin).count() / 1e6;
+            stop.store(true);
+            for (auto &worker : workers) {
+                worker.join();
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+            state.counters.push_back({"p50_us", latencies[latencies.size() / 2]});
+            state.counters.push_back({"p99_us", latencies[latencies.size() * 99 / 100]});
+            state.counters.push_back({"background_bytes_per_second", hashed.load() / seconds});
+        });
+    }
+}
+
+std::string productGuid(size_t i) {
+    char guid[40];
+    std::snprintf(guid, sizeof(guid), "{%08zX-0000-4000-8000-000000000000}", i);
+    return guid;
+}
+
+// A state log of this many products, each with a small manifest and a few checks recorded
+// since the log was last compacted
+void writeStateLog(const std::filesystem::path &dir, size_t products) {
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    ManifestParser parser;
+    auto text = makeManifest(10, "https://updates.example.com", nullptr);
+    parser.feed(text.data(), text.size());
+    auto manifest = parser.finish();
+    StateStore store(dir);
+    for (int check = 1; check <= 3; ++check) {
+        for (size_t i = 0; i < products; ++i) {
+            auto &product = store.get(productGuid(i));
+            product.lastCheck = 1700000000 + check * 3600;
+            product.manifestEtag = "\"1\"";
+            product.manifest = manifest;
+            store.save(productGuid(i));
+        }
+    }
+}
+
+void registerStateBenches() {
+    for (size_t products : {100, 1000}) {
+        auto name = "State/load/products_" + std::to_string(products);
+        addBench(name, [name, products](BenchState &state) {
+            auto dir = std::filesystem::temp_directory_path() / "updsvc_bench_state";
+            writeStateLog(dir, products);
+            std::error_code ec;
+            unsigned long long logBytes = 0;
+            while (state.keepRunning()) {
+                StateStore store(dir);
+                if (store.size() != products) {
+                    std::fprintf(stderr, "%s: state lost\n", name.c_str());
+                    std::exit(1);
+                }
+                logBytes = store.logBytes();
+            }
+            std::filesystem::remove_all(dir, ec);
+            state.counters.push_back({"log_bytes", static_cast<double>(logBytes)});
+        });
+    }
+
+    // A periodic check of an unchanged manifest, fetched whole or revalidated with the ETag
+    // kept in the state store
+    for (bool conditional : {false, true}) {
+        auto name = std::string("State/manifest_check/")
+                + (conditional ? "if_none_match" : "unconditional");
+        addBench(name, [name, conditional](BenchState &state) {
+            LoopbackServer server;
+            BannedSet banned;
+            server.serve("/manifest.json", makeManifest(10000, server.baseUrl(), &banned));
+            SocketTransport transport;
+            HttpRequest request{"127.0.0.1:" + std::to_string(server.port()), "/manifest.json"};
+            Manifest kept;
+            std::string etag;
+            while (state.keepRunning()) {
+                ManifestParser parser;
+                std::ostream sink(&parser);
+                RequestStats stats;
+                request.ifNoneMatch = conditional ? etag : std::string();
+                if (! transport.get(request, sink, stats)) {
+                    std::fprintf(stderr, "%s: request failed\n", name.c_str());
+                    std::exit(1);
+                }
+                if (stats.status != 304) {
+                    kept = parser.finish();
+                    etag = stats.etag;
+                }
+                doNotOptimize(DetectUpdate(kept, "1.0.0", "Stable", banned));
+            }
+            state.counters.push_back({"bytes_served", static_cast<double>(server.bytesServed())});
+        });
+    }
+}
+
+// What the service does before it reports SERVICE_RUNNING, with the state log of 1000
+// products read there or left to the warm-up thread
+void registerStartupBenches() {
+    for (bool eager : {true, false}) {
+        auto name = std::string("Startup/time_to_running/")
+                + (eager ? "state_eager" : "state_deferred");
+        addBench(name, [eager](BenchState &state) {
+            auto dir = std::filesystem::temp_directory_path() / "updsvc_bench_state";
+            writeStateLog(dir, 1000);
+            PosixPlatform platform("true");
+            auto cacheDir = std::filesystem::temp_directory_path() / "updsvc_bench";
+            while (state.keepRunning()) {
+                UpdateEngine engine(platform.backends(), PackageCache(cacheDir), dir);
+                if (eager) {
+                    engine.stateStore().open();
+                }
+                doNotOptimize(engine.installing());
+            }
+            std::error_code ec;
+            std::filesystem::remove_all(dir, ec);
+        });
+    }
+
+    // The first cycle after a start with 100 products that are up to date: on a new machine,
+    // and after a restart less than a period after the last check
+    for (bool restarted : {false, true}) {
+        auto name = std::string("Startup/first_cycle/") + (restarted ? "restarted" : "fresh");
+        addBench(name, [restarted](BenchState &state) {
+            LoopbackServer server;
+            server.serve("/manifest.json", makeManifest(1, server.baseUrl(), nullptr));
+            PosixPlatform platform("true");
+            for (size_t i = 0; i < 100; ++i) {
+                Config cfg{};
+                cfg.product_guid = productGuid(i);
+                cfg.url = server.baseUrl() + "/manifest.json";
+                cfg.params_full = "/quiet";
+                cfg.params_patch = "/quiet";
+                cfg.rel_chan = "Stable";
+                cfg.period = 3600;
+                platform.config.setProduct(cfg);
+                platform.inventory.setProduct(cfg.product_guid, "2.0.0", "/nonexistent/mgui-wgt");
+            }
+            auto dir = std::filesystem::temp_directory_path() / "updsvc_bench_state";
+            auto cacheDir = std::filesystem::temp_directory_path() / "updsvc_bench";
+            std::error_code ec;
+            std::filesystem::remove_all(dir, ec);
+            if (restarted) {
+                UpdateEngine engine(platform.backends(), PackageCache(cacheDir), dir);
+                Scheduler scheduler(platform.clock);
+                engine.runDue(scheduler);
+            }
+            auto before = server.requests();
+            double cycles = 0;
+            while (state.keepRunning()) {
+                UpdateEngine engine(platform.backends(), PackageCache(cacheDir),
+                        restarted ? dir : std::filesystem::path());
+                engine.warmUp();
+                Scheduler scheduler(platform.clock);
+                engine.runDue(scheduler);
+                ++cycles;
+            }
+            std::filesystem::remove_all(dir, ec);
+            auto requests = static_cast<double>(server.requests() - before);
+            state.counters.push_back({"requests_per_start", requests / cycles});
+        });
+    }
+}
+
+// Passes on to a MemoryInventory and counts the products read from it. Without watching it
+// is a backend that cannot tell what changed.
+class CountingInventory : public ProductInventory {
+public:
+    CountingInventory(ProductInventory &inner, bool watching)
+        : inner(inner)
+        , watching(watching) {}
+
+    std::string installedVersion(const std::string &product_guid) override {
+        ++reads;
+        return inner.installedVersion(product_guid);
+    }
+    std::string executablePath(const std::string &product_guid) override {
+        ++reads;
+        return inner.executablePath(product_guid);
+    }
+    std::string installStamp(const std::string &product_guid) override {
+        return watching ? inner.installStamp(product_guid) : std::string();
+    }
+    bool changed() override { return watching ? inner.changed() : true; }
+
+    unsigned long long reads = 0;
+
+private:
+    ProductInventory &inner;
+    bool watching;
+};
+
+// Cycles over 100 products that are up to date, with the inventory read again every cycle
+// and with its changes watched
+void registerInventoryBenches() {
+    for (bool watching : {false, true}) {
+        auto name = std::string("Inventory/cycle/") + (watching ? "watched" : "unwatched");
+        addBench(name, [watching](BenchState &state) {
+            LoopbackServer server;
+            server.serve("/manifest.json", makeManifest(1, server.baseUrl(), nullptr));
+            PosixPlatform platform("true");
+            for (size_t i = 0; i < 100; ++i) {
+                Config cfg{};
+                cfg.product_guid = productGuid(i);
+                cfg.url = server.baseUrl() + "/manifest.json";
+                cfg.params_full = "/quiet";
+                cfg.params_patch = "/quiet";
+                cfg.rel_chan = "Stable";
+                cfg.period = 3600;
+                platform.config.setProduct(cfg);
+                platform.inventory.setProduct(cfg.product_guid, "2.0.0", "/nonexistent/mgui-wgt");
+            }
+            CountingInventory inventory(platform.inventory, watching);
+            Backends backends{platform.transport, platform.config, inventory, platform.probe,
+                    platform.installer, platform.clock};
+            auto cacheDir = std::filesystem::temp_directory_path() / "updsvc_bench";
+            UpdateEngine engine(backends, PackageCache(cacheDir));
+            // The first cycle reads everything either way
+            engine.updateAll();
+            auto before = inventory.reads;
+            double cycles = 0;
+            while (state.keepRunning()) {
+                engine.updateAll();
+                ++cycles;
+            }
+            auto reads = static_cast<double>(inventory.reads - before);
+            state.counters.push_back({"inventory_reads_per_cycle", reads / cycles});
+        });
+    }
+}
+
+// A stop in the middle of a 4 MiB download held to 1 MiB/s, and the start after it: how long
+// the engine takes to return once the token is tripped, and how much of the package the next
+// start still has to download
+void registerStopBenches() {
+    addBench("Stop/during_download", [](BenchState &state) {
+        LoopbackServer server;
+        auto package = randomBytes(4 << 20, 11);
+        server.serve("/manifest.json", makeManifest(1, server.baseUrl(), nullptr));
+        server.serve("/pkg.bin", package);
+        Config cfg{};
+        cfg.product_guid = productGuid(0);
+        cfg.url = server.baseUrl() + "/manifest.json";
+        cfg.params_full = "/quiet";
+        cfg.params_patch = "/quiet";
+        cfg.rel_chan = "Stable";
+        cfg.period = 3600;
+        auto cacheDir = std::filesystem::temp_directory_path() / "updsvc_bench_stop";
+        double stopSeconds = 0;
+        double refetched = 0;
+        double stops = 0;
+        while (state.keepRunning()) {
+            std::error_code ec;
+            std::filesystem::remove_all(cacheDir, ec);
+            {
+                CancelToken cancel;
+                PosixPlatform platform("true", &cancel);
+                cfg.bandwidth.dayKBps = cfg.bandwidth.nightKBps = 1024;
+                platform.config.setProduct(cfg);
+                platform.inventory.setProduct(cfg.product_guid, "0.9.0", "/nonexistent/mgui-wgt");
+                UpdateEngine engine(platform.backends(), PackageCache(cacheDir));
+                Scheduler scheduler(platform.clock);
+                std::thread cycle([&] { engine.runDue(scheduler); });
+                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                auto begin = std::chrono::steady_clock::now();
+                cancel.cancel();
+                cycle.join();
+                stopSeconds += std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - begin).count();
+            }
+            PosixPlatform platform("true");
+            cfg.bandwidth.dayKBps = cfg.bandwidth.nightKBps = 0;
+            platform.config.setProduct(cfg);
+            platform.inventory.setProduct(cfg.product_guid, "0.9.0", "/nonexistent/mgui-wgt");
+            UpdateEngine engine(platform.backends(), PackageCache(cacheDir));
+            Scheduler scheduler(platform.clock);
+            auto before = server.bytesServed();
+            engine.runDue(scheduler);
+            refetched += static_cast<double>(server.bytesServed() - before);
+            ++stops;
+        }
+        std::error_code ec;
+        std::filesystem::remove_all(cacheDir, ec);
+        state.counters.push_back({"stop_ms", stopSeconds * 1000 / stops});
+        state.counters.push_back({"refetched_fraction", refetched / stops / package.size()});
+    });
+}
+
+bool parseArgs(int argc, char *argv[], Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        auto arg = std::string(argv[i]);
+        auto next = [&]() -> const char * { return i + 1 < argc ? argv[++i] : nullptr; };
+        const char *value = nullptr;
+        if (arg == "--filter" && (value = next())) {
+            options.filter = value;
+        }
+        else if (arg == "--min-time" && (value = next())) {
+            options.minTime = std::atof(value);
+        }
+        else if (arg == "--repetitions" && (value = next())) {
+            options.repetitions = std::max(1, std::atoi(value));
+        }
+        else if (arg == "--json" && (value = next())) {
+            options.jsonPath = value;
+        }
+        else if (arg == "--commit" && (value = next())) {
+            options.commit = value;
+        }
+        else if (arg == "--pair" && i + 2 < argc) {
+            options.pairOld = argv[++i];
+            options.pairNew = argv[++i];
+        }
+        else {
+            std::fprintf(stderr,
+                    "usage: updsvc_bench [--filter <substring>] [--min-time <seconds>]\n"
+                    "                    [--repetitions <n>] [--json <file>|-] [--commit <id>]\n"
+                    "                    [--pair <old installer> <new installer>]\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (! parseArgs(argc, argv, options)) {
+        return 2;
+    }
+
+    registerStringBenches();
+    registerEngineBenches();
+    registerValidateBenches();
+    registerCycleBenches();
+    registerManifestBenches();
+    registerDeltaBenches(options);
+    registerMirrorBenches();
+    registerBandwidthBenches();
+    registerResourceBenches();
+    registerStateBenches();
+    registerStartupBenches();
+    registerInventoryBenches();
+    registerStopBenches();
+
+    std::vector<BenchResult> results;
+    auto *table = options.jsonPath == "-" ? stderr : stdout;
+    std::fprintf(table, "%-40s %14s %14s %12s %14s\n", "Benchmark", "Time(ns)", "CPU(ns)",
+            "Iterations", "Throughput");
+    for (auto &bench : registry()) {
+        if (! options.filter.empty() && bench.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        auto result = run(bench, options);
+        char throughput[32] = "";
+        if (result.bytesPerSecond > 0) {
+            std::snprintf(throughput, sizeof(throughput), "%.1f MiB/s",
+                    result.bytesPerSecond / (1 << 20));
+        }
+        std::fprintf(table, "%-40s %14.1f %14.1f %12llu %14s\n", result.name.c_str(),
+                result.realNs, result.cpuNs, result.iterations, throughput);
+        std::fflush(table);
+        results.push_back(std::move(result));
+    }
+
+    if (! options.jsonPath.empty()) {
+        writeJson(results, options);
+    }
+    return 0;
+}
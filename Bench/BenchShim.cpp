@@ -0,0 +1,32 @@
+// Logging for the engine while it is benchmarked: messages are only counted, and written to
+// stderr when UPDSVC_BENCH_LOG is set.
+
+#include "../SvcEngine.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+
+std::atomic<unsigned long long> gShimInfoCount{0};
+std::atomic<unsigned long long> gShimEventCount{0};
+
+static bool logToStderr() {
+    static const bool enabled = std::getenv("UPDSVC_BENCH_LOG") != nullptr;
+    return enabled;
+}
+
+void SvcReportEvent(std::string_view szFunction) {
+    ++gShimEventCount;
+    if (logToStderr()) {
+        std::fprintf(stderr, "error: %.*s failed\n", static_cast<int>(szFunction.size()),
+                szFunction.data());
+    }
+}
+
+void SvcReportInfo(std::string_view szFunction) {
+    ++gShimInfoCount;
+    if (logToStderr()) {
+        std::fprintf(
+                stderr, "info: %.*s\n", static_cast<int>(szFunction.size()), szFunction.data());
+    }
+}
@@ -0,0 +1,686 @@
+// updsvc_fleetsim: a fleet of update engines on virtual time, for predicting what a release
+// rollout does to the origin before it ships.
+//
+//   updsvc_fleetsim [--clients <n>] [--hours <h>] [--edges <n>] [--csv <file>] ...
+//
+// Every client is a real UpdateEngine with its own Scheduler, package cache and Clock.
+// Clients run one at a time in the order of their virtual wake-up times. A request moves the
+// client's clock on by the round trip and the transfer at the client's bandwidth, which the
+// origin's capacity can hold back further. Packages are real files, shrunk by --scale together
+// with the chunk sizes so deltas plan the same ranges; byte counts are reported scaled back.
+
+#include "../SvcChunk.h"
+#include "../SvcCore.h"
+#include "../SvcScheduler.h"
+#include "../json.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+constexpr const char *PRODUCT_GUID = "{028818E2-5DF4-414F-A1E4-2AA542DE4697}";
+constexpr const char *ORIGIN_HOST = "origin.fleetsim";
+constexpr const char *OLD_VERSION = "1.0.0";
+constexpr const char *NEW_VERSION = "1.1.0";
+// Edges refill from the origin at this rate, the origin's capacity permitting
+constexpr double EDGE_FILL_BYTES_PER_SECOND = 1e9 / 8;
+
+struct Options {
+    unsigned clients = 1000;
+    double hours = 12;
+    double releaseAt = 600; // Seconds after the first client boots
+    double bootSpread = 3600; // Clients boot uniformly spread over this many seconds
+    unsigned long period = 3600; // PERIOD of the product, seconds
+    double clientMbps = 25; // Median, client bandwidths are log-normal around it
+    double originMbps = 0; // 0 for unlimited
+    double rttMs = 60;
+    double installSeconds = 30;
+    unsigned edges = 0; // 0: clients fetch from the origin directly
+    double manifestTtl = 300;
+    bool coalesce = false;
+    unsigned packageKib = 256;
+    unsigned scale = 256;
+    double changedPct = 5;
+    unsigned patchKib = 0;
+    bool delta = true;
+    double seededPct = 100;
+    double bucket = 60;
+    std::string csvPath;
+    unsigned seed = 1;
+    fs::path work = fs::temp_directory_path() / "updsvc_fleetsim";
+    bool keep = false;
+};
+
+struct Object {
+    std::shared_ptr<const std::string> body;
+    double publishedAt;
+    bool scaled; // Stands for scale times as many bytes
+};
+
+// What the origin serves at a given time, newest version of each path last
+class Origin {
+public:
+    void publish(const std::string &path, std::string body, double at, bool scaled) {
+        objects[path].push_back({std::make_shared<const std::string>(std::move(body)), at, scaled});
+    }
+
+    const Object *find(const std::string &path, double at) const {
+        auto it = objects.find(path);
+        if (it == objects.end()) {
+            return nullptr;
+        }
+        const Object *found = nullptr;
+        for (auto &object : it->second) {
+            if (object.publishedAt <= at) {
+                found = &object;
+            }
+        }
+        return found;
+    }
+
+private:
+    std::map<std::string, std::vector<Object>> objects;
+};
+
+// Capacity of the origin, tracked per second of virtual time. Transfers are admitted in the
+// order the clients make them, which is close to but not exactly virtual time order.
+class OriginLink {
+public:
+    explicit OriginLink(double bytesPerSecond)
+        : capacity(bytesPerSecond) {}
+
+    // When a transfer of bytes starting at t ends, if the receiver takes at most rate bytes/s
+    double transfer(double t, double bytes, double rate) {
+        if (capacity <= 0) {
+            return t + bytes / rate;
+        }
+        while (bytes > 0) {
+            auto slot = static_cast<size_t>(t);
+            if (slot >= used.size()) {
+                used.resize(slot + 1024);
+            }
+            double slotEnd = static_cast<double>(slot) + 1;
+            double room = std::min(capacity - used[slot], rate * (slotEnd - t));
+            double take = std::min(bytes, std::max(room, 0.0));
+            used[slot] += take;
+            bytes -= take;
+            t = bytes > 0 ? slotEnd : t + take / rate;
+        }
+        return t;
+    }
+
+private:
+    double capacity;
+    std::vector<double> used;
+};
+
+struct EdgeEntry {
+    const Object *object;
+    double readyAt; // Until then the edge is still filling it from the origin
+    double expiresAt;
+};
+
+struct Bucket {
+    unsigned long long clientRequests = 0;
+    unsigned long long originRequests = 0;
+    double clientBytes = 0;
+    double originBytes = 0;
+    unsigned updates = 0;
+};
+
+struct CacheStats {
+    unsigned long long hits = 0;
+    unsigned long long coalesced = 0;
+    unsigned long long misses = 0;
+};
+
+class Fleet;
+
+// One installation of the product: the engine and every backend it talks to
+class SimClient : public Transport,
+                  public ConfigStore,
+                  public ProductInventory,
+                  public ProcessProbe,
+                  public Installer,
+                  public Clock {
+public:
+    SimClient(Fleet &fleet, fs::path cacheDir, double rate, unsigned edge)
+        : fleet(fleet)
+        , rate(rate)
+        , edge(edge)
+        , engine(Backends{*this, *this, *this, *this, *this, *this}, PackageCache(cacheDir))
+        , scheduler(*this) {}
+
+    double seconds() const { return std::chrono::duration<double>(at.time_since_epoch()).count(); }
+    void setSeconds(double s) {
+        at = std::chrono::steady_clock::time_point(
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(s)));
+    }
+
+    // Transport
+    bool get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) override;
+
+    // ConfigStore
+    bool products(std::vector<std::string> &product_guids) override {
+        product_guids = {PRODUCT_GUID};
+        return true;
+    }
+    Config readProduct(const std::string &product_guid) override;
+    BannedSet readBanned(const std::string &) override { return {}; }
+    void addBanned(const std::string &, const std::string &) override {}
+    std::string readSetting(const std::string &) override { return {}; }
+    unsigned long readSetting(const std::string &, unsigned long defaultValue) override {
+        return defaultValue;
+    }
+
+    // ProductInventory, ProcessProbe
+    std::string installedVersion(const std::string &) override { return version; }
+    std::string executablePath(const std::string &) override { return {}; }
+    ProcessState query(const std::string &) override { return ProcessState::NotRunning; }
+
+    // Installer
+    std::unique_ptr<InstallJob> start(const fs::path &package, const std::string &arguments,
+            const InstallLimits &limits) override;
+    bool activate(const fs::path &, const fs::path &) override { return true; }
+
+    // Clock
+    std::chrono::steady_clock::time_point now() override { return at; }
+    bool sleepFor(std::chrono::milliseconds duration) override {
+        at += duration;
+        return true;
+    }
+
+    Fleet &fleet;
+    double rate; // Bytes per second
+    unsigned edge;
+    std::string version = OLD_VERSION;
+    double updatedAt = -1;
+    std::chrono::steady_clock::time_point at;
+    UpdateEngine engine;
+    Scheduler scheduler;
+};
+
+class Fleet {
+public:
+    explicit Fleet(const Options &options)
+        : options(options)
+        , originLink(options.originMbps * 1e6 / 8)
+        , edges(options.edges)
+        , buckets(static_cast<size_t>(options.hours * 3600 / options.bucket) + 1) {}
+
+    void publish(std::mt19937_64 &rng);
+    void populate(std::mt19937_64 &rng);
+    void run();
+    void report() const;
+
+    // Serves a request made at time t, returns when the response has been received
+    double fetch(const SimClient &client, const HttpRequest &request, std::string &body,
+            unsigned long &status);
+    void installed(SimClient &client, const std::string &filename);
+
+    const Options &options;
+
+private:
+    Bucket &bucketAt(double t) {
+        auto i = static_cast<size_t>(std::max(t, 0.0) / options.bucket);
+        return buckets[std::min(i, buckets.size() - 1)];
+    }
+    double weight(const Object &object, size_t bytes) const {
+        return object.scaled ? static_cast<double>(bytes) * options.scale
+                             : static_cast<double>(bytes);
+    }
+
+    Origin origin;
+    OriginLink originLink;
+    std::vector<std::map<std::string, EdgeEntry>> edges;
+    std::map<std::string, std::string> packageVersions; // By file name
+    std::string oldPackage;
+    std::vector<std::unique_ptr<SimClient>> clients;
+    std::vector<Bucket> buckets;
+    CacheStats manifestCache;
+    CacheStats packageCache;
+    double packageBytes = 0; // Package bytes the clients received
+    double packageSize = 0;
+};
+
+std::string randomBytes(size_t size, std::mt19937_64 &rng) {
+    std::string bytes(size, '\0');
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t r = rng();
+        std::memcpy(&bytes[i], &r, std::min<size_t>(8, size - i));
+    }
+    return bytes;
+}
+
+// Same parameters as ChunkParams{}, divided by the scale
+ChunkParams scaledParams(unsigned scale) {
+    ChunkParams params;
+    uint32_t avg = std::max<uint32_t>(64, params.avgSize / std::max(1u, scale));
+    return {avg / 4, avg, avg * 4};
+}
+
+void Fleet::publish(std::mt19937_64 &rng) {
+    auto params = scaledParams(options.scale);
+    oldPackage = randomBytes(size_t(options.packageKib) * 1024, rng);
+    packageSize = static_cast<double>(oldPackage.size()) * options.scale;
+
+    // The new build rewrites blocks of up to sixteen chunks here and there
+    auto newPackage = oldPackage;
+    auto target = static_cast<size_t>(newPackage.size() * options.changedPct / 100);
+    for (size_t changed = 0; changed < target;) {
+        size_t block = std::min<size_t>(rng() % (16 * params.avgSize) + 1, target - changed);
+        size_t offset = rng() % (newPackage.size() - block + 1);
+        auto bytes = randomBytes(block, rng);
+        newPackage.replace(offset, block, bytes);
+        changed += block;
+    }
+
+    std::string base = std::string("http://") + ORIGIN_HOST + "/mgui-wgt/";
+    auto entry = [&](const std::string &path, const std::string &name, size_t size) {
+        return json{{"name", name}, {"url", base + path + "/" + name}, {"channel", "Stable"},
+                {"size", static_cast<double>(size) * options.scale}};
+    };
+    std::string oldName = std::string("mgui-wgt-") + OLD_VERSION + ".exe";
+    std::string newName = std::string("mgui-wgt-") + NEW_VERSION + ".exe";
+    std::string patchName = std::string("mgui-wgt-") + NEW_VERSION + ".msp";
+    packageVersions[oldName] = OLD_VERSION;
+    packageVersions[newName] = NEW_VERSION;
+    packageVersions[patchName] = NEW_VERSION;
+
+    json manifest;
+    auto &versions = manifest["mgui-wgt"]["exe"];
+    versions[OLD_VERSION]["null"] = entry(OLD_VERSION, oldName, oldPackage.size());
+    origin.publish("/mgui-wgt/manifest.json", manifest.dump(), 0, false);
+    origin.publish(std::string("/mgui-wgt/") + OLD_VERSION + "/" + oldName, oldPackage, 0, true);
+
+    auto newPath = std::string("/mgui-wgt/") + NEW_VERSION + "/" + newName;
+    versions[NEW_VERSION]["null"] = entry(NEW_VERSION, newName, newPackage.size());
+    if (options.delta) {
+        versions[NEW_VERSION]["null"]["chunks"] = base + NEW_VERSION + "/" + newName + ".idx";
+        origin.publish(newPath + ".idx",
+                ChunkIndexToJson(ChunkBuffer(newPackage.data(), newPackage.size(), params)),
+                options.releaseAt, false);
+    }
+    if (options.patchKib > 0) {
+        auto patch = randomBytes(size_t(options.patchKib) * 1024, rng);
+        versions[NEW_VERSION][OLD_VERSION] =
+                entry(std::string(NEW_VERSION) + "/" + OLD_VERSION, patchName, patch.size());
+        origin.publish(std::string("/mgui-wgt/") + NEW_VERSION + "/" + OLD_VERSION + "/"
+                        + patchName,
+                std::move(patch), options.releaseAt, true);
+    }
+    origin.publish(newPath, std::move(newPackage), options.releaseAt, true);
+    origin.publish("/mgui-wgt/manifest.json", manifest.dump(), options.releaseAt, false);
+}
+
+//
+// Purpose:
+//   Creates the clients, each with its own package cache. Seeded clients get the old
+//   package as their delta seed, hard-linked to one copy to spare the disk.
+//
+void Fleet::populate(std::mt19937_64 &rng) {
+    std::error_code ec;
+    fs::remove_all(options.work, ec);
+    fs::create_directories(options.work);
+    auto master = options.work / "seed.bin";
+    std::ofstream(master, std::ios::binary) << oldPackage;
+
+    std::lognormal_distribution<double> mbps(std::log(options.clientMbps), 0.75);
+    std::uniform_real_distribution<double> percent(0, 100);
+    std::uniform_int_distribution<unsigned> edge(0, std::max(1u, options.edges) - 1);
+    for (unsigned i = 0; i < options.clients; ++i) {
+        auto dir = options.work / ("c" + std::to_string(i));
+        fs::create_directories(dir);
+        clients.push_back(std::make_unique<SimClient>(*this, dir, mbps(rng) * 1e6 / 8, edge(rng)));
+        if (percent(rng) < options.seededPct) {
+            auto seed = clients.back()->engine.packageCache().seedFor(PRODUCT_GUID);
+            fs::create_hard_link(master, seed, ec);
+            if (ec) {
+                fs::copy_file(master, seed, ec);
+            }
+        }
+    }
+}
+
+double Fleet::fetch(const SimClient &client, const HttpRequest &request, std::string &body,
+        unsigned long &status) {
+    double t = client.seconds();
+    double rtt = options.rttMs / 1000;
+    auto &bucket = bucketAt(t);
+    ++bucket.clientRequests;
+
+    bool isManifest = request.path.size() >= 5
+            && request.path.compare(request.path.size() - 5, 5, ".json") == 0;
+    const Object *object = request.domain == ORIGIN_HOST ? origin.find(request.path, t) : nullptr;
+    double readyAt = t;
+    bool direct = options.edges == 0;
+    if (object != nullptr && ! direct) {
+        auto &cache = isManifest ? manifestCache : packageCache;
+        auto &entries = edges[client.edge];
+        auto it = entries.find(request.path);
+        if (it != entries.end() && t < it->second.expiresAt
+                && (t >= it->second.readyAt || options.coalesce)) {
+            // A hit serves what the edge has, which may be an older manifest
+            object = it->second.object;
+            readyAt = it->second.readyAt;
+            ++(t >= readyAt ? cache.hits : cache.coalesced);
+        }
+        else {
+            ++cache.misses;
+            ++bucket.originRequests;
+            double bytes = weight(*object, object->body->size());
+            bucket.originBytes += bytes;
+            readyAt = originLink.transfer(t + rtt, bytes, EDGE_FILL_BYTES_PER_SECOND);
+            double ttl = isManifest ? options.manifestTtl : 1e300;
+            entries[request.path] = {object, readyAt, readyAt + ttl};
+        }
+    }
+    if (object == nullptr) {
+        status = 404;
+        return t + rtt;
+    }
+
+    const std::string &full = *object->body;
+    size_t first = 0;
+    size_t last = full.size() - 1;
+    status = 200;
+    if (! request.range.empty()) {
+        unsigned long long a = 0;
+        unsigned long long b = 0;
+        if (std::sscanf(request.range.c_str(), "bytes=%llu-%llu", &a, &b) != 2 || a > b
+                || a >= full.size()) {
+            status = 416;
+            return t + rtt;
+        }
+        first = static_cast<size_t>(a);
+        last = std::min<size_t>(static_cast<size_t>(b), full.size() - 1);
+        status = 206;
+    }
+    body = full.substr(first, last - first + 1);
+
+    double bytes = weight(*object, body.size());
+    bucket.clientBytes += bytes;
+    if (object->scaled) {
+        packageBytes += bytes;
+    }
+    if (direct) {
+        ++bucket.originRequests;
+        bucket.originBytes += bytes;
+        return originLink.transfer(t + rtt, bytes, client.rate);
+    }
+    return std::max(t + rtt + bytes / client.rate, readyAt);
+}
+
+void Fleet::installed(SimClient &client, const std::string &filename) {
+    auto it = packageVersions.find(filename);
+    if (it == packageVersions.end()) {
+        return;
+    }
+    client.version = it->second;
+    if (client.version == NEW_VERSION && client.updatedAt < 0) {
+        client.updatedAt = client.seconds();
+        ++bucketAt(client.updatedAt).updates;
+    }
+}
+
+void Fleet::run() {
+    using Wake = std::pair<double, SimClient *>;
+    std::priority_queue<Wake, std::vector<Wake>, std::greater<Wake>> queue;
+    std::mt19937_64 rng(options.seed + 1);
+    std::uniform_real_distribution<double> boot(0, options.bootSpread);
+    for (auto &client : clients) {
+        queue.push({boot(rng), client.get()});
+    }
+
+    double end = options.hours * 3600;
+    while (! queue.empty() && queue.top().first < end) {
+        auto client = queue.top().second;
+        client->setSeconds(queue.top().first);
+        queue.pop();
+
+        client->engine.runDue(client->scheduler);
+        auto wait = client->scheduler.untilNext();
+        if (wait != std::chrono::milliseconds::max()) {
+            queue.push({client->seconds() + wait.count() / 1000.0, client});
+        }
+    }
+}
+
+std::string formatMinutes(double seconds) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "%.1f min", seconds / 60);
+    return text;
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    auto i = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(i, 1)) - 1];
+}
+
+double ratio(const CacheStats &stats) {
+    auto total = stats.hits + stats.coalesced + stats.misses;
+    return total == 0 ? 0 : 100.0 * (stats.hits + stats.coalesced) / total;
+}
+
+void Fleet::report() const {
+    std::vector<double> delays;
+    for (auto &client : clients) {
+        if (client->updatedAt >= 0) {
+            delays.push_back(client->updatedAt - options.releaseAt);
+        }
+    }
+    std::sort(delays.begin(), delays.end());
+
+    Bucket total;
+    Bucket peak;
+    double peakAt = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        auto &b = buckets[i];
+        total.clientRequests += b.clientRequests;
+        total.originRequests += b.originRequests;
+        total.clientBytes += b.clientBytes;
+        total.originBytes += b.originBytes;
+        peak.clientRequests = std::max(peak.clientRequests, b.clientRequests);
+        if (b.originBytes > peak.originBytes) {
+            peak.originBytes = b.originBytes;
+            peakAt = static_cast<double>(i) * options.bucket;
+        }
+        peak.originRequests = std::max(peak.originRequests, b.originRequests);
+    }
+
+    const double GiB = 1024.0 * 1024 * 1024;
+    auto updates = delays.size();
+    printf("clients               %u, %u edge cache(s)\n", options.clients, options.edges);
+    printf("updated               %zu (%.1f%%) within %.1f h\n", updates,
+            100.0 * updates / std::max(1u, options.clients), options.hours);
+    printf("time to update        p50 %s  p99 %s  max %s\n",
+            formatMinutes(percentile(delays, 50)).c_str(),
+            formatMinutes(percentile(delays, 99)).c_str(),
+            formatMinutes(delays.empty() ? 0 : delays.back()).c_str());
+    printf("requests              clients %llu  origin %llu\n", total.clientRequests,
+            total.originRequests);
+    printf("bytes served          clients %.2f GiB  origin %.2f GiB\n", total.clientBytes / GiB,
+            total.originBytes / GiB);
+    char peakLabel[32];
+    std::snprintf(peakLabel, sizeof(peakLabel), "peak per %.0f s", options.bucket);
+    printf("%-22sclients %llu req  origin %llu req, %.0f Mbit/s at %s\n", peakLabel,
+            peak.clientRequests, peak.originRequests,
+            peak.originBytes * 8 / 1e6 / options.bucket, formatMinutes(peakAt).c_str());
+    if (options.edges > 0) {
+        printf("edge hit ratio        manifest %.1f%%  packages %.1f%%  (%llu coalesced)\n",
+                ratio(manifestCache), ratio(packageCache),
+                manifestCache.coalesced + packageCache.coalesced);
+    }
+    if (updates > 0) {
+        printf("package bytes         %.1f%% of a full download per update\n",
+                100.0 * packageBytes / (packageSize * updates));
+    }
+
+    if (options.csvPath.empty()) {
+        return;
+    }
+    FILE *csv = std::fopen(options.csvPath.c_str(), "w");
+    if (csv == nullptr) {
+        fprintf(stderr, "cannot write %s\n", options.csvPath.c_str());
+        return;
+    }
+    fprintf(csv, "time_s,client_requests,origin_requests,client_bytes,origin_bytes,updated\n");
+    unsigned updated = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        auto &b = buckets[i];
+        updated += b.updates;
+        fprintf(csv, "%.0f,%llu,%llu,%.0f,%.0f,%u\n", static_cast<double>(i) * options.bucket,
+                b.clientRequests, b.originRequests, b.clientBytes, b.originBytes, updated);
+    }
+    std::fclose(csv);
+}
+
+bool SimClient::get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) {
+    std::string body;
+    double done = fleet.fetch(*this, request, body, stats.status);
+    sink.write(body.data(), static_cast<std::streamsize>(body.size()));
+    // The simulated origin serves everything plain
+    stats.bytes = body.size();
+    stats.wireBytes = body.size();
+    setSeconds(done);
+    return true;
+}
+
+Config SimClient::readProduct(const std::string &product_guid) {
+    Config cfg;
+    cfg.url = std::string("http://") + ORIGIN_HOST + "/mgui-wgt/manifest.json";
+    cfg.product_guid = product_guid;
+    cfg.params_full = "/S";
+    cfg.params_patch = "/S";
+    cfg.rel_chan = "Stable";
+    cfg.period = fleet.options.period;
+    return cfg;
+}
+
+// The simulated installer is over by the time start() returns
+class FinishedJob : public InstallJob {
+public:
+    bool wait(std::chrono::milliseconds) override { return true; }
+    InstallResult result() override { return {}; }
+};
+
+std::unique_ptr<InstallJob> SimClient::start(
+        const fs::path &package, const std::string &, const InstallLimits &) {
+    setSeconds(seconds() + fleet.options.installSeconds);
+    fleet.installed(*this, package.filename().u8string());
+    return std::make_unique<FinishedJob>();
+}
+
+void usage() {
+    fprintf(stderr,
+            "usage: updsvc_fleetsim [--clients <n>] [--hours <h>] [--release-at <s>]\n"
+            "                       [--boot-spread <s>] [--period <s>] [--client-mbps <m>]\n"
+            "                       [--origin-mbps <m>] [--rtt-ms <ms>] [--install-s <s>]\n"
+            "                       [--edges <n>] [--manifest-ttl <s>] [--coalesce]\n"
+            "                       [--package-kib <k>] [--scale <n>] [--changed-pct <p>]\n"
+            "                       [--patch-kib <k>] [--no-delta] [--seeded-pct <p>]\n"
+            "                       [--bucket <s>] [--csv <file>] [--seed <n>]\n"
+            "                       [--work <dir>] [--keep]\n");
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+    std::map<std::string, std::function<void(const char *)>> values = {
+            {"--clients", [&](const char *v) { options.clients = std::atoi(v); }},
+            {"--hours", [&](const char *v) { options.hours = std::atof(v); }},
+            {"--release-at", [&](const char *v) { options.releaseAt = std::atof(v); }},
+            {"--boot-spread", [&](const char *v) { options.bootSpread = std::atof(v); }},
+            {"--period", [&](const char *v) { options.period = std::strtoul(v, nullptr, 10); }},
+            {"--client-mbps", [&](const char *v) { options.clientMbps = std::atof(v); }},
+            {"--origin-mbps", [&](const char *v) { options.originMbps = std::atof(v); }},
+            {"--rtt-ms", [&](const char *v) { options.rttMs = std::atof(v); }},
+            {"--install-s", [&](const char *v) { options.installSeconds = std::atof(v); }},
+            {"--edges", [&](const char *v) { options.edges = std::atoi(v); }},
+            {"--manifest-ttl", [&](const char *v) { options.manifestTtl = std::atof(v); }},
+            {"--package-kib", [&](const char *v) { options.packageKib = std::atoi(v); }},
+            {"--scale", [&](const char *v) { options.scale = std::max(1, std::atoi(v)); }},
+            {"--changed-pct", [&](const char *v) { options.changedPct = std::atof(v); }},
+            {"--patch-kib", [&](const char *v) { options.patchKib = std::atoi(v); }},
+            {"--seeded-pct", [&](const char *v) { options.seededPct = std::atof(v); }},
+            {"--bucket", [&](const char *v) { options.bucket = std::max(1.0, std::atof(v)); }},
+            {"--csv", [&](const char *v) { options.csvPath = v; }},
+            {"--seed", [&](const char *v) { options.seed = std::atoi(v); }},
+            {"--work", [&](const char *v) { options.work = fs::u8path(v); }},
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = values.find(arg);
+        if (value != values.end() && i + 1 < argc) {
+            value->second(argv[++i]);
+        }
+        else if (arg == "--coalesce") {
+            options.coalesce = true;
+        }
+        else if (arg == "--no-delta") {
+            options.delta = false;
+        }
+        else if (arg == "--keep") {
+            options.keep = true;
+        }
+        else {
+            usage();
+            return false;
+        }
+    }
+    if (options.clients == 0 || options.packageKib == 0 || options.period == 0) {
+        usage();
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    if (! parseOptions(argc, argv, options)) {
+        return 2;
+    }
+
+    std::mt19937_64 rng(options.seed);
+    Fleet fleet(options);
+    auto begin = std::chrono::steady_clock::now();
+    try {
+        fleet.publish(rng);
+        fleet.populate(rng);
+    }
+    catch (fs::filesystem_error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    fleet.run();
+    fleet.report();
+    printf("simulated in          %.1f s\n",
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+
+    if (! options.keep) {
+        std::error_code ec;
+        fs::remove_all(options.work, ec);
+    }
+    return 0;
+}
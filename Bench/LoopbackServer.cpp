@@ -0,0 +1,191 @@
+#include "LoopbackServer.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+static bool sendAll(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        auto sent = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+LoopbackServer::LoopbackServer() {
+    listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        throw std::runtime_error("socket");
+    }
+    int one = 1;
+    ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (::bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::listen(listenFd, SOMAXCONN) != 0) {
+        ::close(listenFd);
+        throw std::runtime_error("bind");
+    }
+
+    socklen_t len = sizeof(addr);
+    ::getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &len);
+    listenPort = ntohs(addr.sin_port);
+
+    acceptThread = std::thread(&LoopbackServer::acceptLoop, this);
+}
+
+LoopbackServer::~LoopbackServer() {
+    stopping.store(true);
+    // shutdown() wakes the thread blocked in accept()
+    ::shutdown(listenFd, SHUT_RDWR);
+    acceptThread.join();
+    ::close(listenFd);
+    while (activeConnections.load() != 0) {
+        std::this_thread::yield();
+    }
+}
+
+std::string LoopbackServer::baseUrl() const {
+    return "http://127.0.0.1:" + std::to_string(listenPort);
+}
+
+void LoopbackServer::serve(const std::string &path, std::string body) {
+    auto shared = std::make_shared<const std::string>(std::move(body));
+    std::lock_guard<std::mutex> lock(resourcesLock);
+    resources[path] = {std::move(shared), nullptr, "\"" + std::to_string(++generation) + "\""};
+}
+
+void LoopbackServer::serveGzip(const std::string &path, std::string body) {
+    auto shared = std::make_shared<const std::string>(std::move(body));
+    std::lock_guard<std::mutex> lock(resourcesLock);
+    resources[path].gzip = std::move(shared);
+}
+
+void LoopbackServer::acceptLoop() {
+    while (! stopping.load()) {
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (stopping.load()) {
+                return;
+            }
+            continue;
+        }
+        ++activeConnections;
+        std::thread([this, fd] {
+            handle(fd);
+            ::close(fd);
+            --activeConnections;
+        }).detach();
+    }
+}
+
+void LoopbackServer::handle(int fd) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    std::string request;
+    char buffer[4096];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        auto got = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (got <= 0) {
+            return;
+        }
+        request.append(buffer, static_cast<size_t>(got));
+    }
+
+    // GET /path HTTP/1.1
+    auto methodEnd = request.find(' ');
+    auto pathEnd = request.find(' ', methodEnd + 1);
+    if (methodEnd == std::string::npos || pathEnd == std::string::npos) {
+        return;
+    }
+    auto path = request.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+
+    // Only what SocketTransport sends: "Accept-Encoding: gzip" without a Range
+    bool gzip = request.find("\r\nAccept-Encoding: gzip") != std::string::npos
+            && request.find("\r\nRange: ") == std::string::npos;
+    std::shared_ptr<const std::string> body;
+    std::string etag;
+    {
+        std::lock_guard<std::mutex> lock(resourcesLock);
+        auto it = resources.find(path);
+        if (it != resources.end()) {
+            gzip = gzip && it->second.gzip;
+            body = gzip ? it->second.gzip : it->second.body;
+            etag = it->second.etag;
+        }
+    }
+    ++requestCount;
+    if (auto delay = delayMs.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+    }
+
+    if (! body) {
+        static const char notFound[] =
+                "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        sendAll(fd, notFound, sizeof(notFound) - 1);
+        return;
+    }
+    static const char ifNoneMatch[] = "\r\nIf-None-Match: ";
+    auto condition = request.find(ifNoneMatch);
+    if (condition != std::string::npos
+            && request.compare(condition + sizeof(ifNoneMatch) - 1, etag.size(), etag) == 0) {
+        auto notModified = "HTTP/1.1 304 Not Modified\r\nETag: " + etag
+                + "\r\nConnection: close\r\n\r\n";
+        sendAll(fd, notModified.data(), notModified.size());
+        return;
+    }
+
+    // A single "Range: bytes=first-last", which is all the delta downloads send, or
+    // "bytes=first-" for a resumed download. A stale If-Range gets the whole body.
+    size_t first = 0;
+    size_t length = body->size();
+    const char *status = "200 OK";
+    static const char rangeHeader[] = "\r\nRange: bytes=";
+    static const char ifRange[] = "\r\nIf-Range: ";
+    auto range = request.find(rangeHeader);
+    auto validator = request.find(ifRange);
+    if (validator != std::string::npos
+            && request.compare(validator + sizeof(ifRange) - 1, etag.size() + 2, etag + "\r\n")
+                    != 0) {
+        range = std::string::npos;
+    }
+    if (range != std::string::npos) {
+        char *end = nullptr;
+        auto begin = request.c_str() + range + sizeof(rangeHeader) - 1;
+        first = std::strtoull(begin, &end, 10);
+        size_t last = *end == '-' && std::isdigit(static_cast<unsigned char>(end[1]))
+                ? std::strtoull(end + 1, nullptr, 10)
+                : body->size() - 1;
+        if (first >= body->size() || last < first) {
+            static const char unsatisfiable[] = "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                                                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            sendAll(fd, unsatisfiable, sizeof(unsatisfiable) - 1);
+            return;
+        }
+        length = std::min(last, body->size() - 1) - first + 1;
+        status = "206 Partial Content";
+    }
+
+    auto header = std::string("HTTP/1.1 ") + status + "\r\nContent-Length: "
+            + std::to_string(length) + (gzip ? "\r\nContent-Encoding: gzip" : "")
+            + "\r\nETag: " + etag + "\r\nConnection: close\r\n\r\n";
+    if (sendAll(fd, header.data(), header.size()) && sendAll(fd, body->data() + first, length)) {
+        bytesCount += length;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef LOOPBACKSERVER_H
+#define LOOPBACKSERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Minimal HTTP/1.1 server on 127.0.0.1 for benchmarking the download path without a network.
+// It answers GET requests for registered paths with the stored body and closes the
+// connection after every response, the same way CreateRequest uses a fresh session per call.
+// Every body gets an ETag of its own; a request whose If-None-Match names it is answered 304.
+class LoopbackServer {
+public:
+    LoopbackServer();
+    ~LoopbackServer();
+    LoopbackServer(const LoopbackServer &) = delete;
+    LoopbackServer &operator=(const LoopbackServer &) = delete;
+
+    unsigned short port() const { return listenPort; }
+    // http://127.0.0.1:<port>, for building manifest and package URLs
+    std::string baseUrl() const;
+
+    void serve(const std::string &path, std::string body);
+    // Gzip encoding of a path already served, sent to requests with Accept-Encoding: gzip
+    void serveGzip(const std::string &path, std::string body);
+    // Holds every response back this long before its headers are sent, the way a queue
+    // building up on the path would
+    void setDelay(std::chrono::milliseconds delay) { delayMs.store(delay.count()); }
+
+    unsigned long long requests() const { return requestCount.load(); }
+    unsigned long long bytesServed() const { return bytesCount.load(); }
+
+private:
+    void acceptLoop();
+    void handle(int fd);
+
+    int listenFd = -1;
+    unsigned short listenPort = 0;
+    std::thread acceptThread;
+    std::mutex resourcesLock;
+    struct Resource {
+        std::shared_ptr<const std::string> body;
+        std::shared_ptr<const std::string> gzip;
+        std::string etag;
+    };
+    std::map<std::string, Resource> resources;
+    unsigned long long generation = 0; // Of the last body served, for its ETag
+    std::atomic<int> activeConnections{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<long long> delayMs{0};
+    std::atomic<unsigned long long> requestCount{0};
+    std::atomic<unsigned long long> bytesCount{0};
+};
+
+#endif // LOOPBACKSERVER_H
@@ -14,7 +14,8 @@
 #define new DEBUG_NEW
 #endif
 #include <vector>
-#include <regex>
+
+#include "../SvcValidate.h"
 
 CString ReadRegistryStringValue(const CString &valueName);
 DWORD ReadRegistryDWORDValue(const CString &valueName);
@@ -312,7 +313,5 @@ std::vector<CString> SetandGetuids(bool uid) {
 }
 
 bool isValidGUID(const CString &str) {
-  const std::wregex uidPattern(L"(\\{[0-9A-Fa-f]{8}-[0-9A-Fa-f]{4}-[0-9A-Fa-f]{4}-[0-9A-Fa-f]{4}-[0-9A-Fa-f]{12}\\})");
-
-  return std::regex_match(str.GetString(), uidPattern);
+  return IsValidGuid(std::wstring_view(str.GetString(), str.GetLength()), GuidBraces::Required);
 }
\ No newline at end of file
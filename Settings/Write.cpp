@@ -1,26 +1,96 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <windows.h>
 
+#include <ktmw32.h>
+
+#include "../SvcValidate.h"
+#include "../json.hpp"
+
+// Writes product settings under HKLM\SOFTWARE\Arskom\updsvc, elevated:
+//
+//   updsvc-write <guid> <period> <rel_chan>
+//   updsvc-write --batch <file.json>
+//   updsvc-write --batch -                  (the manifest on standard input)
+//
+// A batch manifest is a JSON object of product GUIDs, each an object of values; numbers are
+// written as REG_DWORD and strings as REG_SZ:
+//
+//   {"{028818E2-5DF4-414F-A1E4-2AA542DE4697}": {"PERIOD": 3600, "REL_CHAN": "Stable"}}
+//
+// All values are written in one registry transaction, either every one of them lands or none
+// does. The running service is then asked once to read its configuration again.
+//
+// This is a GUI program, cmd does not wait for it unless it is started with start /wait.
+// Messages go to the console of the prompt it was started from, if there is one.
+
+static const std::wstring REGISTRY_ROOT = L"SOFTWARE\\Arskom\\updsvc";
+static const wchar_t SVCNAME[] = L"UpdSvc";
+// SVC_CONTROL_RELOAD in Svc.cpp
+static const DWORD SVC_CONTROL_RELOAD = 128;
+
+struct RegistryValue {
+    std::wstring name;
+    bool isString = false;
+    DWORD number = 0;
+    std::wstring text;
+};
+
+// Values by the key of their product
+using Batch = std::map<std::wstring, std::vector<RegistryValue>>;
+
 std::string ws2s(std::wstring_view s);
-bool WriteRegistryDWORD(const std::wstring &subKey, const std::wstring &valueName, DWORD data);
-bool WriteRegistryString(
-        const std::wstring &subKey, const std::wstring &valueName, const std::wstring &data);
+std::wstring s2ws(std::string_view s);
+bool ReadBatch(std::istream &istr, Batch &batch);
+bool WriteBatch(const Batch &batch);
+void NotifyService();
+void AttachParentConsole();
 
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PSTR lpCmdLine, int nCmdShow) {
+    AttachParentConsole();
 
     int argc = 0;
     LPWSTR *argv = CommandLineToArgvW(GetCommandLineW(), &argc);
 
-    std::wstring guid = argv[1];
-
-    std::wstringstream converter(argv[2]);
-    DWORD dwordValue;
-    converter >> dwordValue;
+    Batch batch;
+    if (argc == 3 && std::wstring(argv[1]) == L"--batch") {
+        bool read = false;
+        if (std::wstring(argv[2]) == L"-") {
+            read = ReadBatch(std::cin, batch);
+        }
+        else {
+            std::ifstream istr(argv[2], std::ios::binary);
+            read = istr.is_open() && ReadBatch(istr, batch);
+        }
+        if (! read) {
+            std::fprintf(stderr, "Invalid batch manifest: %s\n", ws2s(argv[2]).c_str());
+            return 1;
+        }
+    }
+    else if (argc == 4 && IsValidGuid(std::wstring_view(argv[1]), GuidBraces::Required)) {
+        std::wstringstream converter(argv[2]);
+        DWORD dwordValue = 0;
+        converter >> dwordValue;
 
-    WriteRegistryDWORD(L"SOFTWARE\\Arskom\\updsvc\\" + guid, L"PERIOD", dwordValue);
-    WriteRegistryString(L"SOFTWARE\\Arskom\\updsvc\\" + guid, L"REL_CHAN", argv[3]);
+        auto &values = batch[REGISTRY_ROOT + L"\\" + argv[1]];
+        values.push_back({L"PERIOD", false, dwordValue, {}});
+        values.push_back({L"REL_CHAN", true, 0, argv[3]});
+    }
+    else {
+        std::fprintf(stderr, "Usage: updsvc-write <guid> <period> <rel_chan>\n"
+                             "       updsvc-write --batch <file.json | ->\n");
+        return 1;
+    }
 
+    if (! WriteBatch(batch)) {
+        return 2;
+    }
+    NotifyService();
     return 0;
 }
 
@@ -34,44 +104,137 @@ std::string ws2s(std::wstring_view s) {
     return buf;
 }
 
-bool WriteRegistryDWORD(const std::wstring &subKey, const std::wstring &valueName, DWORD data) {
-    HKEY hSubKey;
-    if (RegCreateKeyExW(HKEY_LOCAL_MACHINE, subKey.c_str(), 0, nullptr, REG_OPTION_NON_VOLATILE,
-                KEY_SET_VALUE, nullptr, &hSubKey, nullptr)
-            != ERROR_SUCCESS) {
-        // error handling
-        return false;
-    }
+std::wstring s2ws(std::string_view s) {
+    int slength = (int)s.length();
+    int len = MultiByteToWideChar(CP_UTF8, 0, s.data(), slength, 0, 0);
+    std::wstring buf;
+    buf.resize(len);
+    MultiByteToWideChar(CP_UTF8, 0, s.data(), slength, buf.data(), len);
+    return buf;
+}
 
-    if (RegSetValueExW(hSubKey, valueName.c_str(), 0, REG_DWORD,
-                reinterpret_cast<const BYTE *>(&data), sizeof(data))
-            != ERROR_SUCCESS) {
-        RegCloseKey(hSubKey);
-        // error handling
+// The whole manifest is checked before anything is written
+bool ReadBatch(std::istream &istr, Batch &batch) {
+    using json = nlohmann::json;
+    auto manifest = json::parse(istr, nullptr, false);
+    if (manifest.is_discarded() || ! manifest.is_object()) {
         return false;
     }
-
-    RegCloseKey(hSubKey);
+    for (auto &[guid, product] : manifest.items()) {
+        if (! IsValidGuid(guid, GuidBraces::Required) || ! product.is_object()) {
+            std::fprintf(stderr, "Not a product GUID with values: %s\n", guid.c_str());
+            return false;
+        }
+        auto &values = batch[REGISTRY_ROOT + L"\\" + s2ws(guid)];
+        for (auto &[name, value] : product.items()) {
+            if (name.empty()) {
+                return false;
+            }
+            RegistryValue entry;
+            entry.name = s2ws(name);
+            if (value.is_string()) {
+                entry.isString = true;
+                entry.text = s2ws(value.get<std::string>());
+            }
+            else if (value.is_number_unsigned() && value.get<unsigned long long>() <= MAXDWORD) {
+                entry.number = value.get<DWORD>();
+            }
+            else {
+                std::fprintf(stderr, "%s of %s is neither a string nor a DWORD\n", name.c_str(),
+                        guid.c_str());
+                return false;
+            }
+            values.push_back(std::move(entry));
+        }
+    }
     return true;
 }
 
-bool WriteRegistryString(
-        const std::wstring &subKey, const std::wstring &valueName, const std::wstring &data) {
-    HKEY hSubKey;
-    if (RegCreateKeyExW(HKEY_LOCAL_MACHINE, subKey.c_str(), 0, nullptr, REG_OPTION_NON_VOLATILE,
-                KEY_SET_VALUE, nullptr, &hSubKey, nullptr)
-            != ERROR_SUCCESS) {
+bool WriteBatch(const Batch &batch) {
+    HANDLE transaction = CreateTransaction(
+            nullptr, nullptr, 0, 0, 0, 0, const_cast<LPWSTR>(L"updsvc-write"));
+    if (transaction == INVALID_HANDLE_VALUE) {
+        std::fprintf(stderr, "CreateTransaction failed (%lu)\n", GetLastError());
         return false;
     }
 
-    if (RegSetValueExW(hSubKey, valueName.c_str(), 0, REG_SZ,
-                reinterpret_cast<const BYTE *>(data.c_str()),
-                static_cast<DWORD>((data.length()) * sizeof(wchar_t)))
-            != ERROR_SUCCESS) {
+    LSTATUS result = ERROR_SUCCESS;
+    for (auto &[subKey, values] : batch) {
+        HKEY hSubKey;
+        result = RegCreateKeyTransactedW(HKEY_LOCAL_MACHINE, subKey.c_str(), 0, nullptr,
+                REG_OPTION_NON_VOLATILE, KEY_SET_VALUE, nullptr, &hSubKey, nullptr, transaction,
+                nullptr);
+        if (result != ERROR_SUCCESS) {
+            std::fprintf(stderr, "Creating %s failed (%ld)\n", ws2s(subKey).c_str(), result);
+            break;
+        }
+        for (auto &value : values) {
+            if (value.isString) {
+                result = RegSetValueExW(hSubKey, value.name.c_str(), 0, REG_SZ,
+                        reinterpret_cast<const BYTE *>(value.text.c_str()),
+                        static_cast<DWORD>((value.text.length() + 1) * sizeof(wchar_t)));
+            }
+            else {
+                result = RegSetValueExW(hSubKey, value.name.c_str(), 0, REG_DWORD,
+                        reinterpret_cast<const BYTE *>(&value.number), sizeof(value.number));
+            }
+            if (result != ERROR_SUCCESS) {
+                std::fprintf(stderr, "Setting %s of %s failed (%ld)\n", ws2s(value.name).c_str(),
+                        ws2s(subKey).c_str(), result);
+                break;
+            }
+        }
         RegCloseKey(hSubKey);
-        return false;
+        if (result != ERROR_SUCCESS) {
+            break;
+        }
     }
 
-    RegCloseKey(hSubKey);
-    return true;
+    bool committed = result == ERROR_SUCCESS && CommitTransaction(transaction);
+    if (! committed) {
+        if (result == ERROR_SUCCESS) {
+            std::fprintf(stderr, "CommitTransaction failed (%lu)\n", GetLastError());
+        }
+        RollbackTransaction(transaction);
+    }
+    CloseHandle(transaction);
+    return committed;
+}
+
+// Standard handles that were redirected to a file or a pipe are kept, the others are pointed
+// at the console of the parent. Without one, started from the Settings dialog, messages are
+// dropped and only the exit code tells what happened.
+void AttachParentConsole() {
+    bool inRedirected = GetFileType(GetStdHandle(STD_INPUT_HANDLE)) != FILE_TYPE_UNKNOWN;
+    bool outRedirected = GetFileType(GetStdHandle(STD_OUTPUT_HANDLE)) != FILE_TYPE_UNKNOWN;
+    bool errRedirected = GetFileType(GetStdHandle(STD_ERROR_HANDLE)) != FILE_TYPE_UNKNOWN;
+    if ((inRedirected && outRedirected && errRedirected)
+            || ! AttachConsole(ATTACH_PARENT_PROCESS)) {
+        return;
+    }
+    FILE *stream = nullptr;
+    if (! inRedirected) {
+        freopen_s(&stream, "CONIN$", "r", stdin);
+    }
+    if (! outRedirected) {
+        freopen_s(&stream, "CONOUT$", "w", stdout);
+    }
+    if (! errRedirected) {
+        freopen_s(&stream, "CONOUT$", "w", stderr);
+    }
+}
+
+// A service that is not running reads the values when it starts
+void NotifyService() {
+    SC_HANDLE schSCManager = OpenSCManager(nullptr, nullptr, SC_MANAGER_CONNECT);
+    if (! schSCManager) {
+        return;
+    }
+    SC_HANDLE schService = OpenService(schSCManager, SVCNAME, SERVICE_USER_DEFINED_CONTROL);
+    if (schService) {
+        SERVICE_STATUS status;
+        ControlService(schService, SVC_CONTROL_RELOAD, &status);
+        CloseServiceHandle(schService);
+    }
+    CloseServiceHandle(schSCManager);
 }
@@ -0,0 +1,190 @@
+#ifndef SVCBACKENDS_H
+#define SVCBACKENDS_H
+
+#include "SvcEngine.h"
+
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Everything the update engine needs from the platform. The service plugs in the Win32
+// implementations from SvcWin32.h; benchmarks and Linux builds use the ones in SvcPosix.h.
+
+class CancelToken;
+
+struct HttpRequest {
+    std::string domain;
+    std::string path;
+    std::string range; // Value of the Range header ("bytes=0-99"), empty for the whole body
+    // ETag the range is valid for (If-Range); if the body changed the server sends all of it
+    std::string ifRange;
+    std::string ifNoneMatch; // ETag for a conditional request, the server may answer 304
+    // Accept a gzip body. The transport decodes it as it arrives, sink only sees the
+    // original bytes.
+    bool compressed = false;
+};
+
+struct RequestStats {
+    unsigned long status = 0;
+    unsigned long long bytes = 0; // Written to sink
+    unsigned long long wireBytes = 0; // As received, fewer than bytes if it came compressed
+    std::string etag; // ETag header of the response, empty if it had none
+    // Smoothed round-trip time of the connection, kept current while the body arrives. Zero
+    // if the transport cannot tell.
+    std::chrono::microseconds rtt{0};
+};
+
+class Transport {
+public:
+    virtual ~Transport() = default;
+    // Performs a GET and streams the body into sink. Returns false if no response arrived or
+    // the body was cut short, the HTTP status is left in stats either way. The status and
+    // ETag are filled in before the first byte is written to sink.
+    virtual bool get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) = 0;
+};
+
+// Why a check of a product failed
+enum class FailureReason {
+    None,
+    Manifest, // No source returned a valid manifest
+    Download,
+    InstallerStart, // The installer could not be started
+    InstallerExit, // It exited with a non-zero code
+    InstallerKilled, // It ran past its limits
+    InstallerBusy, // Another install was in progress, nothing is wrong with the package
+};
+
+// Failed checks of a product since the last one that succeeded. It is kept in the state
+// store, so a restarted service keeps backing off instead of retrying right away.
+struct RetryState {
+    unsigned attempts = 0;
+    FailureReason reason = FailureReason::None; // Of the last failure
+    long long notBefore = 0; // Seconds since the Unix epoch, no retry is made before it
+};
+
+class ConfigStore {
+public:
+    virtual ~ConfigStore() = default;
+    // GUIDs of every configured product. Returns false if the configuration itself cannot be
+    // opened, which the service treats as fatal.
+    virtual bool products(std::vector<std::string> &product_guids) = 0;
+    virtual Config readProduct(const std::string &product_guid) = 0;
+    virtual BannedSet readBanned(const std::string &product_guid) = 0;
+    virtual void addBanned(const std::string &product_guid, const std::string &filename) = 0;
+    // Optional service-wide settings, a missing value is not an error
+    virtual std::string readSetting(const std::string &name) = 0;
+    virtual unsigned long readSetting(const std::string &name, unsigned long defaultValue) = 0;
+};
+
+class ProductInventory {
+public:
+    virtual ~ProductInventory() = default;
+    // Installed version as major.minor.patch, empty if the product is not installed
+    virtual std::string installedVersion(const std::string &product_guid) = 0;
+    // Full path of the product's main executable, empty if it cannot be determined
+    virtual std::string executablePath(const std::string &product_guid) = 0;
+
+    // Changes whenever the product is installed, patched, repaired or removed. Empty if the
+    // backend cannot tell, the product is then read again every time anything changed.
+    virtual std::string installStamp(const std::string &) { return {}; }
+    // False if the install state of no product changed since the last call. The first call,
+    // and every call to a backend that cannot watch for changes, returns true.
+    virtual bool changed() { return true; }
+};
+
+enum class ProcessState {
+    NotRunning,
+    Running,
+    Unknown,
+};
+
+class ProcessProbe {
+public:
+    virtual ~ProcessProbe() = default;
+    // Whether a process has exePath loaded
+    virtual ProcessState query(const std::string &exePath) = 0;
+};
+
+// Limits of one installer run, 0 for none. The CPU time and memory limits apply to all of
+// its processes together where the platform can do that (job objects on Windows).
+struct InstallLimits {
+    std::chrono::seconds timeout{0};
+    std::chrono::seconds cpuTime{0};
+    unsigned long long memoryBytes = 0;
+};
+
+struct InstallResult {
+    unsigned long exitCode = 0;
+    // Killed with every process it started, exitCode is not the installer's then
+    bool timedOut = false; // Ran past InstallLimits::timeout
+    bool stopped = false; // The host is shutting down
+};
+
+// An installer run in flight
+class InstallJob {
+public:
+    virtual ~InstallJob() = default;
+    // Waits up to timeout for the installer to exit, killing it when it runs past its limits
+    // or the host shuts down. Returns true once it is gone; result() is final from then on.
+    virtual bool wait(std::chrono::milliseconds timeout) = 0;
+    virtual InstallResult result() = 0;
+};
+
+class Installer {
+public:
+    virtual ~Installer() = default;
+    // Starts the package with the given command line, null if it could not be started.
+    // Destroying a job that has not finished kills the installer.
+    virtual std::unique_ptr<InstallJob> start(const std::filesystem::path &package,
+            const std::string &arguments, const InstallLimits &limits) = 0;
+    // Applies several patches, in order, as one installation. Null if this installer cannot
+    // do that for these packages; the engine then applies the first one alone.
+    virtual std::unique_ptr<InstallJob> startChain(const std::vector<std::filesystem::path> &,
+            const std::string &, const InstallLimits &) {
+        return nullptr;
+    }
+    // Points link at the directory target, creating link if it does not exist. The switch
+    // is a single operation, so a program started through link gets either version
+    // entirely. A junction on Windows, a symbolic link elsewhere.
+    virtual bool activate(
+            const std::filesystem::path &link, const std::filesystem::path &target) = 0;
+};
+
+// Time source for the scheduler and every wait in the engine, so simulations can run on
+// virtual time and the service can wake up when it is stopped.
+class Clock {
+public:
+    virtual ~Clock() = default;
+    virtual std::chrono::steady_clock::time_point now() = 0;
+    // Returns false if the wait was cut short because the host is shutting down
+    virtual bool sleepFor(std::chrono::milliseconds duration) = 0;
+};
+
+class SystemClock : public Clock {
+public:
+    explicit SystemClock(CancelToken *cancel = nullptr)
+        : cancel(cancel) {}
+
+    std::chrono::steady_clock::time_point now() override;
+    bool sleepFor(std::chrono::milliseconds duration) override;
+
+private:
+    CancelToken *cancel;
+};
+
+struct Backends {
+    Transport &transport;
+    ConfigStore &config;
+    ProductInventory &inventory;
+    ProcessProbe &probe;
+    Installer &installer;
+    Clock &clock;
+    // Tripped when the host shuts down, the backends above observe it too. Null if nothing
+    // stops the engine.
+    CancelToken *cancel = nullptr;
+};
+
+#endif // SVCBACKENDS_H
@@ -0,0 +1,195 @@
+#include "SvcBandwidth.h"
+#include "SvcMetrics.h"
+
+#include <algorithm>
+#include <ctime>
+
+// Per sample, the backoff factor grows by up to UP_GAIN while the queue is below the target
+// and shrinks by up to DOWN_GAIN above it. It never throttles below MIN_BACKOFF of the cap.
+static constexpr double UP_GAIN = 0.1;
+static constexpr double DOWN_GAIN = 0.5;
+static constexpr double MIN_BACKOFF = 1.0 / 16;
+
+static int localHour() {
+    auto now = std::time(nullptr);
+    std::tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    return local.tm_hour;
+}
+
+static Gauge &rateGauge() {
+    static auto &gauge = MetricGauge("updsvc_bandwidth_limit_bytes_per_second",
+            "Download rate the bandwidth governor allows, 0 for no limit");
+    return gauge;
+}
+
+BandwidthGovernor::BandwidthGovernor(Clock &clock)
+    : clock(clock) {}
+
+void BandwidthGovernor::setLimits(const BandwidthLimits &newLimits) {
+    std::lock_guard<std::mutex> guard(lock);
+    limits = newLimits;
+    rateGauge().set(static_cast<long long>(rateLocked()));
+}
+
+double BandwidthGovernor::rate() {
+    std::lock_guard<std::mutex> guard(lock);
+    return rateLocked();
+}
+
+double BandwidthGovernor::backoff() {
+    std::lock_guard<std::mutex> guard(lock);
+    return factor;
+}
+
+double BandwidthGovernor::rateLocked() {
+    if (limits.dayKBps == 0 && limits.nightKBps == 0) {
+        return 0;
+    }
+    int hour = localHour();
+    bool night = limits.nightBegins > limits.nightEnds
+            ? hour >= limits.nightBegins || hour < limits.nightEnds
+            : hour >= limits.nightBegins && hour < limits.nightEnds;
+    auto kbps = night ? limits.nightKBps : limits.dayKBps;
+    if (kbps == 0) {
+        return 0;
+    }
+    return kbps * 1024.0 * (limits.adaptive ? factor : 1.0);
+}
+
+bool BandwidthGovernor::acquire(size_t bytes) {
+    static auto &waits = MetricHistogram("updsvc_bandwidth_wait_seconds",
+            "Time downloads slept for the bandwidth cap", 1e-6);
+
+    std::chrono::milliseconds wait;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto now = clock.now();
+        double limit = rateLocked();
+        if (limit <= 0) {
+            tokens = 0;
+            refilled = now;
+            return true;
+        }
+        // Up to a quarter second of idle time can be spent at once
+        double elapsed = std::chrono::duration<double>(now - refilled).count();
+        tokens = std::min(limit / 4, tokens + elapsed * limit);
+        refilled = now;
+        tokens -= static_cast<double>(bytes);
+        if (tokens >= 0) {
+            return true;
+        }
+        // Every reader in debt waits until its own bytes are paid for, whoever took tokens
+        // before it keeps its place
+        wait = std::chrono::ceil<std::chrono::milliseconds>(
+                std::chrono::duration<double>(-tokens / limit));
+    }
+    waits.record(std::chrono::duration_cast<std::chrono::microseconds>(wait).count());
+    return clock.sleepFor(wait);
+}
+
+void BandwidthGovernor::delaySample(const std::string &domain, std::chrono::microseconds delay) {
+    std::lock_guard<std::mutex> guard(lock);
+    sampleLocked(delays[domain], delay);
+}
+
+void BandwidthGovernor::roundTripSample(const std::string &domain,
+        std::chrono::microseconds rtt) {
+    std::lock_guard<std::mutex> guard(lock);
+    sampleLocked(roundTrips[domain], rtt);
+}
+
+void BandwidthGovernor::sampleLocked(DelayHistory &history, std::chrono::microseconds delay) {
+    auto now = clock.now();
+    if (history.used == 0 || now - history.minuteBegin >= std::chrono::minutes(1)) {
+        history.minutes[history.used % history.minutes.size()] = delay;
+        ++history.used;
+        history.minuteBegin = now;
+    }
+    else {
+        auto &minute = history.minutes[(history.used - 1) % history.minutes.size()];
+        minute = std::min(minute, delay);
+    }
+    history.recent[history.samples % history.recent.size()] = delay;
+    ++history.samples;
+    if (! limits.adaptive) {
+        return;
+    }
+
+    auto base = *std::min_element(history.minutes.begin(),
+            history.minutes.begin() + std::min(history.used, history.minutes.size()));
+    auto current = *std::min_element(history.recent.begin(),
+            history.recent.begin() + std::min(history.samples, history.recent.size()));
+    double queuing = std::chrono::duration<double>(current - base).count();
+    double target = std::chrono::duration<double>(TARGET_DELAY).count();
+    double offTarget = std::clamp((target - queuing) / target, -1.0, 1.0);
+    factor *= 1 + offTarget * (offTarget > 0 ? UP_GAIN : DOWN_GAIN);
+    factor = std::clamp(factor, MIN_BACKOFF, 1.0);
+    rateGauge().set(static_cast<long long>(rateLocked()));
+}
+
+// Charges the governor for every write before passing it on to the sink, takes the delay
+// sample at the first one and a round-trip sample every ROUND_TRIP_INTERVAL after it
+class ThrottledBuffer : public std::streambuf {
+public:
+    ThrottledBuffer(std::ostream &sink, BandwidthGovernor &governor, const std::string &domain,
+            const RequestStats &stats)
+        : sink(sink)
+        , governor(governor)
+        , domain(domain)
+        , stats(stats)
+        , begin(std::chrono::steady_clock::now()) {}
+
+    bool cancelled() const { return stopped; }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        auto now = std::chrono::steady_clock::now();
+        if (! sampled) {
+            sampled = true;
+            roundTripTaken = now;
+            governor.delaySample(domain,
+                    std::chrono::duration_cast<std::chrono::microseconds>(now - begin));
+        }
+        else if (now - roundTripTaken >= ThrottledTransport::ROUND_TRIP_INTERVAL
+                && stats.rtt.count() > 0) {
+            roundTripTaken = now;
+            governor.roundTripSample(domain, stats.rtt);
+        }
+        if (stopped || ! governor.acquire(static_cast<size_t>(count))) {
+            stopped = true;
+            return 0;
+        }
+        sink.write(data, count);
+        return sink ? count : 0;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+private:
+    std::ostream &sink;
+    BandwidthGovernor &governor;
+    const std::string &domain;
+    const RequestStats &stats;
+    std::chrono::steady_clock::time_point begin;
+    std::chrono::steady_clock::time_point roundTripTaken;
+    bool sampled = false;
+    bool stopped = false;
+};
+
+bool ThrottledTransport::get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) {
+    ThrottledBuffer throttled(sink, governor, request.domain, stats);
+    std::ostream body(&throttled);
+    bool received = inner.get(request, body, stats);
+    return received && ! throttled.cancelled();
+}
@@ -0,0 +1,89 @@
+#ifndef SVCBANDWIDTH_H
+#define SVCBANDWIDTH_H
+
+#include "SvcBackends.h"
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Token bucket shared by every download, so background updates leave the rest of the link to
+// the users. Readers take tokens for the bytes they got and sleep on the clock while the
+// bucket is in debt; concurrent downloads split the rate between them.
+//
+// With BandwidthLimits::adaptive set the cap is also scaled down, LEDBAT-style, while the
+// delay to a host rises above the lowest one seen for it in the last ten minutes: a queue is
+// building up somewhere on the path, most likely behind someone's interactive traffic. The
+// time to the first byte of each request is one measure of it; the connection's round-trip
+// time, sampled while a long body arrives, is the other. Each has its own baseline.
+class BandwidthGovernor {
+public:
+    explicit BandwidthGovernor(Clock &clock);
+
+    void setLimits(const BandwidthLimits &limits);
+
+    // Takes bytes out of the bucket, sleeping until they are paid for. Returns false if the
+    // sleep was cut short because the host is shutting down.
+    bool acquire(size_t bytes);
+
+    // Time to the first byte of a response from domain
+    void delaySample(const std::string &domain, std::chrono::microseconds delay);
+    // Round-trip time of a connection to domain, taken while its body arrives
+    void roundTripSample(const std::string &domain, std::chrono::microseconds rtt);
+
+    // Bytes per second allowed now, 0 if downloads are not limited
+    double rate();
+    // How far the adaptive backoff has lowered the cap, 1 when it has not
+    double backoff();
+
+    // Queuing delay the adaptive backoff aims for, LEDBAT's TARGET
+    static constexpr std::chrono::milliseconds TARGET_DELAY{100};
+
+private:
+    struct DelayHistory {
+        // Lowest delay of each of the last minutes, the oldest is overwritten
+        std::array<std::chrono::microseconds, 10> minutes;
+        size_t used = 0;
+        std::chrono::steady_clock::time_point minuteBegin;
+        // The last few samples, their lowest is the current delay
+        std::array<std::chrono::microseconds, 3> recent;
+        size_t samples = 0;
+    };
+
+    double rateLocked();
+    // Records the sample and moves the factor towards the target
+    void sampleLocked(DelayHistory &history, std::chrono::microseconds delay);
+
+    Clock &clock;
+    std::mutex lock;
+    BandwidthLimits limits;
+    double tokens = 0; // Negative while downloads wait for it to refill
+    std::chrono::steady_clock::time_point refilled;
+    double factor = 1.0;
+    std::map<std::string, DelayHistory> delays;
+    std::map<std::string, DelayHistory> roundTrips;
+};
+
+// Passes requests on to another transport and holds the body back to the governor's rate.
+// The sink is only written as fast as the bucket allows, so the transport reads its socket
+// that much slower and TCP flow control slows the sender down. A compressed body is charged
+// its decoded size. While the body arrives the round-trip time the transport reports in
+// RequestStats is passed to the governor every ROUND_TRIP_INTERVAL.
+class ThrottledTransport : public Transport {
+public:
+    ThrottledTransport(Transport &inner, BandwidthGovernor &governor)
+        : inner(inner)
+        , governor(governor) {}
+
+    bool get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) override;
+
+    static constexpr std::chrono::milliseconds ROUND_TRIP_INTERVAL{500};
+
+private:
+    Transport &inner;
+    BandwidthGovernor &governor;
+};
+
+#endif // SVCBANDWIDTH_H
@@ -0,0 +1,104 @@
+#include "SvcCancel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+CancelToken::CancelToken() {
+#ifdef _WIN32
+    event = CreateEvent(NULL, TRUE, FALSE, NULL);
+#else
+    if (::pipe2(pipe, O_CLOEXEC) != 0) {
+        pipe[0] = pipe[1] = -1;
+    }
+#endif
+}
+
+CancelToken::~CancelToken() {
+#ifdef _WIN32
+    if (event) {
+        CloseHandle(event);
+    }
+#else
+    for (int fd : pipe) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+#endif
+}
+
+void CancelToken::cancel() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (tripped) {
+        return;
+    }
+    tripped = true;
+#ifdef _WIN32
+    if (event) {
+        SetEvent(event);
+    }
+#else
+    if (pipe[1] >= 0) {
+        // Never read, the pipe stays readable
+        char byte = 1;
+        while (::write(pipe[1], &byte, 1) < 0 && errno == EINTR) {
+        }
+    }
+#endif
+    wake.notify_all();
+    // Under the lock, so a registration ending on another thread waits for its callback
+    for (auto &[id, callback] : callbacks) {
+        callback();
+    }
+}
+
+bool CancelToken::cancelled() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return tripped;
+}
+
+bool CancelToken::sleepFor(std::chrono::milliseconds duration) {
+    std::unique_lock<std::mutex> guard(lock);
+    return ! wake.wait_for(guard, duration, [this] { return tripped; });
+}
+
+CancelToken::Registration CancelToken::onCancel(std::function<void()> callback) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (tripped) {
+        callback();
+        return {};
+    }
+    auto id = nextId++;
+    callbacks.emplace(id, std::move(callback));
+    return {this, id};
+}
+
+CancelToken::Registration::Registration(Registration &&other) noexcept
+    : token(other.token)
+    , id(other.id) {
+    other.token = nullptr;
+}
+
+CancelToken::Registration &CancelToken::Registration::operator=(Registration &&other) noexcept {
+    if (this != &other) {
+        this->~Registration();
+        token = other.token;
+        id = other.id;
+        other.token = nullptr;
+    }
+    return *this;
+}
+
+CancelToken::Registration::~Registration() {
+    if (token) {
+        std::lock_guard<std::mutex> guard(token->lock);
+        token->callbacks.erase(id);
+        token = nullptr;
+    }
+}
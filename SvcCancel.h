@@ -0,0 +1,71 @@
+#ifndef SVCCANCEL_H
+#define SVCCANCEL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// Tripped once, when the host shuts down, and observed by every blocking point of the
+// pipeline. Sleeps wait on it; waits on the system can add waitHandle() to what they wait
+// for; calls that can do neither, like a read from a socket, register a callback that breaks
+// them off. Nothing is reset, a token serves one run of the service.
+class CancelToken {
+public:
+    CancelToken();
+    ~CancelToken();
+    CancelToken(const CancelToken &) = delete;
+    CancelToken &operator=(const CancelToken &) = delete;
+
+    // Trips the token and runs the callbacks, on the calling thread
+    void cancel();
+    bool cancelled() const;
+    // Returns false if the wait was cut short because the token was tripped
+    bool sleepFor(std::chrono::milliseconds duration);
+
+#ifdef _WIN32
+    // Manual-reset event that is signaled once the token is tripped. Null if it could not be
+    // created.
+    void *waitHandle() const { return event; }
+#else
+    // Becomes readable once the token is tripped, for poll(). -1 if the pipe could not be
+    // created.
+    int waitHandle() const { return pipe[0]; }
+#endif
+
+    // Runs callback when the token is tripped, or right away if it already is, until the
+    // registration is destroyed. The destructor waits for a callback that is running, so
+    // whatever the callback uses can be freed after it.
+    class Registration {
+    public:
+        Registration() = default;
+        Registration(Registration &&other) noexcept;
+        Registration &operator=(Registration &&other) noexcept;
+        ~Registration();
+
+    private:
+        friend class CancelToken;
+        Registration(CancelToken *token, unsigned long long id)
+            : token(token)
+            , id(id) {}
+
+        CancelToken *token = nullptr;
+        unsigned long long id = 0;
+    };
+    Registration onCancel(std::function<void()> callback);
+
+private:
+    mutable std::mutex lock;
+    std::condition_variable wake;
+    bool tripped = false;
+    std::map<unsigned long long, std::function<void()>> callbacks;
+    unsigned long long nextId = 1;
+#ifdef _WIN32
+    void *event = nullptr;
+#else
+    int pipe[2] = {-1, -1};
+#endif
+};
+
+#endif // SVCCANCEL_H
@@ -0,0 +1,460 @@
+#include "SvcChunk.h"
+#include "SvcResources.h"
+#include "json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SVC_CHUNK_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// As in SvcText.cpp, GCC and Clang only accept the SHA intrinsics in functions built for them
+#if defined(__GNUC__) || defined(__clang__)
+#define SVC_TARGET_SHA __attribute__((target("sha,sse4.1,ssse3")))
+#else
+#define SVC_TARGET_SHA
+#endif
+
+using json = nlohmann::json;
+
+static constexpr uint32_t SHA256_K[64] = {0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be,
+        0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+        0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e,
+        0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624,
+        0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3,
+        0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256()
+    : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab,
+              0x5be0cd19} {}
+
+#ifdef SVC_CHUNK_X86
+
+// SHA extensions: each sha256rnds2 does two rounds on the state split as ABEF and CDGH, and
+// msg1/msg2 compute the message schedule four words at a time.
+SVC_TARGET_SHA static void compressShaNi(uint32_t state[8], const unsigned char *blocks,
+        size_t count) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+    __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+    __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; count > 0; --count, blocks += 64) {
+        __m128i abefSaved = abef;
+        __m128i cdghSaved = cdgh;
+        __m128i w[4];
+        for (int i = 0; i < 16; ++i) {
+            __m128i m;
+            if (i < 4) {
+                m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(blocks + 16 * i));
+                m = _mm_shuffle_epi8(m, byteSwap);
+            }
+            else {
+                // w[(i + n) & 3] holds the four words of group i - 4 + n
+                m = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+                m = _mm_sha256msg2_epu32(m, w[(i + 3) & 3]);
+            }
+            w[i & 3] = m;
+
+            __m128i k = _mm_add_epi32(
+                    m, _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHA256_K + 4 * i)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abefSaved);
+        cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+static bool cpuHasShaNi() {
+    unsigned int leaf1[4] = {};
+    unsigned int leaf7[4] = {};
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    std::memcpy(leaf1, info, sizeof(info));
+    __cpuidex(info, 7, 0);
+    std::memcpy(leaf7, info, sizeof(info));
+#else
+    if (! __get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3])
+            || ! __get_cpuid_count(7, 0, &leaf7[0], &leaf7[1], &leaf7[2], &leaf7[3])) {
+        return false;
+    }
+#endif
+    bool ssse3 = (leaf1[2] & (1 << 9)) != 0;
+    bool sse41 = (leaf1[2] & (1 << 19)) != 0;
+    bool sha = (leaf7[1] & (1 << 29)) != 0;
+    return ssse3 && sse41 && sha;
+}
+
+static const bool gHasShaNi = cpuHasShaNi();
+
+#endif // SVC_CHUNK_X86
+
+static std::atomic<bool> gUseShaNi{true};
+
+void Sha256UseSimd(bool enable) {
+    gUseShaNi.store(enable, std::memory_order_relaxed);
+}
+
+void Sha256::compress(const unsigned char *blocks, size_t count) {
+#ifdef SVC_CHUNK_X86
+    if (gHasShaNi && gUseShaNi.load(std::memory_order_relaxed)) {
+        compressShaNi(state, blocks, count);
+        return;
+    }
+#endif
+    for (; count > 0; --count, blocks += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(blocks[4 * i]) << 24) | (uint32_t(blocks[4 * i + 1]) << 16)
+                    | (uint32_t(blocks[4 * i + 2]) << 8) | uint32_t(blocks[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g))
+                    + SHA256_K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+void Sha256::update(const void *data, size_t size) {
+    auto *p = static_cast<const unsigned char *>(data);
+    total += size;
+    if (buffered > 0) {
+        size_t take = std::min(size, sizeof(buffer) - buffered);
+        std::memcpy(buffer + buffered, p, take);
+        buffered += take;
+        p += take;
+        size -= take;
+        if (buffered < sizeof(buffer)) {
+            return;
+        }
+        compress(buffer, 1);
+        buffered = 0;
+    }
+    compress(p, size / 64);
+    p += size & ~size_t(63);
+    size &= 63;
+    std::memcpy(buffer, p, size);
+    buffered = size;
+}
+
+Sha256Digest Sha256::finish() {
+    uint64_t bits = total * 8;
+    unsigned char pad[72] = {0x80};
+    size_t padSize = (buffered < 56 ? 56 : 120) - buffered;
+    for (int i = 0; i < 8; ++i) {
+        pad[padSize + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    }
+    update(pad, padSize + 8);
+
+    Sha256Digest digest;
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = static_cast<unsigned char>(state[i] >> 24);
+        digest[4 * i + 1] = static_cast<unsigned char>(state[i] >> 16);
+        digest[4 * i + 2] = static_cast<unsigned char>(state[i] >> 8);
+        digest[4 * i + 3] = static_cast<unsigned char>(state[i]);
+    }
+    return digest;
+}
+
+Sha256Digest Sha256::digest(const void *data, size_t size) {
+    Sha256 sha;
+    sha.update(data, size);
+    return sha.finish();
+}
+
+std::string DigestHex(const Sha256Digest &digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(digest.size() * 2, '\0');
+    for (size_t i = 0; i < digest.size(); ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    return hex;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool ParseDigestHex(std::string_view hex, Sha256Digest &digest) {
+    if (hex.size() != digest.size() * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < digest.size(); ++i) {
+        int hi = hexValue(hex[2 * i]);
+        int lo = hexValue(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        digest[i] = static_cast<unsigned char>(hi << 4 | lo);
+    }
+    return true;
+}
+
+//
+// FastCDC (Xia et al., USENIX ATC 2016). The gear hash shifts one bit per byte, so its top
+// bits only depend on the last few dozen bytes. Up to the average size a stricter mask is
+// used and after it a looser one, which keeps chunk sizes close to the average.
+//
+
+static constexpr std::array<uint64_t, 256> makeGearTable() {
+    std::array<uint64_t, 256> table{};
+    uint64_t x = 0x2545F4914F6CDD1DULL;
+    for (auto &entry : table) {
+        // splitmix64
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}
+
+static constexpr auto GEAR = makeGearTable();
+
+// Mask of the top bits set, matching on average once every 2^bits bytes
+static uint64_t topBitsMask(int bits) {
+    return bits <= 0 ? 0 : ~uint64_t(0) << (64 - bits);
+}
+
+static int log2Floor(uint32_t v) {
+    int bits = 0;
+    while (v > 1) {
+        v >>= 1;
+        ++bits;
+    }
+    return bits;
+}
+
+size_t NextChunkSize(const unsigned char *data, size_t size, const ChunkParams &params) {
+    if (size <= params.minSize) {
+        return size;
+    }
+    size_t end = std::min<size_t>(size, params.maxSize);
+    size_t normal = std::min<size_t>(end, params.avgSize);
+    int bits = log2Floor(params.avgSize);
+    uint64_t maskSmall = topBitsMask(bits + 2);
+    uint64_t maskLarge = topBitsMask(bits - 2);
+
+    uint64_t fp = 0;
+    size_t i = params.minSize;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + GEAR[data[i]];
+        if (! (fp & maskSmall)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i) {
+        fp = (fp << 1) + GEAR[data[i]];
+        if (! (fp & maskLarge)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+ChunkIndex ChunkBuffer(const void *data, size_t size, const ChunkParams &params) {
+    auto *bytes = static_cast<const unsigned char *>(data);
+    ChunkIndex index;
+    index.params = params;
+    index.size = size;
+    index.chunks.reserve(size / params.avgSize + 1);
+
+    Sha256 whole;
+    whole.update(bytes, size);
+    index.hash = whole.finish();
+
+    size_t offset = 0;
+    while (offset < size) {
+        size_t n = NextChunkSize(bytes + offset, size - offset, params);
+        index.chunks.push_back(
+                {offset, static_cast<uint32_t>(n), Sha256::digest(bytes + offset, n)});
+        offset += n;
+        // Only the in-memory chunking of benchmarks and tools, nothing cancels it
+        ResourceCheckpoint();
+    }
+    return index;
+}
+
+bool ChunkFile(const std::filesystem::path &path, ChunkIndex &index, const ChunkParams &params) {
+    std::ifstream in(path, std::ios::binary);
+    if (! in.is_open()) {
+        return false;
+    }
+
+    index = ChunkIndex{};
+    index.params = params;
+
+    // Always hold at least one maximum-size chunk unless the file ends first
+    const size_t capacity = std::max<size_t>(8 << 20, 2 * params.maxSize);
+    std::unique_ptr<unsigned char[]> buffer(new unsigned char[capacity]);
+    size_t begin = 0;
+    size_t end = 0;
+    bool eof = false;
+    uint64_t offset = 0;
+    Sha256 whole;
+
+    for (;;) {
+        if (! eof && end - begin < params.maxSize) {
+            std::memmove(buffer.get(), buffer.get() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            in.read(reinterpret_cast<char *>(buffer.get() + end),
+                    static_cast<std::streamsize>(capacity - end));
+            auto got = static_cast<size_t>(in.gcount());
+            whole.update(buffer.get() + end, got);
+            end += got;
+            if (in.eof()) {
+                eof = true;
+            }
+            else if (! in) {
+                return false;
+            }
+        }
+        if (begin == end) {
+            break;
+        }
+        size_t n = NextChunkSize(buffer.get() + begin, end - begin, params);
+        index.chunks.push_back(
+                {offset, static_cast<uint32_t>(n), Sha256::digest(buffer.get() + begin, n)});
+        begin += n;
+        offset += n;
+        if (! ResourceCheckpoint()) {
+            return false;
+        }
+    }
+
+    index.size = offset;
+    index.hash = whole.finish();
+    return true;
+}
+
+std::string ChunkIndexToJson(const ChunkIndex &index) {
+    json chunks = json::array();
+    for (auto &chunk : index.chunks) {
+        chunks.push_back({chunk.size, DigestHex(chunk.hash)});
+    }
+    json doc = {
+            {"algorithm", "fastcdc-sha256"},
+            {"min", index.params.minSize},
+            {"avg", index.params.avgSize},
+            {"max", index.params.maxSize},
+            {"size", index.size},
+            {"sha256", DigestHex(index.hash)},
+            {"chunks", std::move(chunks)},
+    };
+    return doc.dump();
+}
+
+bool ChunkIndexFromJson(std::string_view text, ChunkIndex &index) {
+    json doc = json::parse(text.begin(), text.end(), nullptr, false);
+    if (! doc.is_object() || doc.value("algorithm", "") != "fastcdc-sha256") {
+        return false;
+    }
+
+    ChunkIndex parsed;
+    try {
+        parsed.params.minSize = doc.at("min").get<uint32_t>();
+        parsed.params.avgSize = doc.at("avg").get<uint32_t>();
+        parsed.params.maxSize = doc.at("max").get<uint32_t>();
+        parsed.size = doc.at("size").get<uint64_t>();
+        if (! ParseDigestHex(doc.at("sha256").get_ref<const std::string &>(), parsed.hash)) {
+            return false;
+        }
+
+        uint64_t offset = 0;
+        for (auto &entry : doc.at("chunks")) {
+            Chunk chunk;
+            chunk.offset = offset;
+            chunk.size = entry.at(0).get<uint32_t>();
+            if (chunk.size == 0
+                    || ! ParseDigestHex(entry.at(1).get_ref<const std::string &>(), chunk.hash)) {
+                return false;
+            }
+            offset += chunk.size;
+            parsed.chunks.push_back(chunk);
+        }
+        if (offset != parsed.size) {
+            return false;
+        }
+    }
+    catch (json::exception &) {
+        return false;
+    }
+    if (parsed.params.minSize == 0 || parsed.params.minSize > parsed.params.avgSize
+            || parsed.params.avgSize > parsed.params.maxSize) {
+        return false;
+    }
+
+    index = std::move(parsed);
+    return true;
+}
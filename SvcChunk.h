@@ -0,0 +1,81 @@
+#ifndef SVCCHUNK_H
+#define SVCCHUNK_H
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content-defined chunking for delta downloads. A package is cut where a rolling hash of the
+// last few bytes matches a mask (FastCDC), so an edit only moves the boundaries next to it
+// and the chunks of two builds of the same installer line up again right after every change.
+// Every chunk carries its SHA-256; a chunk index lists them in file order.
+
+using Sha256Digest = std::array<unsigned char, 32>;
+
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const void *data, size_t size);
+    Sha256Digest finish();
+
+    static Sha256Digest digest(const void *data, size_t size);
+
+private:
+    void compress(const unsigned char *blocks, size_t count);
+
+    uint32_t state[8];
+    unsigned char buffer[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+};
+
+// SHA-256 uses the SHA extensions when the CPU has them; false forces the portable code, for
+// comparing the two in updsvc_bench
+void Sha256UseSimd(bool enable);
+
+std::string DigestHex(const Sha256Digest &digest);
+bool ParseDigestHex(std::string_view hex, Sha256Digest &digest);
+
+// Both ends must chunk with the same parameters, they are stored in the index
+struct ChunkParams {
+    uint32_t minSize = 16 * 1024;
+    uint32_t avgSize = 64 * 1024;
+    uint32_t maxSize = 256 * 1024;
+
+    bool operator==(const ChunkParams &other) const {
+        return minSize == other.minSize && avgSize == other.avgSize && maxSize == other.maxSize;
+    }
+};
+
+struct Chunk {
+    uint64_t offset;
+    uint32_t size;
+    Sha256Digest hash;
+};
+
+struct ChunkIndex {
+    ChunkParams params;
+    uint64_t size = 0;
+    Sha256Digest hash{}; // Of the whole file
+    std::vector<Chunk> chunks;
+};
+
+// Length of the chunk that starts at data; size is what is left of the file
+size_t NextChunkSize(const unsigned char *data, size_t size, const ChunkParams &params);
+
+ChunkIndex ChunkBuffer(const void *data, size_t size, const ChunkParams &params = {});
+
+// Streams the file through the chunker without loading it whole. Returns false if it cannot
+// be read.
+bool ChunkFile(
+        const std::filesystem::path &path, ChunkIndex &index, const ChunkParams &params = {});
+
+// JSON form published next to the package, see the "chunks" member of a manifest entry
+std::string ChunkIndexToJson(const ChunkIndex &index);
+bool ChunkIndexFromJson(std::string_view text, ChunkIndex &index);
+
+#endif // SVCCHUNK_H
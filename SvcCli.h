@@ -0,0 +1,130 @@
+#ifndef SVCCLI_H
+#define SVCCLI_H
+
+#include <windows.h>
+
+#include "json.hpp"
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Command line and output of updsvc-ctl and updsvc-cfg:
+//
+//   updsvc-ctl [--json] <command> <service_name> [<service_name> ...]
+//
+// The command runs for every service at the same time, on a thread of its own, and the
+// results are printed in the order of the names once all of them are done. --json prints
+// them as one array for deployment scripts instead of text.
+
+// What a command did to one service
+struct SvcResult {
+    std::wstring name;
+    bool ok = false;
+    DWORD error = ERROR_SUCCESS; // Of the call that failed
+    DWORD state = 0; // SERVICE_STOPPED..., 0 if it was not queried
+    std::string message;
+    // Further "name: value" lines, the configuration printed by query
+    std::vector<std::pair<std::string, std::wstring>> details;
+};
+
+inline std::string SvcCliUtf8(const std::wstring &s) {
+    int len = WideCharToMultiByte(
+            CP_UTF8, 0, s.data(), static_cast<int>(s.size()), NULL, 0, NULL, NULL);
+    std::string buf(len, '\0');
+    WideCharToMultiByte(
+            CP_UTF8, 0, s.data(), static_cast<int>(s.size()), buf.data(), len, NULL, NULL);
+    return buf;
+}
+
+// Records the call that failed and GetLastError, or error if it is not that
+inline void SvcCliFail(SvcResult &result, const char *call, DWORD error = GetLastError()) {
+    result.ok = false;
+    result.error = error;
+    result.message = std::string(call) + " failed (" + std::to_string(error) + ")";
+}
+
+inline const char *SvcCliStateName(DWORD state) {
+    switch (state) {
+    case SERVICE_STOPPED:
+        return "stopped";
+    case SERVICE_START_PENDING:
+        return "start_pending";
+    case SERVICE_STOP_PENDING:
+        return "stop_pending";
+    case SERVICE_RUNNING:
+        return "running";
+    case SERVICE_CONTINUE_PENDING:
+        return "continue_pending";
+    case SERVICE_PAUSE_PENDING:
+        return "pause_pending";
+    case SERVICE_PAUSED:
+        return "paused";
+    default:
+        return "unknown";
+    }
+}
+
+// Splits "[--json] <command> <service_name>..." off argv; false if there is no name
+inline bool SvcCliParse(int argc, wchar_t *argv[], bool &json, std::wstring &command,
+        std::vector<std::wstring> &names) {
+    int i = 1;
+    json = i < argc && lstrcmpi(argv[i], L"--json") == 0;
+    if (json) {
+        ++i;
+    }
+    if (argc - i < 2) {
+        return false;
+    }
+    command = argv[i++];
+    names.assign(argv + i, argv + argc);
+    return true;
+}
+
+// Runs command for every name concurrently. Each thread gets its own alertable waits, the
+// status notifications of the SCM are delivered to the thread that asked for them.
+template <class Command>
+std::vector<SvcResult> SvcCliRun(const std::vector<std::wstring> &names, Command command) {
+    std::vector<SvcResult> results(names.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < names.size(); ++i) {
+        results[i].name = names[i];
+        threads.emplace_back([&command, &result = results[i]] { command(result); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    return results;
+}
+
+// Returns the exit code of the tool, 0 if the command succeeded for every service
+inline int SvcCliPrint(const std::vector<SvcResult> &results, bool json) {
+    int exitCode = 0;
+    auto array = nlohmann::json::array();
+    for (auto &result : results) {
+        exitCode = result.ok ? exitCode : 1;
+        if (json) {
+            nlohmann::json entry = {{"service", SvcCliUtf8(result.name)}, {"ok", result.ok},
+                    {"error", result.error}, {"message", result.message}};
+            if (result.state != 0) {
+                entry["state"] = SvcCliStateName(result.state);
+            }
+            for (auto &[name, value] : result.details) {
+                entry[name] = SvcCliUtf8(value);
+            }
+            array.push_back(std::move(entry));
+            continue;
+        }
+        std::printf("%s: %s\n", SvcCliUtf8(result.name).c_str(), result.message.c_str());
+        for (auto &[name, value] : result.details) {
+            std::printf("  %s: %s\n", name.c_str(), SvcCliUtf8(value).c_str());
+        }
+    }
+    if (json) {
+        std::printf("%s\n", array.dump(2).c_str());
+    }
+    return exitCode;
+}
+
+#endif // SVCCLI_H
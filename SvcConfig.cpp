@@ -3,67 +3,86 @@
 #include <tchar.h>
 #include <windows.h>
 
+#include "SvcCli.h"
+
 #pragma comment(lib, "advapi32.lib")
 
-TCHAR szCommand[10];
-TCHAR szSvcName[80];
+SC_HANDLE schSCManager;
 
 VOID __stdcall DisplayUsage(void);
 
-VOID __stdcall DoQuerySvc(void);
-VOID __stdcall DoUpdateSvcDesc(void);
-VOID __stdcall DoDisableSvc(void);
-VOID __stdcall DoEnableSvc(void);
-VOID __stdcall DoDeleteSvc(void);
+VOID __stdcall DoQuerySvc(SvcResult &result);
+VOID __stdcall DoUpdateSvcDesc(SvcResult &result);
+VOID __stdcall DoDisableSvc(SvcResult &result);
+VOID __stdcall DoEnableSvc(SvcResult &result);
+VOID __stdcall DoDeleteSvc(SvcResult &result);
 
 //
 // Purpose:
 //   Entry point function. Executes specified command from user.
 //
 // Parameters:
-//   Command-line syntax is: svcconfig [command] [service_path]
+//   Command-line syntax is: svcconfig [--json] [command] [service_name]...
 //
 // Return value:
-//   None, defaults to 0 (zero)
+//   0 if the command succeeded for every service, 1 otherwise
 //
 int __cdecl _tmain(int argc, TCHAR *argv[]) {
-    printf("\n");
-    if (argc != 3) {
+    bool json = false;
+    std::wstring command;
+    std::vector<std::wstring> names;
+    if (! SvcCliParse(argc, argv, json, command, names)) {
         printf("ERROR:\tIncorrect number of arguments\n\n");
         DisplayUsage();
         return 1;
     }
 
-    StringCchCopy(szCommand, 10, argv[1]);
-    StringCchCopy(szSvcName, 80, argv[2]);
-
-    if (lstrcmpi(szCommand, TEXT("query")) == 0)
-        DoQuerySvc();
-    else if (lstrcmpi(szCommand, TEXT("describe")) == 0)
-        DoUpdateSvcDesc();
-    else if (lstrcmpi(szCommand, TEXT("disable")) == 0)
-        DoDisableSvc();
-    else if (lstrcmpi(szCommand, TEXT("enable")) == 0)
-        DoEnableSvc();
-    else if (lstrcmpi(szCommand, TEXT("delete")) == 0)
-        DoDeleteSvc();
+    VOID(__stdcall * pfnCommand)(SvcResult &) = NULL;
+    if (lstrcmpi(command.c_str(), TEXT("query")) == 0)
+        pfnCommand = DoQuerySvc;
+    else if (lstrcmpi(command.c_str(), TEXT("describe")) == 0)
+        pfnCommand = DoUpdateSvcDesc;
+    else if (lstrcmpi(command.c_str(), TEXT("disable")) == 0)
+        pfnCommand = DoDisableSvc;
+    else if (lstrcmpi(command.c_str(), TEXT("enable")) == 0)
+        pfnCommand = DoEnableSvc;
+    else if (lstrcmpi(command.c_str(), TEXT("delete")) == 0)
+        pfnCommand = DoDeleteSvc;
     else {
-        _tprintf(TEXT("Unknown command (%s)\n\n"), szCommand);
+        _tprintf(TEXT("Unknown command (%s)\n\n"), command.c_str());
         DisplayUsage();
+        return 1;
     }
+
+    // Get a handle to the SCM database, shared by the threads of all services.
+
+    schSCManager = OpenSCManager(NULL, // local computer
+            NULL, // ServicesActive database
+            SC_MANAGER_ALL_ACCESS); // full access rights
+
+    if (NULL == schSCManager) {
+        printf("OpenSCManager failed (%d)\n", GetLastError());
+        return 1;
+    }
+
+    auto results = SvcCliRun(names, pfnCommand);
+    CloseServiceHandle(schSCManager);
+    return SvcCliPrint(results, json);
 }
 
 VOID __stdcall DisplayUsage() {
     printf("Description:\n");
-    printf("\tCommand-line tool that configures a service.\n\n");
+    printf("\tCommand-line tool that configures services.\n\n");
     printf("Usage:\n");
-    printf("\tsvcconfig [command] [service_name]\n\n");
+    printf("\tsvcconfig [--json] [command] [service_name]...\n\n");
     printf("\t[command]\n");
     printf("\t  query\n");
     printf("\t  describe\n");
     printf("\t  disable\n");
     printf("\t  enable\n");
-    printf("\t  delete\n");
+    printf("\t  delete\n\n");
+    printf("\tThe services are handled at the same time. --json prints the results\n");
+    printf("\tas a JSON array.\n");
 }
 
 //
@@ -71,38 +90,30 @@ VOID __stdcall DisplayUsage() {
 //   Retrieves and displays the current service configuration.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoQuerySvc() {
-    SC_HANDLE schSCManager;
+VOID __stdcall DoQuerySvc(SvcResult &result) {
     SC_HANDLE schService;
-    LPQUERY_SERVICE_CONFIG lpsc;
-    LPSERVICE_DESCRIPTION lpsd;
+    LPQUERY_SERVICE_CONFIG lpsc = NULL;
+    LPSERVICE_DESCRIPTION lpsd = NULL;
     DWORD dwBytesNeeded, cbBufSize, dwError;
-
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
+    auto hex = [](DWORD value) {
+        wchar_t buf[16];
+        StringCchPrintf(buf, 16, TEXT("0x%x"), value);
+        return std::wstring(buf);
+    };
 
     // Get a handle to the service.
 
     schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+            result.name.c_str(), // name of service
             SERVICE_QUERY_CONFIG); // need query config access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -115,13 +126,13 @@ VOID __stdcall DoQuerySvc() {
             lpsc = (LPQUERY_SERVICE_CONFIG)LocalAlloc(LMEM_FIXED, cbBufSize);
         }
         else {
-            printf("QueryServiceConfig failed (%d)", dwError);
+            SvcCliFail(result, "QueryServiceConfig", dwError);
             goto cleanup;
         }
     }
 
     if (! QueryServiceConfig(schService, lpsc, cbBufSize, &dwBytesNeeded)) {
-        printf("QueryServiceConfig failed (%d)", GetLastError());
+        SvcCliFail(result, "QueryServiceConfig");
         goto cleanup;
     }
 
@@ -132,41 +143,42 @@ VOID __stdcall DoQuerySvc() {
             lpsd = (LPSERVICE_DESCRIPTION)LocalAlloc(LMEM_FIXED, cbBufSize);
         }
         else {
-            printf("QueryServiceConfig2 failed (%d)", dwError);
+            SvcCliFail(result, "QueryServiceConfig2", dwError);
             goto cleanup;
         }
     }
 
     if (! QueryServiceConfig2(
                 schService, SERVICE_CONFIG_DESCRIPTION, (LPBYTE)lpsd, cbBufSize, &dwBytesNeeded)) {
-        printf("QueryServiceConfig2 failed (%d)", GetLastError());
+        SvcCliFail(result, "QueryServiceConfig2");
         goto cleanup;
     }
 
-    // Print the configuration information.
+    // Collect the configuration information.
 
-    _tprintf(TEXT("%s configuration: \n"), szSvcName);
-    _tprintf(TEXT("  Type: 0x%x\n"), lpsc->dwServiceType);
-    _tprintf(TEXT("  Start Type: 0x%x\n"), lpsc->dwStartType);
-    _tprintf(TEXT("  Error Control: 0x%x\n"), lpsc->dwErrorControl);
-    _tprintf(TEXT("  Binary path: %s\n"), lpsc->lpBinaryPathName);
-    _tprintf(TEXT("  Account: %s\n"), lpsc->lpServiceStartName);
+    result.ok = true;
+    result.message = "configuration";
+    result.details.push_back({"type", hex(lpsc->dwServiceType)});
+    result.details.push_back({"start_type", hex(lpsc->dwStartType)});
+    result.details.push_back({"error_control", hex(lpsc->dwErrorControl)});
+    result.details.push_back({"binary_path", lpsc->lpBinaryPathName});
+    result.details.push_back({"account", lpsc->lpServiceStartName});
 
     if (lpsd->lpDescription != NULL && lstrcmp(lpsd->lpDescription, TEXT("")) != 0)
-        _tprintf(TEXT("  Description: %s\n"), lpsd->lpDescription);
+        result.details.push_back({"description", lpsd->lpDescription});
     if (lpsc->lpLoadOrderGroup != NULL && lstrcmp(lpsc->lpLoadOrderGroup, TEXT("")) != 0)
-        _tprintf(TEXT("  Load order group: %s\n"), lpsc->lpLoadOrderGroup);
+        result.details.push_back({"load_order_group", lpsc->lpLoadOrderGroup});
     if (lpsc->dwTagId != 0)
-        _tprintf(TEXT("  Tag ID: %d\n"), lpsc->dwTagId);
+        result.details.push_back({"tag_id", std::to_wstring(lpsc->dwTagId)});
     if (lpsc->lpDependencies != NULL && lstrcmp(lpsc->lpDependencies, TEXT("")) != 0)
-        _tprintf(TEXT("  Dependencies: %s\n"), lpsc->lpDependencies);
-
-    LocalFree(lpsc);
-    LocalFree(lpsd);
+        result.details.push_back({"dependencies", lpsc->lpDependencies});
 
 cleanup:
+    if (lpsc)
+        LocalFree(lpsc);
+    if (lpsd)
+        LocalFree(lpsd);
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
 //
@@ -174,35 +186,22 @@ cleanup:
 //   Disables the service.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoDisableSvc() {
-    SC_HANDLE schSCManager;
+VOID __stdcall DoDisableSvc(SvcResult &result) {
     SC_HANDLE schService;
 
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
-
     // Get a handle to the service.
 
     schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+            result.name.c_str(), // name of service
             SERVICE_CHANGE_CONFIG); // need change config access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -220,13 +219,14 @@ VOID __stdcall DoDisableSvc() {
                 NULL, // password: no change
                 NULL)) // display name: no change
     {
-        printf("ChangeServiceConfig failed (%d)\n", GetLastError());
+        SvcCliFail(result, "ChangeServiceConfig");
+    }
+    else {
+        result.ok = true;
+        result.message = "Service disabled successfully.";
     }
-    else
-        printf("Service disabled successfully.\n");
 
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
 //
@@ -234,35 +234,22 @@ VOID __stdcall DoDisableSvc() {
 //   Enables the service.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoEnableSvc() {
-    SC_HANDLE schSCManager;
+VOID __stdcall DoEnableSvc(SvcResult &result) {
     SC_HANDLE schService;
 
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
-
     // Get a handle to the service.
 
     schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+            result.name.c_str(), // name of service
             SERVICE_CHANGE_CONFIG); // need change config access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -280,13 +267,14 @@ VOID __stdcall DoEnableSvc() {
                 NULL, // password: no change
                 NULL)) // display name: no change
     {
-        printf("ChangeServiceConfig failed (%d)\n", GetLastError());
+        SvcCliFail(result, "ChangeServiceConfig");
+    }
+    else {
+        result.ok = true;
+        result.message = "Service enabled successfully.";
     }
-    else
-        printf("Service enabled successfully.\n");
 
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
 //
@@ -294,37 +282,24 @@ VOID __stdcall DoEnableSvc() {
 //   Updates the service description to "This is a test description".
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoUpdateSvcDesc() {
-    SC_HANDLE schSCManager;
+VOID __stdcall DoUpdateSvcDesc(SvcResult &result) {
     SC_HANDLE schService;
     SERVICE_DESCRIPTION sd;
     LPTSTR szDesc = TEXT("This is a test description");
 
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
-
     // Get a handle to the service.
 
     schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+            result.name.c_str(), // name of service
             SERVICE_CHANGE_CONFIG); // need change config access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -336,13 +311,14 @@ VOID __stdcall DoUpdateSvcDesc() {
                 SERVICE_CONFIG_DESCRIPTION, // change: description
                 &sd)) // new description
     {
-        printf("ChangeServiceConfig2 failed\n");
+        SvcCliFail(result, "ChangeServiceConfig2");
+    }
+    else {
+        result.ok = true;
+        result.message = "Service description updated successfully.";
     }
-    else
-        printf("Service description updated successfully.\n");
 
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
 //
@@ -350,46 +326,34 @@ VOID __stdcall DoUpdateSvcDesc() {
 //   Deletes a service from the SCM database
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoDeleteSvc() {
-    SC_HANDLE schSCManager;
+VOID __stdcall DoDeleteSvc(SvcResult &result) {
     SC_HANDLE schService;
 
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
-
     // Get a handle to the service.
 
     schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+            result.name.c_str(), // name of service
             DELETE); // need delete access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
     // Delete the service.
 
     if (! DeleteService(schService)) {
-        printf("DeleteService failed (%d)\n", GetLastError());
+        SvcCliFail(result, "DeleteService");
+    }
+    else {
+        result.ok = true;
+        result.message = "Service deleted successfully";
     }
-    else
-        printf("Service deleted successfully\n");
 
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
@@ -4,64 +4,135 @@
 #include <tchar.h>
 #include <windows.h>
 
+#include "SvcCli.h"
+
 #pragma comment(lib, "advapi32.lib")
 
-TCHAR szCommand[10];
-TCHAR szSvcName[80];
+// How long a start or stop may take, dependent services included
+static const DWORD SVC_TIMEOUT = 30000;
 
 SC_HANDLE schSCManager;
-SC_HANDLE schService;
 
 VOID __stdcall DisplayUsage(void);
 
-VOID __stdcall DoStartSvc(void);
-VOID __stdcall DoUpdateSvcDacl(void);
-VOID __stdcall DoStopSvc(void);
+VOID __stdcall DoStartSvc(SvcResult &result);
+VOID __stdcall DoUpdateSvcDacl(SvcResult &result);
+VOID __stdcall DoStopSvc(SvcResult &result);
 
-BOOL __stdcall StopDependentServices(void);
+BOOL __stdcall StopDependentServices(SC_HANDLE schService, DWORD dwStartTime);
 
 //
 // Purpose:
 //   Entry point function. Executes specified command from user.
 //
 // Parameters:
-//   Command-line syntax is: svccontrol [command] [service_name]
+//   Command-line syntax is: svccontrol [--json] [command] [service_name]...
 //
 // Return value:
-//   None
+//   0 if the command succeeded for every service, 1 otherwise
 //
-void _tmain(int argc, TCHAR *argv[]) {
-    printf("\n");
-    if (argc != 3) {
+int _tmain(int argc, TCHAR *argv[]) {
+    bool json = false;
+    std::wstring command;
+    std::vector<std::wstring> names;
+    if (! SvcCliParse(argc, argv, json, command, names)) {
         printf("ERROR: Incorrect number of arguments\n\n");
         DisplayUsage();
-        return;
+        return 1;
     }
 
-    StringCchCopy(szCommand, 10, argv[1]);
-    StringCchCopy(szSvcName, 80, argv[2]);
-
-    if (lstrcmpi(szCommand, TEXT("start")) == 0)
-        DoStartSvc();
-    else if (lstrcmpi(szCommand, TEXT("dacl")) == 0)
-        DoUpdateSvcDacl();
-    else if (lstrcmpi(szCommand, TEXT("stop")) == 0)
-        DoStopSvc();
+    VOID(__stdcall * pfnCommand)(SvcResult &) = NULL;
+    if (lstrcmpi(command.c_str(), TEXT("start")) == 0)
+        pfnCommand = DoStartSvc;
+    else if (lstrcmpi(command.c_str(), TEXT("dacl")) == 0)
+        pfnCommand = DoUpdateSvcDacl;
+    else if (lstrcmpi(command.c_str(), TEXT("stop")) == 0)
+        pfnCommand = DoStopSvc;
     else {
-        _tprintf(TEXT("Unknown command (%s)\n\n"), szCommand);
+        _tprintf(TEXT("Unknown command (%s)\n\n"), command.c_str());
         DisplayUsage();
+        return 1;
     }
+
+    // Get a handle to the SCM database, shared by the threads of all services.
+
+    schSCManager = OpenSCManager(NULL, // local computer
+            NULL, // servicesActive database
+            SC_MANAGER_ALL_ACCESS); // full access rights
+
+    if (NULL == schSCManager) {
+        printf("OpenSCManager failed (%d)\n", GetLastError());
+        return 1;
+    }
+
+    auto results = SvcCliRun(names, pfnCommand);
+    CloseServiceHandle(schSCManager);
+    return SvcCliPrint(results, json);
 }
 
 VOID __stdcall DisplayUsage() {
     printf("Description:\n");
-    printf("\tCommand-line tool that controls a service.\n\n");
+    printf("\tCommand-line tool that controls services.\n\n");
     printf("Usage:\n");
-    printf("\tsvccontrol [command] [service_name]\n\n");
+    printf("\tsvccontrol [--json] [command] [service_name]...\n\n");
     printf("\t[command]\n");
     printf("\t  start\n");
     printf("\t  dacl\n");
-    printf("\t  stop\n");
+    printf("\t  stop\n\n");
+    printf("\tThe services are handled at the same time. --json prints the results\n");
+    printf("\tas a JSON array.\n");
+}
+
+// A registration of NotifyServiceStatusChange. It has to stay in place until the service
+// handle is closed, the SCM may still queue its callback after a wait timed out.
+struct SvcWait {
+    SERVICE_NOTIFY notify;
+    BOOL fired;
+};
+
+static VOID CALLBACK OnServiceNotify(PVOID pParameter) {
+    auto *notify = static_cast<PSERVICE_NOTIFY>(pParameter);
+    static_cast<SvcWait *>(notify->pContext)->fired = TRUE;
+}
+
+//
+// Purpose:
+//   Waits until the service is in one of the states of dwNotifyMask (SERVICE_NOTIFY_*) or
+//   dwStartTime + SVC_TIMEOUT has passed. The SCM queues an APC to this thread as soon as
+//   the service gets there, or right away if it already is; the alertable SleepEx returns
+//   once it has run, so nothing is polled.
+//
+// Parameters:
+//   wait - Registration of this wait, alive until schService is closed
+//   ssp - The status the service ended in
+//
+// Return value:
+//   ERROR_SUCCESS, ERROR_TIMEOUT or the error of NotifyServiceStatusChange
+//
+DWORD __stdcall WaitForServiceStatus(SC_HANDLE schService, DWORD dwNotifyMask,
+        DWORD dwStartTime, SvcWait &wait, SERVICE_STATUS_PROCESS &ssp) {
+    ZeroMemory(&wait, sizeof(wait));
+    wait.notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+    wait.notify.pfnNotifyCallback = (PFN_SC_NOTIFY_CALLBACK)OnServiceNotify;
+    wait.notify.pContext = &wait;
+
+    DWORD dwError = NotifyServiceStatusChange(schService, dwNotifyMask, &wait.notify);
+    if (dwError != ERROR_SUCCESS) {
+        return dwError;
+    }
+
+    while (! wait.fired) {
+        DWORD dwElapsed = GetTickCount() - dwStartTime;
+        if (dwElapsed >= SVC_TIMEOUT) {
+            return ERROR_TIMEOUT;
+        }
+        SleepEx(SVC_TIMEOUT - dwElapsed, TRUE);
+    }
+    if (wait.notify.dwNotificationStatus != ERROR_SUCCESS) {
+        return wait.notify.dwNotificationStatus;
+    }
+    ssp = wait.notify.ServiceStatus;
+    return ERROR_SUCCESS;
 }
 
 //
@@ -69,38 +140,26 @@ VOID __stdcall DisplayUsage() {
 //   Starts the service if possible.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoStartSvc() {
+VOID __stdcall DoStartSvc(SvcResult &result) {
     SERVICE_STATUS_PROCESS ssStatus;
-    DWORD dwOldCheckPoint;
-    DWORD dwStartTickCount;
-    DWORD dwWaitTime;
+    DWORD dwStartTime = GetTickCount();
     DWORD dwBytesNeeded;
-
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // servicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
+    DWORD dwError;
+    SvcWait wait;
 
     // Get a handle to the service.
 
-    schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+    SC_HANDLE schService = OpenService(schSCManager, // SCM database
+            result.name.c_str(), // name of service
             SERVICE_ALL_ACCESS); // full access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -112,162 +171,74 @@ VOID __stdcall DoStartSvc() {
                 sizeof(SERVICE_STATUS_PROCESS), // size of structure
                 &dwBytesNeeded)) // size needed if buffer is too small
     {
-        printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
+        SvcCliFail(result, "QueryServiceStatusEx");
         CloseServiceHandle(schService);
-        CloseServiceHandle(schSCManager);
         return;
     }
+    result.state = ssStatus.dwCurrentState;
 
     // Check if the service is already running. It would be possible
     // to stop the service here, but for simplicity this example just returns.
 
     if (ssStatus.dwCurrentState != SERVICE_STOPPED
-            && ssStatus.dwCurrentState != SERVICE_STOP_PENDING) {
-        printf("Cannot start the service because it is already running\n");
+            && ssStatus.dwCurrentState != SERVICE_STOP_PENDING
+            && ssStatus.dwCurrentState != SERVICE_START_PENDING) {
+        result.ok = ssStatus.dwCurrentState == SERVICE_RUNNING;
+        result.message = "Service is already running.";
         CloseServiceHandle(schService);
-        CloseServiceHandle(schSCManager);
         return;
     }
 
-    // Save the tick count and initial checkpoint.
-
-    dwStartTickCount = GetTickCount();
-    dwOldCheckPoint = ssStatus.dwCheckPoint;
-
     // Wait for the service to stop before attempting to start it.
 
-    while (ssStatus.dwCurrentState == SERVICE_STOP_PENDING) {
-        // Do not wait longer than the wait hint. A good interval is
-        // one-tenth of the wait hint but not less than 1 second
-        // and not more than 10 seconds.
-
-        dwWaitTime = ssStatus.dwWaitHint / 10;
-
-        if (dwWaitTime < 1000)
-            dwWaitTime = 1000;
-        else if (dwWaitTime > 10000)
-            dwWaitTime = 10000;
-
-        Sleep(dwWaitTime);
-
-        // Check the status until the service is no longer stop pending.
-
-        if (! QueryServiceStatusEx(schService, // handle to service
-                    SC_STATUS_PROCESS_INFO, // information level
-                    (LPBYTE)&ssStatus, // address of structure
-                    sizeof(SERVICE_STATUS_PROCESS), // size of structure
-                    &dwBytesNeeded)) // size needed if buffer is too small
-        {
-            printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
+    if (ssStatus.dwCurrentState == SERVICE_STOP_PENDING) {
+        dwError = WaitForServiceStatus(
+                schService, SERVICE_NOTIFY_STOPPED, dwStartTime, wait, ssStatus);
+        if (dwError != ERROR_SUCCESS) {
+            SvcCliFail(result, "Waiting for the service to stop", dwError);
             CloseServiceHandle(schService);
-            CloseServiceHandle(schSCManager);
             return;
         }
-
-        if (ssStatus.dwCheckPoint > dwOldCheckPoint) {
-            // Continue to wait and check.
-
-            dwStartTickCount = GetTickCount();
-            dwOldCheckPoint = ssStatus.dwCheckPoint;
-        }
-        else {
-            if (GetTickCount() - dwStartTickCount > ssStatus.dwWaitHint) {
-                printf("Timeout waiting for service to stop\n");
-                CloseServiceHandle(schService);
-                CloseServiceHandle(schSCManager);
-                return;
-            }
-        }
     }
 
-    // Attempt to start the service.
+    // Attempt to start the service, unless someone else already did.
 
-    if (! StartService(schService, // handle to service
+    if (ssStatus.dwCurrentState != SERVICE_START_PENDING
+            && ! StartService(schService, // handle to service
                 0, // number of arguments
                 NULL)) // no arguments
     {
-        printf("StartService failed (%d)\n", GetLastError());
+        SvcCliFail(result, "StartService");
         CloseServiceHandle(schService);
-        CloseServiceHandle(schSCManager);
         return;
     }
-    else
-        printf("Service start pending...\n");
 
-    // Check the status until the service is no longer start pending.
+    // Wait until the service is no longer start pending. A service that fails to start
+    // goes back to stopped.
 
-    if (! QueryServiceStatusEx(schService, // handle to service
-                SC_STATUS_PROCESS_INFO, // info level
-                (LPBYTE)&ssStatus, // address of structure
-                sizeof(SERVICE_STATUS_PROCESS), // size of structure
-                &dwBytesNeeded)) // if buffer too small
-    {
-        printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
+    dwError = WaitForServiceStatus(schService,
+            SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_PAUSED, dwStartTime,
+            wait, ssStatus);
+    if (dwError != ERROR_SUCCESS) {
+        SvcCliFail(result, "Waiting for the service to start", dwError);
         CloseServiceHandle(schService);
-        CloseServiceHandle(schSCManager);
         return;
     }
-
-    // Save the tick count and initial checkpoint.
-
-    dwStartTickCount = GetTickCount();
-    dwOldCheckPoint = ssStatus.dwCheckPoint;
-
-    while (ssStatus.dwCurrentState == SERVICE_START_PENDING) {
-        // Do not wait longer than the wait hint. A good interval is
-        // one-tenth the wait hint, but no less than 1 second and no
-        // more than 10 seconds.
-
-        dwWaitTime = ssStatus.dwWaitHint / 10;
-
-        if (dwWaitTime < 1000)
-            dwWaitTime = 1000;
-        else if (dwWaitTime > 10000)
-            dwWaitTime = 10000;
-
-        Sleep(dwWaitTime);
-
-        // Check the status again.
-
-        if (! QueryServiceStatusEx(schService, // handle to service
-                    SC_STATUS_PROCESS_INFO, // info level
-                    (LPBYTE)&ssStatus, // address of structure
-                    sizeof(SERVICE_STATUS_PROCESS), // size of structure
-                    &dwBytesNeeded)) // if buffer too small
-        {
-            printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
-            break;
-        }
-
-        if (ssStatus.dwCheckPoint > dwOldCheckPoint) {
-            // Continue to wait and check.
-
-            dwStartTickCount = GetTickCount();
-            dwOldCheckPoint = ssStatus.dwCheckPoint;
-        }
-        else {
-            if (GetTickCount() - dwStartTickCount > ssStatus.dwWaitHint) {
-                // No progress made within the wait hint.
-                break;
-            }
-        }
-    }
+    result.state = ssStatus.dwCurrentState;
 
     // Determine whether the service is running.
 
     if (ssStatus.dwCurrentState == SERVICE_RUNNING) {
-        printf("Service started successfully.\n");
+        result.ok = true;
+        result.message = "Service started successfully.";
     }
     else {
-        printf("Service not started. \n");
-        printf("  Current State: %d\n", ssStatus.dwCurrentState);
-        printf("  Exit Code: %d\n", ssStatus.dwWin32ExitCode);
-        printf("  Check Point: %d\n", ssStatus.dwCheckPoint);
-        printf("  Wait Hint: %d\n", ssStatus.dwWaitHint);
+        result.error = ssStatus.dwWin32ExitCode;
+        result.message = "Service not started, exit code "
+                + std::to_string(ssStatus.dwWin32ExitCode);
     }
 
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
 //
@@ -276,12 +247,12 @@ VOID __stdcall DoStartSvc() {
 //   control access to the Guest account.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoUpdateSvcDacl() {
+VOID __stdcall DoUpdateSvcDacl(SvcResult &result) {
     EXPLICIT_ACCESS ea;
     SECURITY_DESCRIPTOR sd;
     PSECURITY_DESCRIPTOR psd = NULL;
@@ -293,26 +264,14 @@ VOID __stdcall DoUpdateSvcDacl() {
     DWORD dwSize = 0;
     DWORD dwBytesNeeded = 0;
 
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
-
     // Get a handle to the service
 
-    schService = OpenService(schSCManager, // SCManager database
-            szSvcName, // name of service
+    SC_HANDLE schService = OpenService(schSCManager, // SCManager database
+            result.name.c_str(), // name of service
             READ_CONTROL | WRITE_DAC); // access
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -326,18 +285,18 @@ VOID __stdcall DoUpdateSvcDacl() {
             psd = (PSECURITY_DESCRIPTOR)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, dwSize);
             if (psd == NULL) {
                 // Note: HeapAlloc does not support GetLastError.
-                printf("HeapAlloc failed\n");
+                SvcCliFail(result, "HeapAlloc", ERROR_NOT_ENOUGH_MEMORY);
                 goto dacl_cleanup;
             }
 
             if (! QueryServiceObjectSecurity(
                         schService, DACL_SECURITY_INFORMATION, psd, dwSize, &dwBytesNeeded)) {
-                printf("QueryServiceObjectSecurity failed (%d)\n", GetLastError());
+                SvcCliFail(result, "QueryServiceObjectSecurity");
                 goto dacl_cleanup;
             }
         }
         else {
-            printf("QueryServiceObjectSecurity failed (%d)\n", GetLastError());
+            SvcCliFail(result, "QueryServiceObjectSecurity");
             goto dacl_cleanup;
         }
     }
@@ -345,7 +304,7 @@ VOID __stdcall DoUpdateSvcDacl() {
     // Get the DACL.
 
     if (! GetSecurityDescriptorDacl(psd, &bDaclPresent, &pacl, &bDaclDefaulted)) {
-        printf("GetSecurityDescriptorDacl failed(%d)\n", GetLastError());
+        SvcCliFail(result, "GetSecurityDescriptorDacl");
         goto dacl_cleanup;
     }
 
@@ -356,35 +315,36 @@ VOID __stdcall DoUpdateSvcDacl() {
 
     dwError = SetEntriesInAcl(1, &ea, pacl, &pNewAcl);
     if (dwError != ERROR_SUCCESS) {
-        printf("SetEntriesInAcl failed(%d)\n", dwError);
+        SvcCliFail(result, "SetEntriesInAcl", dwError);
         goto dacl_cleanup;
     }
 
     // Initialize a new security descriptor.
 
     if (! InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION)) {
-        printf("InitializeSecurityDescriptor failed(%d)\n", GetLastError());
+        SvcCliFail(result, "InitializeSecurityDescriptor");
         goto dacl_cleanup;
     }
 
     // Set the new DACL in the security descriptor.
 
     if (! SetSecurityDescriptorDacl(&sd, TRUE, pNewAcl, FALSE)) {
-        printf("SetSecurityDescriptorDacl failed(%d)\n", GetLastError());
+        SvcCliFail(result, "SetSecurityDescriptorDacl");
         goto dacl_cleanup;
     }
 
     // Set the new DACL for the service object.
 
     if (! SetServiceObjectSecurity(schService, DACL_SECURITY_INFORMATION, &sd)) {
-        printf("SetServiceObjectSecurity failed(%d)\n", GetLastError());
+        SvcCliFail(result, "SetServiceObjectSecurity");
         goto dacl_cleanup;
     }
-    else
-        printf("Service DACL updated successfully\n");
+    else {
+        result.ok = true;
+        result.message = "Service DACL updated successfully";
+    }
 
 dacl_cleanup:
-    CloseServiceHandle(schSCManager);
     CloseServiceHandle(schService);
 
     if (NULL != pNewAcl)
@@ -398,38 +358,26 @@ dacl_cleanup:
 //   Stops the service.
 //
 // Parameters:
-//   None
+//   result - Names the service, receives the outcome
 //
 // Return value:
 //   None
 //
-VOID __stdcall DoStopSvc() {
+VOID __stdcall DoStopSvc(SvcResult &result) {
     SERVICE_STATUS_PROCESS ssp;
     DWORD dwStartTime = GetTickCount();
     DWORD dwBytesNeeded;
-    DWORD dwTimeout = 30000; // 30-second time-out
-    DWORD dwWaitTime;
-
-    // Get a handle to the SCM database.
-
-    schSCManager = OpenSCManager(NULL, // local computer
-            NULL, // ServicesActive database
-            SC_MANAGER_ALL_ACCESS); // full access rights
-
-    if (NULL == schSCManager) {
-        printf("OpenSCManager failed (%d)\n", GetLastError());
-        return;
-    }
+    DWORD dwError;
+    SvcWait wait;
 
     // Get a handle to the service.
 
-    schService = OpenService(schSCManager, // SCM database
-            szSvcName, // name of service
+    SC_HANDLE schService = OpenService(schSCManager, // SCM database
+            result.name.c_str(), // name of service
             SERVICE_STOP | SERVICE_QUERY_STATUS | SERVICE_ENUMERATE_DEPENDENTS);
 
     if (schService == NULL) {
-        printf("OpenService failed (%d)\n", GetLastError());
-        CloseServiceHandle(schSCManager);
+        SvcCliFail(result, "OpenService");
         return;
     }
 
@@ -437,98 +385,69 @@ VOID __stdcall DoStopSvc() {
 
     if (! QueryServiceStatusEx(schService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp,
                 sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded)) {
-        printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
+        SvcCliFail(result, "QueryServiceStatusEx");
         goto stop_cleanup;
     }
+    result.state = ssp.dwCurrentState;
 
     if (ssp.dwCurrentState == SERVICE_STOPPED) {
-        printf("Service is already stopped.\n");
+        result.ok = true;
+        result.message = "Service is already stopped.";
         goto stop_cleanup;
     }
 
-    // If a stop is pending, wait for it.
-
-    while (ssp.dwCurrentState == SERVICE_STOP_PENDING) {
-        printf("Service stop pending...\n");
-
-        // Do not wait longer than the wait hint. A good interval is
-        // one-tenth of the wait hint but not less than 1 second
-        // and not more than 10 seconds.
-
-        dwWaitTime = ssp.dwWaitHint / 10;
-
-        if (dwWaitTime < 1000)
-            dwWaitTime = 1000;
-        else if (dwWaitTime > 10000)
-            dwWaitTime = 10000;
+    // If a stop is pending, wait for it; otherwise dependencies must be stopped first, then
+    // the service itself.
 
-        Sleep(dwWaitTime);
-
-        if (! QueryServiceStatusEx(schService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp,
-                    sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded)) {
-            printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
+    if (ssp.dwCurrentState != SERVICE_STOP_PENDING) {
+        if (! StopDependentServices(schService, dwStartTime)) {
+            SvcCliFail(result, "Stopping the dependent services");
             goto stop_cleanup;
         }
 
-        if (ssp.dwCurrentState == SERVICE_STOPPED) {
-            printf("Service stopped successfully.\n");
-            goto stop_cleanup;
-        }
+        // Send a stop code to the service.
 
-        if (GetTickCount() - dwStartTime > dwTimeout) {
-            printf("Service stop timed out.\n");
+        if (! ControlService(schService, SERVICE_CONTROL_STOP, (LPSERVICE_STATUS)&ssp)) {
+            SvcCliFail(result, "ControlService");
             goto stop_cleanup;
         }
     }
 
-    // If the service is running, dependencies must be stopped first.
-
-    StopDependentServices();
-
-    // Send a stop code to the service.
-
-    if (! ControlService(schService, SERVICE_CONTROL_STOP, (LPSERVICE_STATUS)&ssp)) {
-        printf("ControlService failed (%d)\n", GetLastError());
-        goto stop_cleanup;
-    }
-
     // Wait for the service to stop.
 
-    while (ssp.dwCurrentState != SERVICE_STOPPED) {
-        Sleep(ssp.dwWaitHint);
-        if (! QueryServiceStatusEx(schService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp,
-                    sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded)) {
-            printf("QueryServiceStatusEx failed (%d)\n", GetLastError());
-            goto stop_cleanup;
-        }
-
-        if (ssp.dwCurrentState == SERVICE_STOPPED)
-            break;
-
-        if (GetTickCount() - dwStartTime > dwTimeout) {
-            printf("Wait timed out\n");
-            goto stop_cleanup;
-        }
+    dwError = WaitForServiceStatus(schService, SERVICE_NOTIFY_STOPPED, dwStartTime, wait, ssp);
+    if (dwError != ERROR_SUCCESS) {
+        SvcCliFail(result, "Waiting for the service to stop", dwError);
+        goto stop_cleanup;
     }
-    printf("Service stopped successfully\n");
+    result.state = ssp.dwCurrentState;
+    result.ok = true;
+    result.message = "Service stopped successfully";
 
 stop_cleanup:
     CloseServiceHandle(schService);
-    CloseServiceHandle(schSCManager);
 }
 
-BOOL __stdcall StopDependentServices() {
+//
+// Purpose:
+//   Stops the active services that depend on schService, each after the ones that depend
+//   on it.
+//
+// Return value:
+//   FALSE with the last error set if one of them could not be stopped by dwStartTime +
+//   SVC_TIMEOUT
+//
+BOOL __stdcall StopDependentServices(SC_HANDLE schService, DWORD dwStartTime) {
     DWORD i;
     DWORD dwBytesNeeded;
     DWORD dwCount;
+    DWORD dwError;
 
     LPENUM_SERVICE_STATUS lpDependencies = NULL;
     ENUM_SERVICE_STATUS ess;
     SC_HANDLE hDepService;
     SERVICE_STATUS_PROCESS ssp;
-
-    DWORD dwStartTime = GetTickCount();
-    DWORD dwTimeout = 30000; // 30-second time-out
+    SvcWait wait;
 
     // Pass a zero-length buffer to get the required buffer size.
     if (EnumDependentServices(
@@ -569,17 +488,11 @@ BOOL __stdcall StopDependentServices() {
                         return FALSE;
 
                     // Wait for the service to stop.
-                    while (ssp.dwCurrentState != SERVICE_STOPPED) {
-                        Sleep(ssp.dwWaitHint);
-                        if (! QueryServiceStatusEx(hDepService, SC_STATUS_PROCESS_INFO,
-                                    (LPBYTE)&ssp, sizeof(SERVICE_STATUS_PROCESS), &dwBytesNeeded))
-                            return FALSE;
-
-                        if (ssp.dwCurrentState == SERVICE_STOPPED)
-                            break;
-
-                        if (GetTickCount() - dwStartTime > dwTimeout)
-                            return FALSE;
+                    dwError = WaitForServiceStatus(
+                            hDepService, SERVICE_NOTIFY_STOPPED, dwStartTime, wait, ssp);
+                    if (dwError != ERROR_SUCCESS) {
+                        SetLastError(dwError);
+                        return FALSE;
                     }
                 }
                 __finally {
@@ -0,0 +1,1221 @@
+#include "SvcCore.h"
+#include "SvcCancel.h"
+#include "SvcChunk.h"
+#include "SvcDelta.h"
+#include "SvcMetrics.h"
+#include "SvcTrace.h"
+#include "SvcValidate.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+static bool isSuccess(unsigned long status) {
+    return status >= 200 && status < 300;
+}
+
+static std::string statusLabel(unsigned long status) {
+    return "status=\"" + std::to_string(status) + "\"";
+}
+
+// MIRRORS setting: URLs separated by semicolons or white space
+static std::vector<std::string> splitMirrors(std::string_view list) {
+    std::vector<std::string> mirrors;
+    size_t begin = 0;
+    while (begin < list.size()) {
+        auto end = list.find_first_of("; \t\r\n", begin);
+        if (end == std::string_view::npos) {
+            end = list.size();
+        }
+        if (end > begin) {
+            mirrors.emplace_back(list.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    return mirrors;
+}
+
+// The same request sent to a mirror ("http://host:port" or "http://host:port/prefix"), which
+// serves the origin's paths below its own
+static bool throughMirror(const std::string &mirror, const HttpRequest &origin, HttpRequest &out) {
+    auto base = mirror.back() == '/' ? mirror : mirror + "/";
+    auto parts = SplitUrl(base);
+    if (parts.host.empty()) {
+        return false;
+    }
+    out = origin;
+    out.domain = std::string(parts.host);
+    out.path = std::string(parts.path.substr(0, parts.path.size() - 1)) + origin.path;
+    return true;
+}
+
+const BannedSet &BannedIndex::get(const std::string &product_guid) {
+    auto &entry = entries[product_guid];
+    if (entry.loaded != entry.generation) {
+        TRACE_SPAN("LoadBannedFiles");
+        entry.files = store.readBanned(product_guid);
+        entry.loaded = entry.generation;
+        MetricGauge("updsvc_banned_files", "Files banned after a failed install",
+                "product=\"" + product_guid + "\"")
+                .set(static_cast<long long>(entry.files.size()));
+        SvcReportInfo("Banned file list loaded for product GUID: " + product_guid);
+    }
+    return entry.files;
+}
+
+void BannedIndex::ban(const std::string &product_guid, const std::string &filename) {
+    store.addBanned(product_guid, filename);
+    // Re-read on next use so the set reflects what actually landed in the store
+    ++entries[product_guid].generation;
+}
+
+void BannedIndex::invalidate() {
+    // Start of a new cycle, pick up bans added from outside the service
+    for (auto &entry : entries) {
+        ++entry.second.generation;
+    }
+}
+
+void InventoryIndex::refresh(const std::vector<std::string> &product_guids) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (std::find(product_guids.begin(), product_guids.end(), it->first)
+                == product_guids.end()) {
+            it = entries.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    TRACE_SPAN("ReadInventory");
+    bool changed = inventory.changed();
+    for (auto &product_guid : product_guids) {
+        auto &entry = entries[product_guid];
+        if (entry.loaded && changed) {
+            auto stamp = inventory.installStamp(product_guid);
+            entry.loaded = ! stamp.empty() && stamp == entry.stamp;
+        }
+        load(product_guid);
+    }
+}
+
+const std::string &InventoryIndex::installedVersion(const std::string &product_guid) {
+    return load(product_guid).version;
+}
+
+const std::string &InventoryIndex::executablePath(const std::string &product_guid) {
+    auto &entry = load(product_guid);
+    if (! entry.pathLoaded) {
+        entry.exePath = inventory.executablePath(product_guid);
+        // A source that could not be reached is tried again next time
+        entry.pathLoaded = ! entry.exePath.empty();
+    }
+    return entry.exePath;
+}
+
+void InventoryIndex::invalidate(const std::string &product_guid) {
+    auto it = entries.find(product_guid);
+    if (it != entries.end()) {
+        it->second.loaded = false;
+    }
+}
+
+InventoryIndex::Entry &InventoryIndex::load(const std::string &product_guid) {
+    static auto &reads =
+            MetricCounter("updsvc_inventory_reads_total", "Products read from the inventory");
+
+    auto &entry = entries[product_guid];
+    if (! entry.loaded) {
+        // The stamp first, a change while the product is read shows up at the next refresh
+        entry.stamp = inventory.installStamp(product_guid);
+        entry.version = inventory.installedVersion(product_guid);
+        entry.pathLoaded = false;
+        entry.loaded = true;
+        reads.add();
+    }
+    return entry;
+}
+
+PackageCache::PackageCache(std::filesystem::path directory)
+    : dir(std::move(directory)) {}
+
+std::filesystem::path PackageCache::pathFor(const std::string &filename) const {
+    if (dir.empty() || ! IsSafeFileName(filename)) {
+        return {};
+    }
+    return dir / std::filesystem::u8path(filename);
+}
+
+std::filesystem::path PackageCache::seedFor(const std::string &product_guid) const {
+    if (dir.empty() || ! IsValidGuid(product_guid)) {
+        return {};
+    }
+    auto name = product_guid;
+    if (name.front() == '{') {
+        name = name.substr(1, name.size() - 2);
+    }
+    return dir / (name + ".seed");
+}
+
+void PackageCache::adoptSeed(
+        const std::string &product_guid, const std::filesystem::path &package) {
+    auto seed = seedFor(product_guid);
+    if (seed.empty()) {
+        return;
+    }
+    auto seedIndex = seed;
+    seedIndex += ".idx";
+    auto packageIndex = package;
+    packageIndex += ".idx";
+
+    std::error_code ec;
+    std::filesystem::rename(package, seed, ec);
+    if (ec) {
+        SvcReportEvent("Keeping installed package for delta updates");
+        return;
+    }
+    // A stale index would be detected by its size at the latest, but do not rely on that
+    std::filesystem::remove(seedIndex, ec);
+    if (std::filesystem::exists(packageIndex, ec)) {
+        std::filesystem::rename(packageIndex, seedIndex, ec);
+    }
+}
+
+std::filesystem::path PackageCache::defaultDirectory() {
+    // %TEMP% on Windows, TMPDIR or /tmp elsewhere
+    std::error_code ec;
+    auto temp = std::filesystem::temp_directory_path(ec);
+    if (ec) {
+        return {};
+    }
+    return temp / "updsvc";
+}
+
+UpdateEngine::UpdateEngine(
+        const Backends &backends, PackageCache cache, std::filesystem::path stateDirectory)
+    : backends(backends)
+    , cache(std::move(cache))
+    , banned(backends.config)
+    , inventory(backends.inventory)
+    , governor(backends.clock)
+    , transport(backends.transport, governor)
+    , state(std::move(stateDirectory)) {}
+
+void UpdateEngine::warmUp() {
+    TRACE_SPAN("WarmUp");
+    ResourceScope stage(ResourceClass::Background, 1.0, backends.cancel);
+    state.open();
+}
+
+bool UpdateEngine::loadProducts(std::vector<Config> &configs) {
+    std::vector<std::string> product_guids;
+    if (! backends.config.products(product_guids)) {
+        return false;
+    }
+
+    for (auto &product_guid : product_guids) {
+        if (! IsValidGuid(product_guid)) {
+            continue;
+        }
+        auto cfg = backends.config.readProduct(product_guid);
+        if (cfg.mirrors.empty()) {
+            // Branch offices set one list for every product
+            cfg.mirrors = splitMirrors(backends.config.readSetting("MIRRORS"));
+        }
+        if (cfg.period == 0) {
+            SvcReportInfo("Auto update disabled by user for product GUID: " + product_guid);
+        }
+        else if (cfg.url.empty() || cfg.params_full.empty() || cfg.params_patch.empty()) {
+            SvcReportEvent(
+                    "Service can't start, required parameters are missing for product GUID: "
+                    + product_guid);
+            continue;
+        }
+        configs.push_back(std::move(cfg));
+    }
+    return true;
+}
+
+bool UpdateEngine::updateAll() {
+    TRACE_SPAN("UpdateAll");
+    std::vector<Config> configs;
+    if (! loadProducts(configs)) {
+        return false;
+    }
+
+    std::vector<std::string> product_guids;
+    for (auto &cfg : configs) {
+        product_guids.push_back(cfg.product_guid);
+    }
+    banned.invalidate();
+    inventory.refresh(product_guids);
+    for (auto &cfg : configs) {
+        if (stopping()) {
+            break;
+        }
+        if (cfg.period != 0) {
+            TRACE_SPAN("Product");
+            updateProduct(cfg);
+        }
+    }
+    return true;
+}
+
+bool UpdateEngine::runDue(Scheduler &scheduler) {
+    std::vector<Config> configs;
+    if (! loadProducts(configs)) {
+        return false;
+    }
+
+    std::vector<std::string> product_guids;
+    for (auto &cfg : configs) {
+        scheduler.schedule(cfg.product_guid, std::chrono::seconds(cfg.period));
+        product_guids.push_back(cfg.product_guid);
+    }
+    scheduler.retain(product_guids);
+    state.retain(product_guids);
+    for (auto &cfg : configs) {
+        resume(scheduler, cfg);
+    }
+    for (auto it = closeWaits.begin(); it != closeWaits.end();) {
+        if (std::find(product_guids.begin(), product_guids.end(), it->first)
+                == product_guids.end()) {
+            it = closeWaits.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    collectInstalls(scheduler);
+    activatePending();
+    startClosed(scheduler);
+    auto due = scheduler.due();
+    if (due.empty()) {
+        return true;
+    }
+
+    TRACE_SPAN("UpdateAll");
+    banned.invalidate();
+    inventory.refresh(product_guids);
+    for (auto &product_guid : due) {
+        if (stopping()) {
+            // Still due after the restart
+            break;
+        }
+        // A product whose installer is still running is left alone for another period
+        if (installs.count(product_guid) != 0) {
+            scheduler.completed(product_guid);
+            continue;
+        }
+        // Still waiting for its program after a period; the manifest may have moved on, so
+        // the check starts over
+        closeWaits.erase(product_guid);
+        auto cfg = std::find_if(configs.begin(), configs.end(),
+                [&](const Config &c) { return c.product_guid == product_guid; });
+        {
+            TRACE_SPAN("Product");
+            checkProduct(*cfg, false);
+        }
+        reschedule(scheduler, product_guid);
+    }
+    // Installers that are already done, so a failed one is retried without waiting for
+    // the next call
+    collectInstalls(scheduler);
+    return true;
+}
+
+bool UpdateEngine::updateProduct(const Config &cfg) {
+    // A failed installer bans its package. Try the next candidate from the same manifest
+    // until one installs or the retries run out; every round bans one more file.
+    for (;;) {
+        if (checkProduct(cfg, true)) {
+            auto &job = *installs.at(cfg.product_guid).job;
+            {
+                TRACE_SPAN("WaitForInstaller");
+                while (! job.wait(installPollInterval)) {
+                }
+            }
+            if (finishInstall(cfg.product_guid)) {
+                return true;
+            }
+        }
+        auto &retry = state.get(cfg.product_guid).retry;
+        if (retry.attempts == 0
+                || (retry.reason != FailureReason::InstallerExit
+                        && retry.reason != FailureReason::InstallerKilled
+                        && retry.reason != FailureReason::InstallerBusy)) {
+            // Nothing failed, or it was not the package; the scheduler retries those
+            return false;
+        }
+        if (! backends.clock.sleepFor(retryBackoff(retry.attempts))) {
+            return false;
+        }
+    }
+}
+
+// Seconds since the Unix epoch. Stored times are wall-clock, the steady clock starts over
+// with the service.
+static long long unixNow() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+}
+
+void UpdateEngine::resume(Scheduler &scheduler, const Config &cfg) {
+    if (cfg.period == 0 || ! resumed.insert(cfg.product_guid).second) {
+        return;
+    }
+    auto &product = state.get(cfg.product_guid);
+    long long dueAt = product.retry.attempts != 0 ? product.retry.notBefore
+            : product.lastCheck != 0            ? product.lastCheck + cfg.period
+                                                : 0;
+    auto wait = dueAt - unixNow();
+    if (wait > 0) {
+        // A clock set back does not hold the product off for more than a period
+        scheduler.dueIn(cfg.product_guid,
+                std::chrono::seconds(std::min(wait, static_cast<long long>(cfg.period))));
+    }
+}
+
+bool UpdateEngine::checkProduct(const Config &cfg, bool waitForClose) {
+    TRACE_SPAN("UpdateifRequires");
+    governor.setLimits(cfg.bandwidth);
+
+    auto &product = state.get(cfg.product_guid);
+    auto previousCheck = product.lastCheck;
+    product.lastCheck = unixNow();
+    bool started = false;
+    // A retry takes the manifest of the check that failed, unless fetching it was what failed
+    auto reason = product.retry.reason;
+    bool reuse = product.retry.attempts != 0 && product.manifest.valid
+            && (reason == FailureReason::Download || reason == FailureReason::InstallerStart
+                    || reason == FailureReason::InstallerExit
+                    || reason == FailureReason::InstallerKilled
+                    || reason == FailureReason::InstallerBusy);
+    if (reuse || fetchManifest(cfg, product)) {
+        started = startUpdate(cfg, product.manifest, waitForClose);
+    }
+    else {
+        failed(cfg.product_guid, FailureReason::Manifest);
+    }
+    if (stopping()) {
+        // Cut short, the restarted service checks it again
+        product.lastCheck = previousCheck;
+    }
+    state.save(cfg.product_guid);
+    return started;
+}
+
+bool UpdateEngine::startUpdate(const Config &cfg, const Manifest &manifest, bool waitForClose) {
+    if (installs.count(cfg.product_guid) != 0) {
+        SvcReportInfo("Installer of the last update is still running");
+        return false;
+    }
+    auto version = inventory.installedVersion(cfg.product_guid);
+    if (! cfg.stage_dir.empty() && activations.count(cfg.product_guid) == 0
+            && IsSafeFileName(version)) {
+        // Installed, but the service stopped before it could be activated
+        auto installed = std::filesystem::u8path(cfg.stage_dir) / std::filesystem::u8path(version);
+        std::error_code ec;
+        auto active = std::filesystem::read_symlink(installed.parent_path() / "current", ec);
+        if (std::filesystem::is_directory(installed, ec) && active.filename() != version) {
+            activations[cfg.product_guid] = installed;
+            activatePending();
+        }
+    }
+    if (activations.count(cfg.product_guid) != 0) {
+        SvcReportInfo("Staged version waits for the program to close");
+        return false;
+    }
+    UpdateInfo update_info;
+    {
+        TRACE_SPAN("UpdateDetector");
+        update_info = DetectUpdate(manifest, version, cfg.rel_chan, banned.get(cfg.product_guid));
+    }
+    if (update_info.url.empty()) {
+        SvcReportInfo("Update not required");
+        succeeded(cfg.product_guid);
+        return false;
+    }
+
+    auto &product = state.get(cfg.product_guid);
+    auto package = std::filesystem::u8path(product.package);
+    std::error_code ec;
+    if (product.packageUrl != update_info.url || ! std::filesystem::is_regular_file(package, ec)) {
+        package = download(cfg, update_info);
+        if (package.empty()) {
+            if (! stopping()) {
+                SvcReportEvent("Getting update file");
+            }
+            failed(cfg.product_guid, FailureReason::Download);
+            return false;
+        }
+        // Until it is installed; a check that has to wait for the program, or an installer
+        // that did not start, does not download it again
+        product.packageUrl = update_info.url;
+        product.package = package.u8string();
+    }
+
+    // A staged version is installed next to the running one, nothing waits for it to close.
+    // Patches change the installed files, so they are still applied in place.
+    auto arguments = update_info.is_patch ? cfg.params_patch : cfg.params_full;
+    std::filesystem::path stageDir;
+    if (! cfg.stage_dir.empty() && ! update_info.is_patch) {
+        stageDir = stagePath(cfg, update_info.version, arguments);
+    }
+
+    ReadyInstall ready;
+    ready.cfg = cfg;
+    ready.package = package;
+    ready.arguments = arguments;
+    ready.ispatch = update_info.is_patch;
+    ready.stageDir = stageDir;
+    // Downloaded while the program may still be open
+    if (update_info.is_patch && maxPatchChain > 1) {
+        ready.chain = downloadChain(cfg, manifest, update_info, package);
+    }
+    if (stageDir.empty()) {
+        ready.exePath = inventory.executablePath(cfg.product_guid);
+        ready.waitBegin = TraceNow();
+        auto running = waitUntilClosed(ready.exePath, waitForClose);
+        if (running == ProcessState::Running) {
+            closeWaits[cfg.product_guid] = std::move(ready);
+            return false;
+        }
+        if (running != ProcessState::NotRunning) {
+            return false;
+        }
+    }
+    return startInstall(std::move(ready));
+}
+
+bool UpdateEngine::startInstall(ReadyInstall ready) {
+    TRACE_SPAN("installExe");
+    auto &product_guid = ready.cfg.product_guid;
+    std::unique_ptr<InstallJob> job;
+    if (ready.chain.size() > 1) {
+        job = backends.installer.startChain(ready.chain, ready.arguments, installLimits);
+        if (job) {
+            SvcReportInfo("Applying " + std::to_string(ready.chain.size()) + " patches at once");
+            // A failed chain bans its last patch, the next try stops one release earlier
+            ready.package = ready.chain.back();
+        }
+    }
+    if (! job) {
+        job = backends.installer.start(ready.package, ready.arguments, installLimits);
+    }
+    if (! job) {
+        SvcReportEvent("Installing exe");
+        failed(product_guid, FailureReason::InstallerStart);
+        return false;
+    }
+    installs[product_guid] = {ready.cfg, ready.package, ready.ispatch, ready.stageDir,
+            std::move(job), std::chrono::steady_clock::now()};
+    return true;
+}
+
+void UpdateEngine::startClosed(Scheduler &scheduler) {
+    for (auto it = closeWaits.begin(); it != closeWaits.end() && ! stopping();) {
+        auto running = backends.probe.query(it->second.exePath);
+        if (running == ProcessState::Running) {
+            ++it;
+            continue;
+        }
+        auto ready = std::move(it->second);
+        it = closeWaits.erase(it);
+        if (running == ProcessState::Unknown) {
+            // Checked again after its period
+            SvcReportEvent("Getting process list");
+            continue;
+        }
+        if (gTraceEnabled.load(std::memory_order_relaxed)) {
+            TraceRecord("WaitForExit", ready.waitBegin, TraceNow());
+        }
+        SvcReportInfo("Program is closed update can start");
+        auto product_guid = ready.cfg.product_guid;
+        if (! startInstall(std::move(ready))) {
+            reschedule(scheduler, product_guid);
+        }
+    }
+}
+
+std::filesystem::path UpdateEngine::stagePath(
+        const Config &cfg, const std::string &version, std::string &arguments) {
+    static const std::string PLACEHOLDER = "%STAGE_DIR%";
+    if (arguments.find(PLACEHOLDER) == std::string::npos) {
+        SvcReportInfo("STAGE_DIR is set but PARAMS_FULL has no %STAGE_DIR%, installing in place");
+        return {};
+    }
+    if (! IsSafeFileName(version)) {
+        SvcReportInfo("Version cannot be a directory name, installing in place");
+        return {};
+    }
+    auto dir = std::filesystem::u8path(cfg.stage_dir) / std::filesystem::u8path(version);
+    auto dirText = dir.u8string();
+    for (auto at = arguments.find(PLACEHOLDER); at != std::string::npos;
+            at = arguments.find(PLACEHOLDER, at + dirText.size())) {
+        arguments.replace(at, PLACEHOLDER.size(), dirText);
+    }
+    return dir;
+}
+
+// Version directories are named like 2.1.0, anything else under the stage directory is
+// left alone
+static bool isVersionName(const std::string &name) {
+    return ! name.empty() && name.find_first_not_of("0123456789.") == std::string::npos;
+}
+
+void UpdateEngine::activatePending() {
+    for (auto it = activations.begin(); it != activations.end();) {
+        if (activate(it->first, it->second)) {
+            it = activations.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+bool UpdateEngine::activate(const std::string &product_guid, const std::filesystem::path &target) {
+    auto link = target.parent_path() / "current";
+    std::error_code ec;
+    auto previous = std::filesystem::read_symlink(link, ec);
+    auto exePath = inventory.executablePath(product_guid);
+    if (! exePath.empty()) {
+        // A program started through the link shows up with the link in its path on Windows
+        // and with the version directory on Linux
+        auto exe = std::filesystem::u8path(exePath).filename();
+        for (auto &dir : {link, previous}) {
+            if (! dir.empty()
+                    && backends.probe.query((dir / exe).u8string()) != ProcessState::NotRunning) {
+                return false;
+            }
+        }
+    }
+
+    TRACE_SPAN("Activate");
+    if (! backends.installer.activate(link, target)) {
+        // Tried again once the next update is staged
+        return true;
+    }
+    MetricCounter("updsvc_activations_total", "Staged versions switched to").add();
+    inventory.invalidate(product_guid);
+    SvcReportInfo("Activated version " + target.filename().u8string());
+
+    // Keep the version before it to go back to, remove the older ones
+    std::vector<std::filesystem::path> old;
+    for (auto &entry : std::filesystem::directory_iterator(target.parent_path(), ec)) {
+        auto name = entry.path().filename();
+        if (isVersionName(name.u8string()) && name != target.filename()
+                && name != previous.filename() && entry.is_directory(ec)
+                && ! entry.is_symlink(ec)) {
+            old.push_back(entry.path());
+        }
+    }
+    for (auto &dir : old) {
+        if (std::filesystem::remove_all(dir, ec) == static_cast<std::uintmax_t>(-1)) {
+            SvcReportInfo("Could not remove old version " + dir.filename().u8string());
+        }
+    }
+    return true;
+}
+
+void UpdateEngine::collectInstalls(Scheduler &scheduler) {
+    std::vector<std::string> finished;
+    for (auto &[product_guid, pending] : installs) {
+        if (pending.job->wait(std::chrono::milliseconds(0))) {
+            finished.push_back(product_guid);
+        }
+    }
+    for (auto &product_guid : finished) {
+        if (! finishInstall(product_guid)) {
+            reschedule(scheduler, product_guid);
+        }
+    }
+}
+
+// ERROR_INSTALL_ALREADY_RUNNING, returned by msiexec and by bootstrappers that run it
+static constexpr unsigned long INSTALL_ALREADY_RUNNING = 1618;
+
+static const char *reasonName(FailureReason reason) {
+    switch (reason) {
+    case FailureReason::None:
+        return "none";
+    case FailureReason::Manifest:
+        return "manifest";
+    case FailureReason::Download:
+        return "download";
+    case FailureReason::InstallerStart:
+        return "installer_start";
+    case FailureReason::InstallerExit:
+        return "installer_exit";
+    case FailureReason::InstallerKilled:
+        return "installer_killed";
+    case FailureReason::InstallerBusy:
+        return "installer_busy";
+    }
+    return "unknown";
+}
+
+std::chrono::milliseconds UpdateEngine::retryBackoff(unsigned attempts) const {
+    auto delay = retryDelay;
+    for (unsigned i = 1; i < attempts && delay < retryMaxDelay; ++i) {
+        delay *= 2;
+    }
+    return std::min(delay, retryMaxDelay);
+}
+
+void UpdateEngine::failed(const std::string &product_guid, FailureReason reason) {
+    if (stopping()) {
+        // Whatever the stop broke off did not fail
+        return;
+    }
+    auto &product = state.get(product_guid);
+    auto &retry = product.retry;
+    MetricCounter("updsvc_check_failures_total", "Failed update checks by reason",
+            std::string("reason=\"") + reasonName(reason) + "\"")
+            .add();
+    if (retry.attempts >= retryAttempts) {
+        SvcReportEvent("Giving up on " + product_guid + " after "
+                + std::to_string(retry.attempts) + " retries, last failure: "
+                + reasonName(reason));
+        // The reason stays in the store for whoever looks into it
+        retry = RetryState{};
+        retry.reason = reason;
+        product.packageUrl.clear();
+        product.package.clear();
+        state.save(product_guid);
+        return;
+    }
+
+    ++retry.attempts;
+    retry.reason = reason;
+    auto seconds = std::chrono::ceil<std::chrono::seconds>(retryBackoff(retry.attempts));
+    retry.notBefore = unixNow() + seconds.count();
+    state.save(product_guid);
+    SvcReportInfo(std::string("Check failed at ") + reasonName(reason) + ", retry "
+            + std::to_string(retry.attempts) + " in " + std::to_string(seconds.count()) + " s");
+}
+
+void UpdateEngine::succeeded(const std::string &product_guid) {
+    auto &product = state.get(product_guid);
+    product.retry = RetryState{};
+    product.packageUrl.clear();
+    product.package.clear();
+    state.save(product_guid);
+}
+
+void UpdateEngine::reschedule(Scheduler &scheduler, const std::string &product_guid) {
+    auto &retry = state.get(product_guid).retry;
+    if (retry.attempts != 0 && installs.count(product_guid) == 0) {
+        scheduler.dueIn(product_guid, retryBackoff(retry.attempts));
+    }
+    else {
+        scheduler.completed(product_guid);
+    }
+}
+
+std::vector<std::string> UpdateEngine::sourcesFor(const Config &cfg) {
+    std::vector<std::string> sources;
+    auto now = backends.clock.now();
+    for (auto &mirror : cfg.mirrors) {
+        auto retry = mirrorRetry.find(mirror);
+        if (retry == mirrorRetry.end() || retry->second <= now) {
+            sources.push_back(mirror);
+        }
+    }
+    sources.emplace_back();
+    return sources;
+}
+
+void UpdateEngine::sourceResult(const std::string &mirror, bool ok) {
+    if (mirror.empty()) {
+        return;
+    }
+    MetricCounter("updsvc_mirror_requests_total", "Requests sent to LAN mirrors by outcome",
+            ok ? "result=\"ok\"" : "result=\"failed\"")
+            .add();
+    if (ok) {
+        mirrorRetry.erase(mirror);
+        return;
+    }
+    SvcReportInfo("Mirror failed, trying the next source: " + mirror);
+    mirrorRetry[mirror] = backends.clock.now() + mirrorRetryDelay;
+}
+
+bool UpdateEngine::fetchManifest(const Config &cfg, ProductState &product) {
+    TRACE_SPAN("FetchManifest");
+    ResourceScope stage(stageClass(), backgroundCpuBudget, backends.cancel);
+    static auto &latency =
+            MetricHistogram("updsvc_manifest_fetch_seconds", "Manifest fetch latency", 1e-6);
+
+    HttpRequest origin;
+    if (! urlSplit(cfg.url, origin.domain, origin.path)) {
+        SvcReportEvent("Manifest URL is not a valid http(s) URL: " + cfg.url);
+        return false;
+    }
+    origin.compressed = true;
+    if (product.manifest.valid) {
+        origin.ifNoneMatch = product.manifestEtag;
+    }
+
+    for (auto &mirror : sourcesFor(cfg)) {
+        HttpRequest request = origin;
+        if (! mirror.empty() && ! throughMirror(mirror, origin, request)) {
+            sourceResult(mirror, false);
+            continue;
+        }
+
+        // Parsed while it arrives, the text itself is never stored
+        ManifestParser parser;
+        std::ostream body(&parser);
+        RequestStats stats;
+        auto begin = std::chrono::steady_clock::now();
+        bool received = transport.get(request, body, stats);
+        latency.record(MetricsMicros(begin, std::chrono::steady_clock::now()));
+        MetricCounter("updsvc_manifest_bytes_total",
+                "Manifest bytes as transferred and after decompression", "stage=\"wire\"")
+                .add(stats.wireBytes);
+        MetricCounter("updsvc_manifest_bytes_total",
+                "Manifest bytes as transferred and after decompression", "stage=\"decoded\"")
+                .add(stats.bytes);
+        MetricCounter("updsvc_manifest_requests_total",
+                "Manifest fetches by HTTP status, 304 counts as a cache hit",
+                statusLabel(stats.status))
+                .add();
+
+        bool notModified = received && stats.status == 304 && ! request.ifNoneMatch.empty();
+        // A truncated body or an error page sent with 200 fails like any other error, the
+        // stored copy is kept and the next source asked
+        Manifest manifest;
+        if (received && isSuccess(stats.status)) {
+            manifest = parser.finish();
+        }
+        bool ok = notModified || manifest.valid;
+        sourceResult(mirror, ok);
+        if (notModified) {
+            SvcReportInfo("Manifest not modified");
+            return true;
+        }
+        if (ok) {
+            product.manifest = std::move(manifest);
+            product.manifestEtag = stats.etag;
+            SvcReportInfo("Data downloaded succesfully");
+            return true;
+        }
+        if (received && isSuccess(stats.status)) {
+            SvcReportEvent("Manifest could not be parsed"
+                    + (mirror.empty() ? std::string() : " from mirror " + mirror));
+        }
+        else if (received && mirror.empty()) {
+            SvcReportEvent(
+                    "Manifest request failed with HTTP status " + std::to_string(stats.status));
+        }
+    }
+    return false;
+}
+
+// Whatever source a package came from, resumed or rebuilt, it is run as the service account;
+// it has to be the one updsvc-mkindex published. A digest that cannot be read matches nothing.
+static bool matchesManifest(const std::filesystem::path &file, const UpdateInfo &info) {
+    std::error_code ec;
+    if (info.size != 0 && std::filesystem::file_size(file, ec) != info.size) {
+        return false;
+    }
+    if (info.sha256.empty()) {
+        return true;
+    }
+    Sha256Digest expected;
+    if (! ParseDigestHex(info.sha256, expected)) {
+        return false;
+    }
+    std::ifstream in(file, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    Sha256 hash;
+    while (in) {
+        in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        hash.update(buffer.data(), static_cast<size_t>(in.gcount()));
+    }
+    return in.eof() && hash.finish() == expected;
+}
+
+std::filesystem::path UpdateEngine::download(const Config &cfg, const UpdateInfo &info) {
+    TRACE_SPAN("Download");
+    // Cache writes and the hashing of delta downloads are background work too
+    ResourceScope stage(stageClass(), backgroundCpuBudget, backends.cancel);
+
+    HttpRequest request;
+    if (! urlSplit(info.url, request.domain, request.path)) {
+        SvcReportInfo("Invalid package URL, this file cannot be downloaded");
+        return {};
+    }
+
+    // Control if file name is valid
+    auto filename = request.path.substr(request.path.find_last_of('/') + 1);
+    auto target = cache.pathFor(filename);
+    if (target.empty()) {
+        SvcReportInfo("Invalid file name, this file cannot be downloaded");
+        return {};
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(cache.directory(), ec);
+    if (ec) {
+        SvcReportEvent("Failed to create directory: " + cache.directory().u8string());
+        return {};
+    }
+
+    HttpRequest index;
+    bool hasIndex = false;
+    if (! info.chunks_url.empty()) {
+        hasIndex = urlSplit(info.chunks_url, index.domain, index.path);
+        if (! hasIndex) {
+            SvcReportInfo("Invalid chunk index URL, downloading the whole package");
+        }
+    }
+
+    for (auto &mirror : sourcesFor(cfg)) {
+        if (stopping()) {
+            break;
+        }
+        HttpRequest package = request;
+        HttpRequest packageIndex = index;
+        if (! mirror.empty()
+                && (! throughMirror(mirror, request, package)
+                        || (hasIndex && ! throughMirror(mirror, index, packageIndex)))) {
+            sourceResult(mirror, false);
+            continue;
+        }
+
+        bool rebuilt = hasIndex && downloadDelta(cfg, packageIndex, package, target);
+        bool ok = rebuilt || downloadFull(cfg, package, target);
+        if (! ok && stopping()) {
+            // Not the source's fault, the part is resumed from it next time
+            break;
+        }
+        if (ok && ! matchesManifest(target, info)) {
+            MetricCounter("updsvc_download_mismatches_total",
+                    "Downloaded packages whose size or SHA-256 differ from the manifest")
+                    .add();
+            SvcReportEvent("Downloaded file does not match the manifest"
+                    + (mirror.empty() ? std::string() : " from mirror " + mirror));
+            std::filesystem::remove(target, ec);
+            ok = false;
+        }
+        sourceResult(mirror, ok);
+        if (ok) {
+            if (rebuilt) {
+                SvcReportInfo("File rebuilt from the previous package");
+            }
+            return target;
+        }
+    }
+    return {};
+}
+
+std::vector<std::filesystem::path> UpdateEngine::downloadChain(const Config &cfg,
+        const Manifest &manifest, const UpdateInfo &first,
+        const std::filesystem::path &firstPackage) {
+    auto &bannedFiles = banned.get(cfg.product_guid);
+    auto links = PlanPatchChain(manifest, first, cfg.rel_chan, bannedFiles, maxPatchChain);
+    std::vector<std::filesystem::path> packages{firstPackage};
+    for (size_t i = 1; i < links.size(); ++i) {
+        auto package = download(cfg, links[i]);
+        if (package.empty()) {
+            break;
+        }
+        packages.push_back(std::move(package));
+    }
+    return packages;
+}
+
+// Receives a package into <package>.part. Whether the body continues the file or replaces
+// it is only known from the status, so the file is opened at the first write: a 206 to a
+// Range request is appended, anything else starts over. The ETag of the response goes to
+// <package>.part.etag at the same time, so whatever arrives before a stop or a dropped
+// connection can be resumed with If-Range.
+class PartFileBuffer : public std::streambuf {
+public:
+    PartFileBuffer(std::filesystem::path part, std::filesystem::path journal,
+            const RequestStats &stats, bool resuming)
+        : part(std::move(part))
+        , journal(std::move(journal))
+        , stats(stats)
+        , resuming(resuming) {}
+
+    // Closes the file, false if it could not be written
+    bool close() {
+        if (out.is_open()) {
+            out.close();
+        }
+        return ! failed;
+    }
+    // The body was appended to an earlier part
+    bool resumed() const { return opened && resuming && stats.status == 206; }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        if (! opened && ! open()) {
+            return 0;
+        }
+        out.write(data, count);
+        failed = failed || ! out;
+        return failed ? 0 : count;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+private:
+    bool open() {
+        opened = true;
+        std::error_code ec;
+        std::filesystem::remove(journal, ec);
+        out.open(part, std::ios::binary | (resumed() ? std::ios::app : std::ios::trunc));
+        failed = ! out.is_open();
+        // Without a validator a part cannot be resumed safely
+        if (! failed && ! stats.etag.empty()) {
+            std::ofstream(journal, std::ios::trunc | std::ios::binary) << stats.etag;
+        }
+        return ! failed;
+    }
+
+    std::filesystem::path part;
+    std::filesystem::path journal;
+    const RequestStats &stats;
+    bool resuming;
+    bool opened = false;
+    bool failed = false;
+    std::ofstream out;
+};
+
+bool UpdateEngine::downloadFull(
+        const Config &cfg, const HttpRequest &request, const std::filesystem::path &target) {
+    static auto &throughput = MetricHistogram("updsvc_download_throughput_bytes_per_second",
+            "Download throughput of update packages", 1.0);
+
+    auto part = target;
+    part += ".part";
+    auto journal = part;
+    journal += ".etag";
+    std::error_code ec;
+    HttpRequest ranged = request;
+    {
+        std::ifstream saved(journal, std::ios::binary);
+        std::string etag((std::istreambuf_iterator<char>(saved)), std::istreambuf_iterator<char>());
+        auto size = std::filesystem::file_size(part, ec);
+        if (! etag.empty() && ! ec && size > 0) {
+            ranged.range = "bytes=" + std::to_string(size) + "-";
+            ranged.ifRange = etag;
+        }
+    }
+
+    RequestStats stats;
+    PartFileBuffer buffer(part, journal, stats, ! ranged.range.empty());
+    std::ostream ostr(&buffer);
+    auto begin = std::chrono::steady_clock::now();
+    bool received = transport.get(ranged, ostr, stats);
+    bool written = buffer.close();
+    auto elapsedUs = MetricsMicros(begin, std::chrono::steady_clock::now());
+
+    MetricCounter("updsvc_download_requests_total", "Package downloads by HTTP status",
+            statusLabel(stats.status))
+            .add();
+    MetricCounter("updsvc_download_bytes_total", "Bytes of update packages downloaded",
+            "product=\"" + cfg.product_guid + "\"")
+            .add(stats.bytes);
+    if (elapsedUs > 0 && stats.bytes > 0) {
+        throughput.record(stats.bytes * 1000000 / elapsedUs);
+    }
+
+    if (! received && isSuccess(stats.status) && written) {
+        // Cut off, by a stop or by the network; the next try asks for the rest
+        auto kept = std::filesystem::file_size(part, ec);
+        SvcReportInfo("Download interrupted, " + std::to_string(ec ? 0 : kept)
+                + " bytes kept to resume from");
+        return false;
+    }
+    if (! received || ! isSuccess(stats.status) || ! written) {
+        // Never leave an error page behind where the installer would be started from, and
+        // start over after a 416 for a part that was complete already
+        std::filesystem::remove(part, ec);
+        std::filesystem::remove(journal, ec);
+        return false;
+    }
+    std::filesystem::rename(part, target, ec);
+    if (ec) {
+        SvcReportEvent("Moving the downloaded file into place");
+        return false;
+    }
+    std::filesystem::remove(journal, ec);
+    if (buffer.resumed()) {
+        MetricCounter("updsvc_download_resumed_total", "Package downloads resumed from a part")
+                .add();
+    }
+    SvcReportInfo("File downloaded succesfully");
+    return true;
+}
+
+//
+// Purpose:
+//   Rebuilds a full package from the seed of the product and the chunk index the manifest
+//   lists for it, fetching only the chunks the seed does not have
+//
+// Return value:
+//   false if there is no seed or anything goes wrong, the caller then downloads the whole
+//   package
+//
+bool UpdateEngine::downloadDelta(const Config &cfg, const HttpRequest &index,
+        const HttpRequest &package, const std::filesystem::path &target) {
+    TRACE_SPAN("DeltaDownload");
+    static auto &outcomes = MetricCounter("updsvc_delta_downloads_total",
+            "Delta download attempts by outcome", "result=\"fallback\"");
+
+    std::error_code ec;
+    auto seed = cache.seedFor(cfg.product_guid);
+    if (seed.empty() || ! std::filesystem::exists(seed, ec)) {
+        return false;
+    }
+
+    HttpRequest request = index;
+    request.compressed = true;
+    std::ostringstream body;
+    RequestStats stats;
+    ChunkIndex chunks;
+    if (! transport.get(request, body, stats) || ! isSuccess(stats.status)
+            || ! ChunkIndexFromJson(body.str(), chunks)) {
+        SvcReportEvent("Getting chunk index");
+        outcomes.add();
+        return false;
+    }
+
+    DeltaStats delta;
+    bool built = BuildFromSeed(transport, package, chunks, seed, target, delta);
+    MetricCounter("updsvc_delta_bytes_total", "Bytes of rebuilt packages by where they came from",
+            "source=\"seed\"")
+            .add(delta.reusedBytes);
+    MetricCounter("updsvc_delta_bytes_total", "Bytes of rebuilt packages by where they came from",
+            "source=\"network\"")
+            .add(delta.fetchedBytes);
+    MetricCounter("updsvc_download_bytes_total", "Bytes of update packages downloaded",
+            "product=\"" + cfg.product_guid + "\"")
+            .add(delta.fetchedBytes);
+    if (! built) {
+        SvcReportInfo("Rebuilding from the previous package failed, downloading the whole package");
+        outcomes.add();
+        return false;
+    }
+    MetricCounter("updsvc_delta_downloads_total",
+            "Delta download attempts by outcome", "result=\"built\"")
+            .add();
+
+    // Kept with the package, it becomes the index of the next seed
+    auto indexPath = target;
+    indexPath += ".idx";
+    std::ofstream(indexPath, std::ios::trunc | std::ios::binary) << body.str();
+    return true;
+}
+
+ResourceClass UpdateEngine::stageClass() const {
+    return backgroundMode ? ResourceClass::Background : ResourceClass::Foreground;
+}
+
+bool UpdateEngine::stopping() const {
+    return backends.cancel && backends.cancel->cancelled();
+}
+
+ProcessState UpdateEngine::waitUntilClosed(const std::string &exePath, bool wait) {
+    if (exePath.empty()) {
+        // The inventory already reported why, nothing can be matched against
+        return ProcessState::NotRunning;
+    }
+
+    auto running = backends.probe.query(exePath);
+    if (running == ProcessState::Unknown) {
+        SvcReportEvent("Getting process list");
+        return ProcessState::Unknown;
+    }
+
+    long long waitBegin = TraceNow();
+    while (running == ProcessState::Running) {
+        SvcReportInfo("Program is running cant update");
+        if (! wait) {
+            return ProcessState::Running;
+        }
+        if (! backends.clock.sleepFor(runningPollInterval)) {
+            return ProcessState::Unknown;
+        }
+        running = backends.probe.query(exePath);
+    }
+    if (gTraceEnabled.load(std::memory_order_relaxed)) {
+        TraceRecord("WaitForExit", waitBegin, TraceNow());
+    }
+    SvcReportInfo("Program is closed update can start");
+    return ProcessState::NotRunning;
+}
+
+bool UpdateEngine::finishInstall(const std::string &product_guid) {
+    static auto &installDuration = MetricHistogram(
+            "updsvc_install_duration_seconds", "Wall-clock time of installer runs", 1e-6);
+
+    auto pending = std::move(installs.extract(product_guid).mapped());
+    auto result = pending.job->result();
+    // Whatever the installer got to, the product is read again
+    inventory.invalidate(product_guid);
+    installDuration.record(MetricsMicros(pending.begin, std::chrono::steady_clock::now()));
+    auto code = result.timedOut ? std::string("timeout")
+            : result.stopped    ? std::string("stopped")
+                                : std::to_string(result.exitCode);
+    MetricCounter("updsvc_install_exit_code_total",
+            "Installer runs by exit code, timeout and stopped if they were killed",
+            "code=\"" + code + "\"")
+            .add();
+    if (result.stopped) {
+        SvcReportInfo("Installer killed, the service is stopping");
+        return false;
+    }
+    if (result.timedOut) {
+        SvcReportEvent("Installer ran past its time limit and was killed");
+    }
+    else {
+        SvcReportInfo("Installer exited with code " + code);
+    }
+
+    if (! result.timedOut && result.exitCode == INSTALL_ALREADY_RUNNING) {
+        // Another product's bootstrapper or a user's own install holds the Windows Installer
+        // mutex. The same package is tried again after the retry delay.
+        SvcReportInfo("Another installation is in progress, the update is retried");
+        failed(product_guid, FailureReason::InstallerBusy);
+        return false;
+    }
+
+    // Check the exit code to see if the process completed successfully
+    if (result.timedOut || result.exitCode != 0) {
+        SvcReportEvent("Update installing");
+        auto filename = pending.package.filename().u8string();
+        banned.ban(product_guid, filename);
+        MetricCounter("updsvc_bans_total", "Files banned after a failed install").add();
+        SvcReportInfo("Update has failed, file can be corrupted. " + filename + " banned.");
+        SvcReportEvent("Installing exe");
+        failed(product_guid,
+                result.timedOut ? FailureReason::InstallerKilled : FailureReason::InstallerExit);
+        return false;
+    }
+
+    SvcReportInfo("Exe installed successfully");
+    if (! pending.ispatch) {
+        cache.adoptSeed(product_guid, pending.package);
+    }
+    succeeded(product_guid);
+    if (! pending.stageDir.empty()) {
+        activations[product_guid] = pending.stageDir;
+        activatePending();
+    }
+    return true;
+}
@@ -0,0 +1,271 @@
+#ifndef SVCCORE_H
+#define SVCCORE_H
+
+#include "SvcBackends.h"
+#include "SvcBandwidth.h"
+#include "SvcResources.h"
+#include "SvcScheduler.h"
+#include "SvcState.h"
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// In-memory copy of the ban list of every product. Each product's set is read from the
+// config store at most once per generation; the generation is bumped when a new cycle starts
+// or when a file is banned, so detection never touches the store.
+class BannedIndex {
+public:
+    explicit BannedIndex(ConfigStore &store)
+        : store(store) {}
+
+    const BannedSet &get(const std::string &product_guid);
+    void ban(const std::string &product_guid, const std::string &filename);
+    void invalidate();
+
+private:
+    struct Entry {
+        BannedSet files;
+        unsigned long long generation = 1;
+        unsigned long long loaded = 0;
+    };
+    ConfigStore &store;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+// In-memory copy of what the inventory knows about every product. Versions are read in one
+// pass at the start of a cycle; a product is only read again once the inventory reports a
+// change and its install stamp moved, or after the service installed something for it.
+// Executable paths are cached alongside but read on first use, finding one opens the package
+// at the install source, which may be a share that is not always reachable.
+class InventoryIndex {
+public:
+    explicit InventoryIndex(ProductInventory &inventory)
+        : inventory(inventory) {}
+
+    // Start of a cycle, forgets every product that is not in product_guids
+    void refresh(const std::vector<std::string> &product_guids);
+    const std::string &installedVersion(const std::string &product_guid);
+    const std::string &executablePath(const std::string &product_guid);
+    // Read the product again on next use, after an installer of ours ran
+    void invalidate(const std::string &product_guid);
+
+private:
+    struct Entry {
+        std::string version;
+        std::string exePath;
+        std::string stamp;
+        bool loaded = false;
+        bool pathLoaded = false;
+    };
+    Entry &load(const std::string &product_guid);
+
+    ProductInventory &inventory;
+    std::unordered_map<std::string, Entry> entries;
+};
+
+// Directory the update packages are downloaded to, %TEMP%\updsvc on Windows.
+class PackageCache {
+public:
+    explicit PackageCache(std::filesystem::path directory);
+
+    const std::filesystem::path &directory() const { return dir; }
+    // Where a package with this name is stored. Empty if the name is not a plain file name,
+    // a manifest must not be able to write outside the cache.
+    std::filesystem::path pathFor(const std::string &filename) const;
+
+    // The last full package installed for a product, kept as the seed for delta downloads.
+    // Empty if the GUID is not valid.
+    std::filesystem::path seedFor(const std::string &product_guid) const;
+    // Moves an installed full package into the seed slot, together with the chunk index
+    // downloaded for it (<package>.idx) if there is one.
+    void adoptSeed(const std::string &product_guid, const std::filesystem::path &package);
+
+    static std::filesystem::path defaultDirectory();
+
+private:
+    std::filesystem::path dir;
+};
+
+//
+// The update pipeline: fetch the manifest, pick a package, download it into the cache,
+// wait until the product is closed and run the installer. Every platform dependency goes
+// through the backends, so the same code runs in the service and on Linux for profiling.
+//
+// What it knows about each product is kept in a StateStore in stateDirectory, so a restarted
+// service picks up where it stopped: products checked less than a period ago are not checked
+// again right away, retries keep their backoff and manifests are revalidated with their ETag.
+// Without a directory the state is not persisted.
+//
+class UpdateEngine {
+public:
+    UpdateEngine(const Backends &backends, PackageCache cache,
+            std::filesystem::path stateDirectory = {});
+
+    // Configuration of every product with a valid GUID and the required settings. Products
+    // with PERIOD 0 are returned too, the scheduler skips them.
+    bool loadProducts(std::vector<Config> &configs);
+
+    // One update check for a product, returns true if an update was installed. Waits for
+    // the installer; when it fails, tries the next package after the retry delay.
+    bool updateProduct(const Config &cfg);
+
+    // Checks every product once, regardless of its period. Returns false if the
+    // configuration could not be read.
+    bool updateAll();
+
+    // Reloads the configuration into the scheduler and checks the products that are due.
+    // Installers are left running, each call collects the ones that finished and only checks
+    // the other products. A failed check is scheduled again after the retry delay.
+    // Returns false if the configuration could not be read.
+    bool runDue(Scheduler &scheduler);
+    // An installer started by runDue is still running, call it again within
+    // installPollInterval
+    bool installing() const { return ! installs.empty(); }
+    // A staged version, or a downloaded install in place, waits for its program to close;
+    // call runDue again within runningPollInterval
+    bool activating() const { return ! activations.empty() || ! closeWaits.empty(); }
+
+    // Reads the state log at background priority, so the first cycle does not wait for the
+    // disk. The service runs it on a thread of its own while it waits out the boot delay;
+    // the engine must not be used until it returns.
+    void warmUp();
+
+    BannedIndex &bannedIndex() { return banned; }
+    PackageCache &packageCache() { return cache; }
+    StateStore &stateStore() { return state; }
+    // Every request of the engine goes through it, limited to the caps of the product
+    // being updated
+    BandwidthGovernor &bandwidth() { return governor; }
+
+    // How often a running product is probed before installing
+    std::chrono::milliseconds runningPollInterval{std::chrono::seconds(10)};
+    // A failed check is retried retryDelay later, and twice as late after every further
+    // failure up to retryMaxDelay. After retryAttempts retries the product waits for its
+    // period again.
+    std::chrono::milliseconds retryDelay{std::chrono::seconds(10)};
+    std::chrono::milliseconds retryMaxDelay{std::chrono::hours(1)};
+    unsigned retryAttempts = 5;
+    // A mirror that failed is skipped for this long, so every request does not wait for it
+    std::chrono::milliseconds mirrorRetryDelay{std::chrono::minutes(10)};
+    // An installer that runs out of these is killed with everything it started, and its
+    // package banned
+    InstallLimits installLimits{std::chrono::hours(1)};
+    std::chrono::milliseconds installPollInterval{std::chrono::seconds(1)};
+    // Up to this many patches in a row are downloaded and handed to Installer::startChain,
+    // 1 to apply one patch per check
+    size_t maxPatchChain = 1;
+    // Fetching, downloading and hashing run as background work, capped at this fraction of
+    // one core; see SvcResources.h. Installers run at normal priority either way.
+    bool backgroundMode = false;
+    double backgroundCpuBudget = 1.0;
+
+private:
+    // Mirrors of the product that have not failed recently, then an empty string for the
+    // URLs of the manifest themselves
+    std::vector<std::string> sourcesFor(const Config &cfg);
+    void sourceResult(const std::string &mirror, bool ok);
+
+    // Fetches the manifest into product, or keeps its copy if the server answers 304 to its
+    // ETag
+    bool fetchManifest(const Config &cfg, ProductState &product);
+    std::filesystem::path download(const Config &cfg, const UpdateInfo &info);
+    // The package of first followed by those of the patches PlanPatchChain continues it with,
+    // as far as they could be downloaded
+    std::vector<std::filesystem::path> downloadChain(const Config &cfg, const Manifest &manifest,
+            const UpdateInfo &first, const std::filesystem::path &firstPackage);
+    bool downloadFull(
+            const Config &cfg, const HttpRequest &package, const std::filesystem::path &target);
+    bool downloadDelta(const Config &cfg, const HttpRequest &index, const HttpRequest &package,
+            const std::filesystem::path &target);
+    ResourceClass stageClass() const;
+    // The cancel token of the backends was tripped
+    bool stopping() const;
+    // NotRunning once the program at exePath is not running. With wait false it is probed
+    // once and Running returned if it runs. Unknown if it cannot be told, or the wait was
+    // cut short.
+    ProcessState waitUntilClosed(const std::string &exePath, bool wait);
+
+    // At the first runDue of the service, makes the product due when its period or retry
+    // delay from before the restart runs out rather than right away
+    void resume(Scheduler &scheduler, const Config &cfg);
+    // Fetches the manifest, or takes the one of the failed check being retried, and starts
+    // the installer of the update if there is one. False if nothing was started.
+    // waitForClose is passed on to waitUntilClosed.
+    bool checkProduct(const Config &cfg, bool waitForClose);
+    // Picks and downloads a package and starts its installer. Without waitForClose, an
+    // install in place whose program runs is put in closeWaits.
+    bool startUpdate(const Config &cfg, const Manifest &manifest, bool waitForClose);
+    // Where a staged product's new version is installed, with %STAGE_DIR% in arguments
+    // replaced by it. Empty if it has to be installed in place after all.
+    std::filesystem::path stagePath(
+            const Config &cfg, const std::string &version, std::string &arguments);
+    // Points <stage_dir>/current at the versions that were staged, for every product that
+    // is not running
+    void activatePending();
+    // False while the program still runs
+    bool activate(const std::string &product_guid, const std::filesystem::path &target);
+    struct ReadyInstall;
+    // Starts the installer of a downloaded update, false if it could not be started
+    bool startInstall(ReadyInstall ready);
+    // Starts the installs in closeWaits whose program has closed
+    void startClosed(Scheduler &scheduler);
+    // Returns true if the update was installed
+    bool finishInstall(const std::string &product_guid);
+    // Finishes the installs whose installer exited and schedules the retries of those that
+    // failed
+    void collectInstalls(Scheduler &scheduler);
+
+    std::chrono::milliseconds retryBackoff(unsigned attempts) const;
+    // Records a failed check. The product is retried after retryBackoff, or gives up and
+    // waits for its period once it has run out of attempts.
+    void failed(const std::string &product_guid, FailureReason reason);
+    void succeeded(const std::string &product_guid);
+    // Due again after the retry delay if its last check failed, after its period otherwise
+    void reschedule(Scheduler &scheduler, const std::string &product_guid);
+
+    // A downloaded update, everything its installer is started with
+    struct ReadyInstall {
+        Config cfg;
+        std::filesystem::path package;
+        // Patches to apply at once, when there are more than one
+        std::vector<std::filesystem::path> chain;
+        std::string arguments;
+        bool ispatch = false;
+        std::filesystem::path stageDir; // Empty for an install in place
+        std::string exePath; // Probed before an install in place
+        long long waitBegin = 0; // TraceNow() when the program was found running
+    };
+
+    struct PendingInstall {
+        Config cfg;
+        std::filesystem::path package;
+        bool ispatch = false;
+        std::filesystem::path stageDir; // Empty for an install in place
+        std::unique_ptr<InstallJob> job;
+        std::chrono::steady_clock::time_point begin;
+    };
+
+    Backends backends;
+    PackageCache cache;
+    BannedIndex banned;
+    InventoryIndex inventory;
+    BandwidthGovernor governor;
+    ThrottledTransport transport;
+    std::map<std::string, std::chrono::steady_clock::time_point> mirrorRetry;
+    std::map<std::string, PendingInstall> installs;
+    StateStore state;
+    // Products resume has seen
+    std::set<std::string> resumed;
+    // Staged versions waiting to be activated
+    std::map<std::string, std::filesystem::path> activations;
+    // Installs in place that found their program running. runDue only probes the program
+    // until it closes, the product is not checked again before its period is up.
+    std::map<std::string, ReadyInstall> closeWaits;
+};
+
+#endif // SVCCORE_H
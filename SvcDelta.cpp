@@ -0,0 +1,167 @@
+#include "SvcDelta.h"
+#include "SvcResources.h"
+#include "SvcTrace.h"
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+static uint64_t digestKey(const Sha256Digest &digest) {
+    uint64_t key;
+    std::memcpy(&key, digest.data(), sizeof(key));
+    return key;
+}
+
+DeltaPlan PlanDelta(const ChunkIndex &target, const ChunkIndex &seed) {
+    std::unordered_map<uint64_t, const Chunk *> seedChunks;
+    seedChunks.reserve(seed.chunks.size());
+    for (auto &chunk : seed.chunks) {
+        seedChunks.emplace(digestKey(chunk.hash), &chunk);
+    }
+
+    const auto mergeGap = static_cast<uint64_t>(target.params.avgSize * DELTA_MERGE_GAP_CHUNKS);
+    const uint64_t maxRange = uint64_t(target.params.avgSize) * DELTA_MAX_RANGE_CHUNKS;
+
+    DeltaPlan plan;
+    plan.seedOffsets.reserve(target.chunks.size());
+    for (auto &chunk : target.chunks) {
+        auto it = seedChunks.find(digestKey(chunk.hash));
+        if (it != seedChunks.end() && it->second->hash == chunk.hash
+                && it->second->size == chunk.size) {
+            plan.seedOffsets.push_back(static_cast<long long>(it->second->offset));
+            continue;
+        }
+        plan.seedOffsets.push_back(-1);
+
+        uint64_t last = chunk.offset + chunk.size - 1;
+        if (! plan.ranges.empty()) {
+            auto &open = plan.ranges.back();
+            if (chunk.offset - (open.last + 1) <= mergeGap && last - open.first < maxRange) {
+                open.last = last;
+                continue;
+            }
+        }
+        plan.ranges.push_back({chunk.offset, last});
+    }
+
+    for (auto &range : plan.ranges) {
+        plan.fetchBytes += range.last - range.first + 1;
+    }
+    plan.reusedBytes = target.size - plan.fetchBytes;
+    return plan;
+}
+
+bool LoadSeedIndex(
+        const std::filesystem::path &seed, const ChunkParams &params, ChunkIndex &index) {
+    std::error_code ec;
+    auto seedSize = std::filesystem::file_size(seed, ec);
+    if (ec) {
+        return false;
+    }
+
+    auto indexPath = seed;
+    indexPath += ".idx";
+    {
+        std::ifstream in(indexPath, std::ios::binary);
+        if (in.is_open()) {
+            std::ostringstream text;
+            text << in.rdbuf();
+            if (ChunkIndexFromJson(text.str(), index) && index.params == params
+                    && index.size == seedSize) {
+                return true;
+            }
+        }
+    }
+
+    TRACE_SPAN("ChunkSeed");
+    if (! ChunkFile(seed, index, params)) {
+        return false;
+    }
+    std::ofstream out(indexPath, std::ios::trunc | std::ios::binary);
+    out << ChunkIndexToJson(index);
+    return true;
+}
+
+bool BuildFromSeed(Transport &transport, const HttpRequest &package, const ChunkIndex &target,
+        const std::filesystem::path &seed, const std::filesystem::path &out, DeltaStats &stats) {
+    TRACE_SPAN("BuildFromSeed");
+    ChunkIndex seedIndex;
+    if (! LoadSeedIndex(seed, target.params, seedIndex)) {
+        return false;
+    }
+    auto plan = PlanDelta(target, seedIndex);
+
+    std::ifstream seedFile(seed, std::ios::binary);
+    std::ofstream ostr(out, std::ios::trunc | std::ios::binary);
+    if (! seedFile.is_open() || ! ostr.is_open()) {
+        return false;
+    }
+
+    auto fail = [&] {
+        ostr.close();
+        std::error_code ec;
+        std::filesystem::remove(out, ec);
+        return false;
+    };
+
+    std::unique_ptr<char[]> copy(new char[target.params.maxSize]);
+    std::string body;
+    ByteRange current{1, 0};
+    size_t nextRange = 0;
+    Sha256 whole;
+
+    for (size_t i = 0; i < target.chunks.size(); ++i) {
+        auto &chunk = target.chunks[i];
+        if (chunk.size > target.params.maxSize) {
+            return fail();
+        }
+
+        if (nextRange < plan.ranges.size() && plan.ranges[nextRange].first == chunk.offset) {
+            current = plan.ranges[nextRange++];
+            HttpRequest request = package;
+            request.range = "bytes=" + std::to_string(current.first) + "-"
+                    + std::to_string(current.last);
+            std::ostringstream sink;
+            RequestStats requestStats;
+            bool received = transport.get(request, sink, requestStats);
+            ++stats.requests;
+            body = sink.str();
+            // A 200 would be the whole package, the server does not support ranges
+            if (! received || requestStats.status != 206
+                    || body.size() != current.last - current.first + 1) {
+                return fail();
+            }
+            stats.fetchedBytes += body.size();
+        }
+
+        const char *data;
+        if (chunk.offset >= current.first && chunk.offset + chunk.size - 1 <= current.last) {
+            data = body.data() + (chunk.offset - current.first);
+        }
+        else if (plan.seedOffsets[i] >= 0) {
+            seedFile.seekg(plan.seedOffsets[i]);
+            if (! seedFile.read(copy.get(), chunk.size)) {
+                return fail();
+            }
+            data = copy.get();
+            stats.reusedBytes += chunk.size;
+        }
+        else {
+            return fail();
+        }
+
+        whole.update(data, chunk.size);
+        ostr.write(data, chunk.size);
+        if (! ResourceCheckpoint()) {
+            return fail();
+        }
+    }
+
+    ostr.close();
+    if (ostr.fail() || whole.finish() != target.hash) {
+        return fail();
+    }
+    return true;
+}
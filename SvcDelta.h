@@ -0,0 +1,51 @@
+#ifndef SVCDELTA_H
+#define SVCDELTA_H
+
+#include "SvcBackends.h"
+#include "SvcChunk.h"
+
+#include <filesystem>
+#include <vector>
+
+// Rebuilds a package from the chunk index published for it and an older package on disk
+// (the seed). Chunks the seed already contains are copied from it, everything else is fetched
+// from the package URL with Range requests.
+
+struct ByteRange {
+    uint64_t first;
+    uint64_t last; // Inclusive, as in the Range header
+};
+
+struct DeltaPlan {
+    // For every chunk of the target, where it is in the seed or -1 if it must be fetched
+    std::vector<long long> seedOffsets;
+    std::vector<ByteRange> ranges;
+    uint64_t reusedBytes = 0;
+    uint64_t fetchBytes = 0;
+};
+
+struct DeltaStats {
+    uint64_t reusedBytes = 0;
+    uint64_t fetchedBytes = 0;
+    unsigned requests = 0;
+};
+
+// Missing chunks that are closer than this many average chunks are fetched in one request
+// together with the reusable bytes between them, and no single request asks for more than
+// the cap. With the default parameters that is 32 KiB and 8 MiB; keeping them relative lets
+// updsvc_fleetsim shrink packages and chunks together without changing the plans.
+static constexpr double DELTA_MERGE_GAP_CHUNKS = 0.5;
+static constexpr uint64_t DELTA_MAX_RANGE_CHUNKS = 128;
+
+DeltaPlan PlanDelta(const ChunkIndex &target, const ChunkIndex &seed);
+
+// Chunk index of the seed, from <seed>.idx when it is still valid and otherwise by chunking
+// the file (and saving the result there for the next time).
+bool LoadSeedIndex(const std::filesystem::path &seed, const ChunkParams &params, ChunkIndex &index);
+
+// Writes the target to out. Returns false, with out removed, if a range request fails, the
+// server ignores Range, or the result does not match the index.
+bool BuildFromSeed(Transport &transport, const HttpRequest &package, const ChunkIndex &target,
+        const std::filesystem::path &seed, const std::filesystem::path &out, DeltaStats &stats);
+
+#endif // SVCDELTA_H
@@ -0,0 +1,184 @@
+#include "SvcEngine.h"
+#include "SvcMetrics.h"
+#include "SvcTrace.h"
+#include "SvcValidate.h"
+
+#include <algorithm>
+#include <array>
+
+static constexpr const char *UPDATE_CHECKS_METRIC = "updsvc_update_checks_total";
+static constexpr const char *UPDATE_CHECKS_HELP = "Manifest evaluations by outcome";
+
+UpdateInfo DetectUpdate(std::string_view strjson, std::string_view version,
+        std::string_view rel_chan, const BannedSet &banned) {
+    ManifestParser parser;
+    {
+        TRACE_SPAN("ParseManifest");
+        parser.feed(strjson.data(), strjson.size());
+    }
+    return DetectUpdate(parser.finish(), version, rel_chan, banned);
+}
+
+UpdateInfo DetectUpdate(const Manifest &manifest, std::string_view version,
+        std::string_view rel_chan, const BannedSet &banned) {
+    if (! manifest.valid) {
+        SvcReportEvent("Json parse");
+        MetricCounter(UPDATE_CHECKS_METRIC, UPDATE_CHECKS_HELP, "result=\"error\"").add();
+        return {};
+    }
+
+    static auto &bannedCandidates = MetricCounter("updsvc_banned_candidates_total",
+            "Manifest entries skipped because the file is banned");
+    for (auto it = manifest.releases.rbegin(); it != manifest.releases.rend(); ++it) {
+        // check whether current version is smaller than the version at hand
+        if (compareVersions(it->version, version) != 1) {
+            continue;
+        }
+
+        const ManifestEntry *full = nullptr;
+        for (auto &entry : it->entries) {
+            auto isBanned = banned.count(entry.name) != 0;
+            if (isBanned) {
+                bannedCandidates.add();
+            }
+
+            if (entry.from == version && entry.channel == rel_chan && ! isBanned) {
+                auto patchupdinfo = "Patch update from " + entry.from + " to " + it->version
+                        + " url : " + entry.url;
+                SvcReportInfo(patchupdinfo);
+                MetricCounter(UPDATE_CHECKS_METRIC, UPDATE_CHECKS_HELP, "result=\"patch\"").add();
+                return {entry.url, true, {}, it->version, entry.size, entry.sha256};
+            }
+            if (entry.from == "null") {
+                full = &entry;
+            }
+        }
+
+        if (full && full->channel == rel_chan) {
+            auto fullupdinfo = "Full update from " + std::string(version) + " to " + it->version
+                    + " url : " + full->url;
+            SvcReportInfo(fullupdinfo);
+            MetricCounter(UPDATE_CHECKS_METRIC, UPDATE_CHECKS_HELP, "result=\"full\"").add();
+            return {full->url, false, full->chunks, it->version, full->size, full->sha256};
+        }
+    }
+    MetricCounter(UPDATE_CHECKS_METRIC, UPDATE_CHECKS_HELP, "result=\"none\"").add();
+    return {};
+}
+
+std::vector<UpdateInfo> PlanPatchChain(const Manifest &manifest, const UpdateInfo &first,
+        std::string_view rel_chan, const BannedSet &banned, size_t maxLinks) {
+    std::vector<UpdateInfo> chain{first};
+    while (chain.size() < maxLinks) {
+        const std::string &from = chain.back().version;
+        const ManifestRelease *to = nullptr;
+        const ManifestEntry *patch = nullptr;
+        for (auto &release : manifest.releases) {
+            if (compareVersions(release.version, from) != 1
+                    || (to && compareVersions(release.version, to->version) != 1)) {
+                continue;
+            }
+            for (auto &entry : release.entries) {
+                if (entry.from == from && entry.channel == rel_chan
+                        && banned.count(entry.name) == 0) {
+                    to = &release;
+                    patch = &entry;
+                    break;
+                }
+            }
+        }
+        if (! patch) {
+            break;
+        }
+        chain.push_back({patch->url, true, {}, to->version, patch->size, patch->sha256});
+    }
+    return chain;
+}
+
+// major.minor.patch, missing or non-numeric parts count as 0
+static std::array<int, 3> parseVersion(std::string_view version) {
+    std::array<int, 3> parts{};
+    size_t part = 0;
+    for (char c : version) {
+        if (c == '.') {
+            if (++part == parts.size()) {
+                break;
+            }
+        }
+        else if (c >= '0' && c <= '9') {
+            parts[part] = parts[part] * 10 + (c - '0');
+        }
+    }
+    return parts;
+}
+
+int compareVersions(std::string_view version1, std::string_view version2) {
+    auto v1 = parseVersion(version1);
+    auto v2 = parseVersion(version2);
+
+    // Compare major, minor and patch version in turn
+    for (size_t i = 0; i < v1.size(); ++i) {
+        if (v1[i] < v2[i]) {
+            return -1;
+        }
+        else if (v1[i] > v2[i]) {
+            return 1;
+        }
+    }
+
+    // Versions are equal
+    return 0;
+}
+
+bool urlSplit(std::string_view url, std::string &domain, std::string &path) {
+    auto parts = SplitUrl(url);
+    if (parts.host.empty()) {
+        return false;
+    }
+    domain = parts.host;
+    path = parts.path;
+    return true;
+}
+
+static char asciiLower(char c) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+size_t CaseInsensitiveHash::operator()(std::string_view s) const {
+    // FNV-1a over the lower-cased bytes
+    size_t hash = static_cast<size_t>(14695981039346656037ULL);
+    for (char c : s) {
+        hash ^= static_cast<unsigned char>(asciiLower(c));
+        hash *= static_cast<size_t>(1099511628211ULL);
+    }
+    return hash;
+}
+
+bool CaseInsensitiveEqual::operator()(std::string_view a, std::string_view b) const {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (asciiLower(a[i]) != asciiLower(b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string_view httpHeaderValue(std::string_view head, std::string_view name) {
+    for (size_t line = head.find("\r\n"); line != std::string_view::npos;
+            line = head.find("\r\n", line + 2)) {
+        auto field = head.substr(line + 2);
+        if (field.size() <= name.size() || field[name.size()] != ':'
+                || ! CaseInsensitiveEqual()(field.substr(0, name.size()), name)) {
+            continue;
+        }
+        auto value = field.substr(name.size() + 1, field.find("\r\n") - name.size() - 1);
+        while (! value.empty() && value.front() == ' ') {
+            value.remove_prefix(1);
+        }
+        return value;
+    }
+    return {};
+}
@@ -0,0 +1,84 @@
+#ifndef SVCENGINE_H
+#define SVCENGINE_H
+
+#include "SvcManifest.h"
+#include "SvcText.h"
+
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+// The parts of the update logic that do not touch Win32. They are shared by the service and
+// by updsvc_bench, which supplies its own logging on other platforms. All strings are UTF-8.
+
+struct UpdateInfo {
+    std::string url;
+    bool is_patch = false;
+    // Chunk index of a full package, when the manifest publishes one; see SvcDelta.h
+    std::string chunks_url;
+    std::string version; // Of the release the package installs
+    // What the downloaded package must match, 0 and empty if the manifest does not say
+    uint64_t size = 0;
+    std::string sha256;
+};
+
+// Download caps of a product in KB/s, 0 for none. The night cap applies from nightBegins
+// until nightEnds, in hours of local time. With adaptive set, the cap is lowered further
+// while requests take longer than usual, see BandwidthGovernor.
+struct BandwidthLimits {
+    unsigned long dayKBps = 0;
+    unsigned long nightKBps = 0;
+    bool adaptive = false;
+    int nightBegins = 20;
+    int nightEnds = 7;
+};
+
+struct Config {
+    std::string url;
+    std::string product_guid;
+    std::string params_full;
+    std::string params_patch;
+    std::string rel_chan;
+    unsigned long period;
+    // LAN mirrors tried in order before the URLs of the manifest, see updsvc-mirror
+    std::vector<std::string> mirrors;
+    BandwidthLimits bandwidth;
+    // Versions are installed side by side under this directory and activated by pointing
+    // <stage_dir>/current at one of them, see UpdateEngine. Empty to install in place.
+    std::string stage_dir;
+};
+
+// File names are compared ignoring ASCII case. Package names are restricted to
+// [A-Za-z0-9._-] before they are downloaded, so nothing else can end up banned by the service.
+struct CaseInsensitiveHash {
+    size_t operator()(std::string_view s) const;
+};
+struct CaseInsensitiveEqual {
+    bool operator()(std::string_view a, std::string_view b) const;
+};
+using BannedSet = std::unordered_set<std::string, CaseInsensitiveHash, CaseInsensitiveEqual>;
+
+// Implemented by the host: the service writes to the event log, updsvc_bench to stderr.
+void SvcReportEvent(std::string_view szFunction);
+void SvcReportInfo(std::string_view szFunction);
+
+// Picks the package to install from the manifest JSON: a patch from the installed version
+// if one exists on the channel and is not banned, otherwise the full package.
+UpdateInfo DetectUpdate(std::string_view strjson, std::string_view version,
+        std::string_view rel_chan, const BannedSet &banned);
+UpdateInfo DetectUpdate(const Manifest &manifest, std::string_view version,
+        std::string_view rel_chan, const BannedSet &banned);
+// first, a patch DetectUpdate picked, followed by the patches that continue from its
+// release: at every step the newest release with a patch from the end of the chain, at most
+// maxLinks in all. For installers that apply several patches in one transaction.
+std::vector<UpdateInfo> PlanPatchChain(const Manifest &manifest, const UpdateInfo &first,
+        std::string_view rel_chan, const BannedSet &banned, size_t maxLinks);
+int compareVersions(std::string_view version1, std::string_view version2);
+// Fills domain (host[:port]) and path from an http(s) URL, false if it is not one
+bool urlSplit(std::string_view url, std::string &domain, std::string &path);
+// Value of a header in an HTTP message head (start line and header lines), empty if it is
+// missing. Names are compared ignoring case.
+std::string_view httpHeaderValue(std::string_view head, std::string_view name);
+
+#endif // SVCENGINE_H
@@ -0,0 +1,280 @@
+#include <windows.h>
+
+#include <strsafe.h>
+
+#include "SvcLog.h"
+#include "SvcText.h"
+#include "UpdSvc.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+// Longer messages are truncated at a character boundary, the old per-call buffer was only
+// 80 characters.
+static constexpr size_t LOG_MESSAGE_BYTES = 512;
+// Must be a power of two.
+static constexpr size_t LOG_RING_SLOTS = 1024;
+// How long the drain thread lets messages accumulate before writing them out.
+static constexpr auto LOG_BATCH_INTERVAL = std::chrono::milliseconds(200);
+
+namespace {
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogSeverity severity;
+    DWORD error;
+    unsigned short length;
+    char text[LOG_MESSAGE_BYTES];
+};
+
+// Bounded multi-producer queue (Vyukov). Each slot carries a sequence number that tells
+// producers whether it is free and the consumer whether it has been published.
+class LogRing {
+public:
+    LogRing() {
+        for (size_t i = 0; i < LOG_RING_SLOTS; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(LogSeverity severity, std::string_view text, DWORD error) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        LogSlot *slot;
+        for (;;) {
+            slot = &slots[pos & (LOG_RING_SLOTS - 1)];
+            size_t seq = slot->sequence.load(std::memory_order_acquire);
+            auto dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            }
+            else if (dif < 0) {
+                // Full, the drain thread is behind
+                return false;
+            }
+            else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        auto length = Utf8Truncate(text, LOG_MESSAGE_BYTES);
+        slot->severity = severity;
+        slot->error = error;
+        slot->length = static_cast<unsigned short>(length);
+        std::memcpy(slot->text, text.data(), length);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Single consumer
+    bool pop(LogSeverity &severity, DWORD &error, std::string_view &text, char *buffer) {
+        LogSlot &slot = slots[dequeuePos & (LOG_RING_SLOTS - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+            return false;
+        }
+        severity = slot.severity;
+        error = slot.error;
+        std::memcpy(buffer, slot.text, slot.length);
+        text = std::string_view(buffer, slot.length);
+        slot.sequence.store(dequeuePos + LOG_RING_SLOTS, std::memory_order_release);
+        ++dequeuePos;
+        return true;
+    }
+
+private:
+    LogSlot slots[LOG_RING_SLOTS];
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) size_t dequeuePos = 0;
+};
+
+struct Logger {
+    LogRing ring;
+    HANDLE hEventSource = NULL;
+    std::wstring source;
+    std::thread drainThread;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<bool> running{false};
+    // LogWrite calls that may push, LogStop waits for them before the last drain
+    std::atomic<unsigned> writers{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> errorPending{false};
+    std::atomic<unsigned char> minSeverity{static_cast<unsigned char>(LogSeverity::Info)};
+    std::atomic<unsigned long long> written{0};
+    std::atomic<unsigned long long> dropped{0};
+    std::atomic<unsigned long long> filtered{0};
+    unsigned long long droppedReported = 0;
+};
+
+Logger gLogger;
+
+} // namespace
+
+// The event log takes UTF-16, messages are converted here rather than by every caller
+static void reportToEventLog(HANDLE hEventSource, LPCWSTR source, LogSeverity severity,
+        std::string_view message, DWORD error) {
+    LPCTSTR lpszStrings[2];
+    wchar_t wide[LOG_MESSAGE_BYTES];
+    TCHAR Buffer[LOG_MESSAGE_BYTES + 32];
+    WORD type;
+
+    std::wstring_view text(wide, Utf8ToWide(message, wide, _countof(wide)));
+
+    if (severity == LogSeverity::Error) {
+        StringCchPrintf(Buffer, _countof(Buffer), TEXT("%.*s failed with %d"),
+                static_cast<int>(text.size()), text.data(), error);
+        type = EVENTLOG_ERROR_TYPE;
+    }
+    else {
+        StringCchPrintf(
+                Buffer, _countof(Buffer), TEXT("%.*s"), static_cast<int>(text.size()), text.data());
+        type = EVENTLOG_SUCCESS;
+    }
+
+    lpszStrings[0] = source;
+    lpszStrings[1] = Buffer;
+
+    ReportEvent(hEventSource, // event log handle
+            type, // event type
+            0, // event category
+            SVC_ERROR, // event identifier
+            NULL, // no security identifier
+            2, // size of lpszStrings array
+            0, // no binary data
+            lpszStrings, // array of strings
+            NULL); // no binary data
+}
+
+static void reportDropped() {
+    auto dropped = gLogger.dropped.load(std::memory_order_relaxed);
+    if (dropped == gLogger.droppedReported) {
+        return;
+    }
+
+    TCHAR Buffer[80];
+    StringCchPrintf(Buffer, _countof(Buffer), TEXT("%llu log messages dropped, buffer full"),
+            dropped - gLogger.droppedReported);
+    LPCTSTR lpszStrings[2] = {gLogger.source.c_str(), Buffer};
+    ReportEvent(gLogger.hEventSource, EVENTLOG_WARNING_TYPE, 0, SVC_ERROR, NULL, 2, 0,
+            lpszStrings, NULL);
+    gLogger.droppedReported = dropped;
+}
+
+static void drainLoop() {
+    char buffer[LOG_MESSAGE_BYTES];
+    LogSeverity severity;
+    DWORD error;
+    std::string_view text;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(gLogger.wakeMutex);
+            gLogger.wake.wait_for(lock, LOG_BATCH_INTERVAL, [] {
+                return gLogger.stopping.load() || gLogger.errorPending.load();
+            });
+        }
+        gLogger.errorPending.store(false, std::memory_order_relaxed);
+
+        // Write everything that accumulated since the last wake-up in one go
+        while (gLogger.ring.pop(severity, error, text, buffer)) {
+            reportToEventLog(gLogger.hEventSource, gLogger.source.c_str(), severity, text, error);
+            gLogger.written.fetch_add(1, std::memory_order_relaxed);
+        }
+        reportDropped();
+
+        if (gLogger.stopping.load()) {
+            return;
+        }
+    }
+}
+
+bool LogStart(LPCWSTR source) {
+    if (gLogger.running.load()) {
+        return true;
+    }
+
+    gLogger.source = source;
+    gLogger.hEventSource = RegisterEventSource(NULL, source);
+    if (gLogger.hEventSource == NULL) {
+        return false;
+    }
+
+    gLogger.stopping.store(false);
+    gLogger.drainThread = std::thread(drainLoop);
+    gLogger.running.store(true);
+    return true;
+}
+
+void LogStop() {
+    if (! gLogger.running.exchange(false)) {
+        return;
+    }
+    // A writer that saw running before the exchange may not have pushed yet. Later ones see
+    // it cleared and write synchronously.
+    while (gLogger.writers.load() != 0) {
+        std::this_thread::yield();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(gLogger.wakeMutex);
+        gLogger.stopping.store(true);
+    }
+    gLogger.wake.notify_one();
+    gLogger.drainThread.join();
+
+    DeregisterEventSource(gLogger.hEventSource);
+    gLogger.hEventSource = NULL;
+}
+
+void LogSetMinSeverity(LogSeverity severity) {
+    gLogger.minSeverity.store(static_cast<unsigned char>(severity), std::memory_order_relaxed);
+}
+
+bool LogWrite(LogSeverity severity, std::string_view text, DWORD error) {
+    if (static_cast<unsigned char>(severity)
+            < gLogger.minSeverity.load(std::memory_order_relaxed)) {
+        gLogger.filtered.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Both sequentially consistent: either LogStop sees this writer, or the writer sees
+    // running cleared
+    gLogger.writers.fetch_add(1);
+    if (! gLogger.running.load()) {
+        gLogger.writers.fetch_sub(1);
+        // Not started (or already stopped), fall back to the synchronous path
+        HANDLE hEventSource = RegisterEventSource(NULL, TEXT("UpdSvc"));
+        if (NULL == hEventSource) {
+            return false;
+        }
+        reportToEventLog(hEventSource, TEXT("UpdSvc"), severity, text, error);
+        DeregisterEventSource(hEventSource);
+        gLogger.written.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool pushed = gLogger.ring.push(severity, text, error);
+    gLogger.writers.fetch_sub(1);
+    if (! pushed) {
+        gLogger.dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Errors are flushed right away, everything else waits for the next batch
+    if (severity == LogSeverity::Error && ! gLogger.errorPending.exchange(true)) {
+        gLogger.wake.notify_one();
+    }
+    return true;
+}
+
+LogStats LogGetStats() {
+    LogStats stats;
+    stats.written = gLogger.written.load(std::memory_order_relaxed);
+    stats.dropped = gLogger.dropped.load(std::memory_order_relaxed);
+    stats.filtered = gLogger.filtered.load(std::memory_order_relaxed);
+    return stats;
+}
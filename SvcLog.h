@@ -0,0 +1,34 @@
+#ifndef SVCLOG_H
+#define SVCLOG_H
+
+#include <Windows.h>
+#include <string_view>
+
+enum class LogSeverity : unsigned char {
+    Info = 0,
+    Error = 1,
+};
+
+struct LogStats {
+    unsigned long long written = 0;
+    unsigned long long dropped = 0;
+    unsigned long long filtered = 0;
+};
+
+// Registers the event source once and starts the thread that drains the ring buffer.
+// Until LogStart succeeds, messages are written synchronously.
+bool LogStart(LPCWSTR source);
+
+// Flushes whatever is still queued and releases the event source.
+void LogStop();
+
+// Messages below this severity are discarded before anything is copied or formatted.
+void LogSetMinSeverity(LogSeverity severity);
+
+// Queues a UTF-8 message; error is the GetLastError() value captured by the caller and is only
+// formatted on the drain thread. Returns false if the message was filtered or dropped.
+bool LogWrite(LogSeverity severity, std::string_view text, DWORD error);
+
+LogStats LogGetStats();
+
+#endif // SVCLOG_H
@@ -0,0 +1,438 @@
+#include "SvcManifest.h"
+
+#include <algorithm>
+
+enum class ManifestParser::Lex : uint8_t {
+    Value,
+    FirstKeyOrEnd, // After '{'
+    Key, // After ',' in an object
+    Colon,
+    FirstValueOrEnd, // After '['
+    AfterValue,
+    String,
+    Escape,
+    Unicode,
+    Literal,
+    NumberSign,
+    NumberZero,
+    NumberInt,
+    NumberDot,
+    NumberFraction,
+    NumberExponent,
+    NumberExponentSign,
+    NumberExponentDigits,
+    Done,
+};
+
+enum class ManifestParser::Role : uint8_t {
+    Other,
+    Root,
+    Product, // "mgui-wgt"
+    Releases, // "exe"
+    Release,
+    Entry,
+};
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Sorts by key and drops all but the last of the items with the same key, which is what a
+// std::map-backed DOM ends up with
+template <class T, class Key>
+static void keepLastByKey(std::vector<T> &items, Key keyOf) {
+    std::stable_sort(items.begin(), items.end(),
+            [&](const T &a, const T &b) { return keyOf(a) < keyOf(b); });
+    size_t kept = 0;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (i + 1 < items.size() && keyOf(items[i + 1]) == keyOf(items[i])) {
+            continue;
+        }
+        if (kept != i) {
+            items[kept] = std::move(items[i]);
+        }
+        ++kept;
+    }
+    items.resize(kept);
+}
+
+ManifestParser::ManifestParser()
+    : lex(Lex::Value) {}
+
+std::streamsize ManifestParser::xsputn(const char *data, std::streamsize count) {
+    feed(data, static_cast<size_t>(count));
+    return count;
+}
+
+ManifestParser::int_type ManifestParser::overflow(int_type c) {
+    if (! traits_type::eq_int_type(c, traits_type::eof())) {
+        char ch = traits_type::to_char_type(c);
+        feed(&ch, 1);
+    }
+    return traits_type::not_eof(c);
+}
+
+void ManifestParser::feed(const char *data, size_t size) {
+    for (size_t i = 0; i < size && ! failed; ++i) {
+        if (lex == Lex::String && highSurrogate == 0) {
+            // Strings are most of a manifest, copy their plain characters in one go
+            size_t end = i;
+            while (end < size && data[end] != '"' && data[end] != '\\'
+                    && static_cast<unsigned char>(data[end]) >= 0x20) {
+                ++end;
+            }
+            text.append(data + i, end - i);
+            i = end;
+            if (i == size) {
+                break;
+            }
+        }
+        failed = ! step(data[i]);
+    }
+}
+
+Manifest ManifestParser::finish() {
+    Manifest result = std::move(manifest);
+    manifest = {};
+    result.valid = ! failed && lex == Lex::Done && sawReleases;
+    if (! result.valid) {
+        result.releases.clear();
+        return result;
+    }
+    keepLastByKey(result.releases, [](const ManifestRelease &r) -> const std::string & {
+        return r.version;
+    });
+    for (auto &release : result.releases) {
+        keepLastByKey(release.entries,
+                [](const ManifestEntry &e) -> const std::string & { return e.from; });
+    }
+    return result;
+}
+
+bool ManifestParser::step(char c) {
+    switch (lex) {
+    case Lex::String:
+        if (highSurrogate != 0 && c != '\\') {
+            return false;
+        }
+        if (c == '"') {
+            return endString();
+        }
+        if (c == '\\') {
+            lex = Lex::Escape;
+            return true;
+        }
+        if (static_cast<unsigned char>(c) < 0x20) {
+            return false;
+        }
+        text += c;
+        return true;
+
+    case Lex::Escape: {
+        if (highSurrogate != 0 && c != 'u') {
+            return false;
+        }
+        static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+        lex = Lex::String;
+        if (c == 'u') {
+            lex = Lex::Unicode;
+            unicode = 0;
+            hexDigits = 0;
+            return true;
+        }
+        for (size_t i = 0; i + 1 < sizeof(escapes); i += 2) {
+            if (escapes[i] == c) {
+                text += escapes[i + 1];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    case Lex::Unicode: {
+        int digit = hexValue(c);
+        if (digit < 0) {
+            return false;
+        }
+        unicode = unicode << 4 | static_cast<uint32_t>(digit);
+        if (++hexDigits < 4) {
+            return true;
+        }
+        lex = Lex::String;
+        if (highSurrogate != 0) {
+            if (unicode < 0xDC00 || unicode > 0xDFFF) {
+                return false;
+            }
+            appendCodePoint(0x10000 + ((highSurrogate - 0xD800) << 10) + (unicode - 0xDC00));
+            highSurrogate = 0;
+        }
+        else if (unicode >= 0xD800 && unicode <= 0xDBFF) {
+            highSurrogate = unicode;
+        }
+        else if (unicode >= 0xDC00 && unicode <= 0xDFFF) {
+            return false;
+        }
+        else {
+            appendCodePoint(unicode);
+        }
+        return true;
+    }
+
+    case Lex::Literal:
+        if (c != *literal) {
+            return false;
+        }
+        if (*++literal == '\0') {
+            return endValue();
+        }
+        return true;
+
+    case Lex::NumberSign:
+        if (c == '0') {
+            lex = Lex::NumberZero;
+            return true;
+        }
+        lex = Lex::NumberInt;
+        return isDigit(c);
+    case Lex::NumberZero:
+    case Lex::NumberInt:
+        if (lex == Lex::NumberInt && isDigit(c)) {
+            auto digit = static_cast<uint64_t>(c - '0');
+            numberExact = numberExact && number <= (UINT64_MAX - digit) / 10;
+            number = number * 10 + digit;
+            return true;
+        }
+        if (c == '.') {
+            lex = Lex::NumberDot;
+            numberExact = false;
+            return true;
+        }
+        if (c == 'e' || c == 'E') {
+            lex = Lex::NumberExponent;
+            numberExact = false;
+            return true;
+        }
+        return endNumber(c);
+    case Lex::NumberDot:
+        lex = Lex::NumberFraction;
+        return isDigit(c);
+    case Lex::NumberFraction:
+        if (isDigit(c)) {
+            return true;
+        }
+        if (c == 'e' || c == 'E') {
+            lex = Lex::NumberExponent;
+            return true;
+        }
+        return endNumber(c);
+    case Lex::NumberExponent:
+        if (c == '+' || c == '-') {
+            lex = Lex::NumberExponentSign;
+            return true;
+        }
+        lex = Lex::NumberExponentDigits;
+        return isDigit(c);
+    case Lex::NumberExponentSign:
+        lex = Lex::NumberExponentDigits;
+        return isDigit(c);
+    case Lex::NumberExponentDigits:
+        return isDigit(c) || endNumber(c);
+
+    default:
+        break;
+    }
+
+    if (isSpace(c)) {
+        return true;
+    }
+    switch (lex) {
+    case Lex::Value:
+        return beginValue(c);
+    case Lex::FirstValueOrEnd:
+        if (c == ']') {
+            containers.pop_back();
+            roles.pop_back();
+            return endValue();
+        }
+        return beginValue(c);
+    case Lex::FirstKeyOrEnd:
+        if (c == '}') {
+            containers.pop_back();
+            roles.pop_back();
+            return endValue();
+        }
+        // fall through
+    case Lex::Key:
+        if (c != '"') {
+            return false;
+        }
+        stringIsKey = true;
+        text.clear();
+        lex = Lex::String;
+        return true;
+    case Lex::Colon:
+        lex = Lex::Value;
+        return c == ':';
+    case Lex::AfterValue:
+        if (c == ',') {
+            lex = containers.back() == '{' ? Lex::Key : Lex::Value;
+            return true;
+        }
+        if ((c == '}' && containers.back() == '{') || (c == ']' && containers.back() == '[')) {
+            containers.pop_back();
+            roles.pop_back();
+            return endValue();
+        }
+        return false;
+    default:
+        // Done: only white space may follow the value
+        return false;
+    }
+}
+
+bool ManifestParser::beginValue(char c) {
+    switch (c) {
+    case '{': {
+        Role role = Role::Other;
+        Role parent = roles.empty() ? Role::Other : roles.back();
+        bool inObject = ! containers.empty() && containers.back() == '{';
+        if (containers.empty()) {
+            role = Role::Root;
+        }
+        else if (inObject && parent == Role::Root && key == "mgui-wgt") {
+            role = Role::Product;
+        }
+        else if (inObject && parent == Role::Product && key == "exe") {
+            role = Role::Releases;
+            sawReleases = true;
+        }
+        else if (inObject && parent == Role::Releases) {
+            role = Role::Release;
+            manifest.releases.push_back({key, {}});
+        }
+        else if (inObject && parent == Role::Release) {
+            role = Role::Entry;
+            manifest.releases.back().entries.push_back({key, {}, {}, {}, {}, 0, {}});
+        }
+        containers.push_back('{');
+        roles.push_back(role);
+        lex = Lex::FirstKeyOrEnd;
+        return true;
+    }
+    case '[':
+        containers.push_back('[');
+        roles.push_back(Role::Other);
+        lex = Lex::FirstValueOrEnd;
+        return true;
+    case '"':
+        stringIsKey = false;
+        text.clear();
+        lex = Lex::String;
+        return true;
+    case 't':
+        literal = "rue";
+        lex = Lex::Literal;
+        return true;
+    case 'f':
+        literal = "alse";
+        lex = Lex::Literal;
+        return true;
+    case 'n':
+        literal = "ull";
+        lex = Lex::Literal;
+        return true;
+    case '-':
+        lex = Lex::NumberSign;
+        numberExact = false;
+        return true;
+    case '0':
+        lex = Lex::NumberZero;
+        number = 0;
+        numberExact = true;
+        return true;
+    default:
+        lex = Lex::NumberInt;
+        number = static_cast<uint64_t>(c - '0');
+        numberExact = true;
+        return c >= '1' && c <= '9';
+    }
+}
+
+bool ManifestParser::endValue() {
+    lex = containers.empty() ? Lex::Done : Lex::AfterValue;
+    return true;
+}
+
+bool ManifestParser::endString() {
+    if (stringIsKey) {
+        key.swap(text);
+        lex = Lex::Colon;
+        return true;
+    }
+    if (! roles.empty() && roles.back() == Role::Entry && containers.back() == '{') {
+        auto &entry = manifest.releases.back().entries.back();
+        if (key == "name") {
+            entry.name.swap(text);
+        }
+        else if (key == "url") {
+            entry.url.swap(text);
+        }
+        else if (key == "channel") {
+            entry.channel.swap(text);
+        }
+        else if (key == "chunks") {
+            entry.chunks.swap(text);
+        }
+        else if (key == "sha256") {
+            entry.sha256.swap(text);
+        }
+    }
+    return endValue();
+}
+
+bool ManifestParser::endNumber(char c) {
+    if (numberExact && key == "size" && ! roles.empty() && roles.back() == Role::Entry
+            && containers.back() == '{') {
+        manifest.releases.back().entries.back().size = number;
+    }
+    endValue();
+    return step(c);
+}
+
+void ManifestParser::appendCodePoint(uint32_t codePoint) {
+    if (codePoint < 0x80) {
+        text += static_cast<char>(codePoint);
+    }
+    else if (codePoint < 0x800) {
+        text += static_cast<char>(0xC0 | codePoint >> 6);
+        text += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+    else if (codePoint < 0x10000) {
+        text += static_cast<char>(0xE0 | codePoint >> 12);
+        text += static_cast<char>(0x80 | (codePoint >> 6 & 0x3F));
+        text += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+    else {
+        text += static_cast<char>(0xF0 | codePoint >> 18);
+        text += static_cast<char>(0x80 | (codePoint >> 12 & 0x3F));
+        text += static_cast<char>(0x80 | (codePoint >> 6 & 0x3F));
+        text += static_cast<char>(0x80 | (codePoint & 0x3F));
+    }
+}
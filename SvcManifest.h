@@ -0,0 +1,83 @@
+#ifndef SVCMANIFEST_H
+#define SVCMANIFEST_H
+
+#include <cstdint>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+// The update manifest as DetectUpdate sees it:
+//
+//   {"mgui-wgt": {"exe": {"<version>": {"<from version>|null": {"name": ..., "url": ...,
+//           "channel": ..., "chunks": ..., "size": ..., "sha256": ...}}}}}
+//
+// Only those values of every entry are kept, the rest of the document is checked for
+// syntax and dropped as it is parsed.
+
+struct ManifestEntry {
+    std::string from; // Installed version a patch applies to, "null" for the full package
+    std::string name;
+    std::string url;
+    std::string channel;
+    std::string chunks;
+    // Of the package as updsvc-mkindex published it, 0 and empty for older manifests
+    uint64_t size = 0;
+    std::string sha256; // Hex
+};
+
+struct ManifestRelease {
+    std::string version;
+    std::vector<ManifestEntry> entries; // Sorted by from
+};
+
+struct Manifest {
+    // False if the text was not JSON or has no "mgui-wgt"/"exe" object
+    bool valid = false;
+    std::vector<ManifestRelease> releases; // Sorted by version string, like the JSON keys
+};
+
+// Push parser for the manifest. The transport writes the body into it through an ostream
+// as it arrives (decompressed, if it came gzipped), so the document is never held in memory
+// as a whole. Keys that appear twice keep the last value, the way a DOM parser would.
+class ManifestParser : public std::streambuf {
+public:
+    ManifestParser();
+
+    void feed(const char *data, size_t size);
+    // Valid only if the text ended after one complete value
+    Manifest finish();
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override;
+    int_type overflow(int_type c) override;
+
+private:
+    enum class Lex : uint8_t;
+    enum class Role : uint8_t;
+
+    bool step(char c);
+    bool beginValue(char c);
+    bool endValue();
+    bool endString();
+    bool endNumber(char c);
+    void appendCodePoint(uint32_t codePoint);
+
+    Lex lex;
+    bool failed = false;
+    bool sawReleases = false;
+    // Containers the text is in: '{' or '[', and what the object holds
+    std::vector<char> containers;
+    std::vector<Role> roles;
+    bool stringIsKey = false;
+    std::string text; // String being read
+    std::string key; // Last key of the innermost object
+    uint32_t unicode = 0; // \uXXXX being read
+    uint32_t highSurrogate = 0;
+    int hexDigits = 0;
+    const char *literal = nullptr; // Rest of true, false or null
+    uint64_t number = 0; // Number being read, if numberExact
+    bool numberExact = false; // An integer so far that fits number
+    Manifest manifest;
+};
+
+#endif // SVCMANIFEST_H
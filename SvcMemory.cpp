@@ -0,0 +1,97 @@
+#include "SvcMemory.h"
+
+#include <cstdlib>
+#include <utility>
+
+void MemoryConfigStore::setProduct(const Config &cfg) {
+    std::lock_guard<std::mutex> guard(lock);
+    configs[cfg.product_guid] = cfg;
+}
+
+void MemoryConfigStore::removeProduct(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    configs.erase(product_guid);
+    banned.erase(product_guid);
+}
+
+void MemoryConfigStore::setSetting(const std::string &name, const std::string &value) {
+    std::lock_guard<std::mutex> guard(lock);
+    settings[name] = value;
+}
+
+bool MemoryConfigStore::products(std::vector<std::string> &product_guids) {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto &entry : configs) {
+        product_guids.push_back(entry.first);
+    }
+    return true;
+}
+
+Config MemoryConfigStore::readProduct(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = configs.find(product_guid);
+    if (it == configs.end()) {
+        Config cfg{};
+        cfg.product_guid = product_guid;
+        return cfg;
+    }
+    return it->second;
+}
+
+BannedSet MemoryConfigStore::readBanned(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = banned.find(product_guid);
+    return it == banned.end() ? BannedSet{} : it->second;
+}
+
+void MemoryConfigStore::addBanned(const std::string &product_guid, const std::string &filename) {
+    std::lock_guard<std::mutex> guard(lock);
+    banned[product_guid].insert(filename);
+}
+
+std::string MemoryConfigStore::readSetting(const std::string &name) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = settings.find(name);
+    return it == settings.end() ? std::string{} : it->second;
+}
+
+unsigned long MemoryConfigStore::readSetting(const std::string &name, unsigned long defaultValue) {
+    auto value = readSetting(name);
+    if (value.empty()) {
+        return defaultValue;
+    }
+    return std::strtoul(value.c_str(), nullptr, 10);
+}
+
+void MemoryInventory::setProduct(const std::string &product_guid, const std::string &version,
+        const std::string &exePath) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto &product = products[product_guid];
+    product.version = version;
+    product.exePath = exePath;
+    ++product.stamp;
+    dirty = true;
+}
+
+std::string MemoryInventory::installedVersion(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = products.find(product_guid);
+    return it == products.end() ? std::string{} : it->second.version;
+}
+
+std::string MemoryInventory::executablePath(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = products.find(product_guid);
+    return it == products.end() ? std::string{} : it->second.exePath;
+}
+
+std::string MemoryInventory::installStamp(const std::string &product_guid) {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = products.find(product_guid);
+    return it == products.end() ? std::string("0") : std::to_string(it->second.stamp);
+}
+
+bool MemoryInventory::changed() {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::exchange(dirty, false);
+}
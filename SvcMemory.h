@@ -0,0 +1,54 @@
+#ifndef SVCMEMORY_H
+#define SVCMEMORY_H
+
+#include "SvcBackends.h"
+
+#include <map>
+#include <mutex>
+
+// Stand-in configuration and inventory kept in memory, for running the engine without a
+// registry or an MSI database. Both are safe to share between threads.
+
+class MemoryConfigStore : public ConfigStore {
+public:
+    void setProduct(const Config &cfg);
+    void removeProduct(const std::string &product_guid);
+    void setSetting(const std::string &name, const std::string &value);
+
+    bool products(std::vector<std::string> &product_guids) override;
+    Config readProduct(const std::string &product_guid) override;
+    BannedSet readBanned(const std::string &product_guid) override;
+    void addBanned(const std::string &product_guid, const std::string &filename) override;
+    std::string readSetting(const std::string &name) override;
+    unsigned long readSetting(const std::string &name, unsigned long defaultValue) override;
+
+private:
+    std::mutex lock;
+    std::map<std::string, Config> configs;
+    std::map<std::string, BannedSet> banned;
+    std::map<std::string, std::string> settings;
+};
+
+class MemoryInventory : public ProductInventory {
+public:
+    void setProduct(const std::string &product_guid, const std::string &version,
+            const std::string &exePath);
+
+    std::string installedVersion(const std::string &product_guid) override;
+    std::string executablePath(const std::string &product_guid) override;
+    // Counts the setProduct calls of the product
+    std::string installStamp(const std::string &product_guid) override;
+    bool changed() override;
+
+private:
+    struct Product {
+        std::string version;
+        std::string exePath;
+        unsigned long long stamp = 0;
+    };
+    std::mutex lock;
+    std::map<std::string, Product> products;
+    bool dirty = true;
+};
+
+#endif // SVCMEMORY_H
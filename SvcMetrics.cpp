@@ -0,0 +1,238 @@
+#include "SvcMetrics.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+enum class MetricType { Counter, Gauge, Histogram };
+
+struct Family {
+    std::string help;
+    MetricType type;
+    double scale = 1.0;
+    // keyed by label list, std::map keeps the output stable between snapshots
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+};
+
+std::mutex gRegistryLock;
+std::map<std::string, Family> gFamilies;
+
+struct Writer {
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+Writer gWriter;
+
+Family &family(const char *name, const char *help, MetricType type) {
+    auto &f = gFamilies[name];
+    if (f.help.empty()) {
+        f.help = help;
+        f.type = type;
+    }
+    return f;
+}
+
+std::string withLabels(const std::string &labels, const std::string &extra = {}) {
+    if (labels.empty() && extra.empty()) {
+        return {};
+    }
+    if (labels.empty() || extra.empty()) {
+        return "{" + labels + extra + "}";
+    }
+    return "{" + labels + "," + extra + "}";
+}
+
+int highestBit(unsigned long long v) {
+    int bit = 0;
+    while (v >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+} // namespace
+
+unsigned Histogram::bucketIndex(unsigned long long v) {
+    if (v < 2 * SUB_BUCKETS) {
+        return static_cast<unsigned>(v);
+    }
+    unsigned shift = highestBit(v) - SUB_BUCKET_BITS;
+    unsigned sub = static_cast<unsigned>(v >> shift) & (SUB_BUCKETS - 1);
+    return (shift + 1) * SUB_BUCKETS + sub;
+}
+
+unsigned long long Histogram::bucketUpperBound(unsigned index) {
+    if (index < 2 * SUB_BUCKETS) {
+        return index;
+    }
+    unsigned shift = index / SUB_BUCKETS - 1;
+    unsigned long long sub = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void Histogram::record(unsigned long long v) {
+    buckets[bucketIndex(v)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    valueSum.fetch_add(v, std::memory_order_relaxed);
+}
+
+unsigned long long Histogram::percentile(double q) const {
+    auto n = count();
+    if (n == 0) {
+        return 0;
+    }
+    auto rank = static_cast<unsigned long long>(q * (n - 1)) + 1;
+    unsigned long long seen = 0;
+    for (unsigned i = 0; i < BUCKETS; ++i) {
+        seen += bucket(i);
+        if (seen >= rank) {
+            return bucketUpperBound(i);
+        }
+    }
+    return bucketUpperBound(BUCKETS - 1);
+}
+
+Counter &MetricCounter(const char *name, const char *help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    auto &slot = family(name, help, MetricType::Counter).counters[labels];
+    if (! slot) {
+        slot = std::make_unique<Counter>();
+    }
+    return *slot;
+}
+
+Gauge &MetricGauge(const char *name, const char *help, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    auto &slot = family(name, help, MetricType::Gauge).gauges[labels];
+    if (! slot) {
+        slot = std::make_unique<Gauge>();
+    }
+    return *slot;
+}
+
+Histogram &MetricHistogram(
+        const char *name, const char *help, double scale, const std::string &labels) {
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+    auto &f = family(name, help, MetricType::Histogram);
+    f.scale = scale;
+    auto &slot = f.histograms[labels];
+    if (! slot) {
+        slot = std::make_unique<Histogram>();
+    }
+    return *slot;
+}
+
+std::string MetricsSnapshot() {
+    std::string out;
+    char line[512];
+    std::lock_guard<std::mutex> lock(gRegistryLock);
+
+    for (auto &[name, f] : gFamilies) {
+        static const char *typeNames[] = {"counter", "gauge", "histogram"};
+        std::snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name.c_str(),
+                f.help.c_str(), name.c_str(), typeNames[static_cast<int>(f.type)]);
+        out += line;
+
+        for (auto &[labels, counter] : f.counters) {
+            std::snprintf(line, sizeof(line), "%s%s %llu\n", name.c_str(),
+                    withLabels(labels).c_str(), counter->get());
+            out += line;
+        }
+        for (auto &[labels, gauge] : f.gauges) {
+            std::snprintf(line, sizeof(line), "%s%s %lld\n", name.c_str(),
+                    withLabels(labels).c_str(), gauge->get());
+            out += line;
+        }
+        for (auto &[labels, histogram] : f.histograms) {
+            // Export cumulative counts at power-of-two boundaries; the finer sub-buckets
+            // stay internal so the series set does not explode.
+            unsigned last = 0;
+            for (unsigned i = 0; i < Histogram::BUCKETS; ++i) {
+                if (histogram->bucket(i)) {
+                    last = i;
+                }
+            }
+            unsigned long long cumulative = 0;
+            unsigned i = 0;
+            for (unsigned octave = 1; i <= last && octave < 64; ++octave) {
+                auto bound = (1ULL << octave) - 1;
+                for (; i < Histogram::BUCKETS && Histogram::bucketUpperBound(i) <= bound; ++i) {
+                    cumulative += histogram->bucket(i);
+                }
+                char le[64];
+                std::snprintf(le, sizeof(le), "le=\"%g\"", bound * f.scale);
+                std::snprintf(line, sizeof(line), "%s_bucket%s %llu\n", name.c_str(),
+                        withLabels(labels, le).c_str(), cumulative);
+                out += line;
+            }
+            std::snprintf(line, sizeof(line), "%s_bucket%s %llu\n", name.c_str(),
+                    withLabels(labels, "le=\"+Inf\"").c_str(), histogram->count());
+            out += line;
+            std::snprintf(line, sizeof(line), "%s_sum%s %g\n%s_count%s %llu\n", name.c_str(),
+                    withLabels(labels).c_str(), histogram->sum() * f.scale, name.c_str(),
+                    withLabels(labels).c_str(), histogram->count());
+            out += line;
+        }
+    }
+    return out;
+}
+
+bool MetricsWriteFile(const std::filesystem::path &path) {
+    auto tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream ostr(tmpPath, std::ios::trunc | std::ios::binary);
+        if (! ostr.is_open()) {
+            return false;
+        }
+        ostr << MetricsSnapshot();
+        if (! ostr.good()) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    return ! ec;
+}
+
+void MetricsStartWriter(const std::filesystem::path &path, std::chrono::seconds interval) {
+    if (gWriter.thread.joinable()) {
+        return;
+    }
+    gWriter.stopping = false;
+    gWriter.thread = std::thread([path, interval] {
+        std::unique_lock<std::mutex> lock(gWriter.lock);
+        for (;;) {
+            gWriter.wake.wait_for(lock, interval, [] { return gWriter.stopping; });
+            lock.unlock();
+            MetricsWriteFile(path);
+            lock.lock();
+            if (gWriter.stopping) {
+                return;
+            }
+        }
+    });
+}
+
+void MetricsStopWriter() {
+    if (! gWriter.thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(gWriter.lock);
+        gWriter.stopping = true;
+    }
+    gWriter.wake.notify_one();
+    gWriter.thread.join();
+}
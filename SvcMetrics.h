@@ -0,0 +1,86 @@
+#ifndef SVCMETRICS_H
+#define SVCMETRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+// Counters, gauges and histograms for fleet monitoring. Updating a metric is a relaxed atomic
+// add; only looking a metric up by name takes the registry lock, so hot paths keep the
+// reference. Snapshots are rendered in the Prometheus text exposition format.
+
+class Counter {
+public:
+    void add(unsigned long long n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    unsigned long long get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<unsigned long long> value{0};
+};
+
+class Gauge {
+public:
+    void set(long long v) { value.store(v, std::memory_order_relaxed); }
+    void add(long long n) { value.fetch_add(n, std::memory_order_relaxed); }
+    long long get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<long long> value{0};
+};
+
+// Log-linear buckets in the style of HdrHistogram: every power of two is split into
+// HISTOGRAM_SUB_BUCKETS linear buckets, so any recorded value is known within 12.5%.
+// Values are unsigned integers in the unit the caller picks (microseconds, bytes/s).
+class Histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 3;
+    static constexpr unsigned SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    static constexpr unsigned BUCKETS = 64 * SUB_BUCKETS;
+
+    void record(unsigned long long v);
+
+    unsigned long long count() const { return total.load(std::memory_order_relaxed); }
+    unsigned long long sum() const { return valueSum.load(std::memory_order_relaxed); }
+    unsigned long long bucket(unsigned index) const {
+        return buckets[index].load(std::memory_order_relaxed);
+    }
+    // Upper bound of the value range of a bucket, inclusive
+    static unsigned long long bucketUpperBound(unsigned index);
+    static unsigned bucketIndex(unsigned long long v);
+
+    // Value at quantile q (0..1), reported as the upper bound of its bucket
+    unsigned long long percentile(double q) const;
+
+private:
+    std::array<std::atomic<unsigned long long>, BUCKETS> buckets{};
+    std::atomic<unsigned long long> total{0};
+    std::atomic<unsigned long long> valueSum{0};
+};
+
+// Looks up or creates a metric. labels is the Prometheus label list without braces,
+// e.g. product="{GUID}". scale converts histogram units into the exported base unit
+// (1e-6 for microseconds to seconds).
+Counter &MetricCounter(const char *name, const char *help, const std::string &labels = {});
+Gauge &MetricGauge(const char *name, const char *help, const std::string &labels = {});
+Histogram &MetricHistogram(
+        const char *name, const char *help, double scale, const std::string &labels = {});
+
+std::string MetricsSnapshot();
+
+// Writes the snapshot next to path and renames it over path, so a scraper never reads a
+// half-written file.
+bool MetricsWriteFile(const std::filesystem::path &path);
+
+// Rewrites path every interval on a background thread until MetricsStopWriter.
+void MetricsStartWriter(const std::filesystem::path &path, std::chrono::seconds interval);
+void MetricsStopWriter();
+
+// Microseconds between two steady_clock points, for feeding histograms
+inline unsigned long long MetricsMicros(
+        std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+}
+
+#endif // SVCMETRICS_H
@@ -0,0 +1,1014 @@
+#include "SvcMirror.h"
+#include "SvcValidate.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#include <windows.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <stdexcept>
+#include <streambuf>
+
+static constexpr size_t MAX_REQUEST_HEAD = 16 * 1024;
+static constexpr int RECEIVE_TIMEOUT_SECONDS = 30;
+// A client that takes no data for this long is dropped. sendfile() and TransmitFile ignore
+// SO_SNDTIMEO, CachedFile::sendTo enforces it for them.
+static constexpr int SEND_TIMEOUT_SECONDS = 30;
+
+#ifdef _WIN32
+static const MirrorSocket NO_SOCKET = INVALID_SOCKET;
+// 256 KiB per SEND_TIMEOUT_SECONDS is the slowest client that is still served
+static constexpr uint64_t TRANSMIT_CHUNK = 256 * 1024;
+
+static void closeSocket(MirrorSocket fd) {
+    ::closesocket(fd);
+}
+#else
+static const MirrorSocket NO_SOCKET = -1;
+
+static void closeSocket(MirrorSocket fd) {
+    ::close(fd);
+}
+#endif
+
+static bool sendAll(MirrorSocket fd, const char *data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int sent = ::send(fd, data, static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+#else
+        auto sent = ::send(fd, data, size, MSG_NOSIGNAL);
+#endif
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        size -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+static bool sendAll(MirrorSocket fd, const std::string &data) {
+    return sendAll(fd, data.data(), data.size());
+}
+
+// A cache file opened for sending. The handle stays valid when a newer copy is renamed over
+// the file or a failed download is deleted, so requests in flight are never disturbed.
+class MirrorServer::CachedFile {
+public:
+    explicit CachedFile(const std::filesystem::path &path);
+    ~CachedFile();
+    CachedFile(const CachedFile &) = delete;
+    CachedFile &operator=(const CachedFile &) = delete;
+
+    bool valid() const;
+    uint64_t size() const;
+    long long modified() const; // Seconds since 1970
+    // Sends length bytes from offset straight from the page cache where the platform can
+    bool sendTo(MirrorSocket fd, uint64_t offset, uint64_t length) const;
+
+private:
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+#ifdef _WIN32
+MirrorServer::CachedFile::CachedFile(const std::filesystem::path &path) {
+    handle = ::CreateFileW(path.c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+}
+
+MirrorServer::CachedFile::~CachedFile() {
+    if (handle != INVALID_HANDLE_VALUE) {
+        ::CloseHandle(handle);
+    }
+}
+
+bool MirrorServer::CachedFile::valid() const {
+    return handle != INVALID_HANDLE_VALUE;
+}
+
+uint64_t MirrorServer::CachedFile::size() const {
+    LARGE_INTEGER size;
+    return ::GetFileSizeEx(handle, &size) ? static_cast<uint64_t>(size.QuadPart) : 0;
+}
+
+long long MirrorServer::CachedFile::modified() const {
+    FILETIME written;
+    if (! ::GetFileTime(handle, NULL, NULL, &written)) {
+        return 0;
+    }
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = written.dwLowDateTime;
+    ticks.HighPart = written.dwHighDateTime;
+    // 100 ns ticks since 1601
+    return static_cast<long long>((ticks.QuadPart - 116444736000000000ULL) / 10000000);
+}
+
+bool MirrorServer::CachedFile::sendTo(
+        MirrorSocket fd, uint64_t offset, uint64_t length) const {
+    HANDLE event = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (event == NULL) {
+        return false;
+    }
+    bool ok = true;
+    while (ok && length > 0) {
+        // TransmitFile sends from the file pointer. It is overlapped, so a client that stops
+        // reading can be given up on.
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(offset);
+        auto count = static_cast<DWORD>(std::min(length, TRANSMIT_CHUNK));
+        OVERLAPPED overlapped{};
+        overlapped.Offset = position.LowPart;
+        overlapped.OffsetHigh = static_cast<DWORD>(position.HighPart);
+        overlapped.hEvent = event;
+        ::ResetEvent(event);
+        if (! ::SetFilePointerEx(handle, position, NULL, FILE_BEGIN)) {
+            ok = false;
+            break;
+        }
+        ok = ::TransmitFile(fd, handle, count, 0, &overlapped, NULL, 0);
+        if (! ok && ::WSAGetLastError() == WSA_IO_PENDING) {
+            if (::WaitForSingleObject(event, SEND_TIMEOUT_SECONDS * 1000) != WAIT_OBJECT_0) {
+                ::CancelIoEx(reinterpret_cast<HANDLE>(fd), &overlapped);
+            }
+            DWORD transferred = 0;
+            DWORD flags = 0;
+            // Waits for the cancellation too, overlapped must outlive the operation
+            ok = ::WSAGetOverlappedResult(fd, &overlapped, &transferred, TRUE, &flags)
+                    && transferred == count;
+        }
+        offset += count;
+        length -= count;
+    }
+    ::CloseHandle(event);
+    return ok;
+}
+#else
+MirrorServer::CachedFile::CachedFile(const std::filesystem::path &path) {
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+MirrorServer::CachedFile::~CachedFile() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool MirrorServer::CachedFile::valid() const {
+    return fd >= 0;
+}
+
+uint64_t MirrorServer::CachedFile::size() const {
+    struct stat info;
+    return ::fstat(fd, &info) == 0 ? static_cast<uint64_t>(info.st_size) : 0;
+}
+
+long long MirrorServer::CachedFile::modified() const {
+    struct stat info;
+    return ::fstat(fd, &info) == 0 ? static_cast<long long>(info.st_mtime) : 0;
+}
+
+bool MirrorServer::CachedFile::sendTo(
+        MirrorSocket socket, uint64_t offset, uint64_t length) const {
+#ifdef __linux__
+    // sendfile() on a blocking socket does not give up at SO_SNDTIMEO, so the socket is
+    // made non-blocking and every wait for room gets SEND_TIMEOUT_SECONDS
+    int flags = ::fcntl(socket, F_GETFL);
+    if (flags < 0 || ::fcntl(socket, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return false;
+    }
+    auto position = static_cast<off_t>(offset);
+    bool ok = true;
+    while (length > 0) {
+        auto sent = ::sendfile(socket, fd, &position, std::min<uint64_t>(length, 1 << 30));
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd writable{socket, POLLOUT, 0};
+            int ready = ::poll(&writable, 1, SEND_TIMEOUT_SECONDS * 1000);
+            if (ready > 0 || (ready < 0 && errno == EINTR)) {
+                continue;
+            }
+        }
+        if (sent <= 0) {
+            ok = false;
+            break;
+        }
+        length -= static_cast<uint64_t>(sent);
+    }
+    ::fcntl(socket, F_SETFL, flags);
+    return ok;
+#else
+    char buffer[64 * 1024];
+    while (length > 0) {
+        auto got = ::pread(fd, buffer, std::min<uint64_t>(length, sizeof(buffer)),
+                static_cast<off_t>(offset));
+        if (got <= 0 || ! sendAll(socket, buffer, static_cast<size_t>(got))) {
+            return false;
+        }
+        offset += static_cast<uint64_t>(got);
+        length -= static_cast<uint64_t>(got);
+    }
+    return true;
+#endif
+}
+#endif
+
+// An upstream download in progress. Requests that arrive meanwhile open the part file and send
+// what has been written so far instead of starting a download of their own.
+struct MirrorServer::Fill {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::filesystem::path partPath;
+    std::ofstream out; // Written by the fetching thread only
+    unsigned long status = 0; // Of the upstream response, once it has started
+    uint64_t written = 0;
+    bool done = false;
+    bool ok = false;
+};
+
+struct MirrorServer::Entry {
+    std::mutex lock;
+    std::filesystem::path file;
+    bool mutableFile = false; // Manifests, which are revalidated after the TTL
+    bool checkedDisk = false;
+    bool present = false;
+    bool absent = false; // The origin answered 404 at checkedAt
+    std::string etag; // Sent to clients
+    std::string upstreamEtag; // For revalidation, empty if the origin sent none
+    long long modified = 0;
+    std::chrono::steady_clock::time_point checkedAt;
+    std::shared_ptr<Fill> fill;
+    unsigned generation = 0;
+};
+
+struct MirrorServer::Request {
+    bool head = false;
+    std::string path;
+    std::string range;
+    std::string ifRange;
+    std::string ifNoneMatch;
+    std::string ifModifiedSince;
+    std::string headers; // Added to 200 and 206 responses
+};
+
+// Passes the upstream body to the part file and wakes the requests following the fill
+class FillBuffer : public std::streambuf {
+public:
+    FillBuffer(std::ofstream &out, std::mutex &lock, std::condition_variable &changed,
+            unsigned long &status, uint64_t &written, const RequestStats &stats)
+        : out(out)
+        , lock(lock)
+        , changed(changed)
+        , status(status)
+        , written(written)
+        , stats(stats) {}
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        if (! out.write(data, count) || ! out.flush()) {
+            return 0;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            status = stats.status;
+            written += static_cast<uint64_t>(count);
+        }
+        changed.notify_all();
+        return count;
+    }
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+    }
+
+private:
+    std::ofstream &out;
+    std::mutex &lock;
+    std::condition_variable &changed;
+    unsigned long &status;
+    uint64_t &written;
+    const RequestStats &stats;
+};
+
+static std::string httpDate(long long seconds) {
+    auto time = static_cast<std::time_t>(seconds);
+    std::tm parts{};
+#ifdef _WIN32
+    ::gmtime_s(&parts, &time);
+#else
+    ::gmtime_r(&time, &parts);
+#endif
+    char text[64];
+    std::strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return text;
+}
+
+// Seconds since 1970 of an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), -1 if the text is
+// not one. The obsolete formats are not worth supporting for If-Modified-Since.
+static long long parseHttpDate(const std::string &text) {
+    char month[4] = {};
+    int day, year, hour, minute, second;
+    if (std::sscanf(text.c_str(), "%*3s, %d %3s %d %d:%d:%d", &day, month, &year, &hour, &minute,
+                &second) != 6) {
+        return -1;
+    }
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    auto found = std::strstr(months, month);
+    if (std::strlen(month) != 3 || ! found || (found - months) % 3 != 0) {
+        return -1;
+    }
+    int m = static_cast<int>(found - months) / 3 + 1;
+
+    // Days since 1970 of a proleptic Gregorian date, with the year starting in March
+    int y = year - (m <= 2);
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yearOfEra = y - era * 400;
+    int dayOfYear = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    long long days = era * 146097LL + dayOfEra - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+static std::string fileEtag(uint64_t size, long long modified) {
+    char text[64];
+    std::snprintf(text, sizeof(text), "\"%llx-%llx\"", static_cast<unsigned long long>(size),
+            static_cast<unsigned long long>(modified));
+    return text;
+}
+
+enum class RangeResult {
+    Whole, // No Range header, or one this server ignores
+    Partial,
+    Unsatisfiable,
+};
+
+// A single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range. Lists of ranges are
+// ignored, which the standard allows and which no update client sends.
+static RangeResult parseRange(
+        const std::string &value, uint64_t size, uint64_t &first, uint64_t &last) {
+    static const char unit[] = "bytes=";
+    if (value.compare(0, sizeof(unit) - 1, unit) != 0
+            || value.find(',') != std::string::npos) {
+        return RangeResult::Whole;
+    }
+    auto spec = value.substr(sizeof(unit) - 1);
+    auto dash = spec.find('-');
+    if (dash == std::string::npos
+            || spec.find_first_not_of("0123456789-") != std::string::npos) {
+        return RangeResult::Whole;
+    }
+    auto start = spec.substr(0, dash);
+    auto end = spec.substr(dash + 1);
+    if (start.empty()) {
+        if (end.empty()) {
+            return RangeResult::Whole;
+        }
+        auto suffix = std::strtoull(end.c_str(), nullptr, 10);
+        if (suffix == 0 || size == 0) {
+            return RangeResult::Unsatisfiable;
+        }
+        first = size - std::min<uint64_t>(suffix, size);
+        last = size - 1;
+        return RangeResult::Partial;
+    }
+    first = std::strtoull(start.c_str(), nullptr, 10);
+    last = end.empty() ? UINT64_MAX : std::strtoull(end.c_str(), nullptr, 10);
+    if (last < first) {
+        return RangeResult::Whole;
+    }
+    if (first >= size) {
+        return RangeResult::Unsatisfiable;
+    }
+    last = std::min(last, size - 1);
+    return RangeResult::Partial;
+}
+
+static bool isCompressible(const std::string &path) {
+    auto endsWith = [&](const char *suffix) {
+        auto size = std::strlen(suffix);
+        return path.size() >= size && path.compare(path.size() - size, size, suffix) == 0;
+    };
+    return endsWith(".json") || endsWith(".idx");
+}
+
+// Whether an Accept-Encoding value lists gzip without ruling it out with q=0
+static bool acceptsGzip(std::string_view value) {
+    while (! value.empty()) {
+        auto end = std::min(value.find(','), value.size());
+        auto coding = value.substr(0, end);
+        value.remove_prefix(std::min(end + 1, value.size()));
+        while (! coding.empty() && coding.front() == ' ') {
+            coding.remove_prefix(1);
+        }
+        auto params = coding.find(';');
+        auto name = coding.substr(0, params);
+        while (! name.empty() && name.back() == ' ') {
+            name.remove_suffix(1);
+        }
+        if (name != "gzip") {
+            continue;
+        }
+        if (params == std::string_view::npos) {
+            return true;
+        }
+        auto q = coding.find("q=", params);
+        return q == std::string_view::npos
+                || std::strtod(std::string(coding.substr(q + 2)).c_str(), nullptr) > 0;
+    }
+    return false;
+}
+
+static const char *reasonPhrase(int status) {
+    switch (status) {
+    case 200:
+        return "OK";
+    case 206:
+        return "Partial Content";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 416:
+        return "Range Not Satisfiable";
+    default:
+        return "Bad Gateway";
+    }
+}
+
+static bool sendStatus(MirrorSocket fd, int status, const std::string &headers = {}) {
+    return sendAll(fd, "HTTP/1.1 " + std::to_string(status) + " " + reasonPhrase(status)
+                    + "\r\nContent-Length: 0\r\n" + headers + "Connection: close\r\n\r\n");
+}
+
+MirrorServer::MirrorServer(Transport &upstream, MirrorOptions options)
+    : upstream(upstream)
+    , options(std::move(options))
+    , listenFd(NO_SOCKET) {
+    auto base = this->options.upstream;
+    if (base.empty() || base.back() != '/') {
+        base += '/';
+    }
+    auto parts = SplitUrl(base);
+    if (parts.host.empty() || parts.path.find('?') != std::string_view::npos) {
+        throw std::runtime_error("Upstream URL");
+    }
+    upstreamDomain = std::string(parts.host);
+    upstreamPrefix = std::string(parts.path.substr(0, parts.path.size() - 1));
+
+    std::error_code ec;
+    std::filesystem::create_directories(this->options.cacheDir, ec);
+    if (ec) {
+        throw std::runtime_error("Cache directory");
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (::WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        throw std::runtime_error("WSAStartup");
+    }
+#else
+    // sendfile() has no MSG_NOSIGNAL, a client that hangs up must not kill the process
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(this->options.port);
+    listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd == NO_SOCKET
+            || ::inet_pton(AF_INET, this->options.listenAddress.c_str(), &addr.sin_addr) != 1) {
+        if (listenFd != NO_SOCKET) {
+            closeSocket(listenFd);
+        }
+#ifdef _WIN32
+        ::WSACleanup();
+#endif
+        throw std::runtime_error("Listen address");
+    }
+#ifndef _WIN32
+    int one = 1;
+    ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#endif
+    if (::bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::listen(listenFd, SOMAXCONN) != 0) {
+        closeSocket(listenFd);
+#ifdef _WIN32
+        ::WSACleanup();
+#endif
+        throw std::runtime_error("Binding " + this->options.listenAddress + ":"
+                + std::to_string(this->options.port));
+    }
+
+    socklen_t len = sizeof(addr);
+    ::getsockname(listenFd, reinterpret_cast<sockaddr *>(&addr), &len);
+    listenPort = ntohs(addr.sin_port);
+
+    acceptThread = std::thread(&MirrorServer::acceptLoop, this);
+}
+
+MirrorServer::~MirrorServer() {
+    stopping.store(true);
+#ifdef _WIN32
+    // Closing the socket is what wakes accept() on Windows
+    closeSocket(listenFd);
+    acceptThread.join();
+#else
+    ::shutdown(listenFd, SHUT_RDWR);
+    acceptThread.join();
+    closeSocket(listenFd);
+#endif
+    // Connections and upstream downloads finish on their own. The receive timeout bounds a
+    // client that stops sending its request, the send timeout one that stops reading.
+    while (activeThreads.load() != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+#ifdef _WIN32
+    ::WSACleanup();
+#endif
+}
+
+MirrorStats MirrorServer::stats() const {
+    MirrorStats stats;
+    stats.requests = requestCount.load();
+    stats.hits = hitCount.load();
+    stats.misses = missCount.load();
+    stats.coalesced = coalescedCount.load();
+    stats.revalidated = revalidatedCount.load();
+    stats.notModified = notModifiedCount.load();
+    stats.upstreamFailures = failureCount.load();
+    stats.bytesSent = sentBytes.load();
+    stats.bytesFetched = fetchedBytes.load();
+    return stats;
+}
+
+void MirrorServer::acceptLoop() {
+    while (! stopping.load()) {
+        auto fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd == NO_SOCKET) {
+            if (stopping.load()) {
+                return;
+            }
+            continue;
+        }
+        ++activeThreads;
+        std::thread([this, fd] {
+            handle(fd);
+            closeSocket(fd);
+            --activeThreads;
+        }).detach();
+    }
+}
+
+std::shared_ptr<MirrorServer::Entry> MirrorServer::entryFor(const std::string &path) {
+    std::lock_guard<std::mutex> lock(entriesLock);
+    auto &entry = entries[path];
+    if (! entry) {
+        entry = std::make_shared<Entry>();
+        entry->file = options.cacheDir / std::filesystem::path(path.substr(1)).relative_path();
+        entry->mutableFile = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    }
+    return entry;
+}
+
+void MirrorServer::handle(MirrorSocket fd) {
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&one), sizeof(one));
+#ifdef _WIN32
+    DWORD timeout = RECEIVE_TIMEOUT_SECONDS * 1000;
+#else
+    timeval timeout{RECEIVE_TIMEOUT_SECONDS, 0};
+#endif
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout),
+            sizeof(timeout));
+#ifdef _WIN32
+    DWORD sendTimeout = SEND_TIMEOUT_SECONDS * 1000;
+#else
+    timeval sendTimeout{SEND_TIMEOUT_SECONDS, 0};
+#endif
+    // send() gives up after it; CachedFile::sendTo bounds sendfile() and TransmitFile itself
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&sendTimeout),
+            sizeof(sendTimeout));
+
+    std::string head;
+    char buffer[4096];
+    while (head.find("\r\n\r\n") == std::string::npos) {
+        auto got = ::recv(fd, buffer, static_cast<int>(sizeof(buffer)), 0);
+        if (got <= 0 || head.size() > MAX_REQUEST_HEAD) {
+            return;
+        }
+        head.append(buffer, static_cast<size_t>(got));
+    }
+    head.resize(head.find("\r\n\r\n") + 2);
+    ++requestCount;
+
+    // GET /path HTTP/1.1
+    auto methodEnd = head.find(' ');
+    auto targetEnd = head.find(' ', methodEnd + 1);
+    if (methodEnd == std::string::npos || targetEnd == std::string::npos) {
+        sendStatus(fd, 400);
+        return;
+    }
+    auto method = head.substr(0, methodEnd);
+    Request request;
+    request.head = method == "HEAD";
+    request.path = head.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    if (method != "GET" && ! request.head) {
+        sendStatus(fd, 405, "Allow: GET, HEAD\r\n");
+        return;
+    }
+    // Update URLs never carry a query, and forwarding one would give every variant its own
+    // cache entry
+    if (request.path.empty() || request.path[0] != '/'
+            || request.path.find('?') != std::string::npos) {
+        sendStatus(fd, 400);
+        return;
+    }
+    for (size_t start = 1; start <= request.path.size();) {
+        auto end = std::min(request.path.find('/', start), request.path.size());
+        if (! IsSafeFileName(std::string_view(request.path).substr(start, end - start))) {
+            sendStatus(fd, 404);
+            return;
+        }
+        start = end + 1;
+    }
+    request.range = std::string(httpHeaderValue(head, "Range"));
+    request.ifRange = std::string(httpHeaderValue(head, "If-Range"));
+    request.ifNoneMatch = std::string(httpHeaderValue(head, "If-None-Match"));
+    request.ifModifiedSince = std::string(httpHeaderValue(head, "If-Modified-Since"));
+
+    // Manifests and chunk indexes published with a .gz next to them go out compressed to
+    // clients that accept it. A range refers to the bytes of one encoding, so a request with
+    // one always gets the plain file.
+    if (isCompressible(request.path)) {
+        request.headers = "Vary: Accept-Encoding\r\n";
+        if (request.range.empty() && acceptsGzip(httpHeaderValue(head, "Accept-Encoding"))) {
+            Request variant = request;
+            variant.path += ".gz";
+            variant.headers += "Content-Encoding: gzip\r\n";
+            if (serveCached(fd, variant, true)) {
+                return;
+            }
+        }
+    }
+    serveCached(fd, request, false);
+}
+
+bool MirrorServer::serveCached(MirrorSocket fd, const Request &request, bool optional) {
+    auto entry = entryFor(request.path);
+    std::shared_ptr<Fill> fill;
+    std::unique_ptr<CachedFile> part;
+    bool waitForFill = false;
+    bool fillFailed = false;
+    {
+        std::lock_guard<std::mutex> lock(entry->lock);
+        if (! entry->checkedDisk) {
+            // A copy left by an earlier run. checkedAt stays unset, so a manifest is
+            // revalidated before it is served.
+            CachedFile existing(entry->file);
+            if (existing.valid()) {
+                entry->present = true;
+                entry->modified = existing.modified();
+                entry->etag = fileEtag(existing.size(), entry->modified);
+            }
+            entry->checkedDisk = true;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        bool stale = entry->present && entry->mutableFile
+                && (entry->checkedAt == std::chrono::steady_clock::time_point()
+                        || now - entry->checkedAt >= options.manifestTtl);
+        if (entry->fill) {
+            ++coalescedCount;
+        }
+        else if (entry->absent && now - entry->checkedAt < options.manifestTtl) {
+            // The origin said 404 a moment ago, do not ask again for every client
+        }
+        else if (! entry->present || stale) {
+            std::error_code ec;
+            std::filesystem::create_directories(entry->file.parent_path(), ec);
+            auto started = std::make_shared<Fill>();
+            started->partPath = entry->file;
+            started->partPath += ".part" + std::to_string(++entry->generation);
+            started->out.open(started->partPath, std::ios::trunc | std::ios::binary);
+            if (started->out.is_open()) {
+                entry->fill = started;
+                ++missCount;
+                ++activeThreads;
+                std::thread(&MirrorServer::fetch, this, request.path, entry, started,
+                        entry->present ? entry->upstreamEtag : std::string())
+                        .detach();
+            }
+            else {
+                fillFailed = true;
+            }
+        }
+        else {
+            ++hitCount;
+        }
+
+        fill = entry->fill;
+        // Whether there is a variant to send is only known once its fill is done
+        waitForFill = fill && (entry->present || optional);
+        if (fill && ! waitForFill) {
+            // Opened before the fill can rename or delete the part file
+            part = std::make_unique<CachedFile>(fill->partPath);
+        }
+    }
+
+    if (fillFailed) {
+        ++failureCount;
+        sendStatus(fd, 502);
+        return true;
+    }
+    if (waitForFill) {
+        // A manifest may be replaced, wait for the answer rather than send the old one
+        std::unique_lock<std::mutex> lock(fill->lock);
+        fill->changed.wait(lock, [&] { return fill->done; });
+    }
+    else if (fill) {
+        serveFill(fd, request, *entry, *fill, *part);
+        return true;
+    }
+
+    bool present;
+    bool absent;
+    {
+        std::lock_guard<std::mutex> lock(entry->lock);
+        present = entry->present;
+        absent = entry->absent;
+    }
+    if (! present) {
+        if (optional) {
+            return false;
+        }
+        sendStatus(fd, absent ? 404 : 502);
+        return true;
+    }
+    serveFile(fd, request, *entry);
+    return true;
+}
+
+void MirrorServer::fetch(std::string path, std::shared_ptr<Entry> entry,
+        std::shared_ptr<Fill> fill, std::string ifNoneMatch) {
+    HttpRequest request;
+    request.domain = upstreamDomain;
+    request.path = upstreamPrefix + path;
+    request.ifNoneMatch = std::move(ifNoneMatch);
+    RequestStats stats;
+    FillBuffer buffer(fill->out, fill->lock, fill->changed, fill->status, fill->written, stats);
+    std::ostream sink(&buffer);
+    bool received = upstream.get(request, sink, stats);
+    fill->out.close();
+    fetchedBytes += stats.bytes;
+    bool ok = received && stats.status == 200 && sink.good() && ! fill->out.fail();
+
+    {
+        std::lock_guard<std::mutex> lock(entry->lock);
+        auto now = std::chrono::steady_clock::now();
+        std::error_code ec;
+        if (ok) {
+            std::filesystem::rename(fill->partPath, entry->file, ec);
+            ok = ! ec;
+        }
+        if (ok) {
+            CachedFile stored(entry->file);
+            entry->present = true;
+            entry->modified = stored.modified();
+            entry->upstreamEtag = stats.etag;
+            entry->etag = stats.etag.empty() ? fileEtag(stored.size(), entry->modified)
+                                             : stats.etag;
+            entry->absent = false;
+            entry->checkedAt = now;
+        }
+        else if (received && stats.status == 304 && entry->present) {
+            ++revalidatedCount;
+            entry->checkedAt = now;
+        }
+        else if (received && stats.status == 404 && ! entry->present) {
+            // Not an upstream failure, most .gz variants asked for are never published
+            entry->absent = true;
+            entry->checkedAt = now;
+        }
+        else {
+            ++failureCount;
+            SvcReportInfo("Mirror could not fetch " + path + " (HTTP "
+                    + std::to_string(stats.status) + ")");
+            // The copy on disk is served until the TTL runs out again, instead of every
+            // request waiting for an origin that is down
+            if (entry->present) {
+                entry->checkedAt = now;
+            }
+        }
+        if (! ok) {
+            std::filesystem::remove(fill->partPath, ec);
+        }
+        entry->fill.reset();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(fill->lock);
+        fill->status = stats.status;
+        fill->ok = ok;
+        fill->done = true;
+    }
+    fill->changed.notify_all();
+    --activeThreads;
+}
+
+void MirrorServer::serveFile(MirrorSocket fd, const Request &request, Entry &entry) {
+    CachedFile file(entry.file);
+    std::string etag;
+    long long modified;
+    {
+        std::lock_guard<std::mutex> lock(entry.lock);
+        if (! file.valid()) {
+            // Deleted behind our back, the next request downloads it again
+            entry.present = false;
+            sendStatus(fd, 502);
+            return;
+        }
+        etag = entry.etag;
+        modified = entry.modified;
+    }
+
+    auto validators = "ETag: " + etag + "\r\nLast-Modified: " + httpDate(modified) + "\r\n";
+    bool notModified = ! request.ifNoneMatch.empty()
+            ? request.ifNoneMatch == "*" || request.ifNoneMatch.find(etag) != std::string::npos
+            : ! request.ifModifiedSince.empty()
+                    && modified <= parseHttpDate(request.ifModifiedSince);
+    if (notModified) {
+        ++notModifiedCount;
+        sendStatus(fd, 304, validators);
+        return;
+    }
+
+    // A range continues a copy the client got before. If-Range names that copy; when it is
+    // not this one, the client gets all of this one. Only a strong ETag or the exact date
+    // matches.
+    auto range = request.range;
+    if (! request.ifRange.empty() && request.ifRange != etag
+            && request.ifRange != httpDate(modified)) {
+        range.clear();
+    }
+
+    auto size = file.size();
+    uint64_t first = 0;
+    uint64_t last = size - 1;
+    int status = 200;
+    std::string headers = validators + "Accept-Ranges: bytes\r\n" + request.headers;
+    switch (parseRange(range, size, first, last)) {
+    case RangeResult::Unsatisfiable:
+        sendStatus(fd, 416, "Content-Range: bytes */" + std::to_string(size) + "\r\n");
+        return;
+    case RangeResult::Partial:
+        status = 206;
+        headers += "Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last)
+                + "/" + std::to_string(size) + "\r\n";
+        break;
+    case RangeResult::Whole:
+        break;
+    }
+    uint64_t length = size == 0 ? 0 : last - first + 1;
+
+    auto response = "HTTP/1.1 " + std::to_string(status) + " " + reasonPhrase(status)
+            + "\r\nContent-Length: " + std::to_string(length) + "\r\n" + headers
+            + "Connection: close\r\n\r\n";
+    if (sendAll(fd, response) && ! request.head && length > 0
+            && file.sendTo(fd, first, length)) {
+        sentBytes += length;
+    }
+}
+
+void MirrorServer::serveFill(
+        MirrorSocket fd, const Request &request, Entry &entry, Fill &fill, CachedFile &part) {
+    std::unique_lock<std::mutex> lock(fill.lock);
+    fill.changed.wait(lock, [&] { return fill.status != 0 || fill.done; });
+
+    // Ranges other than "first-last" need the size, which is known once the fill is done.
+    // So does anything that is not a 200 from upstream, and an If-Range, which is checked
+    // against the ETag the finished file gets.
+    uint64_t first = 0;
+    uint64_t last = 0;
+    bool explicitRange = ! request.range.empty() && request.ifRange.empty()
+            && parseRange(request.range, UINT64_MAX, first, last) == RangeResult::Partial
+            && last != UINT64_MAX - 1;
+    bool streamable = request.range.empty() || explicitRange;
+    if (fill.status != 200 || request.head || ! streamable) {
+        fill.changed.wait(lock, [&] { return fill.done; });
+        bool ok = fill.ok;
+        auto upstreamStatus = fill.status;
+        lock.unlock();
+        if (ok) {
+            serveFile(fd, request, entry);
+        }
+        else {
+            sendStatus(fd, upstreamStatus == 404 ? 404 : 502);
+        }
+        return;
+    }
+
+    if (explicitRange) {
+        fill.changed.wait(lock, [&] { return fill.written > last || fill.done; });
+        if (fill.written <= first) {
+            bool ok = fill.ok;
+            lock.unlock();
+            // Past the end of a complete file, or the download failed
+            if (ok) {
+                serveFile(fd, request, entry);
+            }
+            else {
+                sendStatus(fd, 502);
+            }
+            return;
+        }
+        last = std::min(last, fill.written - 1);
+        // The total is not known yet, which Content-Range allows to say with "*"
+        auto total = fill.done ? std::to_string(fill.written) : std::string("*");
+        lock.unlock();
+        uint64_t length = last - first + 1;
+        auto response = "HTTP/1.1 206 Partial Content\r\nContent-Length: "
+                + std::to_string(length) + "\r\nContent-Range: bytes " + std::to_string(first)
+                + "-" + std::to_string(last) + "/" + total + "\r\n" + request.headers
+                + "Connection: close\r\n\r\n";
+        if (sendAll(fd, response) && part.sendTo(fd, first, length)) {
+            sentBytes += length;
+        }
+        return;
+    }
+
+    // The length is not known until the origin has sent everything, so the body goes out
+    // chunked as it arrives. A failed fill closes the connection without the last chunk,
+    // which the client sees as a truncated response.
+    lock.unlock();
+    if (! sendAll(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n" + request.headers
+                        + "Connection: close\r\n\r\n")) {
+        return;
+    }
+    uint64_t sent = 0;
+    for (;;) {
+        uint64_t available;
+        bool done;
+        bool ok;
+        {
+            std::unique_lock<std::mutex> wait(fill.lock);
+            fill.changed.wait(wait, [&] { return fill.written > sent || fill.done; });
+            available = fill.written - sent;
+            done = fill.done;
+            ok = fill.ok;
+        }
+        if (available > 0) {
+            char size[32];
+            std::snprintf(size, sizeof(size), "%llx\r\n",
+                    static_cast<unsigned long long>(available));
+            if (! sendAll(fd, size, std::strlen(size)) || ! part.sendTo(fd, sent, available)
+                    || ! sendAll(fd, "\r\n", 2)) {
+                return;
+            }
+            sent += available;
+            sentBytes += available;
+        }
+        else if (done) {
+            if (ok) {
+                sendAll(fd, "0\r\n\r\n", 5);
+            }
+            return;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef SVCMIRROR_H
+#define SVCMIRROR_H
+
+#include "SvcBackends.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// updsvc-mirror: a read-through cache of one origin for branch offices, where every
+// workstation would otherwise download the same installer over the WAN. Clients list it in
+// MIRRORS and ask it for the origin's paths.
+//
+// Packages and chunk indexes get new paths with every release, so a cached copy of them
+// never expires. Manifests (*.json) are revalidated with If-None-Match once they are older
+// than the TTL, and served stale while the origin cannot be reached. Concurrent misses for a
+// path share one upstream download, which the waiting clients receive while it is written.
+
+#ifdef _WIN32
+using MirrorSocket = std::uintptr_t; // SOCKET
+#else
+using MirrorSocket = int;
+#endif
+
+struct MirrorOptions {
+    std::string upstream; // http://origin[:port][/prefix]
+    std::filesystem::path cacheDir;
+    std::string listenAddress = "0.0.0.0";
+    unsigned short port = 8080; // 0 picks a free port
+    std::chrono::seconds manifestTtl{60};
+};
+
+struct MirrorStats {
+    unsigned long long requests = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0; // Upstream downloads started
+    unsigned long long coalesced = 0; // Served from a download another request started
+    unsigned long long revalidated = 0; // Manifests the origin answered with 304
+    unsigned long long notModified = 0; // 304 sent to clients
+    unsigned long long upstreamFailures = 0;
+    unsigned long long bytesSent = 0;
+    unsigned long long bytesFetched = 0;
+};
+
+class MirrorServer {
+public:
+    // Starts serving, throws std::runtime_error if the upstream URL is not valid or the
+    // address cannot be bound
+    MirrorServer(Transport &upstream, MirrorOptions options);
+    ~MirrorServer();
+    MirrorServer(const MirrorServer &) = delete;
+    MirrorServer &operator=(const MirrorServer &) = delete;
+
+    unsigned short port() const { return listenPort; }
+    MirrorStats stats() const;
+
+private:
+    class CachedFile;
+    struct Fill;
+    struct Entry;
+    struct Request;
+
+    void acceptLoop();
+    void handle(MirrorSocket fd);
+    std::shared_ptr<Entry> entryFor(const std::string &path);
+    // Answers from the cache entry of request.path, filling it first if needed. With
+    // optional set nothing is sent, and false returned, if the origin does not have the file.
+    bool serveCached(MirrorSocket fd, const Request &request, bool optional);
+    void fetch(std::string path, std::shared_ptr<Entry> entry, std::shared_ptr<Fill> fill,
+            std::string ifNoneMatch);
+    void serveFile(MirrorSocket fd, const Request &request, Entry &entry);
+    void serveFill(MirrorSocket fd, const Request &request, Entry &entry, Fill &fill,
+            CachedFile &part);
+
+    Transport &upstream;
+    MirrorOptions options;
+    std::string upstreamDomain;
+    std::string upstreamPrefix;
+
+    MirrorSocket listenFd;
+    unsigned short listenPort = 0;
+    std::thread acceptThread;
+    std::mutex entriesLock;
+    std::map<std::string, std::shared_ptr<Entry>> entries;
+    std::atomic<int> activeThreads{0};
+    std::atomic<bool> stopping{false};
+
+    std::atomic<unsigned long long> requestCount{0};
+    std::atomic<unsigned long long> hitCount{0};
+    std::atomic<unsigned long long> missCount{0};
+    std::atomic<unsigned long long> coalescedCount{0};
+    std::atomic<unsigned long long> revalidatedCount{0};
+    std::atomic<unsigned long long> notModifiedCount{0};
+    std::atomic<unsigned long long> failureCount{0};
+    std::atomic<unsigned long long> sentBytes{0};
+    std::atomic<unsigned long long> fetchedBytes{0};
+};
+
+#endif // SVCMIRROR_H
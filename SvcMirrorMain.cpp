@@ -0,0 +1,168 @@
+#include "SvcMirror.h"
+#include "SvcValidate.h"
+
+#ifdef _WIN32
+#include "SvcWin32.h"
+#else
+#include "SvcPosix.h"
+#endif
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// updsvc-mirror runs in the foreground; a branch office wraps it in whatever keeps its other
+// services running. Upstream failures are logged to stderr, --verbose adds the counters
+// whenever requests come in.
+
+static bool gVerbose = false;
+static volatile std::sig_atomic_t gStop = 0;
+
+void SvcReportEvent(std::string_view szFunction) {
+    std::fprintf(stderr, "ERROR:\t%.*s failed\n", static_cast<int>(szFunction.size()),
+            szFunction.data());
+}
+
+void SvcReportInfo(std::string_view szFunction) {
+    std::fprintf(stderr, "%.*s\n", static_cast<int>(szFunction.size()), szFunction.data());
+}
+
+static void onSignal(int) {
+    gStop = 1;
+}
+
+static void DisplayUsage() {
+    printf("Description:\n");
+    printf("\tCaching HTTP mirror of the update origin for a branch office. Clients list it\n");
+    printf("\tin the MIRRORS setting and fall back to the origin when it is down.\n\n");
+    printf("Usage:\n");
+    printf("\tupdsvc-mirror [options] [upstream_url]\n\n");
+    printf("\t[upstream_url]\n");
+    printf("\t  http://origin[:port][/prefix], requests for /path are fetched from\n");
+    printf("\t  <upstream_url>/path\n\n");
+    printf("\t[options]\n");
+    printf("\t  --listen <address>  IPv4 address to listen on (0.0.0.0)\n");
+    printf("\t  --port <n>          port to listen on (8080)\n");
+    printf("\t  --cache <dir>       cache directory (<temp>/updsvc-mirror)\n");
+    printf("\t  --ttl <seconds>     how long a manifest is served without asking the\n");
+    printf("\t                      origin whether it changed (60)\n");
+    printf("\t  --verbose           print the counters while serving\n");
+}
+
+static bool parseOptions(int argc, char *argv[], MirrorOptions &options) {
+    std::string upstream;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--listen" && hasValue) {
+            options.listenAddress = argv[++i];
+        }
+        else if (arg == "--port" && hasValue) {
+            auto port = std::strtoul(argv[++i], nullptr, 10);
+            if (port > 65535) {
+                printf("ERROR:\tInvalid port (%s)\n\n", argv[i]);
+                return false;
+            }
+            options.port = static_cast<unsigned short>(port);
+        }
+        else if (arg == "--cache" && hasValue) {
+            options.cacheDir = std::filesystem::u8path(argv[++i]);
+        }
+        else if (arg == "--ttl" && hasValue) {
+            options.manifestTtl = std::chrono::seconds(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--verbose") {
+            gVerbose = true;
+        }
+        else if (arg.rfind("--", 0) == 0) {
+            printf("ERROR:\tUnknown option (%s)\n\n", arg.c_str());
+            return false;
+        }
+        else if (upstream.empty()) {
+            upstream = arg;
+        }
+        else {
+            printf("ERROR:\tIncorrect number of arguments\n\n");
+            return false;
+        }
+    }
+    if (upstream.empty()) {
+        printf("ERROR:\tIncorrect number of arguments\n\n");
+        return false;
+    }
+    if (SplitUrl(upstream + "/").host.empty()) {
+        printf("ERROR:\tNot an http(s) URL (%s)\n\n", upstream.c_str());
+        return false;
+    }
+    options.upstream = upstream;
+    if (options.cacheDir.empty()) {
+        options.cacheDir = std::filesystem::temp_directory_path() / "updsvc-mirror";
+    }
+    return true;
+}
+
+//
+// Purpose:
+//   Entry point function. Serves the cache until Ctrl+C or SIGTERM, then prints what it did.
+//
+// Parameters:
+//   Command-line syntax is in DisplayUsage()
+//
+// Return value:
+//   0 after a clean stop, 1 if the mirror cannot start
+//
+int main(int argc, char *argv[]) {
+    MirrorOptions options;
+    if (! parseOptions(argc, argv, options)) {
+        DisplayUsage();
+        return 1;
+    }
+
+#ifdef _WIN32
+    WinHttpTransport transport;
+#else
+    SocketTransport transport;
+#endif
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    MirrorStats stats;
+    try {
+        MirrorServer server(transport, options);
+        printf("Mirroring %s on %s:%u, cache in %s\n", options.upstream.c_str(),
+                options.listenAddress.c_str(), server.port(),
+                options.cacheDir.u8string().c_str());
+        std::fflush(stdout);
+
+        MirrorStats last;
+        while (! gStop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            stats = server.stats();
+            if (gVerbose && stats.requests != last.requests) {
+                printf("%llu requests, %llu hits, %llu misses, %llu coalesced, %llu failures\n",
+                        stats.requests, stats.hits, stats.misses, stats.coalesced,
+                        stats.upstreamFailures);
+                std::fflush(stdout);
+            }
+            last = stats;
+        }
+    }
+    catch (std::exception &e) {
+        printf("ERROR:\t%s\n", e.what());
+        return 1;
+    }
+
+    printf("\nrequests       %llu\n", stats.requests);
+    printf("hits           %llu\n", stats.hits);
+    printf("misses         %llu\n", stats.misses);
+    printf("coalesced      %llu\n", stats.coalesced);
+    printf("revalidated    %llu\n", stats.revalidated);
+    printf("not modified   %llu\n", stats.notModified);
+    printf("upstream fails %llu\n", stats.upstreamFailures);
+    printf("sent           %.1f MiB\n", stats.bytesSent / 1048576.0);
+    printf("fetched        %.1f MiB\n", stats.bytesFetched / 1048576.0);
+    return 0;
+}
@@ -0,0 +1,519 @@
+#include "SvcChunk.h"
+#include "SvcValidate.h"
+#include "json.hpp"
+
+#ifdef UPDSVC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Builds the manifest the service downloads from a release directory laid out as
+//
+//   <release>/<version>/<package>                  full package of <version>
+//   <release>/<version>/<from version>/<package>   patch from <from version> to <version>
+//   <release>/<version>/channel                    channel of <version>, optional
+//
+// and writes the chunk index of every full package next to it as <package>.idx, for the
+// delta downloads in SvcDelta.h. The directory is then published as is under the base URL.
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+// Files are read in segments of this size, and at most this many segments of one file wait
+// for their chunks to be hashed
+static constexpr size_t SEGMENT_BYTES = 8 << 20;
+static constexpr size_t SEGMENTS_IN_FLIGHT = 3;
+static constexpr size_t CHUNKS_PER_TASK = 16;
+
+struct Options {
+    fs::path release;
+    std::string baseUrl;
+    std::string channel = "Stable";
+    fs::path out;
+    bool gzip = false;
+    unsigned threads = 0;
+};
+
+struct Package {
+    std::string version;
+    std::string from; // "null" for a full package, as in the manifest
+    fs::path path;
+    std::string urlPath; // Below the base URL
+    std::string channel;
+    ChunkIndex index;
+    bool indexed = false;
+};
+
+// Fixed set of threads for the hashing; tasks never wait on each other
+class WorkPool {
+public:
+    explicit WorkPool(unsigned threads) {
+        for (unsigned i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    ~WorkPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    std::future<void> submit(std::function<void()> work) {
+        std::packaged_task<void()> task(std::move(work));
+        auto done = task.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+        return done;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::packaged_task<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || ! tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::packaged_task<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+};
+
+struct Segment {
+    std::unique_ptr<unsigned char[]> data;
+    std::vector<Chunk> chunks;
+    std::vector<std::future<void>> hashed;
+};
+
+//
+// Purpose:
+//   Computes the size and SHA-256 of a file and, when chunked is set, its chunk index. The
+//   calling thread reads the file and finds the cut points, which depend on each other; the
+//   pool hashes the chunks and the whole file meanwhile. The cut points are the ones
+//   ChunkFile() finds.
+//
+// Return value:
+//   False if the file cannot be read
+//
+static bool indexFile(const fs::path &path, bool chunked, const ChunkParams &params,
+        WorkPool &pool, ChunkIndex &index) {
+    std::ifstream in(path, std::ios::binary);
+    if (! in.is_open()) {
+        return false;
+    }
+
+    index = ChunkIndex{};
+    index.params = params;
+
+    Sha256 whole;
+    std::future<void> wholeHashed;
+    std::deque<std::unique_ptr<Segment>> pending;
+    // Unless the file ends, the last chunk of a segment is only cut once the next one is read
+    std::vector<unsigned char> carry;
+    uint64_t offset = 0;
+
+    auto retire = [&](Segment &segment) {
+        for (auto &hashed : segment.hashed) {
+            hashed.wait();
+        }
+        index.chunks.insert(index.chunks.end(), segment.chunks.begin(), segment.chunks.end());
+    };
+
+    bool eof = false;
+    while (! eof) {
+        auto segment = std::make_unique<Segment>();
+        segment->data.reset(new unsigned char[carry.size() + SEGMENT_BYTES]);
+        unsigned char *data = segment->data.get();
+        std::copy(carry.begin(), carry.end(), data);
+        in.read(reinterpret_cast<char *>(data + carry.size()), SEGMENT_BYTES);
+        auto got = static_cast<size_t>(in.gcount());
+        if (in.eof()) {
+            eof = true;
+        }
+        else if (! in) {
+            if (wholeHashed.valid()) {
+                wholeHashed.wait();
+            }
+            for (auto &waiting : pending) {
+                retire(*waiting);
+            }
+            return false;
+        }
+
+        // The file hash takes the segments in order, so the previous one must be done
+        if (wholeHashed.valid()) {
+            wholeHashed.wait();
+        }
+        const unsigned char *fresh = data + carry.size();
+        wholeHashed = pool.submit([&whole, fresh, got] { whole.update(fresh, got); });
+        index.size += got;
+
+        size_t size = carry.size() + got;
+        size_t begin = 0;
+        uint64_t base = offset; // File offset of data[0]
+        while (chunked && begin < size && (eof || size - begin >= params.maxSize)) {
+            size_t n = NextChunkSize(data + begin, size - begin, params);
+            segment->chunks.push_back({offset, static_cast<uint32_t>(n), {}});
+            begin += n;
+            offset += n;
+        }
+        carry.assign(data + (chunked ? begin : size), data + size);
+
+        for (size_t first = 0; first < segment->chunks.size(); first += CHUNKS_PER_TASK) {
+            size_t last = std::min(first + CHUNKS_PER_TASK, segment->chunks.size());
+            Chunk *chunks = segment->chunks.data();
+            segment->hashed.push_back(pool.submit([chunks, first, last, data, base] {
+                for (size_t i = first; i < last; ++i) {
+                    auto *start = data + (chunks[i].offset - base);
+                    chunks[i].hash = Sha256::digest(start, chunks[i].size);
+                }
+            }));
+        }
+
+        pending.push_back(std::move(segment));
+        if (pending.size() > SEGMENTS_IN_FLIGHT) {
+            retire(*pending.front());
+            pending.pop_front();
+        }
+    }
+
+    wholeHashed.wait();
+    for (auto &waiting : pending) {
+        retire(*waiting);
+    }
+    index.hash = whole.finish();
+    return true;
+}
+
+static bool writeFile(const fs::path &path, const std::string &text) {
+    std::ofstream out(path, std::ios::trunc | std::ios::binary);
+    out << text;
+    out.close();
+    return ! out.fail();
+}
+
+#ifdef UPDSVC_HAVE_ZLIB
+// Precompressed copy for servers that send it with Content-Encoding: gzip
+static bool writeGzip(const fs::path &path, const std::string &text) {
+    z_stream zs{};
+    // 16 added to the window bits asks for a gzip header instead of the zlib one
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY)
+            != Z_OK) {
+        return false;
+    }
+    std::string out(deflateBound(&zs, static_cast<uLong>(text.size())), '\0');
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+    zs.avail_in = static_cast<uInt>(text.size());
+    zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END && writeFile(path, out);
+}
+#endif
+
+static void DisplayUsage() {
+    printf("Description:\n");
+    printf("\tCommand-line tool that builds the update manifest and chunk indexes of a\n");
+    printf("\trelease directory.\n\n");
+    printf("Usage:\n");
+    printf("\tupdsvc-mkindex [options] [release_dir] [base_url]\n\n");
+    printf("\t[release_dir]\n");
+    printf("\t  <version>/<package>                 full package\n");
+    printf("\t  <version>/<from version>/<package>  patch\n");
+    printf("\t  <version>/channel                   channel of the version, optional\n\n");
+    printf("\t[base_url]\n");
+    printf("\t  URL the release directory is published under\n\n");
+    printf("\t[options]\n");
+    printf("\t  --channel <name>  channel of versions without a channel file (Stable)\n");
+    printf("\t  --out <file>      manifest to write (<release_dir>/manifest.json)\n");
+    printf("\t  --gzip            also write .gz copies of the manifest and indexes\n");
+    printf("\t  --threads <n>     hashing threads (one per CPU)\n");
+}
+
+static bool parseOptions(int argc, char *argv[], Options &options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--channel" && hasValue) {
+            options.channel = argv[++i];
+        }
+        else if (arg == "--out" && hasValue) {
+            options.out = fs::u8path(argv[++i]);
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else if (arg == "--gzip") {
+#ifndef UPDSVC_HAVE_ZLIB
+            printf("ERROR:\tBuilt without zlib, --gzip is not available\n\n");
+            return false;
+#endif
+            options.gzip = true;
+        }
+        else if (arg.rfind("--", 0) == 0) {
+            printf("ERROR:\tUnknown option (%s)\n\n", arg.c_str());
+            return false;
+        }
+        else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2) {
+        printf("ERROR:\tIncorrect number of arguments\n\n");
+        return false;
+    }
+
+    options.release = fs::u8path(positional[0]);
+    options.baseUrl = positional[1];
+    while (! options.baseUrl.empty() && options.baseUrl.back() == '/') {
+        options.baseUrl.pop_back();
+    }
+    if (SplitUrl(options.baseUrl + "/").host.empty()) {
+        printf("ERROR:\tNot an http(s) URL (%s)\n\n", positional[1].c_str());
+        return false;
+    }
+    if (options.out.empty()) {
+        options.out = options.release / "manifest.json";
+    }
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return true;
+}
+
+static bool isPublishedFile(const fs::path &path) {
+    auto name = path.filename().u8string();
+    auto endsWith = [&](const char *suffix) {
+        size_t n = std::strlen(suffix);
+        return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+    };
+    return name != "channel" && ! endsWith(".idx") && ! endsWith(".gz");
+}
+
+// The single package in dir, the service only ever looks at one per version and source
+static bool findPackage(const fs::path &dir, fs::path &package) {
+    std::vector<fs::path> found;
+    for (auto &entry : fs::directory_iterator(dir)) {
+        if (entry.is_regular_file() && isPublishedFile(entry.path())) {
+            found.push_back(entry.path());
+        }
+    }
+    if (found.size() != 1) {
+        printf("ERROR:\tExpected one package in %s, found %zu\n", dir.u8string().c_str(),
+                found.size());
+        return false;
+    }
+    package = found.front();
+    auto name = package.filename().u8string();
+    if (! IsSafeFileName(name)) {
+        // The service refuses to download it
+        printf("ERROR:\tPackage name must only use [A-Za-z0-9._-] (%s)\n", name.c_str());
+        return false;
+    }
+    return true;
+}
+
+static std::string readChannel(const fs::path &versionDir, const std::string &fallback) {
+    std::ifstream in(versionDir / "channel");
+    std::string channel;
+    if (! in.is_open() || ! std::getline(in, channel)) {
+        return fallback;
+    }
+    while (! channel.empty() && std::isspace(static_cast<unsigned char>(channel.back()))) {
+        channel.pop_back();
+    }
+    return channel.empty() ? fallback : channel;
+}
+
+static bool scanRelease(const Options &options, std::vector<Package> &packages) {
+    std::vector<fs::path> versionDirs;
+    for (auto &entry : fs::directory_iterator(options.release)) {
+        if (entry.is_directory()) {
+            versionDirs.push_back(entry.path());
+        }
+    }
+    std::sort(versionDirs.begin(), versionDirs.end());
+
+    for (auto &versionDir : versionDirs) {
+        Package full;
+        full.version = versionDir.filename().u8string();
+        full.from = "null";
+        full.channel = readChannel(versionDir, options.channel);
+        if (! IsSafeFileName(full.version) || ! findPackage(versionDir, full.path)) {
+            printf("ERROR:\tNot a version directory (%s)\n", versionDir.u8string().c_str());
+            return false;
+        }
+        full.urlPath = full.version + "/" + full.path.filename().u8string();
+        packages.push_back(full);
+
+        for (auto &entry : fs::directory_iterator(versionDir)) {
+            if (! entry.is_directory()) {
+                continue;
+            }
+            Package patch;
+            patch.version = full.version;
+            patch.from = entry.path().filename().u8string();
+            patch.channel = full.channel;
+            if (! IsSafeFileName(patch.from) || ! findPackage(entry.path(), patch.path)) {
+                return false;
+            }
+            patch.urlPath = patch.version + "/" + patch.from + "/"
+                    + patch.path.filename().u8string();
+            packages.push_back(patch);
+        }
+    }
+    return true;
+}
+
+//
+// Purpose:
+//   Entry point function. Indexes every package of the release directory, several files at
+//   a time, then writes the chunk indexes and the manifest.
+//
+// Parameters:
+//   Command-line syntax is in DisplayUsage()
+//
+// Return value:
+//   0 on success, 1 if the directory cannot be indexed
+//
+int main(int argc, char *argv[]) {
+    Options options;
+    if (! parseOptions(argc, argv, options)) {
+        DisplayUsage();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Package> packages;
+    try {
+        if (! scanRelease(options, packages)) {
+            return 1;
+        }
+    }
+    catch (fs::filesystem_error &e) {
+        printf("ERROR:\t%s\n", e.what());
+        return 1;
+    }
+
+    ChunkParams params;
+    {
+        WorkPool pool(options.threads);
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> readers;
+        unsigned readerCount = static_cast<unsigned>(
+                std::min<size_t>(options.threads, packages.size()));
+        for (unsigned i = 0; i < readerCount; ++i) {
+            readers.emplace_back([&] {
+                for (size_t n; (n = next++) < packages.size();) {
+                    auto &package = packages[n];
+                    package.indexed = indexFile(
+                            package.path, package.from == "null", params, pool, package.index);
+                }
+            });
+        }
+        for (auto &reader : readers) {
+            reader.join();
+        }
+    }
+
+    json manifest;
+    auto &versions = manifest["mgui-wgt"]["exe"];
+    uint64_t totalBytes = 0;
+    for (auto &package : packages) {
+        if (! package.indexed) {
+            printf("ERROR:\tCannot read %s\n", package.path.u8string().c_str());
+            return 1;
+        }
+
+        json entry = {
+                {"name", package.path.filename().u8string()},
+                {"url", options.baseUrl + "/" + package.urlPath},
+                {"channel", package.channel},
+                {"size", package.index.size},
+                {"sha256", DigestHex(package.index.hash)},
+        };
+        if (package.from == "null") {
+            auto indexPath = package.path;
+            indexPath += ".idx";
+            auto text = ChunkIndexToJson(package.index);
+            bool written = writeFile(indexPath, text);
+#ifdef UPDSVC_HAVE_ZLIB
+            if (options.gzip) {
+                auto gzPath = indexPath;
+                gzPath += ".gz";
+                written = written && writeGzip(gzPath, text);
+            }
+#endif
+            if (! written) {
+                printf("ERROR:\tCannot write %s\n", indexPath.u8string().c_str());
+                return 1;
+            }
+            entry["chunks"] = options.baseUrl + "/" + package.urlPath + ".idx";
+        }
+        versions[package.version][package.from] = std::move(entry);
+        totalBytes += package.index.size;
+
+        printf("%-12s %-12s %12llu bytes %6zu chunks  %s\n", package.version.c_str(),
+                package.from.c_str(), static_cast<unsigned long long>(package.index.size),
+                package.index.chunks.size(), package.path.filename().u8string().c_str());
+    }
+
+    auto text = manifest.dump(2);
+    bool written = writeFile(options.out, text);
+#ifdef UPDSVC_HAVE_ZLIB
+    if (options.gzip) {
+        auto gzPath = options.out;
+        gzPath += ".gz";
+        written = written && writeGzip(gzPath, text);
+    }
+#endif
+    if (! written) {
+        printf("ERROR:\tCannot write %s\n", options.out.u8string().c_str());
+        return 1;
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                             .count();
+    printf("\n%zu packages, %.1f MiB in %.2f s (%.0f MiB/s) -> %s\n", packages.size(),
+            totalBytes / 1048576.0, seconds, totalBytes / 1048576.0 / seconds,
+            options.out.u8string().c_str());
+    return 0;
+}
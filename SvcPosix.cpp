@@ -0,0 +1,513 @@
+#include "SvcPosix.h"
+#include "SvcTrace.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef UPDSVC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern char **environ;
+
+// How often a download refreshes RequestStats::rtt from the kernel's TCP_INFO
+static constexpr std::chrono::milliseconds RTT_REFRESH{100};
+
+static int connectTo(const std::string &host, const std::string &port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *result = nullptr;
+    if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (auto *ai = result; ai; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    ::freeaddrinfo(result);
+
+    if (fd >= 0) {
+        int one = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Transfer-Encoding: chunked, which updsvc-mirror uses while it is still filling its cache
+class ChunkedDecoder {
+public:
+    // Writes the data of the chunks in input to sink, false if the framing is broken
+    bool feed(std::string_view input, std::ostream &sink, unsigned long long &bytes) {
+        while (! input.empty() && state != State::Done) {
+            if (state == State::Data) {
+                auto take = static_cast<size_t>(std::min<uint64_t>(left, input.size()));
+                sink.write(input.data(), static_cast<std::streamsize>(take));
+                bytes += take;
+                input.remove_prefix(take);
+                left -= take;
+                if (left == 0) {
+                    state = State::DataEnd;
+                }
+                continue;
+            }
+
+            auto end = input.find('\n');
+            line.append(input.substr(0, end));
+            if (end == std::string_view::npos) {
+                return line.size() < 1024;
+            }
+            input.remove_prefix(end + 1);
+            if (! line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            if (state == State::Size) {
+                char *sizeEnd = nullptr;
+                left = std::strtoull(line.c_str(), &sizeEnd, 16);
+                if (sizeEnd == line.c_str()) {
+                    return false;
+                }
+                state = left == 0 ? State::Trailer : State::Data;
+            }
+            else if (state == State::DataEnd) {
+                if (! line.empty()) {
+                    return false;
+                }
+                state = State::Size;
+            }
+            else if (line.empty()) {
+                state = State::Done;
+            }
+            line.clear();
+        }
+        return true;
+    }
+
+    bool done() const { return state == State::Done; }
+
+private:
+    enum class State { Size, Data, DataEnd, Trailer, Done };
+    State state = State::Size;
+    std::string line;
+    uint64_t left = 0;
+};
+
+#ifdef UPDSVC_HAVE_ZLIB
+// Content-Encoding: gzip, inflated piece by piece on its way to the sink
+class InflateBuffer : public std::streambuf {
+public:
+    explicit InflateBuffer(std::ostream &sink)
+        : sink(sink) {
+        // 16 added to the window bits accepts only a gzip header
+        ok = inflateInit2(&stream, 15 + 16) == Z_OK;
+    }
+    ~InflateBuffer() { inflateEnd(&stream); }
+    InflateBuffer(const InflateBuffer &) = delete;
+    InflateBuffer &operator=(const InflateBuffer &) = delete;
+
+    // The whole gzip stream arrived and decoded cleanly
+    bool complete() const { return ok && finished; }
+    unsigned long long bytes() const { return produced; }
+
+protected:
+    std::streamsize xsputn(const char *data, std::streamsize count) override {
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream.avail_in = static_cast<uInt>(count);
+        while (ok && ! finished && stream.avail_in > 0) {
+            unsigned char out[64 * 1024];
+            stream.next_out = out;
+            stream.avail_out = sizeof(out);
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result != Z_OK && result != Z_STREAM_END) {
+                ok = false;
+                break;
+            }
+            auto size = sizeof(out) - stream.avail_out;
+            sink.write(reinterpret_cast<const char *>(out), static_cast<std::streamsize>(size));
+            produced += size;
+            finished = result == Z_STREAM_END;
+        }
+        return count;
+    }
+
+    int_type overflow(int_type c) override {
+        if (! traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            xsputn(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    std::ostream &sink;
+    z_stream stream{};
+    bool ok = false;
+    bool finished = false;
+    unsigned long long produced = 0;
+};
+#endif
+
+bool SocketTransport::get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) {
+    TRACE_SPAN("CreateRequest");
+    auto host = request.domain;
+    std::string port = "80";
+    if (auto colon = host.rfind(':'); colon != std::string::npos) {
+        port = host.substr(colon + 1);
+        host.resize(colon);
+    }
+
+    int fd = connectTo(host, port);
+    if (fd < 0) {
+        SvcReportEvent("Sending request");
+        return false;
+    }
+    // Shut down rather than closed, the descriptor stays ours until the registration ends
+    CancelToken::Registration abort;
+    if (cancel) {
+        abort = cancel->onCancel([fd] { ::shutdown(fd, SHUT_RDWR); });
+    }
+
+    auto head = "GET " + request.path + " HTTP/1.1\r\nHost: " + host + "\r\n";
+    if (! request.range.empty()) {
+        head += "Range: " + request.range + "\r\n";
+        if (! request.ifRange.empty()) {
+            head += "If-Range: " + request.ifRange + "\r\n";
+        }
+    }
+    if (! request.ifNoneMatch.empty()) {
+        head += "If-None-Match: " + request.ifNoneMatch + "\r\n";
+    }
+#ifdef UPDSVC_HAVE_ZLIB
+    if (request.compressed) {
+        head += "Accept-Encoding: gzip\r\n";
+    }
+#endif
+    head += "Connection: close\r\n\r\n";
+    if (::send(fd, head.data(), head.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(head.size())) {
+        abort = {};
+        ::close(fd);
+        SvcReportEvent("Sending request");
+        return false;
+    }
+
+    std::string header;
+    unsigned long long totalBytes = 0;
+    bool inBody = false;
+    bool broken = false;
+    bool chunked = false;
+    long long contentLength = -1;
+    ChunkedDecoder decoder;
+    std::ostream *body = &sink;
+#ifdef UPDSVC_HAVE_ZLIB
+    std::optional<InflateBuffer> inflater;
+    std::optional<std::ostream> inflated;
+#endif
+    static thread_local char buffer[64 * 1024];
+    std::chrono::steady_clock::time_point rttRefreshed;
+
+    for (;;) {
+        auto got = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (got <= 0) {
+            break;
+        }
+        std::string_view chunk(buffer, static_cast<size_t>(got));
+        if (! inBody) {
+            header.append(chunk);
+            auto end = header.find("\r\n\r\n");
+            if (end == std::string::npos) {
+                continue;
+            }
+            // HTTP/1.1 200 OK
+            stats.status = std::strtoul(header.c_str() + header.find(' ') + 1, nullptr, 10);
+            auto head = std::string_view(header).substr(0, end + 2);
+            stats.etag = std::string(httpHeaderValue(head, "ETag"));
+            chunked = httpHeaderValue(head, "Transfer-Encoding") == "chunked";
+            auto length = httpHeaderValue(head, "Content-Length");
+            if (! length.empty()) {
+                contentLength = std::strtoll(std::string(length).c_str(), nullptr, 10);
+            }
+#ifdef UPDSVC_HAVE_ZLIB
+            if (request.compressed && httpHeaderValue(head, "Content-Encoding") == "gzip") {
+                inflater.emplace(sink);
+                inflated.emplace(&*inflater);
+                body = &*inflated;
+            }
+#endif
+            chunk = std::string_view(header).substr(end + 4);
+            inBody = true;
+        }
+#ifdef TCP_INFO
+        if (auto now = std::chrono::steady_clock::now(); now - rttRefreshed >= RTT_REFRESH) {
+            rttRefreshed = now;
+            tcp_info info{};
+            socklen_t size = sizeof(info);
+            if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0) {
+                stats.rtt = std::chrono::microseconds(info.tcpi_rtt);
+            }
+        }
+#endif
+        if (chunked) {
+            if (! decoder.feed(chunk, *body, totalBytes)) {
+                broken = true;
+                break;
+            }
+        }
+        else {
+            totalBytes += chunk.size();
+            body->write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        }
+        // Nothing more can be stored (or a throttled download was cancelled), do not drain
+        // the rest of the body
+        if (! sink) {
+            broken = true;
+            break;
+        }
+    }
+    abort = {};
+    ::close(fd);
+
+    stats.bytes = totalBytes;
+    stats.wireBytes = totalBytes;
+#ifdef UPDSVC_HAVE_ZLIB
+    if (inflater) {
+        stats.bytes = inflater->bytes();
+        broken = broken || (totalBytes > 0 && ! inflater->complete());
+    }
+#endif
+    if (cancel && cancel->cancelled()) {
+        // Whatever arrived may look complete if the server sent no length
+        SvcReportInfo("Request cancelled, the service is stopping");
+        return false;
+    }
+    if (! inBody) {
+        SvcReportEvent("Sending request");
+        return false;
+    }
+    // The connection closed before the whole body arrived. A 304 has no body whatever its
+    // Content-Length says.
+    bool shortBody = contentLength >= 0 && stats.status != 304
+            && totalBytes != static_cast<unsigned long long>(contentLength);
+    if (broken || (chunked && ! decoder.done()) || shortBody) {
+        SvcReportEvent("Receiving response");
+        return false;
+    }
+    return true;
+}
+
+ProcessState ProcProbe::query(const std::string &exePath) {
+    TRACE_SPAN("isRunning");
+    std::error_code ec;
+    std::filesystem::directory_iterator proc("/proc", ec);
+    if (ec) {
+        SvcReportEvent("Taking snapshot of all processes");
+        return ProcessState::Unknown;
+    }
+
+    const auto target = std::filesystem::u8path(exePath);
+    // Processes come and go while /proc is walked, so errors only skip the entry
+    for (; ! ec && proc != std::filesystem::directory_iterator(); proc.increment(ec)) {
+        auto name = proc->path().filename().native();
+        if (name.empty() || name.find_first_not_of("0123456789") != std::string::npos) {
+            continue;
+        }
+        // Processes of other users cannot be read without privileges
+        std::error_code linkError;
+        auto exe = std::filesystem::read_symlink(proc->path() / "exe", linkError);
+        if (! linkError && exe == target) {
+            SvcReportInfo("Program found in process list, cant update");
+            return ProcessState::Running;
+        }
+    }
+    return ProcessState::NotRunning;
+}
+
+// The installer's process group
+class SpawnJob : public InstallJob {
+public:
+    SpawnJob(pid_t pid, std::chrono::seconds timeout, CancelToken *cancel)
+        : pid(pid)
+        , cancel(cancel)
+        , deadline(timeout.count() != 0 ? std::chrono::steady_clock::now() + timeout
+                                        : std::chrono::steady_clock::time_point::max()) {
+#ifdef SYS_pidfd_open
+        // Lets wait() sleep in poll() until the process exits, Linux 5.3 and later
+        pidfd = static_cast<int>(::syscall(SYS_pidfd_open, pid, 0));
+#endif
+    }
+
+    ~SpawnJob() override {
+        if (! finished) {
+            // Nobody is going to wait for it any more
+            ::kill(-pid, SIGKILL);
+            reap(0);
+        }
+        if (pidfd >= 0) {
+            ::close(pidfd);
+        }
+    }
+
+    bool wait(std::chrono::milliseconds timeout) override {
+        for (;;) {
+            if (finished) {
+                return true;
+            }
+            int status = 0;
+            auto waited = ::waitpid(pid, &status, WNOHANG);
+            if (waited == pid) {
+                outcome.exitCode =
+                        WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                finished = true;
+                return true;
+            }
+            if (waited < 0 && errno != EINTR) {
+                // Reaped by someone else, how it ended is unknown
+                SvcReportEvent("Waiting for installer");
+                outcome.exitCode = 255;
+                finished = true;
+                return true;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            bool stopping = cancel && cancel->cancelled();
+            if (now >= deadline || stopping) {
+                ::kill(-pid, SIGKILL);
+                reap(0);
+                outcome.timedOut = ! stopping;
+                outcome.stopped = stopping;
+                finished = true;
+                return true;
+            }
+            if (timeout.count() <= 0) {
+                return false;
+            }
+            auto slice = std::min<std::chrono::milliseconds>(
+                    timeout, std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+            if (pidfd >= 0) {
+                // The token's pipe wakes the poll as well, poll() skips a negative descriptor
+                pollfd events[] = {
+                        {pidfd, POLLIN, 0}, {cancel ? cancel->waitHandle() : -1, POLLIN, 0}};
+                ::poll(events, 2, static_cast<int>(std::min<long long>(slice.count(), INT_MAX)));
+            }
+            else {
+                std::this_thread::sleep_for(std::min(slice, std::chrono::milliseconds(10)));
+            }
+            timeout -= std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - now);
+            if (timeout.count() <= 0) {
+                timeout = std::chrono::milliseconds(0);
+            }
+        }
+    }
+
+    InstallResult result() override { return outcome; }
+
+private:
+    void reap(int options) {
+        int status = 0;
+        while (::waitpid(pid, &status, options) < 0 && errno == EINTR) {
+        }
+    }
+
+    pid_t pid;
+    CancelToken *cancel;
+    int pidfd = -1;
+    std::chrono::steady_clock::time_point deadline;
+    bool finished = false;
+    InstallResult outcome;
+};
+
+std::unique_ptr<InstallJob> SpawnInstaller::start(const std::filesystem::path &package,
+        const std::string &arguments, const InstallLimits &limits) {
+    std::vector<std::string> args;
+    if (! launcher.empty()) {
+        args.push_back(launcher);
+    }
+    args.push_back(package.string());
+    std::istringstream split(arguments);
+    for (std::string arg; split >> arg;) {
+        args.push_back(std::move(arg));
+    }
+
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+
+    // A process group of its own, so a timeout kills whatever the installer started too
+    posix_spawnattr_t attributes;
+    ::posix_spawnattr_init(&attributes);
+    ::posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    ::posix_spawnattr_setpgroup(&attributes, 0);
+    pid_t pid = 0;
+    int spawned = ::posix_spawnp(&pid, argv[0], nullptr, &attributes, argv.data(), environ);
+    ::posix_spawnattr_destroy(&attributes);
+    if (spawned != 0) {
+        SvcReportEvent("Create process for installing exe");
+        return nullptr;
+    }
+
+    // Set from the outside, the installer may already have run for a moment without them
+    if (limits.cpuTime.count() != 0) {
+        rlimit cpu{static_cast<rlim_t>(limits.cpuTime.count()),
+                static_cast<rlim_t>(limits.cpuTime.count())};
+        ::prlimit(pid, RLIMIT_CPU, &cpu, nullptr);
+    }
+    if (limits.memoryBytes != 0) {
+        rlimit memory{static_cast<rlim_t>(limits.memoryBytes),
+                static_cast<rlim_t>(limits.memoryBytes)};
+        ::prlimit(pid, RLIMIT_AS, &memory, nullptr);
+    }
+    return std::make_unique<SpawnJob>(pid, limits.timeout, cancel);
+}
+
+bool SpawnInstaller::activate(
+        const std::filesystem::path &link, const std::filesystem::path &target) {
+    // A new link renamed over the old one, rename() replaces it in one step
+    auto next = link;
+    next += ".next";
+    std::error_code ec;
+    std::filesystem::remove(next, ec);
+    std::filesystem::create_directory_symlink(target, next, ec);
+    if (ec) {
+        SvcReportEvent("Creating link to the staged version");
+        return false;
+    }
+    std::filesystem::rename(next, link, ec);
+    if (ec) {
+        SvcReportEvent("Switching to the staged version");
+        std::filesystem::remove(next, ec);
+        return false;
+    }
+    return true;
+}
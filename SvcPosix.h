@@ -0,0 +1,73 @@
+#ifndef SVCPOSIX_H
+#define SVCPOSIX_H
+
+#include "SvcBackends.h"
+#include "SvcCancel.h"
+#include "SvcMemory.h"
+
+// Backends for running the engine on Linux, mainly for profiling and benchmarks.
+
+// Plain HTTP/1.1 over a socket, one connection per request. There is no TLS; the domain may
+// carry a port ("127.0.0.1:8080"), port 80 is used otherwise. A tripped cancel token shuts
+// the socket down, which ends a blocking recv().
+class SocketTransport : public Transport {
+public:
+    explicit SocketTransport(CancelToken *cancel = nullptr)
+        : cancel(cancel) {}
+
+    bool get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) override;
+
+private:
+    CancelToken *cancel;
+};
+
+// Scans /proc for a process whose executable is exePath.
+class ProcProbe : public ProcessProbe {
+public:
+    ProcessState query(const std::string &exePath) override;
+};
+
+// Starts the package with posix_spawn. With a launcher set, the launcher is started instead
+// and gets the package as its first argument, e.g. "sh" for scripts or "true" to skip the
+// install while benchmarking. The arguments are split on whitespace.
+//
+// The installer gets a process group of its own, which is what is killed on timeout or when
+// the cancel token is tripped. The CPU and memory limits are rlimits, so they apply to each
+// of its processes separately.
+class SpawnInstaller : public Installer {
+public:
+    explicit SpawnInstaller(std::string launcher = {}, CancelToken *cancel = nullptr)
+        : launcher(std::move(launcher))
+        , cancel(cancel) {}
+
+    std::unique_ptr<InstallJob> start(const std::filesystem::path &package,
+            const std::string &arguments, const InstallLimits &limits) override;
+    bool activate(
+            const std::filesystem::path &link, const std::filesystem::path &target) override;
+
+private:
+    std::string launcher;
+    CancelToken *cancel;
+};
+
+struct PosixPlatform {
+    explicit PosixPlatform(std::string launcher = {}, CancelToken *cancel = nullptr)
+        : transport(cancel)
+        , installer(std::move(launcher), cancel)
+        , clock(cancel)
+        , cancel(cancel) {}
+
+    SocketTransport transport;
+    MemoryConfigStore config;
+    MemoryInventory inventory;
+    ProcProbe probe;
+    SpawnInstaller installer;
+    SystemClock clock;
+    CancelToken *cancel;
+
+    Backends backends() {
+        return {transport, config, inventory, probe, installer, clock, cancel};
+    }
+};
+
+#endif // SVCPOSIX_H
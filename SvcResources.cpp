@@ -0,0 +1,152 @@
+#include "SvcResources.h"
+#include "SvcCancel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+static thread_local ResourceScope *currentScope = nullptr;
+static thread_local ResourceClass currentClass = ResourceClass::Foreground;
+
+// The budget is kept over windows of this length, so a thread that waited on the network
+// for a while cannot run flat out for as long afterwards
+static constexpr std::chrono::milliseconds BUDGET_WINDOW{500};
+
+ResourceScope::ResourceScope(ResourceClass resourceClass, double cpuBudget, CancelToken *cancel)
+    : outer(currentScope)
+    , previous(currentClass)
+    , budget(resourceClass == ResourceClass::Background ? std::clamp(cpuBudget, 0.05, 1.0) : 1.0)
+    , cancel(cancel || ! currentScope ? cancel : currentScope->cancel)
+    , windowBegin(std::chrono::steady_clock::now())
+    , windowCpu(budget < 1.0 ? ThreadCpuTime() : std::chrono::microseconds(0)) {
+    if (resourceClass != currentClass && SetThreadResourceClass(resourceClass)) {
+        currentClass = resourceClass;
+    }
+    currentScope = this;
+}
+
+ResourceScope::~ResourceScope() {
+    currentScope = outer;
+    if (currentClass != previous && SetThreadResourceClass(previous)) {
+        currentClass = previous;
+    }
+}
+
+bool ResourceCheckpoint() {
+    auto *scope = currentScope;
+    if (! scope) {
+        return true;
+    }
+    if (scope->cancel && scope->cancel->cancelled()) {
+        return false;
+    }
+    if (scope->budget >= 1.0) {
+        return true;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto cpu = ThreadCpuTime();
+    // The wall time the CPU used in this window is allowed to take
+    auto allowed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::duration<double, std::micro>((cpu - scope->windowCpu).count()
+                    / scope->budget));
+    auto elapsed = now - scope->windowBegin;
+    if (allowed > elapsed) {
+        if (! scope->cancel) {
+            std::this_thread::sleep_for(allowed - elapsed);
+        }
+        else if (! scope->cancel->sleepFor(
+                         std::chrono::ceil<std::chrono::milliseconds>(allowed - elapsed))) {
+            return false;
+        }
+        now = std::chrono::steady_clock::now();
+    }
+    if (now - scope->windowBegin >= BUDGET_WINDOW) {
+        scope->windowBegin = now;
+        scope->windowCpu = cpu;
+    }
+    return true;
+}
+
+#ifdef _WIN32
+
+bool SetThreadResourceClass(ResourceClass resourceClass) {
+    // Lowers the CPU, I/O and memory priority of this thread only, processes it starts keep
+    // the priority class of the service
+    return SetThreadPriority(GetCurrentThread(),
+                   resourceClass == ResourceClass::Background ? THREAD_MODE_BACKGROUND_BEGIN
+                                                              : THREAD_MODE_BACKGROUND_END)
+            != FALSE;
+}
+
+std::chrono::microseconds ThreadCpuTime() {
+    FILETIME creation, exit, kernel, user;
+    if (! GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+        return {};
+    }
+    auto ticks = [](const FILETIME &time) {
+        return static_cast<unsigned long long>(time.dwHighDateTime) << 32 | time.dwLowDateTime;
+    };
+    // 100 ns units
+    return std::chrono::microseconds((ticks(kernel) + ticks(user)) / 10);
+}
+
+#else
+
+// ioprio_set has no glibc wrapper, the values are from linux/ioprio.h
+static constexpr int IOPRIO_WHO_PROCESS = 1;
+static constexpr int IOPRIO_CLASS_SHIFT = 13;
+static constexpr int IOPRIO_CLASS_IDLE = 3;
+
+// What the thread ran with before it went background
+static thread_local int savedPolicy = SCHED_OTHER;
+static thread_local sched_param savedParam{};
+static thread_local long savedIoPriority = 0;
+
+static bool setIoPriority(long priority) {
+    auto tid = ::syscall(SYS_gettid);
+    return ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, priority) == 0;
+}
+
+bool SetThreadResourceClass(ResourceClass resourceClass) {
+    if (resourceClass == ResourceClass::Background) {
+        if (::pthread_getschedparam(::pthread_self(), &savedPolicy, &savedParam) != 0) {
+            return false;
+        }
+        auto tid = ::syscall(SYS_gettid);
+        savedIoPriority = std::max(0L, ::syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid));
+        sched_param idle{};
+        if (::pthread_setschedparam(::pthread_self(), SCHED_IDLE, &idle) != 0) {
+            return false;
+        }
+        // Without the idle I/O class the thread is still background for the CPU
+        setIoPriority(IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+        return true;
+    }
+    // Leaving SCHED_IDLE needs CAP_SYS_NICE or an RLIMIT_NICE that allows nice 0, the
+    // thread stays background otherwise
+    if (::pthread_setschedparam(::pthread_self(), savedPolicy, &savedParam) != 0) {
+        return false;
+    }
+    setIoPriority(savedIoPriority);
+    return true;
+}
+
+std::chrono::microseconds ThreadCpuTime() {
+    timespec ts{};
+    if (::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return {};
+    }
+    return std::chrono::microseconds(
+            static_cast<long long>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef SVCRESOURCES_H
+#define SVCRESOURCES_H
+
+#include <chrono>
+
+class CancelToken;
+
+// Resource classes of the pipeline stages. Downloads, cache writes and hashing declare
+// themselves background so they only get the CPU and disk that foreground applications leave
+// idle; the installer keeps running at normal priority.
+
+enum class ResourceClass {
+    Foreground,
+    Background,
+};
+
+// Platform part of the scopes. Background is THREAD_MODE_BACKGROUND_BEGIN on Windows (low
+// CPU, I/O and memory priority), SCHED_IDLE and the idle I/O class on Linux. Returns false if
+// the system refused the change.
+bool SetThreadResourceClass(ResourceClass resourceClass);
+// CPU time used by the calling thread so far
+std::chrono::microseconds ThreadCpuTime();
+
+// Puts the calling thread in a resource class until the scope ends. A background scope can
+// also cap the thread at cpuBudget of one core (0.5 for half), which ResourceCheckpoint
+// enforces. Scopes nest; the outermost one switches the thread back. A scope without a
+// cancel token takes the one of the scope around it.
+class ResourceScope {
+public:
+    explicit ResourceScope(
+            ResourceClass resourceClass, double cpuBudget = 1.0, CancelToken *cancel = nullptr);
+    ~ResourceScope();
+    ResourceScope(const ResourceScope &) = delete;
+    ResourceScope &operator=(const ResourceScope &) = delete;
+
+private:
+    friend bool ResourceCheckpoint();
+
+    ResourceScope *outer;
+    ResourceClass previous;
+    double budget;
+    CancelToken *cancel;
+    // Start of the current budget window
+    std::chrono::steady_clock::time_point windowBegin;
+    std::chrono::microseconds windowCpu;
+};
+
+// Called between pieces of CPU-bound work (a chunk hashed, a block read). Sleeps as long as
+// it takes to bring the thread back within the budget of its innermost scope; without a
+// budget it only reads a thread-local and the cancel token. Returns false once the token
+// is tripped, the work should then be dropped.
+bool ResourceCheckpoint();
+
+#endif // SVCRESOURCES_H
@@ -0,0 +1,96 @@
+#include "SvcScheduler.h"
+#include "SvcCancel.h"
+
+#include <algorithm>
+#include <thread>
+
+std::chrono::steady_clock::time_point SystemClock::now() {
+    return std::chrono::steady_clock::now();
+}
+
+bool SystemClock::sleepFor(std::chrono::milliseconds duration) {
+    if (cancel) {
+        return cancel->sleepFor(duration);
+    }
+    std::this_thread::sleep_for(duration);
+    return true;
+}
+
+void Scheduler::schedule(const std::string &product_guid, std::chrono::seconds period) {
+    auto it = entries.find(product_guid);
+    if (it == entries.end()) {
+        entries.emplace(product_guid, Entry{period, clock.now()});
+        return;
+    }
+    if (it->second.period.count() == 0) {
+        // Re-enabled product, check it right away
+        it->second.next = clock.now();
+    }
+    else {
+        // Keep the last check time, only the distance to the next one changes
+        it->second.next += period - it->second.period;
+    }
+    it->second.period = period;
+}
+
+void Scheduler::retain(const std::vector<std::string> &product_guids) {
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (std::find(product_guids.begin(), product_guids.end(), it->first)
+                == product_guids.end()) {
+            it = entries.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+std::vector<std::string> Scheduler::due() {
+    auto now = clock.now();
+    std::vector<std::pair<std::chrono::steady_clock::time_point, std::string>> ready;
+    for (auto &[guid, entry] : entries) {
+        if (entry.period.count() != 0 && entry.next <= now) {
+            ready.emplace_back(entry.next, guid);
+        }
+    }
+    std::sort(ready.begin(), ready.end());
+
+    std::vector<std::string> guids;
+    guids.reserve(ready.size());
+    for (auto &r : ready) {
+        guids.push_back(std::move(r.second));
+    }
+    return guids;
+}
+
+void Scheduler::completed(const std::string &product_guid) {
+    auto it = entries.find(product_guid);
+    if (it != entries.end()) {
+        it->second.next = clock.now() + it->second.period;
+    }
+}
+
+void Scheduler::dueIn(const std::string &product_guid, std::chrono::milliseconds delay) {
+    auto it = entries.find(product_guid);
+    if (it != entries.end()) {
+        it->second.next = clock.now() + delay;
+    }
+}
+
+std::chrono::milliseconds Scheduler::untilNext() {
+    auto next = std::chrono::steady_clock::time_point::max();
+    for (auto &[guid, entry] : entries) {
+        if (entry.period.count() != 0) {
+            next = std::min(next, entry.next);
+        }
+    }
+    if (next == std::chrono::steady_clock::time_point::max()) {
+        return std::chrono::milliseconds::max();
+    }
+    auto now = clock.now();
+    if (next <= now) {
+        return std::chrono::milliseconds(0);
+    }
+    // Round up so a wait of this length always reaches the due time
+    return std::chrono::ceil<std::chrono::milliseconds>(next - now);
+}
@@ -0,0 +1,47 @@
+#ifndef SVCSCHEDULER_H
+#define SVCSCHEDULER_H
+
+#include "SvcBackends.h"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// Decides when each product is checked next. A product becomes due PERIOD seconds after its
+// previous check finished; a product seen for the first time is due immediately. All times
+// come from the injected clock.
+class Scheduler {
+public:
+    explicit Scheduler(Clock &clock)
+        : clock(clock) {}
+
+    // Adds a product or changes its period. A period of zero disables the product.
+    void schedule(const std::string &product_guid, std::chrono::seconds period);
+    // Forgets every product that is not in product_guids
+    void retain(const std::vector<std::string> &product_guids);
+
+    // Products whose time has come, earliest first
+    std::vector<std::string> due();
+    // Records a finished check, the product is due again one period from now
+    void completed(const std::string &product_guid);
+    // Makes the product due after delay instead of a whole period: a failed check to be
+    // retried, or one that was not due yet when the service restarted
+    void dueIn(const std::string &product_guid, std::chrono::milliseconds delay);
+
+    // Time until the earliest product is due, zero if one is due already. max() if nothing
+    // is scheduled.
+    std::chrono::milliseconds untilNext();
+
+    size_t size() const { return entries.size(); }
+
+private:
+    struct Entry {
+        std::chrono::seconds period{0};
+        std::chrono::steady_clock::time_point next;
+    };
+    Clock &clock;
+    std::map<std::string, Entry> entries;
+};
+
+#endif // SVCSCHEDULER_H
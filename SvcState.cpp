@@ -0,0 +1,455 @@
+#include "SvcState.h"
+#include "SvcEngine.h"
+#include "SvcMetrics.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string_view>
+
+// A log is compacted once it is this many times the size of its live records, and at least
+// COMPACT_MIN_BYTES, so a few products do not rewrite it on every save
+static constexpr unsigned long long COMPACT_RATIO = 4;
+static constexpr unsigned long long COMPACT_MIN_BYTES = 64 * 1024;
+// Bytes before the payload of a record: its length and CRC-32, little-endian
+static constexpr size_t HEADER_BYTES = 8;
+// Larger lengths are taken for garbage rather than allocated
+static constexpr uint32_t MAX_RECORD_BYTES = 64 * 1024 * 1024;
+
+// Record types, the first byte of the payload
+static constexpr char PRODUCT_RECORD = 'P';
+static constexpr char MANIFEST_RECORD = 'M';
+static constexpr char ERASE_RECORD = 'E';
+
+// CRC-32 of zlib and Ethernet, zlib is not always linked in
+static uint32_t crc32(const char *data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static void putU32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+static uint32_t getU32(const char *data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Payloads are made of varints and length-prefixed strings
+static void putVarint(std::string &out, unsigned long long value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static void putString(std::string &out, const std::string &value) {
+    putVarint(out, value.size());
+    out += value;
+}
+
+// Reads a payload back; any read past its end leaves ok false
+class PayloadReader {
+public:
+    explicit PayloadReader(std::string_view payload)
+        : data(payload) {}
+
+    unsigned long long varint() {
+        unsigned long long value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (at >= data.size()) {
+                ok = false;
+                return 0;
+            }
+            auto byte = static_cast<unsigned char>(data[at++]);
+            value |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+            if (! (byte & 0x80)) {
+                return value;
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    std::string string() {
+        auto size = varint();
+        if (! ok || size > data.size() - at) {
+            ok = false;
+            return {};
+        }
+        std::string value(data.substr(at, size));
+        at += size;
+        return value;
+    }
+
+    bool done() const { return ok && at == data.size(); }
+
+    bool ok = true;
+
+private:
+    std::string_view data;
+    size_t at = 0;
+};
+
+static std::string productRecord(const std::string &product_guid, const ProductState &state) {
+    std::string out(1, PRODUCT_RECORD);
+    putString(out, product_guid);
+    putVarint(out, static_cast<unsigned long long>(state.lastCheck));
+    putString(out, state.packageUrl);
+    putString(out, state.package);
+    putVarint(out, state.retry.attempts);
+    putVarint(out, static_cast<unsigned long long>(state.retry.reason));
+    putVarint(out, static_cast<unsigned long long>(state.retry.notBefore));
+    return out;
+}
+
+// Without an ETag the manifest cannot be revalidated, only the empty validator is written
+static std::string manifestRecord(const std::string &product_guid, const ProductState &state) {
+    std::string out(1, MANIFEST_RECORD);
+    putString(out, product_guid);
+    putString(out, state.manifestEtag);
+    if (state.manifestEtag.empty()) {
+        return out;
+    }
+    putVarint(out, state.manifest.valid ? 1 : 0);
+    putVarint(out, state.manifest.releases.size());
+    for (auto &release : state.manifest.releases) {
+        putString(out, release.version);
+        putVarint(out, release.entries.size());
+        for (auto &entry : release.entries) {
+            putString(out, entry.from);
+            putString(out, entry.name);
+            putString(out, entry.url);
+            putString(out, entry.channel);
+            putString(out, entry.chunks);
+        }
+    }
+    return out;
+}
+
+static bool readManifest(PayloadReader &in, Manifest &manifest) {
+    manifest.valid = in.varint() != 0;
+    auto releases = in.varint();
+    for (unsigned long long i = 0; in.ok && i < releases; ++i) {
+        ManifestRelease release;
+        release.version = in.string();
+        auto entries = in.varint();
+        for (unsigned long long j = 0; in.ok && j < entries; ++j) {
+            ManifestEntry entry;
+            entry.from = in.string();
+            entry.name = in.string();
+            entry.url = in.string();
+            entry.channel = in.string();
+            entry.chunks = in.string();
+            release.entries.push_back(std::move(entry));
+        }
+        manifest.releases.push_back(std::move(release));
+    }
+    return in.ok;
+}
+
+static std::FILE *openFile(const std::filesystem::path &path, bool append) {
+#ifdef _WIN32
+    return _wfopen(path.c_str(), append ? L"ab" : L"wb");
+#else
+    return std::fopen(path.c_str(), append ? "ab" : "wb");
+#endif
+}
+
+// Flushes the file to the disk itself, not just to the system
+static bool syncFile(std::FILE *file) {
+    if (std::fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return ::fsync(fileno(file)) == 0;
+#endif
+}
+
+StateStore::StateStore(std::filesystem::path directory)
+    : dir(std::move(directory)) {}
+
+StateStore::~StateStore() {
+    if (log) {
+        std::fclose(log);
+    }
+}
+
+void StateStore::open() {
+    if (opened) {
+        return;
+    }
+    opened = true;
+    if (! dir.empty()) {
+        load();
+    }
+}
+
+ProductState &StateStore::get(const std::string &product_guid) {
+    open();
+    return products[product_guid].state;
+}
+
+void StateStore::save(const std::string &product_guid) {
+    open();
+    auto &entry = products[product_guid];
+    auto record = productRecord(product_guid, entry.state);
+    if (record != entry.record && append(record)) {
+        entry.record = std::move(record);
+    }
+    if (entry.state.manifestEtag != entry.manifestEtag) {
+        auto manifest = manifestRecord(product_guid, entry.state);
+        if (append(manifest)) {
+            entry.manifestEtag = entry.state.manifestEtag;
+            entry.manifestBytes = entry.manifestEtag.empty() ? 0 : manifest.size();
+        }
+    }
+    if (written > COMPACT_MIN_BYTES && written > COMPACT_RATIO * liveBytes()) {
+        compact();
+    }
+}
+
+void StateStore::retain(const std::vector<std::string> &product_guids) {
+    open();
+    for (auto it = products.begin(); it != products.end();) {
+        if (std::find(product_guids.begin(), product_guids.end(), it->first)
+                != product_guids.end()) {
+            ++it;
+            continue;
+        }
+        if (! it->second.record.empty() || it->second.manifestBytes != 0) {
+            std::string record(1, ERASE_RECORD);
+            putString(record, it->first);
+            append(record);
+        }
+        it = products.erase(it);
+    }
+}
+
+size_t StateStore::size() {
+    open();
+    return products.size();
+}
+
+unsigned long long StateStore::logBytes() {
+    open();
+    return written;
+}
+
+std::filesystem::path StateStore::defaultDirectory() {
+#ifdef _WIN32
+    auto *programData = _wgetenv(L"ProgramData");
+    if (! programData || ! *programData) {
+        return {};
+    }
+    return std::filesystem::path(programData) / "updsvc";
+#else
+    auto *configured = std::getenv("UPDSVC_STATE_DIR");
+    if (configured && *configured) {
+        return configured;
+    }
+    return "/var/lib/updsvc";
+#endif
+}
+
+unsigned long long StateStore::liveBytes() const {
+    unsigned long long bytes = 0;
+    for (auto &[product_guid, entry] : products) {
+        if (! entry.record.empty()) {
+            bytes += HEADER_BYTES + entry.record.size();
+        }
+        if (entry.manifestBytes != 0) {
+            bytes += HEADER_BYTES + entry.manifestBytes;
+        }
+    }
+    return bytes;
+}
+
+void StateStore::load() {
+    auto path = dir / "state.log";
+    std::string text;
+    {
+        std::ifstream in(path, std::ios::binary);
+        text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    size_t at = 0;
+    while (text.size() - at >= HEADER_BYTES) {
+        auto size = getU32(text.data() + at);
+        if (size == 0 || size > MAX_RECORD_BYTES || size > text.size() - at - HEADER_BYTES
+                || crc32(text.data() + at + HEADER_BYTES, size) != getU32(text.data() + at + 4)) {
+            break;
+        }
+        std::string_view payload(text.data() + at + HEADER_BYTES, size);
+        PayloadReader in(payload.substr(1));
+        auto product_guid = in.string();
+        if (payload[0] == ERASE_RECORD) {
+            if (! in.done()) {
+                break;
+            }
+            products.erase(product_guid);
+        }
+        else if (payload[0] == PRODUCT_RECORD) {
+            ProductState read;
+            read.lastCheck = static_cast<long long>(in.varint());
+            read.packageUrl = in.string();
+            read.package = in.string();
+            read.retry.attempts = static_cast<unsigned>(in.varint());
+            read.retry.reason = static_cast<FailureReason>(in.varint());
+            read.retry.notBefore = static_cast<long long>(in.varint());
+            if (! in.done()) {
+                break;
+            }
+            auto &entry = products[product_guid];
+            read.manifestEtag = std::move(entry.state.manifestEtag);
+            read.manifest = std::move(entry.state.manifest);
+            entry.state = std::move(read);
+            entry.record = std::string(payload);
+        }
+        else if (payload[0] == MANIFEST_RECORD) {
+            auto etag = in.string();
+            Manifest manifest;
+            if (! etag.empty() && ! readManifest(in, manifest)) {
+                break;
+            }
+            if (! in.done()) {
+                break;
+            }
+            auto &entry = products[product_guid];
+            entry.state.manifestEtag = etag;
+            entry.state.manifest = std::move(manifest);
+            entry.manifestBytes = etag.empty() ? 0 : payload.size();
+            entry.manifestEtag = std::move(etag);
+        }
+        else {
+            break;
+        }
+        at += HEADER_BYTES + size;
+    }
+
+    std::error_code ec;
+    if (at != text.size()) {
+        // Torn by a crash in the middle of an append, or damaged; what follows is lost
+        SvcReportInfo("State log damaged after " + std::to_string(at) + " bytes, truncating it");
+        std::filesystem::resize_file(path, at, ec);
+    }
+    written = at;
+    if (written > COMPACT_MIN_BYTES && written > COMPACT_RATIO * liveBytes()) {
+        compact();
+    }
+    if (! log) {
+        std::filesystem::create_directories(dir, ec);
+        log = openFile(path, true);
+        if (! log) {
+            SvcReportEvent("Cannot open the state log in " + dir.u8string());
+        }
+    }
+}
+
+bool StateStore::append(const std::string &payload) {
+    if (dir.empty()) {
+        // Kept in memory only
+        return true;
+    }
+    if (! log) {
+        return false;
+    }
+    std::string record;
+    record.reserve(HEADER_BYTES + payload.size());
+    putU32(record, static_cast<uint32_t>(payload.size()));
+    putU32(record, crc32(payload.data(), payload.size()));
+    record += payload;
+    // Not synced: a crash of the system can lose the last records, load drops whatever part
+    // of one made it to the disk
+    if (std::fwrite(record.data(), 1, record.size(), log) != record.size()
+            || std::fflush(log) != 0) {
+        SvcReportEvent("Cannot write the state log in " + dir.u8string());
+        return false;
+    }
+    written += record.size();
+    return true;
+}
+
+void StateStore::compact() {
+    static auto &compactions =
+            MetricCounter("updsvc_state_compactions_total", "Times the state log was rewritten");
+
+    auto path = dir / "state.log";
+    auto temp = dir / "state.log.new";
+    auto *out = openFile(temp, false);
+    if (! out) {
+        return;
+    }
+    unsigned long long bytes = 0;
+    bool ok = true;
+    auto put = [&](const std::string &payload) {
+        std::string record;
+        putU32(record, static_cast<uint32_t>(payload.size()));
+        putU32(record, crc32(payload.data(), payload.size()));
+        record += payload;
+        ok = ok && std::fwrite(record.data(), 1, record.size(), out) == record.size();
+        bytes += record.size();
+    };
+    for (auto &[product_guid, entry] : products) {
+        if (entry.manifestBytes != 0) {
+            put(manifestRecord(product_guid, entry.state));
+        }
+        if (! entry.record.empty()) {
+            put(entry.record);
+        }
+    }
+    // The new log has to be on the disk before it replaces the old one
+    ok = syncFile(out) && ok;
+    std::fclose(out);
+
+    std::error_code ec;
+    if (log) {
+        // Windows does not rename over an open file
+        std::fclose(log);
+        log = nullptr;
+    }
+    if (ok) {
+        std::filesystem::rename(temp, path, ec);
+    }
+    if (! ok || ec) {
+        SvcReportInfo("Could not compact the state log");
+        std::filesystem::remove(temp, ec);
+    }
+    else {
+        written = bytes;
+        compactions.add();
+    }
+    log = openFile(path, true);
+}
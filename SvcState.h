@@ -0,0 +1,78 @@
+#ifndef SVCSTATE_H
+#define SVCSTATE_H
+
+#include "SvcBackends.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+// What the engine remembers about a product from one run of the service to the next
+struct ProductState {
+    long long lastCheck = 0; // Seconds since the Unix epoch, 0 if it was never checked
+    // Validator of the last manifest and its parsed copy, used when the server answers 304
+    std::string manifestEtag;
+    Manifest manifest;
+    // Downloaded and not installed yet, the next check installs it without downloading it again
+    std::string packageUrl;
+    std::string package; // UTF-8 path
+    RetryState retry;
+};
+
+// Append-only log of product states in a directory of its own, state.log. Every change
+// appends a record of [length][CRC-32][payload]; a manifest is only written again when its
+// ETag changed. Loading stops at the first torn or corrupt record, which is where a crash
+// left the log, and cuts it off there. Once the log is several times the size of the live
+// records it is compacted into a new file that is flushed to disk and renamed over it.
+//
+// The log is read when the store is first used, or by open. Without a directory nothing is
+// persisted, the state lives for as long as the store.
+class StateStore {
+public:
+    explicit StateStore(std::filesystem::path directory = {});
+    ~StateStore();
+    StateStore(const StateStore &) = delete;
+    StateStore &operator=(const StateStore &) = delete;
+
+    // Reads the log if that was not done yet
+    void open();
+
+    // The state of a product, empty for one that was never saved
+    ProductState &get(const std::string &product_guid);
+    // Writes what changed in the product's state since it was last saved
+    void save(const std::string &product_guid);
+    // Forgets every product that is not in product_guids
+    void retain(const std::vector<std::string> &product_guids);
+
+    size_t size();
+    unsigned long long logBytes();
+
+    // %ProgramData%\updsvc on Windows, UPDSVC_STATE_DIR or /var/lib/updsvc elsewhere
+    static std::filesystem::path defaultDirectory();
+
+private:
+    struct Entry {
+        ProductState state;
+        // Payload of the product record last written, to skip saves that change nothing
+        std::string record;
+        // ETag of the manifest record last written, and its size if it holds a manifest
+        std::string manifestEtag;
+        size_t manifestBytes = 0;
+    };
+
+    void load();
+    bool append(const std::string &payload);
+    // Size of a log holding only the latest records
+    unsigned long long liveBytes() const;
+    void compact();
+
+    std::filesystem::path dir;
+    bool opened = false;
+    std::FILE *log = nullptr;
+    std::map<std::string, Entry> products;
+    unsigned long long written = 0; // Bytes in the log
+};
+
+#endif // SVCSTATE_H
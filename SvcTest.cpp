@@ -1,11 +1,21 @@
 #include "Svc.h"
+#include "SvcLog.h"
+#include "SvcTrace.h"
 #include <Msi.h>
 #include <Windows.h>
 #include <iostream>
 #include <shellapi.h>
 
 int main(int argc, char *argv[]) {
-    DWORD period = 0;
-    UpdateAll(period);
+    Win32Platform platform;
+    UpdateEngine engine(platform.backends(), PackageCache(PackageCache::defaultDirectory()));
+    LogStart(TEXT("UpdSvc"));
+    // updsvc_test <trace.json> records the cycle for chrome://tracing
+    TraceEnable(argc > 1);
+    engine.updateAll();
+    if (argc > 1) {
+        TraceExportChrome(argv[1]);
+    }
+    LogStop();
     return 0;
 }
@@ -0,0 +1,434 @@
+#include "SvcText.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SVC_TEXT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts AVX2 intrinsics anywhere, GCC and Clang only in functions built for it
+#if defined(__GNUC__) || defined(__clang__)
+#define SVC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SVC_TARGET_AVX2
+#endif
+
+static constexpr char32_t REPLACEMENT_CHARACTER = 0xFFFD;
+static constexpr bool WIDE_IS_UTF16 = sizeof(wchar_t) == 2;
+
+static std::atomic<bool> gUseSimd{true};
+
+// Decodes the character at s[i] and advances i past it. Overlong forms, surrogates and
+// values above U+10FFFF are invalid.
+static char32_t decodeUtf8(std::string_view s, size_t &i) {
+    auto c = static_cast<unsigned char>(s[i]);
+    if (c < 0x80) {
+        ++i;
+        return c;
+    }
+
+    size_t extra;
+    char32_t cp;
+    char32_t min;
+    if ((c & 0xE0) == 0xC0) {
+        extra = 1;
+        cp = c & 0x1F;
+        min = 0x80;
+    }
+    else if ((c & 0xF0) == 0xE0) {
+        extra = 2;
+        cp = c & 0x0F;
+        min = 0x800;
+    }
+    else if ((c & 0xF8) == 0xF0) {
+        extra = 3;
+        cp = c & 0x07;
+        min = 0x10000;
+    }
+    else {
+        ++i;
+        return REPLACEMENT_CHARACTER;
+    }
+
+    size_t j = 1;
+    for (; j <= extra && i + j < s.size(); ++j) {
+        auto cc = static_cast<unsigned char>(s[i + j]);
+        if ((cc & 0xC0) != 0x80) {
+            break;
+        }
+        cp = (cp << 6) | (cc & 0x3F);
+    }
+    if (j <= extra) {
+        // Truncated sequence, resume at the byte that broke it
+        i += j;
+        return REPLACEMENT_CHARACTER;
+    }
+    i += extra + 1;
+    if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return REPLACEMENT_CHARACTER;
+    }
+    return cp;
+}
+
+static char32_t decodeWide(std::wstring_view s, size_t &i) {
+    auto c = static_cast<char32_t>(s[i++]);
+    if constexpr (WIDE_IS_UTF16) {
+        if (c >= 0xD800 && c <= 0xDBFF && i < s.size()) {
+            auto low = static_cast<char32_t>(s[i]);
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                ++i;
+                return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+            }
+        }
+    }
+    if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+        return REPLACEMENT_CHARACTER;
+    }
+    return c;
+}
+
+static size_t wideUnits(char32_t cp) {
+    return WIDE_IS_UTF16 && cp >= 0x10000 ? 2 : 1;
+}
+
+static void putWide(char32_t cp, wchar_t *out) {
+    if (WIDE_IS_UTF16 && cp >= 0x10000) {
+        cp -= 0x10000;
+        out[0] = static_cast<wchar_t>(0xD800 + (cp >> 10));
+        out[1] = static_cast<wchar_t>(0xDC00 + (cp & 0x3FF));
+        return;
+    }
+    out[0] = static_cast<wchar_t>(cp);
+}
+
+static size_t utf8Units(char32_t cp) {
+    return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+}
+
+static void putUtf8(char32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = static_cast<char>(cp);
+    }
+    else if (cp < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (cp >> 6));
+        out[1] = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (cp >> 12));
+        out[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    else {
+        out[0] = static_cast<char>(0xF0 | (cp >> 18));
+        out[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+//
+// ASCII kernels. Each converts whole blocks for as long as they are pure ASCII and returns
+// how many characters it converted; the caller decodes the rest one character at a time.
+//
+
+#ifndef SVC_TEXT_X86
+
+static size_t asciiToWideSwar(const char *in, size_t n, wchar_t *out) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, in + i, 8);
+        if (v & 0x8080808080808080ULL) {
+            break;
+        }
+        for (size_t k = 0; k < 8; ++k) {
+            out[i + k] = static_cast<unsigned char>(in[i + k]);
+        }
+    }
+    return i;
+}
+
+static size_t wideToAsciiSwar(const wchar_t *in, size_t n, char *out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        auto any = static_cast<char32_t>(in[i]) | static_cast<char32_t>(in[i + 1])
+                | static_cast<char32_t>(in[i + 2]) | static_cast<char32_t>(in[i + 3]);
+        if (any >= 0x80) {
+            break;
+        }
+        for (size_t k = 0; k < 4; ++k) {
+            out[i + k] = static_cast<char>(in[i + k]);
+        }
+    }
+    return i;
+}
+
+#else
+
+static size_t asciiToWideSse2(const char *in, size_t n, wchar_t *out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        if (_mm_movemask_epi8(v) != 0) {
+            break;
+        }
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        auto *dst = reinterpret_cast<__m128i *>(out + i);
+        if constexpr (WIDE_IS_UTF16) {
+            _mm_storeu_si128(dst, lo);
+            _mm_storeu_si128(dst + 1, hi);
+        }
+        else {
+            _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+        }
+    }
+    return i;
+}
+
+static size_t wideToAsciiSse2(const wchar_t *in, size_t n, char *out) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto *src = reinterpret_cast<const __m128i *>(in + i);
+        __m128i packed;
+        __m128i high;
+        if constexpr (WIDE_IS_UTF16) {
+            __m128i a = _mm_loadu_si128(src);
+            __m128i b = _mm_loadu_si128(src + 1);
+            high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16(static_cast<short>(0xFF80)));
+            packed = _mm_packus_epi16(a, b);
+        }
+        else {
+            __m128i a = _mm_loadu_si128(src);
+            __m128i b = _mm_loadu_si128(src + 1);
+            __m128i c = _mm_loadu_si128(src + 2);
+            __m128i d = _mm_loadu_si128(src + 3);
+            high = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)),
+                    _mm_set1_epi32(static_cast<int>(0xFFFFFF80)));
+            // Signed saturation is exact below 0x80
+            packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, zero)) != 0xFFFF) {
+            break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+    }
+    return i;
+}
+
+SVC_TARGET_AVX2 static size_t asciiToWideAvx2(const char *in, size_t n, wchar_t *out) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        if (_mm256_movemask_epi8(v) != 0) {
+            break;
+        }
+        auto *dst = reinterpret_cast<__m256i *>(out + i);
+        if constexpr (WIDE_IS_UTF16) {
+            _mm256_storeu_si256(dst, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+            _mm256_storeu_si256(dst + 1, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+        }
+        else {
+            for (int k = 0; k < 4; ++k) {
+                auto *src = reinterpret_cast<const __m128i *>(in + i + 8 * k);
+                _mm256_storeu_si256(dst + k, _mm256_cvtepu8_epi32(_mm_loadl_epi64(src)));
+            }
+        }
+    }
+    return i;
+}
+
+SVC_TARGET_AVX2 static size_t wideToAsciiAvx2(const wchar_t *in, size_t n, char *out) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto *src = reinterpret_cast<const __m256i *>(in + i);
+        __m256i packed;
+        if constexpr (WIDE_IS_UTF16) {
+            __m256i a = _mm256_loadu_si256(src);
+            __m256i b = _mm256_loadu_si256(src + 1);
+            __m256i high = _mm256_and_si256(
+                    _mm256_or_si256(a, b), _mm256_set1_epi16(static_cast<short>(0xFF80)));
+            if (! _mm256_testz_si256(high, high)) {
+                break;
+            }
+            // packus works per 128-bit lane, put the quadwords back in order
+            packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        }
+        else {
+            __m256i a = _mm256_loadu_si256(src);
+            __m256i b = _mm256_loadu_si256(src + 1);
+            __m256i c = _mm256_loadu_si256(src + 2);
+            __m256i d = _mm256_loadu_si256(src + 3);
+            __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+            __m256i high = _mm256_and_si256(any, _mm256_set1_epi32(static_cast<int>(0xFFFFFF80)));
+            if (! _mm256_testz_si256(high, high)) {
+                break;
+            }
+            __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+            packed = _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), packed);
+    }
+    return i;
+}
+
+static bool cpuHasAvx2() {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_cpu_supports("avx2");
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    // The OS must save the YMM registers on context switches
+    return osxsave && avx2 && (_xgetbv(0) & 6) == 6;
+#else
+    return false;
+#endif
+}
+
+static const bool gHasAvx2 = cpuHasAvx2();
+
+#endif // SVC_TEXT_X86
+
+static size_t asciiToWide(const char *in, size_t n, wchar_t *out) {
+    if (! gUseSimd.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+#ifdef SVC_TEXT_X86
+    size_t done = gHasAvx2 ? asciiToWideAvx2(in, n, out) : 0;
+    return done + asciiToWideSse2(in + done, n - done, out + done);
+#else
+    return asciiToWideSwar(in, n, out);
+#endif
+}
+
+static size_t wideToAscii(const wchar_t *in, size_t n, char *out) {
+    if (! gUseSimd.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+#ifdef SVC_TEXT_X86
+    size_t done = gHasAvx2 ? wideToAsciiAvx2(in, n, out) : 0;
+    return done + wideToAsciiSse2(in + done, n - done, out + done);
+#else
+    return wideToAsciiSwar(in, n, out);
+#endif
+}
+
+// How many characters are decoded one at a time after a vector block turned out not to be
+// ASCII, before trying the vector path again. The stride doubles every time the vector path
+// comes back empty-handed, so text with a non-ASCII letter every few characters ends up on
+// the scalar loop instead of paying for a failed block each time.
+static constexpr size_t SCALAR_STRIDE = 16;
+static constexpr size_t SCALAR_STRIDE_MAX = 1024;
+
+size_t Utf8ToWide(std::string_view in, wchar_t *out, size_t capacity) {
+    size_t i = 0;
+    size_t o = 0;
+    size_t stride = SCALAR_STRIDE;
+    while (i < in.size() && o < capacity) {
+        size_t run = asciiToWide(in.data() + i, std::min(in.size() - i, capacity - o), out + o);
+        i += run;
+        o += run;
+        stride = run != 0 ? SCALAR_STRIDE : std::min(stride * 2, SCALAR_STRIDE_MAX);
+
+        size_t stop = std::min(in.size(), i + stride);
+        while (i < stop) {
+            auto c = static_cast<unsigned char>(in[i]);
+            if (c < 0x80 && o < capacity) {
+                out[o++] = c;
+                ++i;
+                continue;
+            }
+            size_t at = i;
+            char32_t cp = decodeUtf8(in, i);
+            size_t units = wideUnits(cp);
+            if (o + units > capacity) {
+                i = at;
+                return o;
+            }
+            putWide(cp, out + o);
+            o += units;
+        }
+    }
+    return o;
+}
+
+size_t WideToUtf8(std::wstring_view in, char *out, size_t capacity) {
+    size_t i = 0;
+    size_t o = 0;
+    size_t stride = SCALAR_STRIDE;
+    while (i < in.size() && o < capacity) {
+        size_t run = wideToAscii(in.data() + i, std::min(in.size() - i, capacity - o), out + o);
+        i += run;
+        o += run;
+        stride = run != 0 ? SCALAR_STRIDE : std::min(stride * 2, SCALAR_STRIDE_MAX);
+
+        size_t stop = std::min(in.size(), i + stride);
+        while (i < stop) {
+            auto c = static_cast<char32_t>(in[i]);
+            if (c < 0x80 && o < capacity) {
+                out[o++] = static_cast<char>(c);
+                ++i;
+                continue;
+            }
+            size_t at = i;
+            char32_t cp = decodeWide(in, i);
+            size_t units = utf8Units(cp);
+            if (o + units > capacity) {
+                i = at;
+                return o;
+            }
+            putUtf8(cp, out + o);
+            o += units;
+        }
+    }
+    return o;
+}
+
+// Convert std::string to wstring
+std::wstring s2ws(std::string_view s) {
+    std::wstring buf(s.size(), L'\0');
+    buf.resize(Utf8ToWide(s, buf.data(), buf.size()));
+    return buf;
+}
+
+// Convert wstring to std::string
+std::string ws2s(std::wstring_view s) {
+    std::string buf(s.size() * (WIDE_IS_UTF16 ? 3 : 4), '\0');
+    buf.resize(WideToUtf8(s, buf.data(), buf.size()));
+    return buf;
+}
+
+size_t Utf8Truncate(std::string_view s, size_t maxBytes) {
+    if (s.size() <= maxBytes) {
+        return s.size();
+    }
+    // s[n] is the first byte left out; if it continues a sequence, leave out its start too
+    size_t n = maxBytes;
+    while (n > 0 && (static_cast<unsigned char>(s[n]) & 0xC0) == 0x80) {
+        --n;
+    }
+    return n;
+}
+
+void TextUseSimd(bool enable) {
+    gUseSimd.store(enable, std::memory_order_relaxed);
+}
@@ -0,0 +1,30 @@
+#ifndef SVCTEXT_H
+#define SVCTEXT_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Strings are UTF-8 everywhere inside the service; these convert at the Win32 API boundary,
+// where wchar_t is UTF-16 (UTF-32 on other platforms). Invalid input becomes U+FFFD, the way
+// MultiByteToWideChar handles it. Runs of ASCII are converted 16 or 32 characters at a time
+// with SSE2 or AVX2, whichever the CPU has.
+
+// Converts into out and stops before a character that would not fit. Returns the number of
+// wchar_t written; capacity >= in.size() is always enough.
+size_t Utf8ToWide(std::string_view in, wchar_t *out, size_t capacity);
+
+// Same in the other direction; capacity >= 3 * in.size() (4 * in.size() with a 32-bit
+// wchar_t) is always enough.
+size_t WideToUtf8(std::wstring_view in, char *out, size_t capacity);
+
+std::wstring s2ws(std::string_view s);
+std::string ws2s(std::wstring_view s);
+
+// Length of the longest prefix of s that fits in maxBytes without splitting a character
+size_t Utf8Truncate(std::string_view s, size_t maxBytes);
+
+// Turns the vector paths off, so benchmarks can compare against the scalar code
+void TextUseSimd(bool enable);
+
+#endif // SVCTEXT_H
@@ -0,0 +1,115 @@
+#include "SvcTrace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Per-thread cap so a forgotten TRACE_PATH cannot grow the service without bound.
+static constexpr size_t TRACE_MAX_EVENTS_PER_THREAD = 65536;
+
+std::atomic<bool> gTraceEnabled{false};
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    long long begin;
+    long long end;
+};
+
+struct ThreadBuffer {
+    // Only contended while an export is running
+    std::mutex lock;
+    std::vector<TraceEvent> events;
+    unsigned tid = 0;
+    unsigned long long dropped = 0;
+};
+
+std::mutex gBuffersLock;
+std::vector<std::shared_ptr<ThreadBuffer>> gBuffers;
+unsigned gNextTid = 1;
+const auto gEpoch = std::chrono::steady_clock::now();
+
+ThreadBuffer &threadBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer;
+    if (! buffer) {
+        buffer = std::make_shared<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(gBuffersLock);
+        buffer->tid = gNextTid++;
+        gBuffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+} // namespace
+
+long long TraceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - gEpoch)
+            .count();
+}
+
+void TraceRecord(const char *name, long long begin, long long end) {
+    auto &buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.lock);
+    if (buffer.events.size() >= TRACE_MAX_EVENTS_PER_THREAD) {
+        ++buffer.dropped;
+        return;
+    }
+    buffer.events.push_back({name, begin, end});
+}
+
+void TraceEnable(bool enable) {
+    gTraceEnabled.store(enable, std::memory_order_relaxed);
+}
+
+bool TraceExportChrome(const std::filesystem::path &path) {
+    std::ofstream ostr(path, std::ios::trunc | std::ios::binary);
+    if (! ostr.is_open()) {
+        return false;
+    }
+
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(gBuffersLock);
+        buffers = gBuffers;
+    }
+
+    // Timestamps are microseconds in the trace-event format
+    char line[256];
+    bool first = true;
+    ostr << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (auto &buffer : buffers) {
+        std::vector<TraceEvent> events;
+        unsigned long long dropped;
+        {
+            std::lock_guard<std::mutex> lock(buffer->lock);
+            events.swap(buffer->events);
+            dropped = buffer->dropped;
+            buffer->dropped = 0;
+        }
+
+        for (auto &event : events) {
+            std::snprintf(line, sizeof(line),
+                    "%s\n{\"name\":\"%s\",\"cat\":\"updsvc\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                    "\"ts\":%.3f,\"dur\":%.3f}",
+                    first ? "" : ",", event.name, buffer->tid, event.begin / 1000.0,
+                    (event.end - event.begin) / 1000.0);
+            ostr << line;
+            first = false;
+        }
+        if (dropped) {
+            std::snprintf(line, sizeof(line),
+                    "%s\n{\"name\":\"dropped\",\"ph\":\"C\",\"pid\":1,\"tid\":%u,\"ts\":0,"
+                    "\"args\":{\"spans\":%llu}}",
+                    first ? "" : ",", buffer->tid, dropped);
+            ostr << line;
+            first = false;
+        }
+    }
+    ostr << "\n]}\n";
+    return ostr.good();
+}
@@ -0,0 +1,48 @@
+#ifndef SVCTRACE_H
+#define SVCTRACE_H
+
+#include <atomic>
+#include <filesystem>
+
+// Scoped latency spans for the update cycle. Spans are kept in a buffer owned by the
+// recording thread and written out as Chrome trace-event JSON (chrome://tracing, Perfetto).
+// While tracing is disabled a span costs one relaxed load and a branch.
+
+extern std::atomic<bool> gTraceEnabled;
+
+// Nanoseconds on the monotonic clock
+long long TraceNow();
+void TraceRecord(const char *name, long long begin, long long end);
+
+void TraceEnable(bool enable);
+
+// Writes every buffered span to path and empties the buffers.
+bool TraceExportChrome(const std::filesystem::path &path);
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name) {
+        if (gTraceEnabled.load(std::memory_order_relaxed)) {
+            this->name = name;
+            begin = TraceNow();
+        }
+    }
+    ~TraceSpan() {
+        if (name) {
+            TraceRecord(name, begin, TraceNow());
+        }
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name = nullptr;
+    long long begin = 0;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// name must be a string literal, only the pointer is stored
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name)
+
+#endif // SVCTRACE_H
@@ -0,0 +1,149 @@
+#ifndef SVCVALIDATE_H
+#define SVCVALIDATE_H
+
+#include <string_view>
+
+// Scanners for the product GUIDs, package file names and URLs the service checks on every
+// cycle. They used to be std::regex patterns, which are compiled at runtime and then matched
+// by a backtracking engine; these are single passes and constexpr, so the cases at the bottom
+// of this file are checked by the compiler.
+
+enum class GuidBraces {
+    Optional, // Registry key names, MSI accepts both forms
+    Required, // What the Settings dialog writes
+};
+
+template <class CharT>
+constexpr bool validateIsHex(CharT c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+template <class CharT>
+constexpr bool validateGuid(std::basic_string_view<CharT> s, GuidBraces braces) {
+    bool braced = ! s.empty() && s.front() == '{';
+    if (braced) {
+        if (s.back() != '}') {
+            return false;
+        }
+        s = s.substr(1, s.size() - 2);
+    }
+    else if (braces == GuidBraces::Required) {
+        return false;
+    }
+
+    // xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+    if (s.size() != 36) {
+        return false;
+    }
+    for (size_t i = 0; i < s.size(); ++i) {
+        bool dash = i == 8 || i == 13 || i == 18 || i == 23;
+        if (dash ? s[i] != '-' : ! validateIsHex(s[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+constexpr bool IsValidGuid(std::string_view s, GuidBraces braces = GuidBraces::Optional) {
+    return validateGuid(s, braces);
+}
+
+constexpr bool IsValidGuid(std::wstring_view s, GuidBraces braces = GuidBraces::Optional) {
+    return validateGuid(s, braces);
+}
+
+// Package names from the manifest end up as a path under the package cache, so only
+// [A-Za-z0-9._-] is allowed and "." and ".." are rejected.
+constexpr bool IsSafeFileName(std::string_view s) {
+    if (s.empty() || s == "." || s == "..") {
+        return false;
+    }
+    for (char c : s) {
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                || c == '.' || c == '_' || c == '-';
+        if (! ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct UrlParts {
+    std::string_view scheme; // "http", "https" or empty when the URL has none
+    std::string_view host; // Including the port, if any
+    std::string_view path; // From the first '/' after the host, query included
+};
+
+constexpr bool validateHasPrefix(std::string_view s, std::string_view prefix) {
+    if (s.size() < prefix.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < prefix.size(); ++i) {
+        char c = s[i];
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<char>(c + ('a' - 'A'));
+        }
+        if (c != prefix[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Splits an http(s) URL into host and path. The host is empty when the URL has a scheme
+// other than http or https, no host, or no path.
+constexpr UrlParts SplitUrl(std::string_view url) {
+    UrlParts parts;
+    auto rest = url;
+    if (validateHasPrefix(rest, "https://")) {
+        parts.scheme = rest.substr(0, 5);
+        rest.remove_prefix(8);
+    }
+    else if (validateHasPrefix(rest, "http://")) {
+        parts.scheme = rest.substr(0, 4);
+        rest.remove_prefix(7);
+    }
+    else if (rest.find("://") != std::string_view::npos) {
+        return {};
+    }
+
+    auto slash = rest.find('/');
+    if (slash == 0 || slash == std::string_view::npos) {
+        return {};
+    }
+    parts.host = rest.substr(0, slash);
+    parts.path = rest.substr(slash);
+    return parts;
+}
+
+static_assert(IsValidGuid("{028818E2-5DF4-414F-A1E4-2AA542DE4697}"));
+static_assert(IsValidGuid("028818e2-5df4-414f-a1e4-2aa542de4697"));
+static_assert(IsValidGuid(L"{028818E2-5DF4-414F-A1E4-2AA542DE4697}", GuidBraces::Required));
+static_assert(! IsValidGuid(L"028818E2-5DF4-414F-A1E4-2AA542DE4697", GuidBraces::Required));
+static_assert(! IsValidGuid("{028818E2-5DF4-414F-A1E4-2AA542DE4697"));
+static_assert(! IsValidGuid("{028818E2-5DF4-414F-A1E4-2AA542DE469}"));
+static_assert(! IsValidGuid("{028818E2-5DF4-414F-A1E4-2AA542DE469G}"));
+static_assert(! IsValidGuid("{028818E2_5DF4-414F-A1E4-2AA542DE4697}"));
+static_assert(! IsValidGuid("{}"));
+static_assert(! IsValidGuid(""));
+
+static_assert(IsSafeFileName("mgui-wgt_2.4.1.exe"));
+static_assert(! IsSafeFileName(""));
+static_assert(! IsSafeFileName(".."));
+static_assert(! IsSafeFileName("..\\setup.exe"));
+static_assert(! IsSafeFileName("setup.exe?token=1"));
+static_assert(! IsSafeFileName("kurulum\xC3\xA7.exe"));
+
+static_assert(SplitUrl("https://updates.example.com/mgui-wgt/manifest.json").scheme == "https");
+static_assert(SplitUrl("https://updates.example.com/mgui-wgt/manifest.json").host
+        == "updates.example.com");
+static_assert(SplitUrl("HTTPS://updates.example.com/a").path == "/a");
+static_assert(SplitUrl("http://127.0.0.1:8080/pkg.bin").host == "127.0.0.1:8080");
+static_assert(SplitUrl("http://127.0.0.1:8080/pkg.bin").path == "/pkg.bin");
+static_assert(SplitUrl("updates.example.com/a?b=c").path == "/a?b=c");
+static_assert(SplitUrl("updates.example.com/a").scheme.empty());
+static_assert(SplitUrl("ftp://updates.example.com/a").host.empty());
+static_assert(SplitUrl("https://updates.example.com").host.empty());
+static_assert(SplitUrl("https:///manifest.json").host.empty());
+
+#endif // SVCVALIDATE_H
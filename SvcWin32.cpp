@@ -0,0 +1,1268 @@
+#include <winsock2.h>
+#include <windows.h>
+
+#include <mstcpip.h>
+#include <tlhelp32.h>
+#include <winhttp.h>
+#include <winioctl.h>
+
+#include <Msi.h>
+#include <msiquery.h>
+
+#include "SvcMetrics.h"
+#include "SvcText.h"
+#include "SvcTrace.h"
+#include "SvcValidate.h"
+#include "SvcWin32.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cstddef>
+#include <cwchar>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+static const std::wstring REGISTRY_ROOT = L"SOFTWARE\\Arskom\\updsvc";
+static const std::wstring INSTALLER_USERDATA =
+        L"SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Installer\\UserData";
+
+// How often a download refreshes RequestStats::rtt from the connection's TCP statistics
+static constexpr std::chrono::milliseconds RTT_REFRESH{100};
+
+static std::wstring readDataString(std::wstring keyPath, std::wstring regValueName);
+static DWORD ReadDWORDFromRegedit(std::wstring keyPath, std::wstring regValueName);
+static void createRegistryEntry(
+        std::wstring keyPath, std::wstring stringvalue, std::wstring valueData);
+static BannedSet readBannedFiles(const std::wstring &keyPath);
+static UINT GetProductInfo(
+        const std::wstring &product_guid, const wchar_t *property, std::wstring &value);
+static std::wstring PackedGuid(const std::string &product_guid);
+static std::wstring GetSourcePath(const std::wstring &product_guid);
+static std::wstring GetFirstFileNameInDirectory(const std::wstring &directoryPath);
+static std::wstring ReadMSI(const std::wstring &product_guid, const wchar_t *msiPath);
+static std::wstring getPathofComponent(
+        const std::wstring &product_guid, const wchar_t *componentid);
+static bool isexe(std::wstring s);
+static int ListProcessModules(DWORD dwPID, const std::wstring &exepath);
+
+bool WinHttpTransport::get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) {
+    TRACE_SPAN("CreateRequest");
+    DWORD dwSize = 0;
+    DWORD dwDownloaded = 0;
+    DWORD dwStatusCode = 0;
+    unsigned long long totalBytes = 0;
+    std::string buffer;
+
+    BOOL bResults = FALSE;
+    HINTERNET hSession = NULL, hConnect = NULL, hRequest = NULL;
+    long long stageBegin = TraceNow();
+    auto domain = s2ws(request.domain);
+    auto path = s2ws(request.path);
+
+    // Mirrors usually listen on a port of their own ("mirror:8080")
+    INTERNET_PORT port = INTERNET_DEFAULT_PORT;
+    if (auto colon = domain.rfind(L':'); colon != std::wstring::npos) {
+        port = static_cast<INTERNET_PORT>(std::wcstoul(domain.c_str() + colon + 1, nullptr, 10));
+        domain.resize(colon);
+    }
+
+    // Use WinHttpOpen to obtain a session handle.
+    hSession = WinHttpOpen(L"Http Request Attempt", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+            WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+
+    // Specify an HTTP server.
+    if (hSession) {
+        hConnect = WinHttpConnect(hSession, domain.c_str(), port, 0);
+        SvcReportInfo("HTTP server specified");
+    }
+    // Create an HTTP Request handle.
+    if (hConnect) {
+        hRequest = WinHttpOpenRequest(hConnect, L"GET", path.c_str(), NULL,
+                WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES, 0);
+        SvcReportInfo("HTTP request handle created");
+    }
+    // Until the handles are closed below; the callback closes the request handle instead
+    bool aborted = false;
+    CancelToken::Registration abort;
+    if (hRequest && cancel) {
+        abort = cancel->onCancel([&] {
+            WinHttpCloseHandle(hRequest);
+            aborted = true;
+        });
+    }
+    if (hRequest && request.compressed) {
+        // Windows 8.1 and later send Accept-Encoding and inflate the body before
+        // WinHttpReadData returns it. Older versions refuse the option and get it plain.
+        DWORD decompression = WINHTTP_DECOMPRESSION_FLAG_GZIP;
+        WinHttpSetOption(
+                hRequest, WINHTTP_OPTION_DECOMPRESSION, &decompression, sizeof(decompression));
+    }
+    if (gTraceEnabled.load(std::memory_order_relaxed)) {
+        TraceRecord("WinHttpConnect", stageBegin, TraceNow());
+    }
+
+    // Send a Request.
+    if (hRequest) {
+        TRACE_SPAN("WinHttpSendRequest");
+        std::wstring headers;
+        if (! request.range.empty()) {
+            headers += L"Range: " + s2ws(request.range) + L"\r\n";
+            if (! request.ifRange.empty()) {
+                headers += L"If-Range: " + s2ws(request.ifRange) + L"\r\n";
+            }
+        }
+        if (! request.ifNoneMatch.empty()) {
+            headers += L"If-None-Match: " + s2ws(request.ifNoneMatch) + L"\r\n";
+        }
+        bResults = WinHttpSendRequest(hRequest,
+                headers.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : headers.c_str(),
+                static_cast<DWORD>(headers.size()), WINHTTP_NO_REQUEST_DATA, 0, 0, 0);
+        SvcReportInfo("Request sent");
+    }
+
+    // End the request.
+    if (bResults) {
+        TRACE_SPAN("WinHttpReceiveResponse");
+        bResults = WinHttpReceiveResponse(hRequest, NULL);
+        SvcReportInfo("Request ended");
+    }
+
+    if (bResults) {
+        DWORD dwStatusSize = sizeof(dwStatusCode);
+        WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                WINHTTP_HEADER_NAME_BY_INDEX, &dwStatusCode, &dwStatusSize,
+                WINHTTP_NO_HEADER_INDEX);
+        stats.status = dwStatusCode;
+
+        wchar_t etag[256];
+        DWORD etagSize = sizeof(etag);
+        if (WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_ETAG, WINHTTP_HEADER_NAME_BY_INDEX, etag,
+                    &etagSize, WINHTTP_NO_HEADER_INDEX)) {
+            stats.etag = ws2s(std::wstring_view(etag, etagSize / sizeof(wchar_t)));
+        }
+    }
+
+    // Keep checking for data until there is nothing left.
+    if (bResults) {
+        TRACE_SPAN("ReadBody");
+        std::chrono::steady_clock::time_point rttRefreshed;
+        do {
+            // Check for available data.
+            dwSize = 0;
+            if (! WinHttpQueryDataAvailable(hRequest, &dwSize)) {
+                SvcReportEvent("WinHttpQueryDataAvailable");
+                bResults = FALSE;
+                break;
+            }
+
+            // No more available data.
+            if (! dwSize) {
+                break;
+            }
+
+            // The buffer only grows, chunks are rarely larger than a few KB
+            if (buffer.size() < dwSize) {
+                buffer.resize(dwSize);
+            }
+
+            // Read the Data.
+            if (! WinHttpReadData(hRequest, buffer.data(), dwSize, &dwDownloaded)) {
+                SvcReportEvent("WinHttpReadData");
+                bResults = FALSE;
+                break;
+            }
+
+            assert(dwSize == dwDownloaded);
+            totalBytes += dwDownloaded;
+#ifdef WINHTTP_OPTION_CONNECTION_STATS_V0
+            if (auto now = std::chrono::steady_clock::now(); now - rttRefreshed >= RTT_REFRESH) {
+                rttRefreshed = now;
+                TCP_INFO_v0 info{};
+                DWORD infoSize = sizeof(info);
+                if (WinHttpQueryOption(hRequest, WINHTTP_OPTION_CONNECTION_STATS_V0, &info,
+                            &infoSize)) {
+                    stats.rtt = std::chrono::microseconds(info.RttUs);
+                }
+            }
+#endif
+            sink.write(buffer.data(), dwDownloaded);
+            if (! sink) {
+                bResults = FALSE;
+                break;
+            }
+
+            // This condition should never be reached since WinHttpQueryDataAvailable
+            // reported that there are bits to read.
+            if (dwDownloaded == 0) {
+                break;
+            }
+        } while (dwSize > 0);
+    }
+    else {
+        // Report any errors.
+        SvcReportEvent("Sending request");
+    }
+
+    // Close any open handles.
+    abort = {};
+    if (hRequest && ! aborted) {
+        WinHttpCloseHandle(hRequest);
+    }
+    if (aborted) {
+        SvcReportInfo("Request cancelled, the service is stopping");
+        bResults = FALSE;
+    }
+    if (hConnect) {
+        WinHttpCloseHandle(hConnect);
+    }
+    if (hSession) {
+        WinHttpCloseHandle(hSession);
+    }
+
+    stats.status = dwStatusCode;
+    stats.bytes = totalBytes;
+    // WinHTTP does not tell how large a body it decompressed was on the wire
+    stats.wireBytes = totalBytes;
+    return bResults != FALSE;
+}
+
+bool RegistryConfigStore::products(std::vector<std::string> &product_guids) {
+    HKEY hKey;
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, REGISTRY_ROOT.c_str(), 0, KEY_READ, &hKey)
+            != ERROR_SUCCESS) {
+        SvcReportEvent("Unable to open registry key: SOFTWARE\\Arskom\\updsvc");
+        return false;
+    }
+
+    wchar_t subkeyName[MAX_PATH];
+    DWORD index = 0;
+    while (RegEnumKey(hKey, index, subkeyName, MAX_PATH) == ERROR_SUCCESS) {
+        product_guids.push_back(ws2s(subkeyName));
+        index++;
+    }
+
+    RegCloseKey(hKey);
+    return true;
+}
+
+// Like ReadDWORDFromRegedit, for values that are usually not set
+static DWORD readOptionalDWORD(
+        const std::wstring &keyPath, const std::wstring &regValueName, DWORD defaultValue) {
+    DWORD value = 0;
+    DWORD size = sizeof(value);
+    if (RegGetValue(HKEY_LOCAL_MACHINE, keyPath.c_str(), regValueName.c_str(), RRF_RT_REG_DWORD,
+                NULL, &value, &size)
+            != ERROR_SUCCESS) {
+        return defaultValue;
+    }
+    return value;
+}
+
+// Like readDataString, but a missing value is not an error
+static std::wstring readOptionalString(
+        const std::wstring &keyPath, const std::wstring &regValueName) {
+    DWORD size = 0;
+    if (RegGetValue(HKEY_LOCAL_MACHINE, keyPath.c_str(), regValueName.c_str(), RRF_RT_REG_SZ,
+                NULL, NULL, &size)
+            != ERROR_SUCCESS) {
+        return {};
+    }
+    std::wstring value(size / sizeof(wchar_t), L'\0');
+    if (RegGetValue(HKEY_LOCAL_MACHINE, keyPath.c_str(), regValueName.c_str(), RRF_RT_REG_SZ,
+                NULL, value.data(), &size)
+            != ERROR_SUCCESS) {
+        return {};
+    }
+    value.resize(size / sizeof(wchar_t) - 1);
+    return value;
+}
+
+Config RegistryConfigStore::readProduct(const std::string &product_guid) {
+    auto keyPath = REGISTRY_ROOT + L"\\" + s2ws(product_guid);
+    Config cfg;
+    cfg.product_guid = product_guid;
+    cfg.url = ws2s(readDataString(keyPath, L"URL"));
+    cfg.params_full = ws2s(readDataString(keyPath, L"PARAMS_FULL"));
+    cfg.params_patch = ws2s(readDataString(keyPath, L"PARAMS_PATCH"));
+    cfg.period = ReadDWORDFromRegedit(keyPath, L"PERIOD");
+    cfg.rel_chan = ws2s(readDataString(keyPath, L"REL_CHAN"));
+    cfg.bandwidth.dayKBps = readOptionalDWORD(keyPath, L"BANDWIDTH_DAY", 0);
+    cfg.bandwidth.nightKBps = readOptionalDWORD(keyPath, L"BANDWIDTH_NIGHT", 0);
+    cfg.bandwidth.adaptive = readOptionalDWORD(keyPath, L"BANDWIDTH_ADAPTIVE", 0) != 0;
+    cfg.stage_dir = ws2s(readOptionalString(keyPath, L"STAGE_DIR"));
+    return cfg;
+}
+
+BannedSet RegistryConfigStore::readBanned(const std::string &product_guid) {
+    return readBannedFiles(REGISTRY_ROOT + L"\\" + s2ws(product_guid) + L"\\banned");
+}
+
+void RegistryConfigStore::addBanned(const std::string &product_guid, const std::string &filename) {
+    createRegistryEntry(
+            REGISTRY_ROOT + L"\\" + s2ws(product_guid) + L"\\banned", s2ws(filename), L"1");
+}
+
+// Optional settings directly under SOFTWARE\Arskom\updsvc.
+std::string RegistryConfigStore::readSetting(const std::string &name) {
+    return ws2s(readOptionalString(REGISTRY_ROOT, s2ws(name)));
+}
+
+unsigned long RegistryConfigStore::readSetting(
+        const std::string &name, unsigned long defaultValue) {
+    return readOptionalDWORD(REGISTRY_ROOT, s2ws(name), defaultValue);
+}
+
+// Function to retrieve the version of a program
+std::string MsiInventory::installedVersion(const std::string &product_guid) {
+    TRACE_SPAN("GetProgramVersion");
+    std::wstring version;
+
+    // Use MsiGetProductInfo for get the version
+    UINT result =
+            GetProductInfo(s2ws(product_guid), INSTALLPROPERTY_VERSIONSTRING, version);
+    if (result == ERROR_SUCCESS) {
+        return ws2s(version);
+    }
+    SvcReportEvent("Getting program version");
+    return {};
+}
+
+// The main executable is the first .exe component of the MSI package the product was
+// installed from.
+std::string MsiInventory::executablePath(const std::string &product_guid) {
+    auto wideGuid = s2ws(product_guid);
+    auto source = GetSourcePath(wideGuid);
+    auto fullpath = source + GetFirstFileNameInDirectory(source);
+    return ws2s(ReadMSI(wideGuid, fullpath.c_str()));
+}
+
+MsiInventory::~MsiInventory() {
+    if (changeEvent) {
+        CloseHandle(changeEvent);
+    }
+    if (watched) {
+        RegCloseKey(watched);
+    }
+}
+
+std::string MsiInventory::installStamp(const std::string &product_guid) {
+    auto packed = PackedGuid(product_guid);
+    HKEY hKey;
+    if (packed.empty()
+            || RegOpenKeyEx(HKEY_LOCAL_MACHINE,
+                       (INSTALLER_USERDATA + L"\\S-1-5-18\\Products\\" + packed
+                               + L"\\InstallProperties")
+                               .c_str(),
+                       0, KEY_QUERY_VALUE | KEY_WOW64_64KEY, &hKey)
+                    != ERROR_SUCCESS) {
+        // Not installed, or installed for a user; read again whenever anything changed
+        return {};
+    }
+    FILETIME written = {};
+    LONG result = RegQueryInfoKey(
+            hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &written);
+    RegCloseKey(hKey);
+    if (result != ERROR_SUCCESS) {
+        return {};
+    }
+    return std::to_string(
+            (static_cast<unsigned long long>(written.dwHighDateTime) << 32)
+            | written.dwLowDateTime);
+}
+
+bool MsiInventory::changed() {
+    if (changeEvent && WaitForSingleObject(changeEvent, 0) == WAIT_TIMEOUT) {
+        return false;
+    }
+    // Armed again before the products are read, a change in the meantime is not missed
+    watch();
+    return true;
+}
+
+bool MsiInventory::watch() {
+    if (! watched
+            && RegOpenKeyEx(HKEY_LOCAL_MACHINE, INSTALLER_USERDATA.c_str(), 0,
+                       KEY_NOTIFY | KEY_WOW64_64KEY, &watched)
+                    != ERROR_SUCCESS) {
+        watched = NULL;
+        return false;
+    }
+    if (! changeEvent) {
+        changeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
+    // Thread agnostic, the notification outlives the thread that asked for it
+    if (! changeEvent
+            || RegNotifyChangeKeyValue(watched, TRUE,
+                       REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET
+                               | REG_NOTIFY_THREAD_AGNOSTIC,
+                       changeEvent, TRUE)
+                    != ERROR_SUCCESS) {
+        SvcReportEvent("Watching the Windows Installer records");
+        if (changeEvent) {
+            CloseHandle(changeEvent);
+            changeEvent = NULL;
+        }
+        return false;
+    }
+    return true;
+}
+
+ProcessState ToolhelpProbe::query(const std::string &exePath) {
+    TRACE_SPAN("isRunning");
+    auto widePath = s2ws(exePath);
+    HANDLE hProcessSnap;
+    PROCESSENTRY32 pe32;
+
+    // Take a snapshot of all processes in the system.
+    hProcessSnap = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (hProcessSnap == INVALID_HANDLE_VALUE) {
+        SvcReportEvent(("Taking snapshot of all processes"));
+        return ProcessState::Unknown;
+    }
+
+    // Set the size of the structure before using it.
+    pe32.dwSize = sizeof(PROCESSENTRY32);
+
+    // Retrieve information about the first process,
+    // and exit if unsuccessful
+    if (! Process32First(hProcessSnap, &pe32)) {
+        SvcReportEvent(("Retrieve information about first process"));
+        CloseHandle(hProcessSnap); // clean the snapshot object
+        return ProcessState::Unknown;
+    }
+
+    std::size_t lastSlashPos = widePath.find_last_of(L"\\");
+    auto exename = widePath.substr(lastSlashPos + 1);
+    auto state = ProcessState::NotRunning;
+    // Now walk the snapshot of processes, and
+    // compare programs name with all processes
+    do {
+        if (! (wcscmp(pe32.szExeFile, exename.c_str()))) {
+            auto programsituation = ListProcessModules(pe32.th32ProcessID, widePath);
+            if (programsituation == 1) {
+                state = ProcessState::Running;
+                break;
+            }
+            else if (programsituation == -1) {
+                state = ProcessState::Unknown;
+                break;
+            }
+        }
+
+    } while (Process32Next(hProcessSnap, &pe32));
+
+    CloseHandle(hProcessSnap);
+    return state;
+}
+
+// The process tree of one installer
+class JobInstall : public InstallJob {
+public:
+    JobInstall(HANDLE job, HANDLE process, HANDLE stopEvent, std::chrono::seconds timeout)
+        : job(job)
+        , process(process)
+        , stopEvent(stopEvent)
+        , deadline(timeout.count() != 0 ? std::chrono::steady_clock::now() + timeout
+                                        : std::chrono::steady_clock::time_point::max()) {}
+
+    ~JobInstall() override {
+        if (! finished) {
+            // Nobody is going to wait for it any more
+            TerminateJobObject(job, ERROR_PROCESS_ABORTED);
+        }
+        CloseHandle(process);
+        CloseHandle(job);
+    }
+
+    bool wait(std::chrono::milliseconds timeout) override {
+        if (finished) {
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        bool lastWait = deadline - now <= timeout;
+        if (lastWait) {
+            timeout = std::max(std::chrono::milliseconds(0),
+                    std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+        }
+        HANDLE handles[] = {process, stopEvent};
+        DWORD waited = WaitForMultipleObjects(stopEvent ? 2 : 1, handles, FALSE,
+                static_cast<DWORD>(std::min<long long>(timeout.count(), INFINITE - 1)));
+
+        if (waited == WAIT_OBJECT_0) {
+            DWORD exitCode = 0;
+            if (! GetExitCodeProcess(process, &exitCode)) {
+                SvcReportEvent(("GetExitCode of installing exe"));
+            }
+            outcome.exitCode = exitCode;
+            finished = true;
+            return true;
+        }
+        if (waited == WAIT_TIMEOUT && ! lastWait) {
+            return false;
+        }
+        if (waited == WAIT_TIMEOUT) {
+            outcome.timedOut = true;
+        }
+        else {
+            if (waited == WAIT_FAILED) {
+                SvcReportEvent("Waiting for installer");
+            }
+            outcome.stopped = true;
+        }
+        // The installer and whatever it started, helpers and msiexec sessions included
+        if (! TerminateJobObject(job, ERROR_TIMEOUT)) {
+            SvcReportEvent("TerminateJobObject");
+        }
+        finished = true;
+        return true;
+    }
+
+    InstallResult result() override { return outcome; }
+
+private:
+    HANDLE job;
+    HANDLE process;
+    HANDLE stopEvent;
+    std::chrono::steady_clock::time_point deadline;
+    bool finished = false;
+    InstallResult outcome;
+};
+
+std::unique_ptr<InstallJob> ProcessInstaller::start(const std::filesystem::path &package,
+        const std::string &arguments, const InstallLimits &limits) {
+    HANDLE job = CreateJobObject(NULL, NULL);
+    if (! job) {
+        SvcReportEvent("CreateJobObject");
+        return nullptr;
+    }
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info = {};
+    if (limits.cpuTime.count() != 0) {
+        // 100 ns units; the job's processes are terminated when they used it up
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_TIME;
+        info.BasicLimitInformation.PerJobUserTimeLimit.QuadPart =
+                limits.cpuTime.count() * 10000000LL;
+    }
+    if (limits.memoryBytes != 0) {
+        info.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        info.JobMemoryLimit = static_cast<SIZE_T>(limits.memoryBytes);
+    }
+    if (! SetInformationJobObject(job, JobObjectExtendedLimitInformation, &info, sizeof(info))) {
+        SvcReportEvent("SetInformationJobObject");
+        CloseHandle(job);
+        return nullptr;
+    }
+
+    STARTUPINFO si;
+    ZeroMemory(&si, sizeof(STARTUPINFO));
+    si.cb = sizeof(STARTUPINFO); // The size of the structure, in bytes.
+    PROCESS_INFORMATION pi;
+    // CreateProcess may write to the command line buffer
+    std::wstring commandLine = s2ws(arguments);
+
+    // Create the process
+    bool success = CreateProcess(package.c_str(), // The name of the module to be executed
+            commandLine.data(), // The command line to be executed.
+            NULL, // If lpProcessAttributes is NULL, the handle cannot be inherited
+            NULL, // If lpThreadAttributes is NULL, the handle cannot be inherited.
+            FALSE, // If the parameter is FALSE, the handles are not inherited
+            // Suspended until it is in the job, so nothing it starts escapes the limits
+            CREATE_NO_WINDOW | CREATE_SUSPENDED,
+            NULL, // If this parameter is NULL, the new process uses the environment of the calling
+                  // proces
+            NULL, // If this parameter is NULL, the new process will have the same current drive and
+                  // directory as the calling process
+            &si, // Startup Info
+            &pi // Process Information
+    );
+
+    // Check if the process was created successfully
+    if (! success) {
+        SvcReportEvent(("Create process for installing exe"));
+        CloseHandle(job);
+        return nullptr;
+    }
+    if (! AssignProcessToJobObject(job, pi.hProcess)) {
+        SvcReportEvent("AssignProcessToJobObject");
+        TerminateProcess(pi.hProcess, ERROR_PROCESS_ABORTED);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+        CloseHandle(job);
+        return nullptr;
+    }
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+    return std::make_unique<JobInstall>(job, pi.hProcess, stopEvent, limits.timeout);
+}
+
+// The mount point part of REPARSE_DATA_BUFFER, which is only declared in the DDK
+struct MountPointReparseBuffer {
+    DWORD ReparseTag;
+    WORD ReparseDataLength;
+    WORD Reserved;
+    WORD SubstituteNameOffset;
+    WORD SubstituteNameLength;
+    WORD PrintNameOffset;
+    WORD PrintNameLength;
+    WCHAR PathBuffer[1];
+};
+
+bool ProcessInstaller::activate(
+        const std::filesystem::path &link, const std::filesystem::path &target) {
+    std::error_code ec;
+    auto print = std::filesystem::absolute(target, ec).wstring();
+    if (ec) {
+        SvcReportEvent("Resolving the staged version");
+        return false;
+    }
+    // A junction stores the NT path of its target, followed by the path to show
+    auto substitute = L"\\??\\" + print;
+    size_t pathBytes = (substitute.size() + 1 + print.size() + 1) * sizeof(WCHAR);
+    std::vector<BYTE> buffer(offsetof(MountPointReparseBuffer, PathBuffer) + pathBytes);
+    auto *reparse = reinterpret_cast<MountPointReparseBuffer *>(buffer.data());
+    reparse->ReparseTag = IO_REPARSE_TAG_MOUNT_POINT;
+    // Everything after ReparseTag, ReparseDataLength and Reserved
+    reparse->ReparseDataLength = static_cast<WORD>(buffer.size() - 8);
+    reparse->SubstituteNameOffset = 0;
+    reparse->SubstituteNameLength = static_cast<WORD>(substitute.size() * sizeof(WCHAR));
+    reparse->PrintNameOffset = static_cast<WORD>((substitute.size() + 1) * sizeof(WCHAR));
+    reparse->PrintNameLength = static_cast<WORD>(print.size() * sizeof(WCHAR));
+    std::copy(substitute.c_str(), substitute.c_str() + substitute.size() + 1,
+            reparse->PathBuffer);
+    std::copy(print.c_str(), print.c_str() + print.size() + 1,
+            reparse->PathBuffer + substitute.size() + 1);
+
+    // An empty directory the first time. After that the reparse data of the existing
+    // junction is replaced, so the link is never missing or half written.
+    if (! CreateDirectory(link.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        SvcReportEvent("Creating junction to the staged version");
+        return false;
+    }
+    HANDLE junction = CreateFile(link.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+            FILE_FLAG_OPEN_REPARSE_POINT | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (junction == INVALID_HANDLE_VALUE) {
+        SvcReportEvent("Opening junction to the staged version");
+        return false;
+    }
+    DWORD returned = 0;
+    BOOL switched = DeviceIoControl(junction, FSCTL_SET_REPARSE_POINT, buffer.data(),
+            static_cast<DWORD>(buffer.size()), NULL, 0, &returned, NULL);
+    CloseHandle(junction);
+    if (! switched) {
+        // Also what a real, non-empty directory at link ends up in
+        SvcReportEvent("Switching to the staged version");
+        return false;
+    }
+    return true;
+}
+
+// Windows Installer runs one installation at a time and its UI handler is per process
+static std::mutex msiLock;
+
+// One installation through the Windows Installer API, run on a thread of its own
+class MsiInstall : public InstallJob {
+public:
+    MsiInstall(std::vector<std::filesystem::path> packages, const std::string &arguments,
+            HANDLE stopEvent, std::chrono::seconds timeout)
+        : packages(std::move(packages))
+        , arguments(s2ws(arguments))
+        , stopEvent(stopEvent)
+        , limit(timeout)
+        , started(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , finished(CreateEvent(NULL, TRUE, FALSE, NULL))
+        , worker([this] { run(); }) {}
+
+    ~MsiInstall() override {
+        // Nobody is going to wait for it any more
+        cancel = true;
+        worker.join();
+        CloseHandle(started);
+        CloseHandle(finished);
+    }
+
+    bool wait(std::chrono::milliseconds timeout) override {
+        if (done) {
+            return true;
+        }
+        if (! running) {
+            // Queued behind another installation, which does not count against the limit
+            HANDLE handles[] = {started, stopEvent};
+            DWORD waited = WaitForMultipleObjects(stopEvent ? 2 : 1, handles, FALSE,
+                    static_cast<DWORD>(std::min<long long>(timeout.count(), INFINITE - 1)));
+            if (waited == WAIT_TIMEOUT) {
+                return false;
+            }
+            if (waited == WAIT_OBJECT_0) {
+                // The worker set deadline before it signaled started
+                running = true;
+                return false;
+            }
+            // The worker gives up as soon as it gets the lock
+            cancel = true;
+            WaitForSingleObject(finished, INFINITE);
+            outcome.exitCode = exitCode;
+            outcome.stopped = exitCode == ERROR_INSTALL_USEREXIT;
+            done = true;
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        bool lastWait = deadline - now <= timeout;
+        if (lastWait) {
+            timeout = std::max(std::chrono::milliseconds(0),
+                    std::chrono::ceil<std::chrono::milliseconds>(deadline - now));
+        }
+        HANDLE handles[] = {finished, stopEvent};
+        DWORD waited = WaitForMultipleObjects(stopEvent ? 2 : 1, handles, FALSE,
+                static_cast<DWORD>(std::min<long long>(timeout.count(), INFINITE - 1)));
+        if (waited == WAIT_TIMEOUT && ! lastWait) {
+            return false;
+        }
+        if (waited != WAIT_OBJECT_0) {
+            // Cancelled at the next message, then it waits for the rollback
+            cancel = true;
+            WaitForSingleObject(finished, INFINITE);
+            if (exitCode == ERROR_INSTALL_USEREXIT) {
+                outcome.timedOut = waited == WAIT_TIMEOUT;
+                outcome.stopped = ! outcome.timedOut;
+            }
+        }
+        outcome.exitCode = exitCode;
+        done = true;
+        return true;
+    }
+
+    InstallResult result() override { return outcome; }
+
+private:
+    void run();
+    static INT CALLBACK uiHandler(LPVOID context, UINT messageType, MSIHANDLE record);
+    void actionStart(MSIHANDLE record);
+    void actionEnd();
+    void progress(MSIHANDLE record);
+
+    std::vector<std::filesystem::path> packages;
+    std::wstring arguments;
+    HANDLE stopEvent;
+    std::chrono::seconds limit;
+    // limit from when the worker got msiLock; it is set before started
+    std::chrono::steady_clock::time_point deadline;
+    HANDLE started;
+    HANDLE finished;
+    bool running = false; // started was seen
+    std::atomic<bool> cancel{false};
+    UINT exitCode = ERROR_SUCCESS; // Written by the worker before finished is set
+    bool done = false;
+    InstallResult outcome;
+
+    // Worker thread only
+    std::string action;
+    std::chrono::steady_clock::time_point actionBegin;
+    long long actionTraceBegin = 0;
+    long long ticksTotal = 0;
+    long long ticksDone = 0;
+    bool forward = true;
+
+    std::thread worker; // Last, it starts running in the constructor
+};
+
+void MsiInstall::run() {
+    std::lock_guard<std::mutex> serial(msiLock);
+    deadline = limit.count() != 0 ? std::chrono::steady_clock::now() + limit
+                                  : std::chrono::steady_clock::time_point::max();
+    SetEvent(started);
+    if (cancel) {
+        // Stopped or dropped while it was queued
+        exitCode = ERROR_INSTALL_USEREXIT;
+        SetEvent(finished);
+        return;
+    }
+    MsiSetInternalUI(INSTALLUILEVEL_NONE, NULL);
+    INSTALLUI_HANDLER_RECORD previous = NULL;
+    MsiSetExternalUIRecord(&MsiInstall::uiHandler,
+            INSTALLLOGMODE_ACTIONSTART | INSTALLLOGMODE_PROGRESS | INSTALLLOGMODE_ERROR
+                    | INSTALLLOGMODE_FATALEXIT,
+            this, &previous);
+
+    UINT status;
+    if (packages.size() > 1) {
+        std::wstring list;
+        for (auto &patch : packages) {
+            list += (list.empty() ? L"" : L";") + patch.wstring();
+        }
+        status = MsiApplyMultiplePatches(list.c_str(), NULL, arguments.c_str());
+    }
+    else if (_wcsicmp(packages.front().extension().c_str(), L".msp") == 0) {
+        status = MsiApplyPatch(
+                packages.front().c_str(), NULL, INSTALLTYPE_DEFAULT, arguments.c_str());
+    }
+    else {
+        status = MsiInstallProduct(packages.front().c_str(), arguments.c_str());
+    }
+    actionEnd();
+    MsiSetExternalUIRecord(previous, 0, NULL, NULL);
+
+    if (status == ERROR_SUCCESS_REBOOT_REQUIRED || status == ERROR_SUCCESS_REBOOT_INITIATED) {
+        SvcReportInfo("Update installed, it is completed by a reboot");
+        status = ERROR_SUCCESS;
+    }
+    exitCode = status;
+    SetEvent(finished);
+}
+
+INT CALLBACK MsiInstall::uiHandler(LPVOID context, UINT messageType, MSIHANDLE record) {
+    auto *self = static_cast<MsiInstall *>(context);
+    if (self->cancel) {
+        return IDCANCEL;
+    }
+    switch (static_cast<INSTALLMESSAGE>(messageType & 0xFF000000)) {
+    case INSTALLMESSAGE_ACTIONSTART:
+        self->actionStart(record);
+        return IDOK;
+    case INSTALLMESSAGE_PROGRESS:
+        self->progress(record);
+        return IDOK;
+    default:
+        // Errors are left to the installation, which fails with their code
+        return 0;
+    }
+}
+
+void MsiInstall::actionStart(MSIHANDLE record) {
+    actionEnd();
+    wchar_t name[128];
+    DWORD size = sizeof(name) / sizeof(wchar_t);
+    if (MsiRecordGetString(record, 1, name, &size) != ERROR_SUCCESS) {
+        return;
+    }
+    action = ws2s(name);
+    actionBegin = std::chrono::steady_clock::now();
+    actionTraceBegin = TraceNow();
+}
+
+void MsiInstall::actionEnd() {
+    if (action.empty()) {
+        return;
+    }
+    MetricHistogram("updsvc_msi_action_seconds", "Time of each Windows Installer action", 1e-6,
+            "action=\"" + action + "\"")
+            .record(MetricsMicros(actionBegin, std::chrono::steady_clock::now()));
+    if (gTraceEnabled.load(std::memory_order_relaxed)) {
+        // The trace keeps the name pointer, so every action name is stored once
+        static std::mutex namesLock;
+        static std::set<std::string> names;
+        std::lock_guard<std::mutex> guard(namesLock);
+        TraceRecord(names.insert(action).first->c_str(), actionTraceBegin, TraceNow());
+    }
+    action.clear();
+}
+
+void MsiInstall::progress(MSIHANDLE record) {
+    static auto &percent = MetricGauge(
+            "updsvc_install_progress_percent", "Progress of the running Windows Installer action");
+    switch (MsiRecordGetInteger(record, 1)) {
+    case 0: // Reset: total ticks and the direction of the bar
+        ticksTotal = MsiRecordGetInteger(record, 2);
+        forward = MsiRecordGetInteger(record, 3) == 0;
+        ticksDone = forward ? 0 : ticksTotal;
+        break;
+    case 2: // Ticks done
+        ticksDone += (forward ? 1 : -1) * static_cast<long long>(MsiRecordGetInteger(record, 2));
+        break;
+    case 3: // Ticks added to the total
+        ticksTotal += MsiRecordGetInteger(record, 2);
+        break;
+    default:
+        return;
+    }
+    if (ticksTotal > 0) {
+        percent.set(std::clamp(ticksDone * 100 / ticksTotal, 0LL, 100LL));
+    }
+}
+
+static bool isMsiPackage(const std::filesystem::path &package, const wchar_t *extension) {
+    return _wcsicmp(package.extension().c_str(), extension) == 0;
+}
+
+std::unique_ptr<InstallJob> MsiInstaller::start(const std::filesystem::path &package,
+        const std::string &arguments, const InstallLimits &limits) {
+    if (! isMsiPackage(package, L".msi") && ! isMsiPackage(package, L".msp")) {
+        return processes.start(package, arguments, limits);
+    }
+    return std::make_unique<MsiInstall>(
+            std::vector<std::filesystem::path>{package}, arguments, stopEvent, limits.timeout);
+}
+
+std::unique_ptr<InstallJob> MsiInstaller::startChain(
+        const std::vector<std::filesystem::path> &patches, const std::string &arguments,
+        const InstallLimits &limits) {
+    for (auto &patch : patches) {
+        if (! isMsiPackage(patch, L".msp")) {
+            return nullptr;
+        }
+    }
+    return std::make_unique<MsiInstall>(patches, arguments, stopEvent, limits.timeout);
+}
+
+std::chrono::steady_clock::time_point Win32Clock::now() {
+    return std::chrono::steady_clock::now();
+}
+
+bool Win32Clock::sleepFor(std::chrono::milliseconds duration) {
+    if (! stopEvent) {
+        Sleep(static_cast<DWORD>(duration.count()));
+        return true;
+    }
+    return WaitForSingleObject(stopEvent, static_cast<DWORD>(duration.count())) == WAIT_TIMEOUT;
+}
+
+// MsiGetProductInfo into a string that grows until the value fits. ERROR_MORE_DATA leaves
+// the length of the value, without the terminator, in the size.
+UINT GetProductInfo(
+        const std::wstring &product_guid, const wchar_t *property, std::wstring &value) {
+    value.resize(MAX_PATH);
+    for (;;) {
+        DWORD size = static_cast<DWORD>(value.size());
+        UINT result = MsiGetProductInfo(product_guid.c_str(), property, value.data(), &size);
+        if (result == ERROR_MORE_DATA) {
+            value.resize(size + 1);
+            continue;
+        }
+        value.resize(result == ERROR_SUCCESS ? size : 0);
+        return result;
+    }
+}
+
+// A product code the way Windows Installer spells it in the registry: the first three groups
+// reversed, then the hex digits of each remaining byte swapped
+std::wstring PackedGuid(const std::string &product_guid) {
+    if (! IsValidGuid(product_guid)) {
+        return {};
+    }
+    std::wstring hex;
+    for (char c : product_guid) {
+        if (std::isxdigit(static_cast<unsigned char>(c))) {
+            hex += static_cast<wchar_t>(std::toupper(static_cast<unsigned char>(c)));
+        }
+    }
+    std::wstring packed;
+    packed.append(hex.rbegin() + 24, hex.rend());
+    packed.append(hex.rbegin() + 20, hex.rbegin() + 24);
+    packed.append(hex.rbegin() + 16, hex.rbegin() + 20);
+    for (size_t i = 16; i < hex.size(); i += 2) {
+        packed += hex[i + 1];
+        packed += hex[i];
+    }
+    return packed;
+}
+
+std::wstring GetSourcePath(const std::wstring &product_guid) {
+    std::wstring source;
+
+    // Use MsiGetProductInfo for get the source path
+    UINT result = GetProductInfo(product_guid, INSTALLPROPERTY_INSTALLSOURCE, source);
+    if (result == ERROR_SUCCESS) {
+        return source;
+    }
+    SvcReportEvent("Getting source path");
+    return {};
+}
+
+std::wstring GetFirstFileNameInDirectory(const std::wstring &directoryPath) {
+    DWORD fileAttributes = GetFileAttributes(directoryPath.c_str());
+    if (fileAttributes != INVALID_FILE_ATTRIBUTES && (fileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        WIN32_FIND_DATA findFileData;
+        HANDLE hFind = FindFirstFile((directoryPath + L"*").c_str(), &findFileData);
+
+        if (hFind == INVALID_HANDLE_VALUE) {
+            SvcReportEvent("Finding first file in directory(source file dir)");
+            return L"";
+        }
+
+        do {
+            if (! (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                // Return the first file name
+                FindClose(hFind);
+                SvcReportInfo("Source file found succesfully");
+                return findFileData.cFileName;
+            }
+        } while (FindNextFile(hFind, &findFileData) != 0);
+
+        FindClose(hFind);
+    }
+    // Return an empty string if the directory does not exist or contains no files.
+    SvcReportEvent("Directory does not exist or contains no files, getting name of first file");
+    return L"";
+}
+
+std::wstring ReadMSI(const std::wstring &product_guid, const wchar_t *msiPath) {
+    TRACE_SPAN("ReadMSI");
+
+    // Open the MSI package
+    MSIHANDLE hDatabase = 0;
+    if (MsiOpenDatabase(msiPath, MSIDBOPEN_READONLY, &hDatabase) != ERROR_SUCCESS) {
+        SvcReportEvent("Open MSI package");
+        return L"";
+    }
+
+    // Prepare the query to fetch all files from the MSI package
+    PMSIHANDLE hView = 0;
+    if (MsiDatabaseOpenView(hDatabase, L"SELECT ComponentId FROM Component", &hView)
+            != ERROR_SUCCESS) {
+        MsiCloseHandle(hDatabase);
+        SvcReportEvent("Preparing query (ReadMSI)");
+        return L"";
+    }
+
+    // Execute the query
+    if (MsiViewExecute(hView, 0) != ERROR_SUCCESS) {
+        MsiCloseHandle(hDatabase);
+        SvcReportEvent("Execute query (ReadMSI)");
+        return L"";
+    }
+
+    wchar_t componentId[1024];
+    DWORD dirparentBufferSize = sizeof(componentId) / sizeof(wchar_t);
+    std::wstring path;
+
+    // Fetch and extract each file from the MSI package
+    PMSIHANDLE hRecord = 0;
+
+    while (MsiViewFetch(hView, &hRecord) == ERROR_SUCCESS) {
+        UINT res = MsiRecordGetString(hRecord, 1, componentId, &dirparentBufferSize);
+
+        if (res != ERROR_SUCCESS) {
+            MsiCloseHandle(hDatabase);
+            SvcReportEvent("MsiRecordGetString(Read MSI) ");
+            return L"";
+        }
+
+        // Get the information from the record
+        path = getPathofComponent(product_guid, componentId);
+        if (isexe(path)) {
+            MsiCloseHandle(hDatabase);
+            SvcReportInfo("Path of program(.exe file) found successfully");
+            return path;
+        }
+        dirparentBufferSize = sizeof(componentId) / sizeof(wchar_t);
+    }
+
+    MsiCloseHandle(hDatabase);
+    SvcReportEvent("Founding path of program(.exe file) ");
+    return L"";
+}
+
+std::wstring getPathofComponent(const std::wstring &product_guid, const wchar_t *componentid) {
+    std::wstring path(MAX_PATH, L'\0');
+    DWORD size = static_cast<DWORD>(path.size());
+    if (MsiGetComponentPath(product_guid.c_str(), componentid, path.data(), &size)
+            == INSTALLSTATE_MOREDATA) {
+        path.assign(size + 1, L'\0');
+        size = static_cast<DWORD>(path.size());
+        MsiGetComponentPath(product_guid.c_str(), componentid, path.data(), &size);
+    }
+    path.resize(std::wcslen(path.c_str()));
+    return path;
+}
+
+bool isexe(std::wstring s) {
+    return s.size() >= 4 && s.compare(s.size() - 4, 4, L".exe") == 0;
+}
+
+// Purpose:
+//   First we get list of current processes(in ToolhelpProbe::query)
+//   If our exe's name is inside of it, calls this function
+//   Compare our path with exe files module to be sure its our program
+
+// if process gets an error
+//   function returns -1
+// if module of mgui-wgt.exe contains our path
+//   function returns 1
+// if module of mgu-wgt.exe dont contains our path
+//   function returns 0
+int ListProcessModules(DWORD dwPID, const std::wstring &exepath) {
+    TRACE_SPAN("ListProcessModules");
+    HANDLE hModuleSnap = INVALID_HANDLE_VALUE;
+    MODULEENTRY32 me32;
+
+    // Take a snapshot of all modules in the specified process.
+    hModuleSnap = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, dwPID);
+    if (hModuleSnap == INVALID_HANDLE_VALUE) {
+        SvcReportEvent(("Taking snapshot of all modules"));
+        return -1;
+    }
+
+    // Set the size of the structure before using it.
+    me32.dwSize = sizeof(MODULEENTRY32);
+
+    // Retrieve information about the first module,
+    // and exit if unsuccessful
+    if (! Module32First(hModuleSnap, &me32)) {
+        SvcReportEvent(("Retrieving information about first module"));
+        CloseHandle(hModuleSnap); // clean the snapshot object
+        return -1;
+    }
+
+    // Now walk the module list of the process,
+    // and compare the paths with our path
+    do {
+        if (! (wcscmp(me32.szExePath, exepath.c_str()))) {
+            CloseHandle(hModuleSnap);
+            SvcReportInfo("Program found in process list, cant update");
+            return 1;
+        }
+    } while (Module32Next(hModuleSnap, &me32));
+
+    CloseHandle(hModuleSnap);
+    SvcReportInfo("Update could start");
+    return 0;
+}
+
+void createRegistryEntry(std::wstring keyPath, std::wstring stringvalue, std::wstring valueData) {
+    HKEY hKey;
+
+    // Create or open the registry key
+    LONG result = RegCreateKeyEx(HKEY_LOCAL_MACHINE, keyPath.c_str(), 0, NULL,
+            REG_OPTION_NON_VOLATILE, KEY_SET_VALUE, NULL, &hKey, NULL);
+    if (result == ERROR_SUCCESS) {
+        // Set the value data for the specified filename
+        result = RegSetValueEx(hKey, stringvalue.c_str(), 0, REG_SZ,
+                (const BYTE *)valueData.c_str(), (DWORD)(valueData.size() + 1) * sizeof(wchar_t));
+        if (result != ERROR_SUCCESS) {
+            SvcReportEvent(("Setting registry value"));
+        }
+        else {
+            SvcReportInfo("Registry value is set successfully");
+        }
+
+        // Close the key handle
+        RegCloseKey(hKey);
+    }
+    else {
+        SvcReportEvent(("Creating or opening the registry key"));
+    }
+}
+
+std::wstring readDataString(std::wstring keyPath, std::wstring regValueName) {
+    HKEY hKey;
+    LONG openResult = RegOpenKeyEx(HKEY_LOCAL_MACHINE, keyPath.c_str(), 0, KEY_READ, &hKey);
+    if (openResult != ERROR_SUCCESS) {
+        SvcReportEvent(("Opening registry"));
+        return {};
+    }
+    DWORD bufferSize = 0;
+    LONG queryResult =
+            RegQueryValueEx(hKey, regValueName.c_str(), nullptr, nullptr, nullptr, &bufferSize);
+    if (queryResult == ERROR_FILE_NOT_FOUND) {
+        SvcReportEvent(("Finding value in registry"));
+        RegCloseKey(hKey);
+        return {};
+    }
+    else if (queryResult != ERROR_SUCCESS) {
+        SvcReportEvent(("Query the value with readDataString"));
+        RegCloseKey(hKey);
+        return {};
+    }
+
+    // Allocate memory for the string data
+    wchar_t *buffer = new wchar_t[bufferSize / sizeof(wchar_t)];
+
+    queryResult = RegQueryValueEx(hKey, regValueName.c_str(), nullptr, nullptr,
+            reinterpret_cast<BYTE *>(buffer), &bufferSize);
+    if (queryResult != ERROR_SUCCESS) {
+        SvcReportEvent("Query the value data for " + ws2s(regValueName));
+        delete[] buffer; // Clean up allocated memory
+        RegCloseKey(hKey);
+        return {};
+    }
+
+    // Use the string data
+    std::wstring valueData = buffer;
+
+    // Clean up allocated memory and close the key handle
+    delete[] buffer;
+    RegCloseKey(hKey);
+    SvcReportInfo("Reading data of string value ended successfully");
+    return valueData;
+}
+
+DWORD ReadDWORDFromRegedit(std::wstring keyPath, std::wstring regValueName) {
+    HKEY hKey;
+    DWORD dwValue = 0;
+    DWORD dwSize = sizeof(DWORD);
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, keyPath.c_str(), 0, KEY_READ, &hKey) == ERROR_SUCCESS) {
+        if (RegQueryValueEx(hKey, regValueName.c_str(), nullptr, nullptr,
+                    reinterpret_cast<LPBYTE>(&dwValue), &dwSize)
+                != ERROR_SUCCESS) {
+            SvcReportEvent("Read DWORD value from the Registry");
+            RegCloseKey(hKey);
+            return {};
+        }
+        RegCloseKey(hKey);
+    }
+    else {
+        SvcReportEvent("Registry opening");
+        return {};
+    }
+    SvcReportInfo("Reading data of DWORD value ended successfully");
+    return dwValue;
+}
+
+//
+// Purpose:
+//   Reads every value name under the banned key of a product in a single pass
+//
+// Parameters:
+//   keyPath - SOFTWARE\Arskom\updsvc\<guid>\banned
+//
+// Return value:
+//   Set of banned file names, empty if the key does not exist
+//
+BannedSet readBannedFiles(const std::wstring &keyPath) {
+    BannedSet files;
+    HKEY hKey;
+
+    LONG result = RegOpenKeyExW(HKEY_LOCAL_MACHINE, keyPath.c_str(), 0, KEY_READ, &hKey);
+    if (result == ERROR_FILE_NOT_FOUND) {
+        // Nothing was banned for this product yet
+        return files;
+    }
+    if (result != ERROR_SUCCESS) {
+        SvcReportEvent(("Opening registry"));
+        return files;
+    }
+
+    DWORD valueCount = 0;
+    DWORD maxValueNameLen = 0;
+    result = RegQueryInfoKey(hKey, NULL, NULL, NULL, NULL, NULL, NULL, &valueCount,
+            &maxValueNameLen, NULL, NULL, NULL);
+    if (result != ERROR_SUCCESS) {
+        SvcReportEvent(("Querying banned key"));
+        RegCloseKey(hKey);
+        return files;
+    }
+
+    std::wstring valueName(maxValueNameLen + 1, L'\0');
+    files.reserve(valueCount);
+
+    for (DWORD i = 0;; ++i) {
+        DWORD valueNameSize = static_cast<DWORD>(valueName.size());
+        result = RegEnumValue(hKey, i, valueName.data(), &valueNameSize, nullptr, NULL, NULL, NULL);
+
+        if (result == ERROR_SUCCESS) {
+            files.insert(ws2s(std::wstring_view(valueName.data(), valueNameSize)));
+        }
+        else if (result == ERROR_NO_MORE_ITEMS) {
+            break;
+        }
+        else {
+            SvcReportEvent(("Enumerating registry values"));
+            break;
+        }
+    }
+
+    RegCloseKey(hKey);
+    return files;
+}
@@ -0,0 +1,140 @@
+#ifndef SVCWIN32_H
+#define SVCWIN32_H
+
+#include <Windows.h>
+
+#include "SvcBackends.h"
+#include "SvcCancel.h"
+
+// Backends for the service: WinHTTP, the registry under HKLM\SOFTWARE\Arskom\updsvc, the
+// MSI database of the installed product, Toolhelp snapshots and CreateProcess.
+
+// A tripped cancel token closes the request handle, which is how a synchronous WinHTTP call
+// in progress on another thread is broken off.
+class WinHttpTransport : public Transport {
+public:
+    explicit WinHttpTransport(CancelToken *cancel = nullptr)
+        : cancel(cancel) {}
+
+    bool get(const HttpRequest &request, std::ostream &sink, RequestStats &stats) override;
+
+private:
+    CancelToken *cancel;
+};
+
+class RegistryConfigStore : public ConfigStore {
+public:
+    bool products(std::vector<std::string> &product_guids) override;
+    Config readProduct(const std::string &product_guid) override;
+    BannedSet readBanned(const std::string &product_guid) override;
+    void addBanned(const std::string &product_guid, const std::string &filename) override;
+    std::string readSetting(const std::string &name) override;
+    unsigned long readSetting(const std::string &name, unsigned long defaultValue) override;
+};
+
+// Windows Installer keeps what it installed for the machine under
+// HKLM\SOFTWARE\Microsoft\Windows\CurrentVersion\Installer\UserData. changed watches that
+// subtree, and the stamp of a product is the last write time of its InstallProperties key.
+class MsiInventory : public ProductInventory {
+public:
+    MsiInventory() = default;
+    ~MsiInventory();
+    MsiInventory(const MsiInventory &) = delete;
+    MsiInventory &operator=(const MsiInventory &) = delete;
+
+    std::string installedVersion(const std::string &product_guid) override;
+    std::string executablePath(const std::string &product_guid) override;
+    std::string installStamp(const std::string &product_guid) override;
+    bool changed() override;
+
+private:
+    // Asks for changeEvent to be signaled at the next change, false if it cannot be
+    bool watch();
+
+    HKEY watched = NULL;
+    HANDLE changeEvent = NULL; // Auto-reset
+};
+
+class ToolhelpProbe : public ProcessProbe {
+public:
+    ProcessState query(const std::string &exePath) override;
+};
+
+// Runs every installer in a job object of its own, which carries the CPU and memory limits
+// and lets a hung installer be killed with everything it started. Waits also end when
+// stopEvent is signaled.
+class ProcessInstaller : public Installer {
+public:
+    explicit ProcessInstaller(HANDLE stopEvent = NULL)
+        : stopEvent(stopEvent) {}
+
+    std::unique_ptr<InstallJob> start(const std::filesystem::path &package,
+            const std::string &arguments, const InstallLimits &limits) override;
+    bool activate(
+            const std::filesystem::path &link, const std::filesystem::path &target) override;
+
+private:
+    HANDLE stopEvent;
+};
+
+// Installs .msi and .msp packages through the Windows Installer API instead of a child
+// process and hands everything else to ProcessInstaller. A UI handler sees every action and
+// progress message, which feed the trace and metrics; a timeout or stop cancels the
+// installation from the handler and Windows Installer rolls it back. The CPU and memory
+// limits do not apply, the work is done by the Windows Installer service.
+class MsiInstaller : public Installer {
+public:
+    explicit MsiInstaller(HANDLE stopEvent = NULL)
+        : processes(stopEvent)
+        , stopEvent(stopEvent) {}
+
+    std::unique_ptr<InstallJob> start(const std::filesystem::path &package,
+            const std::string &arguments, const InstallLimits &limits) override;
+    // MsiApplyMultiplePatches, for .msp files only
+    std::unique_ptr<InstallJob> startChain(const std::vector<std::filesystem::path> &patches,
+            const std::string &arguments, const InstallLimits &limits) override;
+    bool activate(
+            const std::filesystem::path &link, const std::filesystem::path &target) override {
+        return processes.activate(link, target);
+    }
+
+private:
+    ProcessInstaller processes;
+    HANDLE stopEvent;
+};
+
+// Waits end early when stopEvent is signaled, so a stop request does not sit out a poll
+// interval.
+class Win32Clock : public Clock {
+public:
+    explicit Win32Clock(HANDLE stopEvent = NULL)
+        : stopEvent(stopEvent) {}
+
+    std::chrono::steady_clock::time_point now() override;
+    bool sleepFor(std::chrono::milliseconds duration) override;
+
+private:
+    HANDLE stopEvent;
+};
+
+struct Win32Platform {
+    explicit Win32Platform(CancelToken *cancel = nullptr)
+        : transport(cancel)
+        , installer(cancel ? static_cast<HANDLE>(cancel->waitHandle()) : NULL)
+        , clock(cancel ? static_cast<HANDLE>(cancel->waitHandle()) : NULL)
+        , cancel(cancel) {}
+
+    WinHttpTransport transport;
+    RegistryConfigStore config;
+    MsiInventory inventory;
+    ToolhelpProbe probe;
+    MsiInstaller installer;
+    Win32Clock clock;
+    CancelToken *cancel;
+
+    Backends backends() {
+        return {transport, config, inventory, probe, installer, clock, cancel};
+    }
+};
+
+#endif // SVCWIN32_H